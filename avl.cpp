@@ -2,17 +2,12 @@
 #include <cstddef> 
 #include <iostream>
 #include <algorithm>
-#include <set>
 #include <assert.h>
 #include <cstdlib> 
 #include <cstring>
 #include "avl.h"
 #include "hashtable.h"
 
-struct AVLTree {
-    AVLNode* root = nullptr;
-};
-
 uint32_t avl_height(AVLNode* node) {
     return node ? node->height : 0;
 }
@@ -28,15 +23,13 @@ void updateNode(AVLNode* node) {
     }
 }
 
-int getBalanceFactor(AVLNode* node) {
-    return node ? static_cast<int>(avl_height(node->left) - avl_height(node->right)) : 0;
-}
-
-AVLNode* findMin(AVLNode* node) {
-    while (node && node->left) {
-        node = node->left;
+// order by score, then by name
+bool zless(const ZNode *node, double score, const char *name, size_t len) {
+    if (node->score != score) {
+        return node->score < score;
     }
-    return node;
+    int rv = memcmp(node->name, name, std::min(node->len, len));
+    return rv != 0 ? rv < 0 : node->len < len;
 }
 
 AVLNode* rotateRight(AVLNode* z) {
@@ -73,142 +66,116 @@ AVLNode* rotateLeft(AVLNode* z) {
     return y;
 }
 
-
-AVLNode* avl_insert(AVLNode* root, ZNode* newNode) {
-    if (!root) {
-        return &newNode->tree;
-    }
-
-    ZNode* rootData = container_of(root, ZNode, tree);
-
-    // Check if the names match
-    if (strcmp(newNode->name, rootData->name) == 0) {
-        // Update the score if the names match
-        rootData->score = newNode->score;
-        return root;
+// the left subtree is taller by 2
+static AVLNode* fixLeft(AVLNode* root) {
+    if (avl_height(root->left->left) < avl_height(root->left->right)) {
+        root->left = rotateLeft(root->left);
     }
+    return rotateRight(root);
+}
 
-    // Compare based on score, then len, then name
-    if (newNode->score < rootData->score ||
-        (newNode->score == rootData->score && newNode->len < rootData->len) ||
-        (newNode->score == rootData->score && newNode->len == rootData->len && strcmp(newNode->name, rootData->name) < 0)) {
-        root->left = avl_insert(root->left, newNode);
-        root->left->parent = root;
-    } else if (newNode->score > rootData->score ||
-               (newNode->score == rootData->score && newNode->len > rootData->len) ||
-               (newNode->score == rootData->score && newNode->len == rootData->len &&
-                strcmp(newNode->name, rootData->name) > 0)) {
-
-        root->right = avl_insert(root->right, newNode);
-        root->right->parent = root;
+// the right subtree is taller by 2
+static AVLNode* fixRight(AVLNode* root) {
+    if (avl_height(root->right->right) < avl_height(root->right->left)) {
+        root->right = rotateRight(root->right);
     }
+    return rotateLeft(root);
+}
 
-    updateNode(root);
-
-    int balance = getBalanceFactor(root);
+// fix heights and rebalance from `node` up to the root, returns the new root
+static AVLNode* avl_fix(AVLNode* node) {
+    while (true) {
+        AVLNode** from = &node; // where the fixed subtree is attached
+        AVLNode* parent = node->parent;
+        if (parent) {
+            from = parent->left == node ? &parent->left : &parent->right;
+        }
 
-    // Balancing the AVL tree
-    if (balance > 1) {
-        if (getBalanceFactor(root->left) >= 0) {
-            return rotateRight(root);
-        } else {
-            root->left = rotateLeft(root->left);
-            return rotateRight(root);
+        updateNode(node);
+        uint32_t l = avl_height(node->left);
+        uint32_t r = avl_height(node->right);
+        if (l == r + 2) {
+            *from = fixLeft(node);
+        } else if (l + 2 == r) {
+            *from = fixRight(node);
         }
-    }
 
-    if (balance < -1) {
-        if (getBalanceFactor(root->right) <= 0) {
-            return rotateLeft(root);
-        } else {
-            root->right = rotateRight(root->right);
-            return rotateLeft(root);
+        if (!parent) {
+            return *from;
         }
+        node = parent;
     }
-
-    return root;
 }
 
-
-AVLNode* avl_delete(AVLNode* root, ZNode* nodeDelete) {
+AVLNode* avl_insert(AVLNode* root, ZNode* newNode) {
+    avl_init(&newNode->tree);
     if (!root) {
-        return nullptr;
+        return &newNode->tree;
     }
 
-    ZNode* rootData = container_of(root, ZNode, tree);
-
-    // Compare nodes based on score, len, and name
-    if (nodeDelete->score < rootData->score ||
-        (nodeDelete->score == rootData->score && nodeDelete->len < rootData->len) ||
-        (nodeDelete->score == rootData->score && nodeDelete->len == rootData->len &&
-         strcmp(nodeDelete->name, rootData->name) < 0)) {
-        root->left = avl_delete(root->left, nodeDelete);
-    } else if (nodeDelete->score > rootData->score ||
-               (nodeDelete->score == rootData->score && nodeDelete->len > rootData->len) ||
-               (nodeDelete->score == rootData->score && nodeDelete->len == rootData->len &&
-                strcmp(nodeDelete->name, rootData->name) > 0)) {
-        root->right = avl_delete(root->right, nodeDelete);
-    } else {
-        // Node to be deleted found
-        if (!root->left || !root->right) {
-            AVLNode* temp = root->left ? root->left : root->right;
-
-            if (!temp) {
-                // No children
-                temp = root;
-                root = nullptr;
-            } else {
-                // One child
-                *root = *temp;
-            }
-
-            //free(container_of(temp, ZNode, tree));
-        } else {
-            // Two children: Get the inorder successor
-            AVLNode* temp = findMin(root->right);
-            ZNode* tempData = container_of(temp, ZNode, tree);
-
-            // Copy successor's data to current node
-            rootData->score = tempData->score;
-            rootData->len = tempData->len;
-            memcpy(rootData->name, tempData->name, tempData->len + 1);
-
-            // Delete the inorder successor
-            root->right = avl_delete(root->right, tempData);
+    // walk down to an empty leaf slot
+    AVLNode* cur = root;
+    while (true) {
+        ZNode* curData = container_of(cur, ZNode, tree);
+        bool left = !zless(curData, newNode->score, newNode->name, newNode->len);
+        AVLNode** from = left ? &cur->left : &cur->right;
+        if (!*from) {
+            *from = &newNode->tree;
+            newNode->tree.parent = cur;
+            break;
         }
+        cur = *from;
     }
+    return avl_fix(&newNode->tree);
+}
 
-    if (!root) {
-        return root;
+// detach a node with at most 1 child
+static AVLNode* avl_delete_easy(AVLNode* node) {
+    AVLNode* child = node->left ? node->left : node->right;
+    AVLNode* parent = node->parent;
+    if (child) {
+        child->parent = parent;
     }
+    if (!parent) {
+        return child;
+    }
+    AVLNode** from = parent->left == node ? &parent->left : &parent->right;
+    *from = child;
+    return avl_fix(parent);
+}
 
-    // Update height and count
-    updateNode(root);
-
-    // Rebalance the tree
-    int balance = getBalanceFactor(root);
-
-    if (balance > 1) {
-        if (getBalanceFactor(root->left) >= 0) {
-            return rotateRight(root);
-        } else {
-            root->left = rotateLeft(root->left);
-            return rotateRight(root);
-        }
+// detach `nodeDelete` from the tree, the node itself is not freed.
+// nodes are relinked rather than copied, so the caller still owns
+// exactly the node it passed in.
+AVLNode* avl_delete(AVLNode* root, ZNode* nodeDelete) {
+    (void)root;
+    AVLNode* node = &nodeDelete->tree;
+    if (!node->left || !node->right) {
+        return avl_delete_easy(node);
     }
 
-    if (balance < -1) {
-        if (getBalanceFactor(root->right) <= 0) {
-            return rotateLeft(root);
-        } else {
-            root->right = rotateRight(root->right);
-            return rotateLeft(root);
-        }
+    // two children: put the inorder successor in place of the node
+    AVLNode* victim = node->right;
+    while (victim->left) {
+        victim = victim->left;
     }
+    AVLNode* newRoot = avl_delete_easy(victim);
 
-    return root;
+    *victim = *node;
+    if (victim->left) {
+        victim->left->parent = victim;
+    }
+    if (victim->right) {
+        victim->right->parent = victim;
+    }
+    AVLNode** from = &newRoot;
+    AVLNode* parent = node->parent;
+    if (parent) {
+        from = parent->left == node ? &parent->left : &parent->right;
+    }
+    *from = victim;
+    return newRoot;
 }
-
 AVLNode *avl_offset(AVLNode *node, int64_t offset) {
     int64_t pos = 0;    // relative to the starting node
     while (offset != pos) {
@@ -28,6 +28,7 @@ inline void avl_init(AVLNode* node) {
 }
 
 
+bool zless(const ZNode *node, double score, const char *name, size_t len);
 AVLNode* avl_insert(AVLNode* root, ZNode* newNode);
 AVLNode* avl_delete(AVLNode* root, ZNode* nodeDelete);
 AVLNode *avl_offset(AVLNode *node, int64_t offset);
\ No newline at end of file
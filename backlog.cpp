@@ -0,0 +1,47 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "backlog.h"
+
+
+void backlog_init(Backlog *bl, size_t cap, uint64_t offset) {
+    assert(cap > 0);
+    backlog_free(bl);
+    bl->data = (uint8_t *)malloc(cap);
+    bl->cap = cap;
+    bl->len = 0;
+    bl->end = offset;
+}
+
+void backlog_free(Backlog *bl) {
+    free(bl->data);
+    bl->data = NULL;
+    bl->cap = bl->len = 0;
+}
+
+void backlog_append(Backlog *bl, const uint8_t *data, size_t n) {
+    bl->end += n;
+    if (n >= bl->cap) {
+        // only the tail fits
+        data += n - bl->cap;
+        n = bl->cap;
+    }
+    size_t pos = (size_t)((bl->end - n) % bl->cap);
+    size_t first = n < bl->cap - pos ? n : bl->cap - pos;
+    memcpy(bl->data + pos, data, first);
+    memcpy(bl->data, data + first, n - first);
+    bl->len = bl->len + n < bl->cap ? bl->len + n : bl->cap;
+}
+
+bool backlog_has(const Backlog *bl, uint64_t offset) {
+    return bl->data && offset <= bl->end && bl->end - offset <= bl->len;
+}
+
+void backlog_copy(const Backlog *bl, uint64_t offset, Buffer *out) {
+    assert(backlog_has(bl, offset));
+    size_t n = (size_t)(bl->end - offset);
+    size_t pos = (size_t)(offset % bl->cap);
+    size_t first = n < bl->cap - pos ? n : bl->cap - pos;
+    buf_append(out, bl->data + pos, first);
+    buf_append(out, bl->data, n - first);
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "buffer.h"
+
+// a ring buffer of the most recent bytes of the replication stream, so a
+// replica that reconnects can continue from its offset.
+struct Backlog {
+    uint8_t *data = NULL;
+    size_t cap = 0;
+    size_t len = 0;     // bytes held, at most `cap`
+    uint64_t end = 0;   // stream offset after the newest byte
+};
+
+void backlog_init(Backlog *bl, size_t cap, uint64_t offset);
+void backlog_free(Backlog *bl);
+void backlog_append(Backlog *bl, const uint8_t *data, size_t n);
+// whether the stream from `offset` to the end is still held
+bool backlog_has(const Backlog *bl, uint64_t offset);
+// append the stream from `offset` to the end to `out`
+void backlog_copy(const Backlog *bl, uint64_t offset, Buffer *out);
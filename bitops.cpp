@@ -0,0 +1,155 @@
+#include <string.h>
+#include <algorithm>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#include "bitops.h"
+
+
+static uint64_t load64(const uint8_t *p) {
+    uint64_t w = 0;
+    memcpy(&w, p, 8);
+    return w;
+}
+
+static void store64(uint8_t *p, uint64_t w) {
+    memcpy(p, &w, 8);
+}
+
+static uint64_t count_scalar(const uint8_t *data, size_t n) {
+    uint64_t total = 0;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        total += __builtin_popcountll(load64(data + i));
+    }
+    for (; i < n; ++i) {
+        total += __builtin_popcount(data[i]);
+    }
+    return total;
+}
+
+static void op_scalar(uint32_t op, uint8_t *dst, const uint8_t *src, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t a = load64(dst + i), b = load64(src + i);
+        store64(dst + i, op == BITOP_AND ? a & b : op == BITOP_OR ? a | b : a ^ b);
+    }
+    for (; i < n; ++i) {
+        dst[i] = op == BITOP_AND ? dst[i] & src[i] : op == BITOP_OR ? dst[i] | src[i] : dst[i] ^ src[i];
+    }
+}
+
+#if defined(__x86_64__)
+// the same loop, compiled to the popcnt instruction, 4 independent sums
+__attribute__((target("popcnt")))
+static uint64_t count_popcnt(const uint8_t *data, size_t n) {
+    uint64_t s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        s0 += __builtin_popcountll(load64(data + i));
+        s1 += __builtin_popcountll(load64(data + i + 8));
+        s2 += __builtin_popcountll(load64(data + i + 16));
+        s3 += __builtin_popcountll(load64(data + i + 24));
+    }
+    for (; i + 8 <= n; i += 8) {
+        s0 += __builtin_popcountll(load64(data + i));
+    }
+    for (; i < n; ++i) {
+        s0 += __builtin_popcount(data[i]);
+    }
+    return s0 + s1 + s2 + s3;
+}
+
+// the nibble lookup with vpshufb: per byte counts are summed for up to 31
+// blocks of 32 bytes (8 * 31 < 256) before they are widened with vpsadbw
+__attribute__((target("avx2,popcnt")))
+static uint64_t count_avx2(const uint8_t *data, size_t n) {
+    const __m256i lut = _mm256_setr_epi8(
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low = _mm256_set1_epi8(0x0f);
+    __m256i total = _mm256_setzero_si256();
+    size_t i = 0;
+    while (i + 32 <= n) {
+        size_t end = std::min(n - (n - i) % 32, i + 31 * 32);
+        __m256i acc = _mm256_setzero_si256();
+        for (; i < end; i += 32) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(data + i));
+            __m256i lo = _mm256_shuffle_epi8(lut, _mm256_and_si256(v, low));
+            __m256i hi = _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(v, 4), low));
+            acc = _mm256_add_epi8(acc, _mm256_add_epi8(lo, hi));
+        }
+        total = _mm256_add_epi64(total, _mm256_sad_epu8(acc, _mm256_setzero_si256()));
+    }
+    uint64_t sum = (uint64_t)_mm256_extract_epi64(total, 0) + (uint64_t)_mm256_extract_epi64(total, 1)
+        + (uint64_t)_mm256_extract_epi64(total, 2) + (uint64_t)_mm256_extract_epi64(total, 3);
+    return sum + count_popcnt(data + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void op_avx2(uint32_t op, uint8_t *dst, const uint8_t *src, size_t n) {
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(dst + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i r = op == BITOP_AND ? _mm256_and_si256(a, b)
+            : op == BITOP_OR ? _mm256_or_si256(a, b) : _mm256_xor_si256(a, b);
+        _mm256_storeu_si256((__m256i *)(dst + i), r);
+    }
+    op_scalar(op, dst + i, src + i, n - i);
+}
+#endif
+
+struct BitKernels {
+    uint64_t (*count)(const uint8_t *, size_t);
+    void (*op)(uint32_t, uint8_t *, const uint8_t *, size_t);
+    const char *name;
+};
+
+static BitKernels bit_pick() {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) {
+        return {&count_avx2, &op_avx2, "avx2"};
+    }
+    if (__builtin_cpu_supports("popcnt")) {
+        return {&count_popcnt, &op_scalar, "popcnt"};
+    }
+#endif
+    return {&count_scalar, &op_scalar, "scalar"};
+}
+
+static const BitKernels g_bit = bit_pick();
+
+uint64_t bit_count(const uint8_t *data, size_t n) {
+    return g_bit.count(data, n);
+}
+
+void bit_op(uint32_t op, uint8_t *dst, const uint8_t *src, size_t n) {
+    g_bit.op(op, dst, src, n);
+}
+
+void bit_not(uint8_t *data, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        data[i] = ~data[i];
+    }
+}
+
+int64_t bit_pos(const uint8_t *data, size_t n, bool bit) {
+    uint64_t skip = bit ? 0 : ~0ULL;    // words without the bit
+    size_t i = 0;
+    while (i + 8 <= n && load64(data + i) == skip) {
+        i += 8;
+    }
+    for (; i < n; ++i) {
+        uint8_t byte = bit ? data[i] : (uint8_t)~data[i];
+        if (byte) {
+            return (int64_t)(i * 8 + __builtin_clz((uint32_t)byte << 24));
+        }
+    }
+    return -1;
+}
+
+const char *bit_kernel() {
+    return g_bit.name;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// kernels for bitmaps stored in strings. bit 0 is the most significant bit
+// of the first byte. the AVX2 or POPCNT versions are picked at startup from
+// what the CPU supports, with plain C++ as the fallback.
+enum {
+    BITOP_AND = 0,
+    BITOP_OR = 1,
+    BITOP_XOR = 2,
+};
+
+uint64_t bit_count(const uint8_t *data, size_t n);
+// dst[i] = dst[i] op src[i]
+void bit_op(uint32_t op, uint8_t *dst, const uint8_t *src, size_t n);
+void bit_not(uint8_t *data, size_t n);
+// the first bit that equals `bit`, or -1
+int64_t bit_pos(const uint8_t *data, size_t n, bool bit);
+// "avx2", "popcnt" or "scalar"
+const char *bit_kernel();
@@ -0,0 +1,140 @@
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include "bloom.h"
+
+
+const size_t k_bloom_words = k_bloom_block / 8;
+
+// the false positive rate of a blocked filter with `bpe` bits per element:
+// the load of a block is Poisson distributed, and a block with i elements
+// answers like a plain 512-bit filter with i elements.
+static double bloom_fp_rate(double bpe, uint32_t k) {
+    const double bits = k_bloom_block * 8;
+    double lambda = bits / bpe;
+    double p = exp(-lambda);    // P(load == i)
+    double fp = 0;
+    for (uint32_t i = 0; i < lambda + 20 * sqrt(lambda) + 20; ++i) {
+        fp += p * pow(1 - pow(1 - 1 / bits, (double)k * i), k);
+        p *= lambda / (i + 1);
+    }
+    return fp;
+}
+
+static uint32_t bloom_k(double bpe) {
+    double k = round(bpe * M_LN2);
+    return (uint32_t)std::min<double>(std::max<double>(k, 1), k_bloom_max_k);
+}
+
+// starts from a plain Bloom filter and adds bits until the uneven load of
+// the blocks is paid for
+static double bloom_bits_per_elem(double error_rate) {
+    double bpe = -log(error_rate) / (M_LN2 * M_LN2);
+    while (bpe < 1024 && bloom_fp_rate(bpe, bloom_k(bpe)) > error_rate) {
+        bpe *= 1.02;
+    }
+    return bpe;
+}
+
+size_t bloom_size(uint64_t capacity, double error_rate) {
+    double bits = std::max<double>(1, capacity) * bloom_bits_per_elem(error_rate);
+    double nblocks = ceil(bits / (k_bloom_block * 8));
+    return (size_t)std::min(nblocks * k_bloom_block, (double)SIZE_MAX / 2);
+}
+
+static void bloom_alloc(Bloom *bf, uint64_t nblocks) {
+    bf->nblocks = nblocks;
+    bf->bits = (uint64_t *)aligned_alloc(k_bloom_block, nblocks * k_bloom_block);
+    assert(bf->bits);
+    memset(bf->bits, 0, nblocks * k_bloom_block);
+}
+
+void bloom_init(Bloom *bf, uint64_t capacity, double error_rate) {
+    bloom_alloc(bf, bloom_size(capacity, error_rate) / k_bloom_block);
+    bf->k = bloom_k(bloom_bits_per_elem(error_rate));
+    bf->capacity = capacity;
+    bf->items = 0;
+}
+
+// the block from the high half of the hash, without a division
+static uint64_t *bloom_block(const Bloom *bf, uint64_t hash) {
+    uint64_t idx = (uint64_t)(((unsigned __int128)(hash >> 32) * bf->nblocks) >> 32);
+    return bf->bits + idx * k_bloom_words;
+}
+
+// the k bits within the block, 9 at a time from the top of an LCG seeded
+// by the hash. double hashing in 9 bits collides too often for large k.
+static void bloom_mask(const Bloom *bf, uint64_t hash, uint64_t *mask) {
+    uint64_t x = hash;
+    for (uint32_t i = 0; i < bf->k; ++i) {
+        x = x * 0x5851f42d4c957f2dULL + 0x14057b7ef767814fULL;
+        uint32_t pos = (uint32_t)(x >> 55);     // 0..511
+        mask[pos >> 6] |= 1ULL << (pos & 63);
+    }
+}
+
+bool bloom_add(Bloom *bf, uint64_t hash) {
+    uint64_t *block = bloom_block(bf, hash);
+    uint64_t mask[k_bloom_words] = {};
+    bloom_mask(bf, hash, mask);
+    uint64_t missing = 0;
+    for (size_t i = 0; i < k_bloom_words; ++i) {
+        missing |= mask[i] & ~block[i];
+        block[i] |= mask[i];
+    }
+    bf->items += missing != 0;
+    return missing != 0;
+}
+
+bool bloom_exists(const Bloom *bf, uint64_t hash) {
+    const uint64_t *block = bloom_block(bf, hash);
+    uint64_t mask[k_bloom_words] = {};
+    bloom_mask(bf, hash, mask);
+    uint64_t missing = 0;
+    for (size_t i = 0; i < k_bloom_words; ++i) {
+        missing |= mask[i] & ~block[i];
+    }
+    return missing == 0;
+}
+
+void bloom_free(Bloom *bf) {
+    free(bf->bits);
+    *bf = Bloom{};
+}
+
+size_t bloom_mem(const Bloom *bf) {
+    return sizeof(Bloom) + bf->nblocks * k_bloom_block;
+}
+
+// [k: u32][capacity: u64][items: u64] then the blocks
+const size_t k_bloom_dump_hdr = 4 + 8 + 8;
+
+std::string bloom_dump(const Bloom *bf) {
+    std::string out;
+    out.reserve(k_bloom_dump_hdr + bf->nblocks * k_bloom_block);
+    out.append((const char *)&bf->k, 4);
+    out.append((const char *)&bf->capacity, 8);
+    out.append((const char *)&bf->items, 8);
+    out.append((const char *)bf->bits, bf->nblocks * k_bloom_block);
+    return out;
+}
+
+bool bloom_load(Bloom *bf, const char *data, size_t len) {
+    if (len <= k_bloom_dump_hdr || (len - k_bloom_dump_hdr) % k_bloom_block != 0) {
+        return false;
+    }
+    uint32_t k = 0;
+    memcpy(&k, data, 4);
+    if (k < 1 || k > k_bloom_max_k) {
+        return false;
+    }
+    bloom_free(bf);
+    bloom_alloc(bf, (len - k_bloom_dump_hdr) / k_bloom_block);
+    bf->k = k;
+    memcpy(&bf->capacity, data + 4, 8);
+    memcpy(&bf->items, data + 12, 8);
+    memcpy(bf->bits, data + k_bloom_dump_hdr, len - k_bloom_dump_hdr);
+    return true;
+}
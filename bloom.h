@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+// a blocked Bloom filter: an element's hash picks one 64-byte block, and
+// its k bits are all set within that block, so an add or a lookup touches
+// a single cache line. it needs a few more bits per element than a plain
+// Bloom filter for the same false positive rate.
+const size_t k_bloom_block = 64;
+const uint32_t k_bloom_max_k = 16;
+
+struct Bloom {
+    uint64_t *bits = NULL;      // nblocks * 8 words, cache line aligned
+    uint64_t nblocks = 0;
+    uint32_t k = 0;             // bits per element
+    uint64_t capacity = 0;      // elements it was sized for
+    uint64_t items = 0;         // adds that set a bit
+};
+
+// bytes of bits for `capacity` elements at `error_rate` false positives
+size_t bloom_size(uint64_t capacity, double error_rate);
+void bloom_init(Bloom *bf, uint64_t capacity, double error_rate);
+// returns true if the element was not already (maybe) in
+bool bloom_add(Bloom *bf, uint64_t hash);
+bool bloom_exists(const Bloom *bf, uint64_t hash);
+void bloom_free(Bloom *bf);
+size_t bloom_mem(const Bloom *bf);
+// a self-contained copy, for the replication snapshot
+std::string bloom_dump(const Bloom *bf);
+bool bloom_load(Bloom *bf, const char *data, size_t len);
@@ -0,0 +1,313 @@
+#include <assert.h>
+#include <string.h>
+#include "btree.h"
+
+
+// a node below half full is refilled from or merged with a sibling
+const uint32_t k_leaf_min = k_bt_leaf_max / 2;
+const uint32_t k_inner_min = k_bt_fanout / 2;
+
+static size_t node_size(const BNode *node) {
+    return node->leaf ? sizeof(BLeaf) : sizeof(BInner);
+}
+
+static BLeaf *leaf_new(BTree *tree) {
+    tree->mem += sizeof(BLeaf);
+    return new BLeaf();
+}
+
+static BInner *inner_new(BTree *tree) {
+    tree->mem += sizeof(BInner);
+    BInner *inner = new BInner();
+    inner->leaf = false;
+    return inner;
+}
+
+static void node_del(BTree *tree, BNode *node) {
+    tree->mem -= node_size(node);
+    if (node->leaf) {
+        delete (BLeaf *)node;
+    } else {
+        delete (BInner *)node;
+    }
+}
+
+// the first position in a leaf with a key >= `key`
+static uint32_t leaf_lower(const BLeaf *leaf, const std::string &key) {
+    uint32_t lo = 0, hi = leaf->n;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (*leaf->keys[mid] < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// the child of an internal node that covers `key`
+static uint32_t inner_child(const BInner *inner, const std::string &key) {
+    uint32_t lo = 0, hi = inner->n - 1;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (inner->seps[mid] <= key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// returns the new right sibling when the node splits, and its lowest key
+static BNode *insert_rec(BTree *tree, BNode *node, const std::string *key, std::string &sep) {
+    if (node->leaf) {
+        BLeaf *leaf = (BLeaf *)node;
+        uint32_t pos = leaf_lower(leaf, *key);
+        assert(pos == leaf->n || *leaf->keys[pos] != *key);
+        memmove(&leaf->keys[pos + 1], &leaf->keys[pos], (leaf->n - pos) * sizeof(leaf->keys[0]));
+        leaf->keys[pos] = key;
+        if (++leaf->n <= k_bt_leaf_max) {
+            return NULL;
+        }
+
+        BLeaf *right = leaf_new(tree);
+        uint32_t half = leaf->n / 2;
+        right->n = leaf->n - half;
+        memcpy(right->keys, &leaf->keys[half], right->n * sizeof(leaf->keys[0]));
+        leaf->n = half;
+        right->next = leaf->next;
+        leaf->next = right;
+        sep = *right->keys[0];
+        return right;
+    }
+
+    BInner *inner = (BInner *)node;
+    uint32_t idx = inner_child(inner, *key);
+    std::string kid_sep;
+    BNode *kid_right = insert_rec(tree, inner->kids[idx], key, kid_sep);
+    if (!kid_right) {
+        return NULL;
+    }
+    for (uint32_t i = inner->n; i > idx + 1; --i) {
+        inner->kids[i] = inner->kids[i - 1];
+        inner->seps[i - 1].swap(inner->seps[i - 2]);
+    }
+    inner->kids[idx + 1] = kid_right;
+    inner->seps[idx].swap(kid_sep);
+    if (++inner->n <= k_bt_fanout) {
+        return NULL;
+    }
+
+    // the middle separator moves up
+    BInner *right = inner_new(tree);
+    uint32_t half = inner->n / 2;
+    right->n = inner->n - half;
+    for (uint32_t i = 0; i < right->n; ++i) {
+        right->kids[i] = inner->kids[half + i];
+    }
+    for (uint32_t i = 0; i + 1 < right->n; ++i) {
+        right->seps[i].swap(inner->seps[half + i]);
+    }
+    sep.swap(inner->seps[half - 1]);
+    inner->n = half;
+    return right;
+}
+
+void bt_insert(BTree *tree, const std::string *key) {
+    if (!tree->root) {
+        tree->root = leaf_new(tree);
+    }
+    std::string sep;
+    BNode *right = insert_rec(tree, tree->root, key, sep);
+    if (right) {
+        BInner *root = inner_new(tree);
+        root->n = 2;
+        root->kids[0] = tree->root;
+        root->kids[1] = right;
+        root->seps[0].swap(sep);
+        tree->root = root;
+    }
+    tree->size++;
+}
+
+static bool underfull(const BNode *node) {
+    return node->n < (node->leaf ? k_leaf_min : k_inner_min);
+}
+
+static void inner_remove(BInner *inner, uint32_t idx) {
+    // drops kids[idx + 1] and seps[idx]
+    for (uint32_t i = idx + 1; i + 1 < inner->n; ++i) {
+        inner->kids[i] = inner->kids[i + 1];
+        inner->seps[i - 1].swap(inner->seps[i]);
+    }
+    inner->n--;
+    inner->seps[inner->n - 1].clear();
+}
+
+// refill or merge kids[idx] of `parent` with a neighbour
+static void fix_child(BTree *tree, BInner *parent, uint32_t idx) {
+    uint32_t li = idx > 0 ? idx - 1 : idx;   // the pair is kids[li], kids[li + 1]
+    BNode *left = parent->kids[li];
+    BNode *right = parent->kids[li + 1];
+    std::string &sep = parent->seps[li];
+
+    if (left->leaf) {
+        BLeaf *l = (BLeaf *)left, *r = (BLeaf *)right;
+        if (l->n + r->n <= k_bt_leaf_max) {
+            memcpy(&l->keys[l->n], r->keys, r->n * sizeof(r->keys[0]));
+            l->n += r->n;
+            l->next = r->next;
+            node_del(tree, r);
+            inner_remove(parent, li);
+            return;
+        }
+        // even out the two leaves
+        uint32_t total = l->n + r->n;
+        uint32_t want = total / 2;
+        if (l->n < want) {
+            uint32_t move = want - l->n;
+            memcpy(&l->keys[l->n], r->keys, move * sizeof(r->keys[0]));
+            memmove(r->keys, &r->keys[move], (r->n - move) * sizeof(r->keys[0]));
+            l->n += move;
+            r->n -= move;
+        } else {
+            uint32_t move = l->n - want;
+            memmove(&r->keys[move], r->keys, r->n * sizeof(r->keys[0]));
+            memcpy(r->keys, &l->keys[want], move * sizeof(r->keys[0]));
+            l->n -= move;
+            r->n += move;
+        }
+        sep = *r->keys[0];
+        return;
+    }
+
+    BInner *l = (BInner *)left, *r = (BInner *)right;
+    if (l->n + r->n <= k_bt_fanout) {
+        // the parent separator comes down between the two halves
+        l->seps[l->n - 1].swap(sep);
+        for (uint32_t i = 0; i < r->n; ++i) {
+            l->kids[l->n + i] = r->kids[i];
+        }
+        for (uint32_t i = 0; i + 1 < r->n; ++i) {
+            l->seps[l->n + i].swap(r->seps[i]);
+        }
+        l->n += r->n;
+        node_del(tree, r);
+        inner_remove(parent, li);
+        return;
+    }
+    // rotate children through the parent one at a time
+    while (l->n < r->n && underfull(l)) {
+        l->kids[l->n] = r->kids[0];
+        l->seps[l->n - 1].swap(sep);
+        sep.swap(r->seps[0]);
+        l->n++;
+        for (uint32_t i = 0; i + 1 < r->n; ++i) {
+            r->kids[i] = r->kids[i + 1];
+            if (i + 2 < r->n) {
+                r->seps[i].swap(r->seps[i + 1]);
+            }
+        }
+        r->n--;
+        r->seps[r->n - 1].clear();
+    }
+    while (r->n < l->n && underfull(r)) {
+        for (uint32_t i = r->n; i > 0; --i) {
+            r->kids[i] = r->kids[i - 1];
+            if (i < r->n) {
+                r->seps[i].swap(r->seps[i - 1]);
+            }
+        }
+        r->kids[0] = l->kids[l->n - 1];
+        r->seps[0].swap(sep);
+        r->n++;
+        sep.swap(l->seps[l->n - 2]);
+        l->seps[l->n - 2].clear();
+        l->n--;
+    }
+}
+
+static bool delete_rec(BTree *tree, BNode *node, const std::string &key) {
+    if (node->leaf) {
+        BLeaf *leaf = (BLeaf *)node;
+        uint32_t pos = leaf_lower(leaf, key);
+        if (pos == leaf->n || *leaf->keys[pos] != key) {
+            return false;
+        }
+        memmove(&leaf->keys[pos], &leaf->keys[pos + 1], (leaf->n - pos - 1) * sizeof(leaf->keys[0]));
+        leaf->n--;
+        return true;
+    }
+
+    BInner *inner = (BInner *)node;
+    uint32_t idx = inner_child(inner, key);
+    if (!delete_rec(tree, inner->kids[idx], key)) {
+        return false;
+    }
+    if (underfull(inner->kids[idx])) {
+        fix_child(tree, inner, idx);
+    }
+    return true;
+}
+
+bool bt_delete(BTree *tree, const std::string &key) {
+    if (!tree->root || !delete_rec(tree, tree->root, key)) {
+        return false;
+    }
+    tree->size--;
+    BNode *root = tree->root;
+    if (!root->leaf && root->n == 1) {
+        tree->root = ((BInner *)root)->kids[0];
+        node_del(tree, root);
+    } else if (root->leaf && root->n == 0) {
+        node_del(tree, root);
+        tree->root = NULL;
+    }
+    return true;
+}
+
+static void clear_rec(BTree *tree, BNode *node) {
+    if (!node->leaf) {
+        BInner *inner = (BInner *)node;
+        for (uint32_t i = 0; i < inner->n; ++i) {
+            clear_rec(tree, inner->kids[i]);
+        }
+    }
+    node_del(tree, node);
+}
+
+void bt_clear(BTree *tree) {
+    if (tree->root) {
+        clear_rec(tree, tree->root);
+    }
+    tree->root = NULL;
+    tree->size = 0;
+}
+
+BIter bt_seek(BTree *tree, const std::string &key) {
+    BIter it;
+    BNode *node = tree->root;
+    if (!node) {
+        return it;
+    }
+    while (!node->leaf) {
+        BInner *inner = (BInner *)node;
+        node = inner->kids[inner_child(inner, key)];
+    }
+    it.leaf = (BLeaf *)node;
+    it.idx = leaf_lower(it.leaf, key);
+    if (it.idx == it.leaf->n) {
+        it.leaf = it.leaf->next;
+        it.idx = 0;
+    }
+    return it;
+}
+
+void bt_next(BIter *it) {
+    if (++it->idx == it->leaf->n) {
+        it->leaf = it->leaf->next;
+        it->idx = 0;
+    }
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+// a B+ tree of string keys owned by the caller, in byte order. internal
+// nodes keep copies of their separators so a key can be freed right after
+// it is deleted. leaves are chained for range scans.
+const uint32_t k_bt_leaf_max = 64;  // keys per leaf
+const uint32_t k_bt_fanout = 64;    // children per internal node
+
+struct BNode {
+    bool leaf = true;
+    uint32_t n = 0;     // keys of a leaf, children of an internal node
+};
+
+struct BLeaf : BNode {
+    BLeaf *next = NULL;
+    const std::string *keys[k_bt_leaf_max + 1];     // one extra before a split
+};
+
+struct BInner : BNode {
+    BNode *kids[k_bt_fanout + 1];
+    std::string seps[k_bt_fanout];  // seps[i] is the lowest key under kids[i + 1]
+};
+
+struct BTree {
+    BNode *root = NULL;
+    size_t size = 0;
+    size_t mem = 0;     // bytes of the nodes
+};
+
+struct BIter {
+    BLeaf *leaf = NULL;
+    uint32_t idx = 0;
+};
+
+void bt_insert(BTree *tree, const std::string *key);
+bool bt_delete(BTree *tree, const std::string &key);
+void bt_clear(BTree *tree);
+// the first key >= `key`
+BIter bt_seek(BTree *tree, const std::string &key);
+
+inline bool bt_valid(const BIter *it) {
+    return it->leaf != NULL;
+}
+
+inline const std::string *bt_key(const BIter *it) {
+    return it->leaf->keys[it->idx];
+}
+
+void bt_next(BIter *it);
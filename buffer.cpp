@@ -0,0 +1,152 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "buffer.h"
+
+
+RcStr *rcstr_new() {
+    return new RcStr();
+}
+
+void rcstr_ref(RcStr *str) {
+    str->refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+void rcstr_unref(RcStr *str) {
+    if (str->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        delete str;
+    }
+}
+
+// make room for `n` more bytes and return the write position
+uint8_t *buf_reserve(Buffer *buf, size_t n) {
+    if (buf->cap - buf->tail < n) {
+        size_t cap = buf->cap ? buf->cap : 256;
+        while (cap - buf->tail < n) {
+            cap *= 2;
+        }
+        buf->data = (uint8_t *)realloc(buf->data, cap);
+        assert(buf->data);
+        buf->cap = cap;
+    }
+    return buf->data + buf->tail;
+}
+
+void buf_append(Buffer *buf, const void *src, size_t n) {
+    memcpy(buf_reserve(buf, n), src, n);
+    buf->tail += n;
+}
+
+// reference the string instead of copying it
+void buf_append_ref(Buffer *buf, RcStr *str) {
+    if (str->data.empty()) {
+        return;
+    }
+    rcstr_ref(str);
+    BufRef ref;
+    ref.pos = buf->tail;
+    ref.str = str;
+    buf->refs.push_back(ref);
+    buf->ref_bytes += str->data.size();
+}
+
+// drop everything appended after the position `pos`, which must not be in
+// the consumed data. a string spliced in at `pos` ends what came before it,
+// such as the previous response, and stays.
+void buf_truncate(Buffer *buf, size_t pos) {
+    assert(buf->head <= pos && pos <= buf->tail);
+    while (!buf->refs.empty() && buf->refs.back().pos > pos) {
+        BufRef &ref = buf->refs.back();
+        assert(ref.sent == 0);
+        buf->ref_bytes -= ref.str->data.size() - ref.sent;
+        rcstr_unref(ref.str);
+        buf->refs.pop_back();
+    }
+    buf->tail = pos;
+}
+
+void buf_consume(Buffer *buf, size_t n) {
+    while (n > 0) {
+        size_t end = buf->refs.empty() ? buf->tail : buf->refs.front().pos;
+        if (buf->head < end) {
+            size_t k = end - buf->head < n ? end - buf->head : n;
+            buf->head += k;
+            n -= k;
+            continue;
+        }
+
+        BufRef &ref = buf->refs.front();
+        size_t remain = ref.str->data.size() - ref.sent;
+        size_t k = remain < n ? remain : n;
+        ref.sent += k;
+        buf->ref_bytes -= k;
+        n -= k;
+        if (ref.sent == ref.str->data.size()) {
+            rcstr_unref(ref.str);
+            buf->refs.pop_front();
+        }
+    }
+
+    if (buf->head == buf->tail && buf->refs.empty()) {
+        buf->head = buf->tail = 0;
+    } else if (buf->head >= 4096 && buf->head * 2 >= buf->tail) {
+        // move the data to the front once the dead space dominates
+        memmove(buf->data, buf->data + buf->head, buf->tail - buf->head);
+        for (BufRef &ref : buf->refs) {
+            ref.pos -= buf->head;
+        }
+        buf->tail -= buf->head;
+        buf->head = 0;
+    }
+}
+
+// fill the iovec array with the unconsumed data, in order
+int buf_iov(Buffer *buf, struct iovec *iov, int max_iov) {
+    int n = 0;
+    size_t pos = buf->head;
+    for (BufRef &ref : buf->refs) {
+        if (n + 2 > max_iov) {
+            return n;
+        }
+        if (pos < ref.pos) {
+            iov[n].iov_base = buf->data + pos;
+            iov[n].iov_len = ref.pos - pos;
+            n++;
+            pos = ref.pos;
+        }
+        iov[n].iov_base = (void *)(ref.str->data.data() + ref.sent);
+        iov[n].iov_len = ref.str->data.size() - ref.sent;
+        n++;
+    }
+    if (n < max_iov && pos < buf->tail) {
+        iov[n].iov_base = buf->data + pos;
+        iov[n].iov_len = buf->tail - pos;
+        n++;
+    }
+    return n;
+}
+
+void buf_free(Buffer *buf) {
+    for (BufRef &ref : buf->refs) {
+        rcstr_unref(ref.str);
+    }
+    buf->refs.clear();
+    free(buf->data);
+    buf->data = NULL;
+    buf->cap = buf->head = buf->tail = 0;
+    buf->ref_bytes = 0;
+}
+
+void buf_move(Buffer *dst, Buffer *src) {
+    size_t pos = src->head;
+    for (BufRef &ref : src->refs) {
+        buf_append(dst, src->data + pos, ref.pos - pos);
+        pos = ref.pos;
+        ref.pos = dst->tail;
+        dst->refs.push_back(ref);
+        dst->ref_bytes += ref.str->data.size() - ref.sent;
+    }
+    buf_append(dst, src->data + pos, src->tail - pos);
+    src->refs.clear();
+    buf_free(src);
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <atomic>
+#include <deque>
+#include <string>
+
+// a refcounted string, shared between the keyspace and the output of
+// connections so that big values are sent without copying them.
+struct RcStr {
+    std::atomic<uint32_t> refs{1};
+    std::string data;
+};
+
+RcStr *rcstr_new();
+void rcstr_ref(RcStr *str);
+void rcstr_unref(RcStr *str);
+
+// a shared string spliced into the byte stream before `pos`
+struct BufRef {
+    size_t pos = 0;
+    size_t sent = 0;
+    RcStr *str = NULL;
+};
+
+// a byte queue, appended at the back and consumed from the front.
+// positions are indexes into `data` and stay valid until buf_consume().
+struct Buffer {
+    uint8_t *data = NULL;
+    size_t cap = 0;
+    size_t head = 0;    // the first unconsumed byte
+    size_t tail = 0;    // the end of the data
+    std::deque<BufRef> refs;
+    size_t ref_bytes = 0;   // unconsumed bytes in `refs`
+};
+
+uint8_t *buf_reserve(Buffer *buf, size_t n);
+void buf_append(Buffer *buf, const void *src, size_t n);
+void buf_append_ref(Buffer *buf, RcStr *str);
+void buf_truncate(Buffer *buf, size_t pos);
+void buf_consume(Buffer *buf, size_t n);
+int buf_iov(Buffer *buf, struct iovec *iov, int max_iov);
+void buf_free(Buffer *buf);
+// append what `src` holds to `dst`, the references move along; `src` ends
+// up empty
+void buf_move(Buffer *dst, Buffer *src);
+
+// bytes not yet consumed, including the spliced strings
+inline size_t buf_size(const Buffer *buf) {
+    return buf->tail - buf->head + buf->ref_bytes;
+}
+
+inline void buf_append_u8(Buffer *buf, uint8_t val) {
+    *buf_reserve(buf, 1) = val;
+    buf->tail++;
+}
@@ -0,0 +1,246 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <algorithm>
+#include "chashtable.h"
+#include "common.h"
+
+
+const size_t k_chm_load_factor = 8;     // as HMap
+const size_t k_chm_move_chunk = 64;     // buckets a writer moves at a time
+
+static CHStripe *stripe_of(CHMap *map, uint64_t hcode) {
+    return &map->stripes[hcode & (k_chm_stripes - 1)];
+}
+
+// held for a few pointer writes
+static void stripe_lock(CHStripe *s) {
+    uint32_t spins = 0;
+    while (s->lock.exchange(1, std::memory_order_acquire)) {
+        while (s->lock.load(std::memory_order_relaxed)) {
+            spin_wait(spins);
+        }
+    }
+}
+
+static void stripe_unlock(CHStripe *s) {
+    s->lock.store(0, std::memory_order_release);
+}
+
+static CHTab *tab_new(size_t n) {
+    assert(n >= k_chm_stripes && ((n - 1) & n) == 0);
+    CHTab *t = new CHTab();
+    t->slots = (HNode **)calloc(n, sizeof(HNode *));
+    assert(t->slots);
+    t->mask = n - 1;
+    return t;
+}
+
+static void tab_free(CHTab *t) {
+    free(t->slots);
+    delete t;
+}
+
+static HNode **slot_of(CHTab *t, uint64_t hcode) {
+    return &t->slots[hcode & t->mask];
+}
+
+// the table that holds the bucket of `hcode`, and the bucket's first node
+static CHTab *tab_find(CHMap *map, uint64_t hcode, HNode **head) {
+    CHTab *t = map->tab.load(std::memory_order_acquire);
+    while ((*head = __atomic_load_n(slot_of(t, hcode), __ATOMIC_ACQUIRE)) == &t->moved_marker) {
+        t = __atomic_load_n(&t->next, __ATOMIC_ACQUIRE);
+    }
+    return t;
+}
+
+// split a bucket of `t` into its two buckets of the bigger table. lookups
+// walking the chain meanwhile may be sent into the other half, the stripe's
+// `seq` tells them to look again.
+static void bucket_move(CHMap *map, CHTab *t, size_t pos) {
+    CHStripe *s = &map->stripes[pos & (k_chm_stripes - 1)];
+    stripe_lock(s);
+    uint32_t seq = s->seq.load(std::memory_order_relaxed);
+    s->seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    size_t bit = t->mask + 1;
+    HNode *lists[2] = {NULL, NULL};
+    for (HNode *cur = t->slots[pos]; cur; ) {
+        HNode *next = cur->next;
+        HNode *&list = lists[(cur->hcode & bit) ? 1 : 0];
+        __atomic_store_n(&cur->next, list, __ATOMIC_RELAXED);
+        list = cur;
+        cur = next;
+    }
+    // the new buckets are complete before lookups are sent to them
+    __atomic_store_n(&t->next->slots[pos], lists[0], __ATOMIC_RELEASE);
+    __atomic_store_n(&t->next->slots[pos | bit], lists[1], __ATOMIC_RELEASE);
+    __atomic_store_n(&t->slots[pos], &t->moved_marker, __ATOMIC_RELEASE);
+
+    s->seq.store(seq + 2, std::memory_order_release);
+    stripe_unlock(s);
+}
+
+// move a chunk of buckets of a growing table, and switch the map over
+// after the last one
+static void chm_help(CHMap *map, CHTab *t) {
+    size_t nslots = t->mask + 1;
+    size_t start = t->claimed.fetch_add(k_chm_move_chunk, std::memory_order_relaxed);
+    if (start >= nslots) {
+        return;     // all handed out, the movers finish without us
+    }
+    size_t end = std::min(start + k_chm_move_chunk, nslots);
+    for (size_t pos = start; pos < end; ++pos) {
+        bucket_move(map, t, pos);
+    }
+    if (t->moved.fetch_add(end - start, std::memory_order_acq_rel) + (end - start) == nslots) {
+        t->next->prev = t;
+        map->tab.store(t->next, std::memory_order_release);
+    }
+}
+
+// writers help a resize in progress before doing their own work
+static void chm_help_resizing(CHMap *map) {
+    CHTab *t = map->tab.load(std::memory_order_acquire);
+    if (__atomic_load_n(&t->next, __ATOMIC_ACQUIRE)) {
+        chm_help(map, t);
+    }
+}
+
+// only the current table grows, and one resize runs at a time
+static void chm_start_resizing(CHMap *map, CHTab *t) {
+    if (map->tab.load(std::memory_order_acquire) != t
+        || __atomic_load_n(&t->next, __ATOMIC_ACQUIRE))
+    {
+        return;
+    }
+    CHTab *bigger = tab_new((t->mask + 1) * 2);
+    CHTab *expected = NULL;
+    if (__atomic_compare_exchange_n(&t->next, &expected, bigger, false,
+        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+        map->resizes.fetch_add(1, std::memory_order_relaxed);
+    } else {
+        tab_free(bigger);   // another writer started it
+    }
+}
+
+void chm_init(CHMap *map, size_t n) {
+    size_t slots = k_chm_stripes;
+    while (slots * (k_chm_load_factor / 2) < n) {
+        slots *= 2;
+    }
+    map->tab.store(tab_new(slots), std::memory_order_release);
+}
+
+void chm_destroy(CHMap *map) {
+    CHTab *t = map->tab.load();
+    if (t && t->next) {
+        tab_free(t->next);  // a resize that did not finish
+    }
+    while (t) {
+        CHTab *prev = t->prev;
+        tab_free(t);
+        t = prev;
+    }
+    map->tab.store(NULL);
+    for (CHStripe &s : map->stripes) {
+        s.size.store(0);
+    }
+}
+
+void chm_insert(CHMap *map, HNode *node) {
+    chm_help_resizing(map);
+    CHStripe *s = stripe_of(map, node->hcode);
+    stripe_lock(s);
+    HNode *head = NULL;
+    CHTab *t = tab_find(map, node->hcode, &head);
+    node->next = head;
+    // linked before it is published
+    __atomic_store_n(slot_of(t, node->hcode), node, __ATOMIC_RELEASE);
+    int64_t size = s->size.load(std::memory_order_relaxed) + 1;
+    s->size.store(size, std::memory_order_relaxed);
+    stripe_unlock(s);
+
+    // the stripe's share of the buckets is over the load factor. the
+    // stripes see the same number of keys on average, so no shared counter
+    // is needed to tell.
+    if ((size_t)size > (t->mask + 1) / k_chm_stripes * k_chm_load_factor) {
+        chm_start_resizing(map, t);
+    }
+}
+
+// a hit is a hit, even while the bucket moves. a miss only counts if the
+// stripe's buckets did not move meanwhile.
+HNode *chm_lookup(CHMap *map, HNode *key, bool (*eq)(HNode *, HNode *)) {
+    CHStripe *s = stripe_of(map, key->hcode);
+    uint32_t spins = 0;
+    while (true) {
+        uint32_t seq = s->seq.load(std::memory_order_acquire);
+        HNode *cur = NULL;
+        tab_find(map, key->hcode, &cur);
+        for (; cur; cur = __atomic_load_n(&cur->next, __ATOMIC_ACQUIRE)) {
+            if (cur->hcode == key->hcode && eq(cur, key)) {
+                return cur;
+            }
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (!(seq & 1) && s->seq.load(std::memory_order_relaxed) == seq) {
+            return NULL;
+        }
+        spin_wait(spins);
+    }
+}
+
+HNode *chm_pop(CHMap *map, HNode *key, bool (*eq)(HNode *, HNode *)) {
+    chm_help_resizing(map);
+    CHStripe *s = stripe_of(map, key->hcode);
+    stripe_lock(s);
+    HNode *head = NULL;
+    CHTab *t = tab_find(map, key->hcode, &head);
+    HNode **from = slot_of(t, key->hcode);
+    for (HNode *cur; (cur = *from) != NULL; from = &cur->next) {
+        if (cur->hcode == key->hcode && eq(cur, key)) {
+            // the node keeps its link, a lookup standing on it goes on
+            __atomic_store_n(from, cur->next, __ATOMIC_RELEASE);
+            s->size.store(s->size.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+            stripe_unlock(s);
+            return cur;
+        }
+    }
+    stripe_unlock(s);
+    return NULL;
+}
+
+size_t chm_size(CHMap *map) {
+    int64_t n = 0;
+    for (CHStripe &s : map->stripes) {
+        n += s.size.load(std::memory_order_relaxed);
+    }
+    return n > 0 ? (size_t)n : 0;
+}
+
+static void tab_scan(CHTab *t, void (*f)(HNode *, void *), void *arg) {
+    for (size_t i = 0; i <= t->mask; ++i) {
+        HNode *node = t->slots[i];
+        if (node == &t->moved_marker) {
+            continue;
+        }
+        while (node) {
+            HNode *next = node->next;
+            f(node, arg);
+            node = next;
+        }
+    }
+}
+
+void chm_scan(CHMap *map, void (*f)(HNode *, void *), void *arg) {
+    CHTab *t = map->tab.load();
+    if (!t) {
+        return;
+    }
+    tab_scan(t, f, arg);
+    if (t->next) {
+        tab_scan(t->next, f, arg);  // the buckets moved so far
+    }
+}
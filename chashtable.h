@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include "hashtable.h"
+
+// a hashtable for several threads, on the same intrusive HNode as HMap.
+//
+// lookups take no locks. writers lock one of k_chm_stripes stripes, picked
+// by the low bits of the hash: a table is never smaller than the stripe
+// count, so a stripe covers the same buckets in every table size. growing
+// is cooperative: the bigger table is hung off the current one, and every
+// writer moves a chunk of buckets before its own operation; the one that
+// moves the last chunk switches the map over. a moved bucket holds the
+// table's `moved_marker`, lookups and writers go on in the next table.
+//
+// a lookup may still stand on a node that was just popped, so the caller
+// must not free or reinsert a popped node until no lookup can be on it
+// (see ebr.h). the old bucket arrays are kept until chm_destroy(), all of
+// them together are smaller than the current one.
+const size_t k_chm_stripes = 1024;
+
+struct CHStripe {
+    alignas(64) std::atomic<uint32_t> lock{0};
+    std::atomic<uint32_t> seq{0};       // odd while its buckets move to a bigger table
+    std::atomic<int64_t> size{0};       // nodes in its buckets, changed under `lock`
+};
+
+struct CHTab {
+    HNode **slots = NULL;
+    size_t mask = 0;
+    CHTab *next = NULL;         // the bigger table being moved to, set once
+    CHTab *prev = NULL;         // the table this one replaced
+    std::atomic<size_t> claimed{0};     // buckets handed out to movers
+    std::atomic<size_t> moved{0};
+    HNode moved_marker;
+};
+
+struct CHMap {
+    std::atomic<CHTab *> tab{NULL};
+    CHStripe stripes[k_chm_stripes];
+    std::atomic<uint64_t> resizes{0};
+};
+
+// sized for `n` nodes, before any other thread uses the map
+void chm_init(CHMap *map, size_t n);
+// once no other thread uses the map, the nodes are not touched
+void chm_destroy(CHMap *map);
+void chm_insert(CHMap *map, HNode *node);
+HNode *chm_lookup(CHMap *map, HNode *key, bool (*eq)(HNode *, HNode *));
+HNode *chm_pop(CHMap *map, HNode *key, bool (*eq)(HNode *, HNode *));
+// exact when no writer is running
+size_t chm_size(CHMap *map);
+// visit every node, when no writer is running. `f` may free the node.
+void chm_scan(CHMap *map, void (*f)(HNode *, void *), void *arg);
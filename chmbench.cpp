@@ -0,0 +1,309 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "chashtable.h"
+#include "hashtable.h"
+#include "common.h"
+
+// a contention benchmark of CHMap against HMap behind a mutex. threads run
+// a mix of lookups and writes over one keyspace; a write pops a key and, if
+// it was not there, inserts it as a new node. each thread writes its own
+// keys, so the key count stays about the same and can be checked at the
+// end. popped nodes are freed after the run, as no reclamation is used.
+// --test grow inserts into an empty map instead, to measure the resizing.
+
+static uint64_t get_monotonic_usec() {
+    timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000 + tv.tv_nsec / 1000;
+}
+
+struct BenchOpts {
+    std::vector<size_t> threads = {1, 2, 4, 8, 16, 32, 64};
+    std::vector<size_t> reads = {100, 95, 50};  // percent of the operations
+    size_t keys = 1000000;
+    size_t ops = 2000000;       // per run, shared by the threads
+    std::string map = "both";   // chm, hmap or both
+    std::string test = "mixed";
+};
+
+struct BNode {
+    HNode node;
+    uint64_t key = 0;
+};
+
+static bool bnode_eq(HNode *lhs, HNode *rhs) {
+    return container_of(lhs, BNode, node)->key == container_of(rhs, BNode, node)->key;
+}
+
+static uint64_t key_hash(uint64_t x) {    // splitmix64
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+static BNode *bnode_new(uint64_t key) {
+    BNode *n = new BNode();
+    n->key = key;
+    n->node.hcode = key_hash(key);
+    return n;
+}
+
+static uint64_t rng_next(uint64_t &x) {    // xorshift64
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return x;
+}
+
+// the two maps behind one interface
+struct BenchMap {
+    bool chm = false;
+    CHMap cmap;
+    HMap hmap;
+    std::mutex mu;
+};
+
+static void map_insert(BenchMap *m, BNode *n) {
+    if (m->chm) {
+        chm_insert(&m->cmap, &n->node);
+    } else {
+        std::lock_guard<std::mutex> lock(m->mu);
+        hm_insert(&m->hmap, &n->node);
+    }
+}
+
+static HNode *map_lookup(BenchMap *m, BNode *key) {
+    if (m->chm) {
+        return chm_lookup(&m->cmap, &key->node, &bnode_eq);
+    }
+    std::lock_guard<std::mutex> lock(m->mu);    // hm_lookup() helps resizing
+    return hm_lookup(&m->hmap, &key->node, &bnode_eq);
+}
+
+static HNode *map_pop(BenchMap *m, BNode *key) {
+    if (m->chm) {
+        return chm_pop(&m->cmap, &key->node, &bnode_eq);
+    }
+    std::lock_guard<std::mutex> lock(m->mu);
+    return hm_pop(&m->hmap, &key->node, &bnode_eq);
+}
+
+static size_t map_size(BenchMap *m) {
+    return m->chm ? chm_size(&m->cmap) : hm_size(&m->hmap);
+}
+
+struct Worker {
+    size_t id = 0;
+    size_t ops = 0;
+    int64_t delta = 0;          // keys added minus keys popped
+    uint64_t hits = 0;
+    std::vector<HNode *> popped;
+};
+
+struct Run {
+    const BenchOpts *opts = NULL;
+    BenchMap *map = NULL;
+    size_t nthreads = 0;
+    size_t read_pct = 0;
+    std::atomic<size_t> ready{0};
+};
+
+static void worker_mixed(Run *run, Worker *w) {
+    uint64_t rng = key_hash(w->id + 1);
+    size_t keys = run->opts->keys;
+    size_t owned = keys / run->nthreads;
+    BNode probe;
+    for (size_t i = 0; i < w->ops; ++i) {
+        uint64_t r = rng_next(rng);
+        if (r % 100 < run->read_pct) {
+            probe.key = (r >> 8) % keys;
+            probe.node.hcode = key_hash(probe.key);
+            w->hits += map_lookup(run->map, &probe) != NULL;
+            continue;
+        }
+        probe.key = ((r >> 8) % owned) * run->nthreads + w->id;
+        probe.node.hcode = key_hash(probe.key);
+        if (HNode *node = map_pop(run->map, &probe)) {
+            w->popped.push_back(node);
+            w->delta--;
+        } else {
+            map_insert(run->map, bnode_new(probe.key));
+            w->delta++;
+        }
+    }
+}
+
+static void worker_grow(Run *run, Worker *w) {
+    for (size_t i = 0; i < w->ops; ++i) {
+        map_insert(run->map, bnode_new(i * run->nthreads + w->id));
+    }
+    w->delta = (int64_t)w->ops;
+}
+
+static void worker_main(Run *run, Worker *w) {
+    // start together
+    run->ready.fetch_add(1);
+    while (run->ready.load() < run->nthreads) {
+        std::this_thread::yield();
+    }
+    if (run->opts->test == "grow") {
+        worker_grow(run, w);
+    } else {
+        worker_mixed(run, w);
+    }
+}
+
+static void free_node(HNode *node, void *) {
+    delete container_of(node, BNode, node);
+}
+
+static void h_scan(HTab *tab, void (*f)(HNode *, void *), void *arg) {
+    for (size_t i = 0; tab->tab && i <= tab->mask; ++i) {
+        for (HNode *node = tab->tab[i]; node; ) {
+            HNode *next = node->next;
+            f(node, arg);
+            node = next;
+        }
+    }
+}
+
+// ops per second, 0 if the final key count is wrong
+static double run_one(const BenchOpts &opts, bool chm, size_t nthreads, size_t read_pct,
+                      uint64_t *resizes) {
+    BenchMap m;
+    m.chm = chm;
+    bool grow = opts.test == "grow";
+    size_t prefill = grow ? 0 : opts.keys;
+    if (chm) {
+        chm_init(&m.cmap, prefill);
+    }
+    for (size_t k = 0; k < prefill; ++k) {
+        map_insert(&m, bnode_new(k));
+    }
+    uint64_t resizes_before = chm ? m.cmap.resizes.load() : 0;
+
+    Run run;
+    run.opts = &opts;
+    run.map = &m;
+    run.nthreads = nthreads;
+    run.read_pct = read_pct;
+    std::vector<Worker> workers(nthreads);
+    std::vector<std::thread> threads;
+    uint64_t start_us = get_monotonic_usec();
+    for (size_t i = 0; i < nthreads; ++i) {
+        workers[i].id = i;
+        workers[i].ops = opts.ops / nthreads;
+        threads.emplace_back(&worker_main, &run, &workers[i]);
+    }
+    size_t total = 0;
+    int64_t expect = (int64_t)prefill;
+    for (size_t i = 0; i < nthreads; ++i) {
+        threads[i].join();
+        total += workers[i].ops;
+        expect += workers[i].delta;
+    }
+    uint64_t elapsed_us = std::max<uint64_t>(get_monotonic_usec() - start_us, 1);
+    *resizes = chm ? m.cmap.resizes.load() - resizes_before : 0;
+    bool ok = map_size(&m) == (size_t)expect;
+
+    // every node is either in the map or popped
+    if (chm) {
+        chm_scan(&m.cmap, &free_node, NULL);
+        chm_destroy(&m.cmap);
+    } else {
+        h_scan(&m.hmap.ht1, &free_node, NULL);
+        h_scan(&m.hmap.ht2, &free_node, NULL);
+        hm_destroy(&m.hmap);
+    }
+    for (Worker &w : workers) {
+        for (HNode *node : w.popped) {
+            free_node(node, NULL);
+        }
+    }
+    return ok ? total * 1e6 / elapsed_us : 0;
+}
+
+static std::vector<size_t> parse_list(const char *s) {
+    std::vector<size_t> out;
+    for (const char *p = s; *p; ) {
+        char *end = NULL;
+        size_t val = strtoull(p, &end, 10);
+        if (end == p) {
+            return {};
+        }
+        out.push_back(val);
+        p = *end == ',' ? end + 1 : end;
+    }
+    return out;
+}
+
+int main(int argc, char *argv[]) {
+    BenchOpts opts;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        const char *name = argv[i];
+        const char *val = argv[i + 1];
+        if (!strcmp(name, "--threads")) {
+            opts.threads = parse_list(val);
+        } else if (!strcmp(name, "--reads")) {
+            opts.reads = parse_list(val);
+        } else if (!strcmp(name, "--keys")) {
+            opts.keys = strtoull(val, NULL, 10);
+        } else if (!strcmp(name, "--ops")) {
+            opts.ops = strtoull(val, NULL, 10);
+        } else if (!strcmp(name, "--map")) {
+            opts.map = val;
+        } else if (!strcmp(name, "--test")) {
+            opts.test = val;
+        } else {
+            fprintf(stderr, "bad option: %s\n", name);
+            return 1;
+        }
+    }
+    bool bad_list = opts.threads.empty() || opts.reads.empty();
+    for (size_t n : opts.threads) {
+        bad_list = bad_list || n == 0 || n > opts.keys;
+    }
+    for (size_t pct : opts.reads) {
+        bad_list = bad_list || pct > 100;
+    }
+    if (argc % 2 == 0 || bad_list || !opts.ops
+        || (opts.map != "chm" && opts.map != "hmap" && opts.map != "both")
+        || (opts.test != "mixed" && opts.test != "grow"))
+    {
+        fprintf(stderr, "Usage: ./chmbench [--threads 1,2,4,...] [--reads 100,95,50] [--keys n]\n"
+                        "                  [--ops n] [--map chm|hmap|both] [--test mixed|grow]\n");
+        return 1;
+    }
+    if (opts.test == "grow") {
+        opts.reads = {0};
+    }
+
+    printf("%-8s %-6s %14s %14s %8s\n", "threads", "reads", "chm ops/s", "hmap ops/s", "resizes");
+    for (size_t pct : opts.reads) {
+        for (size_t n : opts.threads) {
+            uint64_t resizes = 0, unused = 0;
+            double chm = 0, hmap = 0;
+            if (opts.map != "hmap") {
+                chm = run_one(opts, true, n, pct, &resizes);
+            }
+            if (opts.map != "chm") {
+                hmap = run_one(opts, false, n, pct, &unused);
+            }
+            printf("%-8zu %-6zu %14.0f %14.0f %8llu\n", n, pct, chm, hmap,
+                   (unsigned long long)resizes);
+            if ((opts.map != "hmap" && chm == 0) || (opts.map != "chm" && hmap == 0)) {
+                fprintf(stderr, "wrong key count after the run\n");
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
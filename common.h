@@ -2,9 +2,23 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <string.h>
+#include <sched.h>
 #define container_of(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
 
 
+// one step of a spin-wait on another thread: pause, and yield now and
+// then in case that thread is not running, with more threads than cores
+inline void spin_wait(uint32_t &spins) {
+    if (++spins % 64 == 0) {
+        sched_yield();
+    } else {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    }
+}
+
 inline uint64_t str_hash(const uint8_t *data, size_t len) {
     uint32_t h = 0x811C9DC5;
     for (size_t i = 0; i < len; i++) {
@@ -13,6 +27,33 @@ inline uint64_t str_hash(const uint8_t *data, size_t len) {
     return h;
 }
 
+// MurmurHash64A, for the structures that need all 64 bits of a hash
+inline uint64_t str_hash64(const uint8_t *data, size_t len) {
+    const uint64_t m = 0xc6a4a7935bd1e995ULL;
+    const int r = 47;
+    uint64_t h = 0x5bd1e995 ^ (len * m);
+    const uint8_t *end = data + (len & ~(size_t)7);
+    for (; data != end; data += 8) {
+        uint64_t k = 0;
+        memcpy(&k, data, 8);
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+        h ^= k;
+        h *= m;
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, data, len & 7);
+    if (len & 7) {
+        h ^= tail;
+        h *= m;
+    }
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+    return h;
+}
+
 enum {
     SER_NIL = 0,
     SER_ERR = 1,
@@ -20,5 +61,6 @@ enum {
     SER_INT = 3,
     SER_DBL = 4,
     SER_ARR = 5,
-    SER_KV  = 6
+    SER_KV  = 6,
+    SER_PUSH = 7,   // an array sent by the server on its own, not a reply
 };
\ No newline at end of file
@@ -0,0 +1,229 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "config.h"
+
+Config g_conf;
+
+static const char *k_policy_names[] = {
+    "noeviction", "allkeys-lru", "allkeys-lfu",
+    "volatile-lru", "volatile-lfu", "volatile-ttl",
+};
+
+static bool str2u64(const std::string &s, uint64_t &out) {
+    char *endp = NULL;
+    out = strtoull(s.c_str(), &endp, 10);
+    return !s.empty() && s[0] != '-' && endp == s.c_str() + s.size();
+}
+
+// accepts plain bytes or a kb/mb/gb suffix
+static bool str2bytes(const std::string &s, size_t &out) {
+    size_t unit = 1;
+    std::string num = s;
+    if (s.size() > 2) {
+        const char *suffix = s.c_str() + s.size() - 2;
+        if (0 == strcasecmp(suffix, "kb")) {
+            unit = 1024;
+        } else if (0 == strcasecmp(suffix, "mb")) {
+            unit = 1024 * 1024;
+        } else if (0 == strcasecmp(suffix, "gb")) {
+            unit = 1024 * 1024 * 1024;
+        }
+        if (unit != 1) {
+            num = s.substr(0, s.size() - 2);
+        }
+    }
+    uint64_t val = 0;
+    if (!str2u64(num, val) || val > SIZE_MAX / unit) {
+        return false;   // would wrap around to a small size
+    }
+    out = (size_t)(val * unit);
+    return true;
+}
+
+static bool str2u32(const std::string &s, uint32_t &out) {
+    uint64_t val = 0;
+    if (!str2u64(s, val) || val > UINT32_MAX) {
+        return false;
+    }
+    out = (uint32_t)val;
+    return true;
+}
+
+bool config_set(const std::string &name, const std::string &val) {
+    if (name == "maxmemory") {
+        return str2bytes(val, g_conf.maxmemory);
+    } else if (name == "maxmemory-policy") {
+        for (uint32_t i = 0; i < sizeof(k_policy_names) / sizeof(k_policy_names[0]); ++i) {
+            if (0 == strcasecmp(val.c_str(), k_policy_names[i])) {
+                g_conf.maxmemory_policy = i;
+                return true;
+            }
+        }
+        return false;
+    } else if (name == "maxmemory-samples") {
+        uint32_t n = 0;
+        if (!str2u32(val, n) || n == 0) {
+            return false;
+        }
+        g_conf.maxmemory_samples = n;
+        return true;
+    } else if (name == "lfu-log-factor") {
+        return str2u32(val, g_conf.lfu_log_factor);
+    } else if (name == "lfu-decay-time") {
+        return str2u32(val, g_conf.lfu_decay_time);
+    } else if (name == "lazyfree-threshold") {
+        return str2u32(val, g_conf.lazyfree_threshold);
+    } else if (name == "zset-max-compact-entries") {
+        return str2u32(val, g_conf.zset_max_compact_entries);
+    } else if (name == "zset-max-compact-value") {
+        return str2u32(val, g_conf.zset_max_compact_value);
+    } else if (name == "zset-merge-parallel-min") {
+        return str2u32(val, g_conf.zset_merge_parallel_min);
+    } else if (name == "hash-max-compact-entries") {
+        return str2u32(val, g_conf.hash_max_compact_entries);
+    } else if (name == "hash-max-compact-value") {
+        return str2u32(val, g_conf.hash_max_compact_value);
+    } else if (name == "hll-sparse-max-bytes") {
+        return str2u32(val, g_conf.hll_sparse_max_bytes);
+    } else if (name == "bf-default-capacity") {
+        uint32_t n = 0;
+        if (!str2u32(val, n) || n == 0) {
+            return false;
+        }
+        g_conf.bf_default_capacity = n;
+        return true;
+    } else if (name == "compress-min-size") {
+        size_t n = 0;
+        if (!str2bytes(val, n) || n > UINT32_MAX || (n && n < k_compress_min_size)) {
+            return false;
+        }
+        g_conf.compress_min_size = (uint32_t)n;
+        return true;
+    } else if (name == "repl-backlog-size") {
+        size_t n = 0;
+        if (!str2bytes(val, n) || n == 0) {
+            return false;
+        }
+        g_conf.repl_backlog_size = n;
+        return true;
+    } else if (name == "conn-request-budget") {
+        return str2u32(val, g_conf.conn_request_budget);
+    } else if (name == "output-soft-limit") {
+        return str2bytes(val, g_conf.output_soft_limit);
+    } else if (name == "output-hard-limit") {
+        return str2bytes(val, g_conf.output_hard_limit);
+    } else if (name == "slowlog-log-slower-than") {
+        return str2u32(val, g_conf.slowlog_log_slower_than);
+    } else if (name == "slowlog-max-len") {
+        return str2u32(val, g_conf.slowlog_max_len);
+    } else if (name == "latency-monitor-threshold") {
+        return str2u32(val, g_conf.latency_monitor_threshold);
+    } else if (name == "hotkeys-sample-rate") {
+        return str2u32(val, g_conf.hotkeys_sample_rate);
+    } else if (name == "tracking-table-max-keys") {
+        return str2u32(val, g_conf.tracking_table_max_keys);
+    } else if (name == "pubsub-output-limit") {
+        return str2bytes(val, g_conf.pubsub_output_limit);
+    } else if (name == "vlog-memory") {
+        return str2bytes(val, g_conf.vlog_memory);
+    } else if (name == "vlog-min-value") {
+        uint32_t n = 0;
+        if (!str2u32(val, n) || n == 0) {
+            return false;
+        }
+        g_conf.vlog_min_value = n;
+        return true;
+    } else if (name == "vlog-compact-pct") {
+        uint32_t n = 0;
+        if (!str2u32(val, n) || n == 0 || n > 100) {
+            return false;
+        }
+        g_conf.vlog_compact_pct = n;
+        return true;
+    }
+    return false;
+}
+
+bool config_get(const std::string &name, std::string &val) {
+    if (name == "port") {
+        val = std::to_string(g_conf.port);
+    } else if (name == "unixsocket") {
+        val = g_conf.unixsocket;
+    } else if (name == "unixsocketperm") {
+        char buf[16];
+        snprintf(buf, sizeof(buf), "%o", g_conf.unixsocket_perm);
+        val = buf;
+    } else if (name == "dbfilename") {
+        val = g_conf.dbfilename;
+    } else if (name == "key-index") {
+        val = g_conf.key_index ? "yes" : "no";
+    } else if (name == "maxmemory") {
+        val = std::to_string(g_conf.maxmemory);
+    } else if (name == "maxmemory-policy") {
+        val = k_policy_names[g_conf.maxmemory_policy];
+    } else if (name == "maxmemory-samples") {
+        val = std::to_string(g_conf.maxmemory_samples);
+    } else if (name == "lfu-log-factor") {
+        val = std::to_string(g_conf.lfu_log_factor);
+    } else if (name == "lfu-decay-time") {
+        val = std::to_string(g_conf.lfu_decay_time);
+    } else if (name == "lazyfree-threshold") {
+        val = std::to_string(g_conf.lazyfree_threshold);
+    } else if (name == "zset-max-compact-entries") {
+        val = std::to_string(g_conf.zset_max_compact_entries);
+    } else if (name == "zset-max-compact-value") {
+        val = std::to_string(g_conf.zset_max_compact_value);
+    } else if (name == "zset-merge-threads") {
+        val = std::to_string(g_conf.zset_merge_threads);
+    } else if (name == "zset-merge-parallel-min") {
+        val = std::to_string(g_conf.zset_merge_parallel_min);
+    } else if (name == "hash-max-compact-entries") {
+        val = std::to_string(g_conf.hash_max_compact_entries);
+    } else if (name == "hash-max-compact-value") {
+        val = std::to_string(g_conf.hash_max_compact_value);
+    } else if (name == "hll-sparse-max-bytes") {
+        val = std::to_string(g_conf.hll_sparse_max_bytes);
+    } else if (name == "bf-default-capacity") {
+        val = std::to_string(g_conf.bf_default_capacity);
+    } else if (name == "compress-min-size") {
+        val = std::to_string(g_conf.compress_min_size);
+    } else if (name == "repl-backlog-size") {
+        val = std::to_string(g_conf.repl_backlog_size);
+    } else if (name == "conn-request-budget") {
+        val = std::to_string(g_conf.conn_request_budget);
+    } else if (name == "output-soft-limit") {
+        val = std::to_string(g_conf.output_soft_limit);
+    } else if (name == "output-hard-limit") {
+        val = std::to_string(g_conf.output_hard_limit);
+    } else if (name == "slowlog-log-slower-than") {
+        val = std::to_string(g_conf.slowlog_log_slower_than);
+    } else if (name == "slowlog-max-len") {
+        val = std::to_string(g_conf.slowlog_max_len);
+    } else if (name == "latency-monitor-threshold") {
+        val = std::to_string(g_conf.latency_monitor_threshold);
+    } else if (name == "hotkeys-sample-rate") {
+        val = std::to_string(g_conf.hotkeys_sample_rate);
+    } else if (name == "tracking-table-max-keys") {
+        val = std::to_string(g_conf.tracking_table_max_keys);
+    } else if (name == "pubsub-output-limit") {
+        val = std::to_string(g_conf.pubsub_output_limit);
+    } else if (name == "vlog-file") {
+        val = g_conf.vlog_file;
+    } else if (name == "vlog-io-threads") {
+        val = std::to_string(g_conf.vlog_io_threads);
+    } else if (name == "vlog-memory") {
+        val = std::to_string(g_conf.vlog_memory);
+    } else if (name == "vlog-min-value") {
+        val = std::to_string(g_conf.vlog_min_value);
+    } else if (name == "vlog-compact-pct") {
+        val = std::to_string(g_conf.vlog_compact_pct);
+    } else if (name == "read-threads") {
+        val = std::to_string(g_conf.read_threads);
+    } else if (name == "read-port") {
+        val = std::to_string(g_conf.read_port);
+    } else {
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+enum {
+    EVICT_NOEVICTION = 0,
+    EVICT_ALLKEYS_LRU = 1,
+    EVICT_ALLKEYS_LFU = 2,
+    EVICT_VOLATILE_LRU = 3,
+    EVICT_VOLATILE_LFU = 4,
+    EVICT_VOLATILE_TTL = 5,
+};
+
+// smaller values cannot shrink by the 1/8 compression must save
+const uint32_t k_compress_min_size = 16;
+
+// server settings, from the command line (--name value) or `config set`
+struct Config {
+    uint32_t port = 8085;           // set at startup only
+    // path of an extra AF_UNIX listener, set at startup only, empty for none
+    std::string unixsocket;
+    uint32_t unixsocket_perm = 0;   // octal mode of the socket file, 0 keeps the umask
+    bool key_index = false;         // set at startup only, see btree.h
+    // the keyspace file, see store.h. set at startup only, empty for none
+    std::string dbfilename;
+    // the value log for cold strings, see vlog.h. set at startup only,
+    // empty for none, and so is the number of threads reading it
+    std::string vlog_file;
+    uint32_t vlog_io_threads = 4;
+    // cold string values move to the log while the used memory is over
+    // this, 0 means never
+    size_t vlog_memory = 0;
+    uint32_t vlog_min_value = 256;      // smaller values stay in memory
+    uint32_t vlog_compact_pct = 50;     // a log file this much dead is compacted
+    // threads serving get on their own port, see reader_get(). set at
+    // startup only, 0 for none; the port defaults to port + 1
+    uint32_t read_threads = 0;
+    uint32_t read_port = 0;
+    size_t maxmemory = 0;           // bytes, 0 means no limit
+    uint32_t maxmemory_policy = EVICT_NOEVICTION;
+    uint32_t maxmemory_samples = 5; // keys sampled per eviction
+    uint32_t lfu_log_factor = 10;   // higher means the counter saturates slower
+    uint32_t lfu_decay_time = 1;    // minutes for the counter to decay by 1
+    // values that take more allocations than this are freed on a background
+    // thread, 0 frees everything inline
+    uint32_t lazyfree_threshold = 1000;
+    // sorted sets within both limits use the compact array encoding
+    uint32_t zset_max_compact_entries = 128;
+    uint32_t zset_max_compact_value = 64;   // bytes of a member name
+    // threads that help with zunionstore / zinterstore once they have at
+    // least zset_merge_parallel_min members to visit. set at startup only,
+    // 0 runs them on the event loop alone.
+    uint32_t zset_merge_threads = 3;
+    uint32_t zset_merge_parallel_min = 100000;
+    // hashes within both limits use the compact array encoding
+    uint32_t hash_max_compact_entries = 128;
+    uint32_t hash_max_compact_value = 64;   // bytes of a field or a value
+    // HyperLogLogs switch to the 16 KB dense encoding past this many bytes
+    uint32_t hll_sparse_max_bytes = 3000;
+    // elements a Bloom filter created by bf.add is sized for, at 1% errors
+    uint32_t bf_default_capacity = 100000;
+    // string values of at least this size are stored LZ4 compressed if that
+    // saves space, 0 disables compression. at least k_compress_min_size.
+    uint32_t compress_min_size = 1024;
+    // bytes of the replication stream kept for replicas that reconnect,
+    // applies when the backlog is created
+    size_t repl_backlog_size = 1 << 20;
+    // requests a connection may run per event loop iteration before the
+    // others get a turn, 0 means no limit
+    uint32_t conn_request_budget = 64;
+    // a connection stops running requests while more output than the soft
+    // limit is queued, and is closed above the hard limit. 0 means no limit.
+    size_t output_soft_limit = 1 << 20;
+    size_t output_hard_limit = 256 << 20;
+    // commands that run at least this long (us) go to the slowlog
+    uint32_t slowlog_log_slower_than = 10000;
+    uint32_t slowlog_max_len = 128;
+    // event loop stalls of at least this long (us) are recorded, 0 is off
+    uint32_t latency_monitor_threshold = 0;
+    // one key lookup in this many (on average) feeds the hot key sketch,
+    // 0 is off
+    uint32_t hotkeys_sample_rate = 16;
+    // keys remembered for default mode client tracking, 0 means no limit
+    uint32_t tracking_table_max_keys = 1000000;
+    // a subscriber with more queued output than this is closed instead of
+    // being sent more messages, 0 means no limit
+    size_t pubsub_output_limit = 32 << 20;
+};
+
+extern Config g_conf;
+
+bool config_set(const std::string &name, const std::string &val);
+bool config_get(const std::string &name, std::string &val);
@@ -0,0 +1,64 @@
+#include <assert.h>
+#include <algorithm>
+#include "ebr.h"
+
+
+EbrSlot *ebr_register(Ebr *ebr) {
+    uint32_t i = ebr->nslots.fetch_add(1);
+    return i < k_ebr_max_readers ? &ebr->slots[i] : NULL;
+}
+
+void ebr_enter(Ebr *ebr, EbrSlot *slot) {
+    uint64_t epoch = ebr->epoch.load(std::memory_order_relaxed);
+    slot->state.store(epoch << 1 | 1, std::memory_order_relaxed);
+    // the announcement must be visible before anything shared is read
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+void ebr_exit(EbrSlot *slot) {
+    slot->state.store(0, std::memory_order_release);
+}
+
+void ebr_retire(Ebr *ebr, void (*free)(void *), void *ptr) {
+    uint64_t epoch = ebr->epoch.load(std::memory_order_relaxed);
+    EbrItem item;
+    item.free = free;
+    item.ptr = ptr;
+    ebr->limbo[epoch % 3].push_back(item);
+    ebr->pending++;
+}
+
+static void limbo_free(Ebr *ebr, std::vector<EbrItem> &items) {
+    for (const EbrItem &item : items) {
+        item.free(item.ptr);
+    }
+    ebr->pending -= items.size();
+    ebr->freed += items.size();
+    items.clear();
+}
+
+bool ebr_poll(Ebr *ebr) {
+    if (!ebr->pending) {
+        return false;
+    }
+    uint64_t epoch = ebr->epoch.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    uint32_t n = std::min<uint32_t>(ebr->nslots.load(), k_ebr_max_readers);
+    for (uint32_t i = 0; i < n; ++i) {
+        uint64_t state = ebr->slots[i].state.load(std::memory_order_acquire);
+        if ((state & 1) && (state >> 1) != epoch) {
+            return true;    // a reader is still in an older epoch
+        }
+    }
+    ebr->epoch.store(epoch + 1, std::memory_order_release);
+    // retired in epoch - 1, before every active reader entered
+    limbo_free(ebr, ebr->limbo[(epoch + 2) % 3]);
+    return ebr->pending > 0;
+}
+
+void ebr_drain(Ebr *ebr) {
+    for (std::vector<EbrItem> &items : ebr->limbo) {
+        limbo_free(ebr, items);
+    }
+    assert(ebr->pending == 0);
+}
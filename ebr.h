@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <vector>
+
+// epoch-based reclamation, for memory that reader threads may still be
+// looking at after the writer unlinked it. readers announce the epoch they
+// entered a critical section in; the writer advances the epoch once every
+// active reader has seen the current one, and frees what was retired two
+// epochs back, which no reader can still reach.
+//
+// there is a single writer: only it retires and polls.
+const size_t k_ebr_max_readers = 64;
+
+struct EbrSlot {
+    alignas(64) std::atomic<uint64_t> state{0};     // epoch << 1 | active
+};
+
+struct EbrItem {
+    void (*free)(void *) = NULL;
+    void *ptr = NULL;
+};
+
+struct Ebr {
+    std::atomic<uint64_t> epoch{1};
+    EbrSlot slots[k_ebr_max_readers];
+    std::atomic<uint32_t> nslots{0};
+    std::vector<EbrItem> limbo[3];  // retired in epoch e, in limbo[e % 3]
+    size_t pending = 0;
+    uint64_t freed = 0;
+};
+
+// a slot for a reader thread, NULL when all are taken
+EbrSlot *ebr_register(Ebr *ebr);
+void ebr_enter(Ebr *ebr, EbrSlot *slot);
+void ebr_exit(EbrSlot *slot);
+// free `ptr` with `free` once no reader can reach it
+void ebr_retire(Ebr *ebr, void (*free)(void *), void *ptr);
+// advance the epoch if the readers allow and free what is safe to free,
+// true if something is still waiting
+bool ebr_poll(Ebr *ebr);
+// free everything, once there are no readers
+void ebr_drain(Ebr *ebr);
@@ -0,0 +1,271 @@
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+#include "hash.h"
+#include "common.h"
+#include "config.h"
+
+
+struct HashNode {
+    HNode hnode;
+    uint32_t flen = 0;
+    uint32_t vlen = 0;
+    char data[0];   // the field, then the value
+};
+
+static HashNode *hnode_new(const char *field, size_t flen, const char *val, size_t vlen) {
+    HashNode *node = (HashNode *)malloc(sizeof(HashNode) + flen + vlen);
+    assert(node);
+    node->hnode.next = NULL;
+    node->hnode.hcode = str_hash((uint8_t *)field, flen);
+    node->flen = (uint32_t)flen;
+    node->vlen = (uint32_t)vlen;
+    memcpy(&node->data[0], field, flen);
+    memcpy(&node->data[flen], val, vlen);
+    return node;
+}
+
+// a helper structure for the hashtable lookup
+struct HKey {
+    HNode node;
+    const char *field = NULL;
+    size_t flen = 0;
+};
+
+static void hkey_init(HKey *key, const char *field, size_t flen) {
+    key->node.hcode = str_hash((uint8_t *)field, flen);
+    key->field = field;
+    key->flen = flen;
+}
+
+static bool hcmp(HNode *node, HNode *key) {
+    HashNode *hnode = container_of(node, HashNode, hnode);
+    HKey *hkey = container_of(key, HKey, node);
+    return hnode->flen == hkey->flen && 0 == memcmp(hnode->data, hkey->field, hkey->flen);
+}
+
+// the compact encoding, records are [field len: u32][value len: u32][field][value]
+const size_t k_lp_rec_hdr = 4 + 4;
+
+static uint32_t lp_flen(const uint8_t *rec) {
+    uint32_t n = 0;
+    memcpy(&n, rec, 4);
+    return n;
+}
+
+static uint32_t lp_vlen(const uint8_t *rec) {
+    uint32_t n = 0;
+    memcpy(&n, rec + 4, 4);
+    return n;
+}
+
+static uint32_t lp_rec_size(const uint8_t *rec) {
+    return (uint32_t)k_lp_rec_hdr + lp_flen(rec) + lp_vlen(rec);
+}
+
+// linear scan by field, returns the offset of the record or -1
+static int64_t lp_find(Hash *hash, const char *field, size_t flen) {
+    uint8_t *rec = hash->lp;
+    for (uint32_t i = 0; i < hash->lp_len; ++i) {
+        if (lp_flen(rec) == flen && 0 == memcmp(rec + k_lp_rec_hdr, field, flen)) {
+            return rec - hash->lp;
+        }
+        rec += lp_rec_size(rec);
+    }
+    return -1;
+}
+
+static void lp_append(Hash *hash, const char *field, size_t flen, const char *val, size_t vlen) {
+    uint32_t rsize = (uint32_t)(k_lp_rec_hdr + flen + vlen);
+    hash->lp = (uint8_t *)realloc(hash->lp, hash->lp_bytes + rsize);
+    assert(hash->lp);
+    uint8_t *rec = hash->lp + hash->lp_bytes;
+    uint32_t flen32 = (uint32_t)flen, vlen32 = (uint32_t)vlen;
+    memcpy(rec, &flen32, 4);
+    memcpy(rec + 4, &vlen32, 4);
+    memcpy(rec + k_lp_rec_hdr, field, flen);
+    memcpy(rec + k_lp_rec_hdr + flen, val, vlen);
+    hash->lp_len++;
+    hash->lp_bytes += rsize;
+}
+
+static void lp_delete(Hash *hash, uint32_t pos) {
+    uint32_t rsize = lp_rec_size(hash->lp + pos);
+    memmove(hash->lp + pos, hash->lp + pos + rsize, hash->lp_bytes - pos - rsize);
+    hash->lp_len--;
+    hash->lp_bytes -= rsize;
+    if (hash->lp_len == 0) {
+        free(hash->lp);
+        hash->lp = NULL;
+        hash->lp_bytes = 0;
+    }
+}
+
+static void node_add(Hash *hash, const char *field, size_t flen, const char *val, size_t vlen) {
+    HashNode *node = hnode_new(field, flen, val, vlen);
+    hash->node_bytes += sizeof(HashNode) + flen + vlen;
+    hm_insert(&hash->hmap, &node->hnode);
+}
+
+static void node_free(Hash *hash, HashNode *node) {
+    hash->node_bytes -= sizeof(HashNode) + node->flen + node->vlen;
+    free(node);
+}
+
+// move the records into the hashtable
+static void hash_convert(Hash *hash) {
+    assert(hash->compact);
+    uint8_t *rec = hash->lp;
+    for (uint32_t i = 0; i < hash->lp_len; ++i) {
+        uint32_t flen = lp_flen(rec);
+        const char *field = (const char *)rec + k_lp_rec_hdr;
+        node_add(hash, field, flen, field + flen, lp_vlen(rec));
+        rec += lp_rec_size(rec);
+    }
+    free(hash->lp);
+    hash->lp = NULL;
+    hash->lp_len = 0;
+    hash->lp_bytes = 0;
+    hash->compact = false;
+}
+
+static HashNode *node_lookup(Hash *hash, HKey *key) {
+    HNode *found = hm_lookup(&hash->hmap, &key->node, &hcmp);
+    return found ? container_of(found, HashNode, hnode) : NULL;
+}
+
+bool hash_set(Hash *hash, const char *field, size_t flen, const char *val, size_t vlen) {
+    if (hash->compact) {
+        bool fits = flen <= g_conf.hash_max_compact_value && vlen <= g_conf.hash_max_compact_value;
+        int64_t pos = lp_find(hash, field, flen);
+        if (pos >= 0 && fits && lp_vlen(hash->lp + pos) == vlen) {
+            memcpy(hash->lp + pos + k_lp_rec_hdr + flen, val, vlen);    // in place
+            return false;
+        }
+        if (pos >= 0) {
+            lp_delete(hash, (uint32_t)pos);
+        }
+        if (fits && hash->lp_len < g_conf.hash_max_compact_entries) {
+            lp_append(hash, field, flen, val, vlen);
+            return pos < 0;
+        }
+        hash_convert(hash);
+        node_add(hash, field, flen, val, vlen);
+        return pos < 0;
+    }
+
+    HKey key;
+    hkey_init(&key, field, flen);
+    HashNode *node = node_lookup(hash, &key);
+    if (node && node->vlen == vlen) {
+        memcpy(&node->data[flen], val, vlen);
+        return false;
+    }
+    if (node) {
+        // a different size needs a new allocation
+        hm_pop(&hash->hmap, &key.node, &hcmp);
+        node_free(hash, node);
+    }
+    node_add(hash, field, flen, val, vlen);
+    return node == NULL;
+}
+
+bool hash_get(Hash *hash, const char *field, size_t flen, const char **val, size_t *vlen) {
+    if (hash->compact) {
+        int64_t pos = lp_find(hash, field, flen);
+        if (pos < 0) {
+            return false;
+        }
+        const uint8_t *rec = hash->lp + pos;
+        *val = (const char *)rec + k_lp_rec_hdr + flen;
+        *vlen = lp_vlen(rec);
+        return true;
+    }
+    HKey key;
+    hkey_init(&key, field, flen);
+    HashNode *node = node_lookup(hash, &key);
+    if (!node) {
+        return false;
+    }
+    *val = &node->data[flen];
+    *vlen = node->vlen;
+    return true;
+}
+
+bool hash_del(Hash *hash, const char *field, size_t flen) {
+    if (hash->compact) {
+        int64_t pos = lp_find(hash, field, flen);
+        if (pos >= 0) {
+            lp_delete(hash, (uint32_t)pos);
+        }
+        return pos >= 0;
+    }
+    HKey key;
+    hkey_init(&key, field, flen);
+    HNode *found = hm_pop(&hash->hmap, &key.node, &hcmp);
+    if (found) {
+        node_free(hash, container_of(found, HashNode, hnode));
+    }
+    return found != NULL;
+}
+
+static void htab_foreach(HTab *tab,
+                         void (*f)(const char *, size_t, const char *, size_t, void *),
+                         void *arg)
+{
+    for (size_t i = 0; tab->tab && i <= tab->mask; ++i) {
+        for (HNode *cur = tab->tab[i]; cur; cur = cur->next) {
+            HashNode *node = container_of(cur, HashNode, hnode);
+            f(node->data, node->flen, &node->data[node->flen], node->vlen, arg);
+        }
+    }
+}
+
+void hash_foreach(Hash *hash,
+                  void (*f)(const char *field, size_t flen, const char *val, size_t vlen, void *arg),
+                  void *arg)
+{
+    if (hash->compact) {
+        const uint8_t *rec = hash->lp;
+        for (uint32_t i = 0; i < hash->lp_len; ++i) {
+            uint32_t flen = lp_flen(rec);
+            const char *field = (const char *)rec + k_lp_rec_hdr;
+            f(field, flen, field + flen, lp_vlen(rec), arg);
+            rec += lp_rec_size(rec);
+        }
+        return;
+    }
+    htab_foreach(&hash->hmap.ht1, f, arg);
+    htab_foreach(&hash->hmap.ht2, f, arg);
+}
+
+static void htab_dispose(HTab *tab) {
+    for (size_t i = 0; tab->tab && i <= tab->mask; ++i) {
+        HNode *cur = tab->tab[i];
+        while (cur) {
+            HNode *next = cur->next;
+            free(container_of(cur, HashNode, hnode));
+            cur = next;
+        }
+    }
+}
+
+void hash_dispose(Hash *hash) {
+    htab_dispose(&hash->hmap.ht1);
+    htab_dispose(&hash->hmap.ht2);
+    hm_destroy(&hash->hmap);
+    free(hash->lp);
+    hash->node_bytes = 0;
+    hash->lp = NULL;
+    hash->lp_len = 0;
+    hash->lp_bytes = 0;
+}
+
+size_t hash_len(Hash *hash) {
+    return hash->compact ? hash->lp_len : hm_size(&hash->hmap);
+}
+
+// bytes owned by the hash, including the hashtable buckets
+size_t hash_mem(Hash *hash) {
+    return sizeof(Hash) + hm_mem(&hash->hmap) + hash->node_bytes + hash->lp_bytes;
+}
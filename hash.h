@@ -0,0 +1,29 @@
+#pragma once
+
+#include "hashtable.h"
+
+// small hashes are stored as one packed array of (field, value) records in
+// no particular order, searched linearly; big hashes use a hashtable of
+// HashNodes, each one allocation holding the field and the value.
+struct Hash {
+    HMap hmap;
+    size_t node_bytes = 0;  // sum of the HashNode allocations
+    bool compact = true;
+    uint8_t *lp = NULL;     // the compact array
+    uint32_t lp_len = 0;    // number of records
+    uint32_t lp_bytes = 0;  // size of the compact array
+};
+
+// returns true if the field is new
+bool hash_set(Hash *hash, const char *field, size_t flen, const char *val, size_t vlen);
+// the value is a view, valid until the hash is modified
+bool hash_get(Hash *hash, const char *field, size_t flen, const char **val, size_t *vlen);
+bool hash_del(Hash *hash, const char *field, size_t flen);
+// calls `f` for every field, in no particular order. the hash must not be
+// modified meanwhile.
+void hash_foreach(Hash *hash,
+                  void (*f)(const char *field, size_t flen, const char *val, size_t vlen, void *arg),
+                  void *arg);
+void hash_dispose(Hash *hash);
+size_t hash_mem(Hash *hash);
+size_t hash_len(Hash *hash);
@@ -1,6 +1,15 @@
 #include <cassert>
 #include <cstdlib>
+#include <time.h>
 #include "hashtable.h"
+#include "common.h"
+
+
+static uint64_t get_monotonic_nsec() {
+    timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
 
 
 static void h_init(HTab* htab, size_t n){
@@ -16,28 +25,72 @@ static void h_init(HTab* htab, size_t n){
 void h_insert(HTab* htab, HNode* node){
 
     size_t pos = node->hcode & htab->mask;
-    HNode *next = htab->tab[pos];
-    htab->tab[pos] = node;
-    node->next = next;  
+    node->next = htab->tab[pos];
+    // linked before it is published, for hm_lookup_shared()
+    __atomic_store_n(&htab->tab[pos], node, __ATOMIC_RELEASE);
     htab->size++;
 } 
 
+// the writer side of the seqlock in `seq`
+static void hm_move_begin(HMap *hmap) {
+    __atomic_store_n(&hmap->seq, hmap->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void hm_move_end(HMap *hmap) {
+    __atomic_store_n(&hmap->seq, hmap->seq + 1, __ATOMIC_RELEASE);
+}
+
+static void h_set(HTab *dst, const HTab &src) {
+    __atomic_store_n(&dst->tab, src.tab, __ATOMIC_RELAXED);
+    __atomic_store_n(&dst->mask, src.mask, __ATOMIC_RELAXED);
+    dst->size = src.size;
+}
+
+static void h_free(HMap *hmap, HNode **tab) {
+    if (hmap->retire && tab) {
+        hmap->retire(tab);
+    } else {
+        free(tab);
+    }
+}
+
+// the first bucket array, zeroed before readers can see it
+static void hm_init(HMap *hmap, size_t n) {
+    HTab tab;
+    h_init(&tab, n);
+    hm_move_begin(hmap);
+    h_set(&hmap->ht1, tab);
+    hm_move_end(hmap);
+}
+
 static void hm_start_resizing(HMap* hmap){
     assert(hmap->ht2.tab == nullptr);
+    uint64_t start_ns = get_monotonic_nsec();
 
-    hmap->ht2 = hmap->ht1; // point all the values from ht1 to ht2
-    h_init(&hmap->ht1, (hmap->ht1.mask +1)*2);
+    HTab bigger;
+    h_init(&bigger, (hmap->ht1.mask +1)*2);
+    hm_move_begin(hmap);
+    h_set(&hmap->ht2, hmap->ht1); // point all the values from ht1 to ht2
+    h_set(&hmap->ht1, bigger);
+    hm_move_end(hmap);
     hmap->resizing_pos = 0;
+    hmap->resize_ns += get_monotonic_nsec() - start_ns;
 
 } 
 
 const size_t k_max_load_factor = 8;
 
+static void hm_help_resizing(HMap *hmap);
+
 void hm_insert(HMap* hmap, HNode* node){ 
 
     if (!hmap->ht1.tab){
-        h_init(&hmap->ht1,4);
+        hm_init(hmap, 4);
     } 
+    // inserts that are not preceded by a lookup must move nodes too, or
+    // ht1 fills up while ht2 is still being drained
+    hm_help_resizing(hmap);
     
     h_insert(&hmap->ht1,node);
 
@@ -54,14 +107,20 @@ const size_t k_resizing_work = 128;
 
 static HNode* h_detach(HTab* htab,HNode** from){
     HNode *node = *from;
-    *from = node->next;
+    // the node keeps its link, a reader standing on it goes on from there
+    __atomic_store_n(from, node->next, __ATOMIC_RELEASE);
 	htab->size--;
 	return node;
 } 
 
 static void hm_help_resizing(HMap *hmap){
+     if (!hmap->ht2.tab) {
+        return;
+     }
+     uint64_t start_ns = get_monotonic_nsec();
      size_t nwork = 0;
 
+     hm_move_begin(hmap);
      while (nwork < k_resizing_work && hmap->ht2.size > 0){
         HNode** from = &hmap->ht2.tab[hmap->resizing_pos];
         if (!*from) {
@@ -72,11 +131,14 @@ static void hm_help_resizing(HMap *hmap){
         h_insert(&hmap->ht1, h_detach(&hmap->ht2, from));
         nwork++;
      }
+      HNode **done = NULL;
       if (hmap->ht2.size == 0 && hmap->ht2.tab) {
-        // done
-        free(hmap->ht2.tab);
-        hmap->ht2 = HTab{};
+        done = hmap->ht2.tab;
+        h_set(&hmap->ht2, HTab{});
     } 
+    hm_move_end(hmap);
+    h_free(hmap, done);
+    hmap->resize_ns += get_monotonic_nsec() - start_ns;
 } 
 
 HNode** h_lookup(HTab* htab,HNode* key, bool(*eq)(HNode *, HNode *)){
@@ -104,6 +166,67 @@ HNode* hm_lookup(HMap* hmap, HNode* key,  bool(*eq)(HNode *, HNode *)){
     return from ? *from : nullptr;
 } 
 
+HNode *hm_lookup_ro(const HMap *hmap, HNode *key, bool(*eq)(HNode *, HNode *)) {
+    HNode **from = h_lookup((HTab *)&hmap->ht1, key, eq);
+    if (!from) {
+        from = h_lookup((HTab *)&hmap->ht2, key, eq);
+    }
+    return from ? *from : nullptr;
+}
+
+static HNode *h_lookup_shared(HNode **tab, size_t mask, HNode *key, bool(*eq)(HNode *, HNode *)) {
+    if (!tab) {
+        return NULL;
+    }
+    HNode *cur = __atomic_load_n(&tab[key->hcode & mask], __ATOMIC_ACQUIRE);
+    for (; cur; cur = __atomic_load_n(&cur->next, __ATOMIC_ACQUIRE)) {
+        if (cur->hcode == key->hcode && eq(cur, key)) {
+            return cur;
+        }
+    }
+    return NULL;
+}
+
+// a node moving from ht2 to ht1 takes the rest of its old chain out of
+// view, so a miss only counts if nothing moved meanwhile. a hit is a hit.
+HNode *hm_lookup_shared(const HMap *hmap, HNode *key, bool(*eq)(HNode *, HNode *)) {
+    uint32_t spins = 0;
+    while (true) {
+        uint64_t seq = __atomic_load_n(&hmap->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            spin_wait(spins);   // the writer is moving up to k_resizing_work nodes
+            continue;
+        }
+        HNode **tab1 = __atomic_load_n(&hmap->ht1.tab, __ATOMIC_RELAXED);
+        size_t mask1 = __atomic_load_n(&hmap->ht1.mask, __ATOMIC_RELAXED);
+        HNode **tab2 = __atomic_load_n(&hmap->ht2.tab, __ATOMIC_RELAXED);
+        size_t mask2 = __atomic_load_n(&hmap->ht2.mask, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&hmap->seq, __ATOMIC_RELAXED) != seq) {
+            spin_wait(spins);   // a torn (table, mask) pair
+            continue;
+        }
+        HNode *node = h_lookup_shared(tab1, mask1, key, eq);
+        if (!node) {
+            node = h_lookup_shared(tab2, mask2, key, eq);
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (node || __atomic_load_n(&hmap->seq, __ATOMIC_RELAXED) == seq) {
+            return node;
+        }
+        spin_wait(spins);
+    }
+}
+
+void hm_reserve(HMap *hmap, size_t n) {
+    assert(!hmap->ht1.tab && !hmap->ht2.tab);
+    size_t slots = 4;
+    while (slots * (k_max_load_factor / 2) < n) {
+        slots *= 2;
+    }
+    hm_init(hmap, slots);
+}
+
 HNode* hm_pop(HMap* hmap, HNode* key,  bool(*eq)(HNode *, HNode *)){
      hm_help_resizing(hmap);
     
@@ -121,7 +244,51 @@ size_t hm_size(HMap *hmap) {
 }
 
 void hm_destroy(HMap *hmap) {
-    free(hmap->ht1.tab);
-    free(hmap->ht2.tab);
-    *hmap = HMap{};
-}
\ No newline at end of file
+    HNode **tab1 = hmap->ht1.tab, **tab2 = hmap->ht2.tab;
+    hm_move_begin(hmap);
+    h_set(&hmap->ht1, HTab{});
+    h_set(&hmap->ht2, HTab{});
+    hm_move_end(hmap);
+    h_free(hmap, tab1);
+    h_free(hmap, tab2);
+    hmap->resizing_pos = 0;
+}
+
+// bytes used by the bucket arrays
+size_t hm_mem(HMap *hmap) {
+    size_t n = 0;
+    if (hmap->ht1.tab) {
+        n += (hmap->ht1.mask + 1) * sizeof(HNode *);
+    }
+    if (hmap->ht2.tab) {
+        n += (hmap->ht2.mask + 1) * sizeof(HNode *);
+    }
+    return n;
+}
+
+// pick a random node for sampling. it starts from a random slot and takes
+// the first non-empty chain, so it is cheap but not perfectly uniform.
+HNode *hm_random(HMap *hmap) {
+    if (hm_size(hmap) == 0) {
+        return NULL;
+    }
+    size_t n1 = hmap->ht1.tab ? hmap->ht1.mask + 1 : 0;
+    size_t n2 = hmap->ht2.tab ? hmap->ht2.mask + 1 : 0;
+    size_t start = (size_t)rand() % (n1 + n2);
+    for (size_t i = 0; i < n1 + n2; ++i) {
+        size_t pos = (start + i) % (n1 + n2);
+        HNode *node = pos < n1 ? hmap->ht1.tab[pos] : hmap->ht2.tab[pos - n1];
+        if (!node) {
+            continue;
+        }
+        size_t len = 0;
+        for (HNode *cur = node; cur; cur = cur->next) {
+            len++;
+        }
+        for (size_t skip = (size_t)rand() % len; skip > 0; --skip) {
+            node = node->next;
+        }
+        return node;
+    }
+    return NULL;
+}
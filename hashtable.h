@@ -24,6 +24,11 @@ struct HMap
     HTab ht1;
     HTab ht2;
     size_t resizing_pos = 0;
+    uint64_t resize_ns = 0;     // time spent resizing, for the latency monitor
+    // for hm_lookup_shared(): odd while nodes move between the tables, and
+    // the bucket arrays that readers may still be in are handed to `retire`
+    uint64_t seq = 0;
+    void (*retire)(void *) = NULL;
 };
 
 
@@ -32,6 +37,17 @@ struct HMap
 
 void hm_insert(HMap* hmap, HNode* node);  // to insert in hmap it is needed to have the map, the entry
 HNode* hm_lookup(HMap* hmap, HNode* key,bool(*eq)(HNode *, HNode *));
+// the same without helping the resizing, so several threads may look up
+// concurrently as long as nothing modifies the map
+HNode *hm_lookup_ro(const HMap *hmap, HNode *key, bool(*eq)(HNode *, HNode *));
+// a lookup from another thread while one writer modifies the map. the
+// writer must keep unlinked nodes alive until the reader is done, and the
+// bucket arrays through `retire`.
+HNode *hm_lookup_shared(const HMap *hmap, HNode *key, bool(*eq)(HNode *, HNode *));
+// size an empty map for `n` inserts, so that they do not start resizing
+void hm_reserve(HMap *hmap, size_t n);
 HNode *hm_pop(HMap *hmap, HNode *key, bool(*eq)(HNode *, HNode *));
 size_t hm_size(HMap *hmap);
 void hm_destroy(HMap *hmap);
+size_t hm_mem(HMap *hmap);
+HNode *hm_random(HMap *hmap);
@@ -0,0 +1,223 @@
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "hll.h"
+#include "config.h"
+
+
+// the register and its value for a hash
+static void hll_reg(uint64_t hash, uint32_t *idx, uint8_t *val) {
+    *idx = (uint32_t)(hash & (k_hll_regs - 1));
+    uint64_t w = (hash >> k_hll_p) | (1ULL << k_hll_q);     // caps the value at q + 1
+    *val = (uint8_t)(__builtin_ctzll(w) + 1);
+}
+
+static void hll_densify(Hll *hll) {
+    hll->regs.assign(k_hll_regs, 0);
+    for (uint32_t e : hll->sparse) {
+        hll->regs[e >> 8] = (uint8_t)e;
+    }
+    std::vector<uint32_t>().swap(hll->sparse);
+    hll->dense = true;
+}
+
+// raise a register to `val`, returns false if it was already there
+static bool hll_set(Hll *hll, uint32_t idx, uint8_t val) {
+    if (hll->dense) {
+        if (hll->regs[idx] >= val) {
+            return false;
+        }
+        hll->regs[idx] = val;
+        return true;
+    }
+    std::vector<uint32_t> &sp = hll->sparse;
+    auto it = std::lower_bound(sp.begin(), sp.end(), idx << 8);
+    if (it != sp.end() && (*it >> 8) == idx) {
+        if ((uint8_t)*it >= val) {
+            return false;
+        }
+        *it = idx << 8 | val;
+        return true;
+    }
+    if ((sp.size() + 1) * 4 > g_conf.hll_sparse_max_bytes) {
+        hll_densify(hll);
+        hll->regs[idx] = val;
+        return true;
+    }
+    sp.insert(it, idx << 8 | val);
+    return true;
+}
+
+bool hll_add(Hll *hll, uint64_t hash) {
+    uint32_t idx = 0;
+    uint8_t val = 0;
+    hll_reg(hash, &idx, &val);
+    if (!hll_set(hll, idx, val)) {
+        return false;
+    }
+    hll->card = -1;
+    return true;
+}
+
+static double hll_sigma(double x) {
+    if (x == 1) {
+        return INFINITY;
+    }
+    double y = 1, z = x, prev = 0;
+    do {
+        x *= x;
+        prev = z;
+        z += x * y;
+        y += y;
+    } while (prev != z);
+    return z;
+}
+
+static double hll_tau(double x) {
+    if (x == 0 || x == 1) {
+        return 0;
+    }
+    double y = 1, z = 1 - x, prev = 0;
+    do {
+        x = sqrt(x);
+        prev = z;
+        y *= 0.5;
+        z -= (1 - x) * (1 - x) * y;
+    } while (prev != z);
+    return z / 3;
+}
+
+// Ertl's improved raw estimator, from the histogram of the register values.
+// unlike the original one it needs no bias tables or switch to linear
+// counting for the small range.
+static uint64_t hll_estimate(const uint32_t *hist) {
+    double m = k_hll_regs;
+    double z = m * hll_tau((m - hist[k_hll_q + 1]) / m);
+    for (uint32_t k = k_hll_q; k >= 1; --k) {
+        z = 0.5 * (z + hist[k]);
+    }
+    z += m * hll_sigma(hist[0] / m);
+    return (uint64_t)llround(0.5 / log(2) * m * m / z);
+}
+
+uint64_t hll_estimate_regs(const uint8_t *regs) {
+    uint32_t hist[k_hll_q + 2] = {};
+    for (uint32_t i = 0; i < k_hll_regs; ++i) {
+        hist[regs[i]]++;
+    }
+    return hll_estimate(hist);
+}
+
+uint64_t hll_count(Hll *hll) {
+    if (hll->card >= 0) {
+        return (uint64_t)hll->card;
+    }
+    if (hll->dense) {
+        hll->card = (int64_t)hll_estimate_regs(hll->regs.data());
+    } else {
+        uint32_t hist[k_hll_q + 2] = {};
+        hist[0] = k_hll_regs - (uint32_t)hll->sparse.size();
+        for (uint32_t e : hll->sparse) {
+            hist[(uint8_t)e]++;
+        }
+        hll->card = (int64_t)hll_estimate(hist);
+    }
+    return (uint64_t)hll->card;
+}
+
+// dst[i] = max(dst[i], src[i]), 16 registers per instruction with SSE2
+static void regs_max(uint8_t *dst, const uint8_t *src, size_t n) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    for (; i + 16 <= n; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(dst + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_max_epu8(a, b));
+    }
+#endif
+    for (; i < n; ++i) {
+        dst[i] = std::max(dst[i], src[i]);
+    }
+}
+
+void hll_merge_regs(uint8_t *dst, const Hll *src) {
+    if (src->dense) {
+        regs_max(dst, src->regs.data(), k_hll_regs);
+        return;
+    }
+    for (uint32_t e : src->sparse) {
+        dst[e >> 8] = std::max(dst[e >> 8], (uint8_t)e);
+    }
+}
+
+void hll_merge(Hll *dst, const Hll *src) {
+    dst->card = -1;
+    if (!dst->dense && !src->dense) {
+        for (uint32_t e : src->sparse) {
+            hll_set(dst, e >> 8, (uint8_t)e);
+        }
+        return;
+    }
+    if (!dst->dense) {
+        hll_densify(dst);
+    }
+    hll_merge_regs(dst->regs.data(), src);
+}
+
+size_t hll_mem(const Hll *hll) {
+    return sizeof(Hll) + hll->sparse.capacity() * 4 + hll->regs.capacity();
+}
+
+// [dense: u8] then the registers, or the sparse entries
+std::string hll_dump(const Hll *hll) {
+    std::string out(1, hll->dense ? 1 : 0);
+    if (hll->dense) {
+        out.append((const char *)hll->regs.data(), k_hll_regs);
+    } else {
+        out.append((const char *)hll->sparse.data(), hll->sparse.size() * 4);
+    }
+    return out;
+}
+
+bool hll_load(Hll *hll, const char *data, size_t len) {
+    if (len < 1 || data[0] > 1) {
+        return false;
+    }
+    Hll tmp;
+    tmp.dense = data[0] == 1;
+    data++;
+    len--;
+    if (tmp.dense) {
+        if (len != k_hll_regs) {
+            return false;
+        }
+        tmp.regs.assign((const uint8_t *)data, (const uint8_t *)data + len);
+        for (uint8_t r : tmp.regs) {
+            if (r > k_hll_q + 1) {
+                return false;
+            }
+        }
+    } else {
+        if (len % 4 != 0) {
+            return false;
+        }
+        tmp.sparse.resize(len / 4);
+        if (len) {
+            memcpy(tmp.sparse.data(), data, len);
+        }
+        for (size_t i = 0; i < tmp.sparse.size(); ++i) {
+            uint32_t e = tmp.sparse[i];
+            uint8_t val = (uint8_t)e;
+            if ((e >> 8) >= k_hll_regs || val == 0 || val > k_hll_q + 1
+                || (i && (tmp.sparse[i - 1] >> 8) >= (e >> 8)))
+            {
+                return false;   // not sorted, or not a register
+            }
+        }
+    }
+    *hll = std::move(tmp);
+    return true;
+}
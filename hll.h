@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// a HyperLogLog counts distinct elements in fixed memory, with a standard
+// error of 1.04 / sqrt(2^p) = 0.81%. an element's 64-bit hash picks one of
+// the 2^p registers with its low p bits, and the register keeps the highest
+// position of the lowest set bit among the other bits.
+const uint32_t k_hll_p = 14;
+const uint32_t k_hll_regs = 1 << k_hll_p;
+const uint32_t k_hll_q = 64 - k_hll_p;     // register values are 0..q+1
+
+// small counters only hold their non-zero registers, as sorted
+// (index << 8 | value) entries, and switch to a byte per register past
+// hll-sparse-max-bytes.
+struct Hll {
+    bool dense = false;
+    std::vector<uint32_t> sparse;
+    std::vector<uint8_t> regs;  // k_hll_regs of them when dense
+    int64_t card = -1;          // the cached count, -1 when stale
+};
+
+// returns true if a register changed
+bool hll_add(Hll *hll, uint64_t hash);
+uint64_t hll_count(Hll *hll);
+// the register-wise maximum, into `dst`
+void hll_merge(Hll *dst, const Hll *src);
+// the same, into k_hll_regs registers
+void hll_merge_regs(uint8_t *dst, const Hll *src);
+uint64_t hll_estimate_regs(const uint8_t *regs);
+size_t hll_mem(const Hll *hll);
+// a self-contained copy, for the replication snapshot
+std::string hll_dump(const Hll *hll);
+bool hll_load(Hll *hll, const char *data, size_t len);
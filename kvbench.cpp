@@ -0,0 +1,244 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#include "kvclient.h"
+
+// a load generator built on the client library. each thread sends batches
+// of `pipeline` requests through a shared pool and waits for each batch.
+// --test publish also subscribes `subscribers` connections to the channel
+// and runs until they received every message.
+
+static uint64_t get_monotonic_usec() {
+    timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000 + tv.tv_nsec / 1000;
+}
+
+struct BenchOpts {
+    std::string host = "127.0.0.1";    // or the path of a unix socket
+    uint16_t port = 8085;
+    size_t conns = 1;
+    size_t threads = 1;
+    size_t requests = 100000;   // per thread
+    size_t pipeline = 1;
+    size_t size = 16;
+    size_t keys = 10000;
+    std::string test = "set";
+    size_t subscribers = 1;     // for --test publish
+};
+
+const char *k_bench_channel = "bench";
+
+// the subscribers are plain sockets read by one thread, the client library
+// has a thread per connection, which doesn't scale to thousands of them
+struct Subscribers {
+    std::vector<int> fds;
+    int epfd = -1;
+    size_t msg_size = 0;
+    size_t expect = 0;      // bytes of messages to receive
+    size_t got = 0;
+};
+
+static bool subs_connect(const BenchOpts &opts, Subscribers *subs, std::string *err) {
+    std::string req;
+    kv_encode_req(req, {"subscribe", k_bench_channel});
+    subs->epfd = epoll_create1(0);
+    for (size_t i = 0; i < opts.subscribers; ++i) {
+        int fd = kv_dial(opts.host.c_str(), opts.port, err);
+        if (fd < 0) {
+            return false;
+        }
+        subs->fds.push_back(fd);
+        char reply[13];     // [len][SER_INT][count]
+        if (write(fd, req.data(), req.size()) != (ssize_t)req.size()
+            || recv(fd, reply, sizeof(reply), MSG_WAITALL) != (ssize_t)sizeof(reply))
+        {
+            *err = "subscribe failed";
+            return false;
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        epoll_ctl(subs->epfd, EPOLL_CTL_ADD, fd, &ev);
+    }
+    return true;
+}
+
+// until every message arrived, or nothing did for a while because the
+// server closed a subscriber that fell behind
+static void subs_drain(Subscribers *subs) {
+    std::vector<char> buf(64 << 10);
+    struct epoll_event events[256];
+    uint64_t last_us = get_monotonic_usec();
+    while (subs->got < subs->expect && get_monotonic_usec() - last_us < 5000000) {
+        int n = epoll_wait(subs->epfd, events, 256, 100);
+        for (int i = 0; i < n; ++i) {
+            ssize_t rv = read(events[i].data.fd, buf.data(), buf.size());
+            if (rv > 0) {
+                subs->got += rv;
+                last_us = get_monotonic_usec();
+            } else if (rv == 0) {
+                epoll_ctl(subs->epfd, EPOLL_CTL_DEL, events[i].data.fd, NULL);
+            }
+        }
+    }
+}
+
+static void subs_close(Subscribers *subs) {
+    for (int fd : subs->fds) {
+        close(fd);
+    }
+    if (subs->epfd >= 0) {
+        close(subs->epfd);
+    }
+}
+
+static void run_thread(const BenchOpts &opts, KvPool *pool, size_t id,
+                       std::atomic<size_t> *errors, std::vector<uint32_t> *lat_us)
+{
+    std::string val(opts.size, 'x');
+    std::vector<std::future<KvReply>> batch;
+    for (size_t done = 0; done < opts.requests; ) {
+        size_t n = std::min(opts.pipeline, opts.requests - done);
+        uint64_t start = get_monotonic_usec();
+        for (size_t i = 0; i < n; ++i) {
+            std::string key = "key:" + std::to_string((id * opts.requests + done + i) % opts.keys);
+            KvConn *conn = kv_pool_get(pool);
+            if (opts.test == "get") {
+                batch.push_back(kv_send(conn, {"get", key}));
+            } else if (opts.test == "publish") {
+                batch.push_back(kv_send(conn, {"publish", k_bench_channel, val}));
+            } else if (opts.test == "incr") {
+                batch.push_back(kv_send(conn, {"incr", "counter:" + std::to_string(id)}));
+            } else if (opts.test == "pfadd" || opts.test == "bf.add") {
+                std::string elem = "elem:" + std::to_string(id * opts.requests + done + i);
+                batch.push_back(kv_send(conn, {opts.test, "bench:" + opts.test, elem}));
+            } else {
+                batch.push_back(kv_send(conn, {"set", key, val}));
+            }
+        }
+        for (std::future<KvReply> &f : batch) {
+            KvReply reply = f.get();
+            if (!reply.err.empty() || kv_type(kv_root(reply)) == SER_ERR) {
+                (*errors)++;
+            }
+        }
+        batch.clear();
+        lat_us->push_back((uint32_t)(get_monotonic_usec() - start));
+        done += n;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    BenchOpts opts;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        const char *name = argv[i];
+        const char *val = argv[i + 1];
+        if (!strcmp(name, "--host")) {
+            opts.host = val;
+        } else if (!strcmp(name, "--socket")) {
+            opts.host = val;
+        } else if (!strcmp(name, "--port")) {
+            opts.port = (uint16_t)atoi(val);
+        } else if (!strcmp(name, "--conns")) {
+            opts.conns = strtoull(val, NULL, 10);
+        } else if (!strcmp(name, "--threads")) {
+            opts.threads = strtoull(val, NULL, 10);
+        } else if (!strcmp(name, "--requests")) {
+            opts.requests = strtoull(val, NULL, 10);
+        } else if (!strcmp(name, "--pipeline")) {
+            opts.pipeline = strtoull(val, NULL, 10);
+        } else if (!strcmp(name, "--size")) {
+            opts.size = strtoull(val, NULL, 10);
+        } else if (!strcmp(name, "--keys")) {
+            opts.keys = strtoull(val, NULL, 10);
+        } else if (!strcmp(name, "--test")) {
+            opts.test = val;
+        } else if (!strcmp(name, "--subscribers")) {
+            opts.subscribers = strtoull(val, NULL, 10);
+        } else {
+            fprintf(stderr, "bad option: %s\n", name);
+            return 1;
+        }
+    }
+    if (argc % 2 == 0 || !opts.conns || !opts.threads || !opts.pipeline || !opts.keys) {
+        fprintf(stderr, "Usage: ./kvbench [--host h] [--port p] [--socket path] [--conns n] [--threads n]\n"
+                        "                 [--requests n] [--pipeline n] [--size n] [--keys n]\n"
+                        "                 [--test set|get|incr|pfadd|bf.add|publish] [--subscribers n]\n");
+        return 1;
+    }
+
+    KvPool pool;
+    std::string err;
+    if (!kv_pool_connect(&pool, opts.host.c_str(), opts.port, opts.conns, &err)) {
+        fprintf(stderr, "connect: %s\n", err.c_str());
+        return 1;
+    }
+
+    Subscribers subs;
+    std::thread drain;
+    if (opts.test == "publish") {
+        if (!subs_connect(opts, &subs, &err)) {
+            fprintf(stderr, "subscribe: %s\n", err.c_str());
+            return 1;
+        }
+        // [len][SER_PUSH][n] then "message", the channel and the payload
+        subs.msg_size = 4 + 5 + (5 + 7) + (5 + strlen(k_bench_channel)) + (5 + opts.size);
+        subs.expect = subs.msg_size * opts.requests * opts.threads * opts.subscribers;
+    }
+
+    std::atomic<size_t> errors{0};
+    uint64_t start = get_monotonic_usec();
+    if (opts.test == "publish") {
+        drain = std::thread(subs_drain, &subs);
+    }
+    std::vector<std::vector<uint32_t>> lat_us(opts.threads);
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < opts.threads; ++i) {
+        threads.emplace_back(run_thread, std::cref(opts), &pool, i, &errors, &lat_us[i]);
+    }
+    for (std::thread &t : threads) {
+        t.join();
+    }
+    if (drain.joinable()) {
+        drain.join();
+    }
+    double secs = (double)(get_monotonic_usec() - start) / 1e6;
+    kv_pool_close(&pool);
+
+    size_t total = opts.requests * opts.threads;
+    printf("%s: %zu requests in %.3f s, %.0f req/s, %zu errors\n",
+           opts.test.c_str(), total, secs, (double)total / secs, errors.load());
+    if (opts.test == "publish") {
+        size_t delivered = subs.got / subs.msg_size;
+        printf("fan-out to %zu subscribers: %zu of %zu messages delivered, %.0f msg/s\n",
+               opts.subscribers, delivered, total * opts.subscribers, (double)delivered / secs);
+        subs_close(&subs);
+        if (delivered < total * opts.subscribers) {
+            errors++;
+        }
+    }
+
+    // round trips of whole batches
+    std::vector<uint32_t> all;
+    for (const std::vector<uint32_t> &v : lat_us) {
+        all.insert(all.end(), v.begin(), v.end());
+    }
+    std::sort(all.begin(), all.end());
+    if (!all.empty()) {
+        printf("batch latency: p50 %u us, p99 %u us, max %u us\n",
+               all[all.size() / 2], all[all.size() * 99 / 100], all.back());
+    }
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,453 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <memory>
+#include "kvclient.h"
+
+
+const size_t k_max_msg = 32 << 20;
+const size_t k_read_size = 64 * 1024;
+
+static uint32_t read_u32(const uint8_t *p) {
+    uint32_t v = 0;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+// the encoded size of the value, 0 if it is truncated
+static size_t value_size(KvView v) {
+    if (v.len < 1) {
+        return 0;
+    }
+    size_t n = 0;
+    switch (v.data[0]) {
+    case SER_NIL:
+        return 1;
+    case SER_ERR:
+        n = v.len >= 9 ? 9 + (size_t)read_u32(v.data + 5) : 0;
+        break;
+    case SER_STR:
+    case SER_KV:
+        n = v.len >= 5 ? 5 + (size_t)read_u32(v.data + 1) : 0;
+        break;
+    case SER_INT:
+    case SER_DBL:
+        n = 9;
+        break;
+    case SER_ARR:
+    case SER_PUSH: {
+        if (v.len < 5) {
+            return 0;
+        }
+        uint32_t count = read_u32(v.data + 1);
+        KvView elem{v.data + 5, v.len - 5};
+        n = 5;
+        for (uint32_t i = 0; i < count; ++i) {
+            size_t sz = value_size(elem);
+            if (sz == 0) {
+                return 0;
+            }
+            n += sz;
+            elem.data += sz;
+            elem.len -= sz;
+        }
+        break;
+    }
+    default:
+        return 0;
+    }
+    return n <= v.len ? n : 0;
+}
+
+int kv_type(KvView v) {
+    return value_size(v) ? v.data[0] : -1;
+}
+
+int64_t kv_int(KvView v) {
+    int64_t val = 0;
+    if (kv_type(v) == SER_INT) {
+        memcpy(&val, v.data + 1, 8);
+    }
+    return val;
+}
+
+double kv_dbl(KvView v) {
+    double val = 0;
+    if (kv_type(v) == SER_DBL) {
+        memcpy(&val, v.data + 1, 8);
+    }
+    return val;
+}
+
+std::string_view kv_str(KvView v) {
+    int type = kv_type(v);
+    if (type == SER_STR) {
+        return std::string_view((const char *)v.data + 5, read_u32(v.data + 1));
+    } else if (type == SER_ERR) {
+        return std::string_view((const char *)v.data + 9, read_u32(v.data + 5));
+    }
+    return std::string_view();
+}
+
+int32_t kv_err_code(KvView v) {
+    int32_t code = 0;
+    if (kv_type(v) == SER_ERR) {
+        memcpy(&code, v.data + 1, 4);
+    }
+    return code;
+}
+
+// SER_KV: [total u32][klen u32][key][vlen u32][val]
+std::string_view kv_key(KvView v) {
+    if (kv_type(v) != SER_KV || read_u32(v.data + 1) < 8) {
+        return std::string_view();
+    }
+    uint32_t klen = read_u32(v.data + 5);
+    return std::string_view((const char *)v.data + 9, klen);
+}
+
+std::string_view kv_val(KvView v) {
+    if (kv_type(v) != SER_KV || read_u32(v.data + 1) < 8) {
+        return std::string_view();
+    }
+    uint32_t klen = read_u32(v.data + 5);
+    const uint8_t *p = v.data + 9 + klen;
+    return std::string_view((const char *)p + 4, read_u32(p));
+}
+
+uint32_t kv_arr_len(KvView v) {
+    int type = kv_type(v);
+    return type == SER_ARR || type == SER_PUSH ? read_u32(v.data + 1) : 0;
+}
+
+KvView kv_arr_first(KvView v) {
+    int type = kv_type(v);
+    if (type != SER_ARR && type != SER_PUSH) {
+        return KvView();
+    }
+    return KvView{v.data + 5, v.len - 5};
+}
+
+KvView kv_next(KvView v) {
+    size_t sz = value_size(v);
+    if (sz == 0 || sz == v.len) {
+        return KvView();
+    }
+    return KvView{v.data + sz, v.len - sz};
+}
+
+// [len u32][nargs u32] then [len u32][bytes] per argument
+void kv_encode_req(std::string &out, const std::vector<std::string_view> &args) {
+    size_t len = 4;
+    for (std::string_view arg : args) {
+        len += 4 + arg.size();
+    }
+    uint32_t header[2] = {(uint32_t)len, (uint32_t)args.size()};
+    out.append((const char *)header, 8);
+    for (std::string_view arg : args) {
+        uint32_t n = (uint32_t)arg.size();
+        out.append((const char *)&n, 4);
+        out.append(arg.data(), arg.size());
+    }
+}
+
+static void fail_all(KvConn *conn, const std::string &err) {
+    pthread_mutex_lock(&conn->mu);
+    if (conn->err.empty()) {
+        conn->err = err;
+    }
+    std::deque<KvCallback> waiting;
+    waiting.swap(conn->waiting);
+    conn->out.clear();
+    pthread_mutex_unlock(&conn->mu);
+
+    for (KvCallback &cb : waiting) {
+        KvReply reply;
+        reply.err = err;
+        conn->inflight--;
+        cb(reply);
+    }
+}
+
+static void on_reply(KvConn *conn, const uint8_t *data, size_t len) {
+    if (len > 0 && data[0] == SER_PUSH) {
+        if (conn->on_push) {
+            KvReply push;
+            push.data.assign(data, data + len);
+            conn->on_push(push);
+        }
+        return;     // not the reply to a request
+    }
+    pthread_mutex_lock(&conn->mu);
+    assert(!conn->waiting.empty());
+    KvCallback cb = std::move(conn->waiting.front());
+    conn->waiting.pop_front();
+    pthread_mutex_unlock(&conn->mu);
+
+    KvReply reply;
+    reply.data.assign(data, data + len);
+    conn->inflight--;
+    cb(reply);
+}
+
+static void *io_thread(void *arg) {
+    KvConn *conn = (KvConn *)arg;
+    std::string wbuf;
+    size_t wpos = 0;
+    std::vector<uint8_t> rbuf;
+    size_t rpos = 0;    // parsed up to here
+    std::string err;
+
+    while (err.empty()) {
+        pthread_mutex_lock(&conn->mu);
+        bool closing = conn->closing;
+        if (wpos == wbuf.size()) {
+            wbuf.clear();
+            wpos = 0;
+        }
+        wbuf.append(conn->out);     // everything queued goes out in one batch
+        conn->out.clear();
+        pthread_mutex_unlock(&conn->mu);
+        if (closing) {
+            err = "connection closed";
+            break;
+        }
+
+        struct pollfd pfds[2] = {};
+        pfds[0].fd = conn->fd;
+        pfds[0].events = POLLIN | (wpos < wbuf.size() ? POLLOUT : 0);
+        pfds[1].fd = conn->wake_fd;
+        pfds[1].events = POLLIN;
+        if (poll(pfds, 2, -1) < 0) {
+            if (errno != EINTR) {
+                err = "poll() error";
+            }
+            continue;
+        }
+        if (pfds[1].revents & POLLIN) {
+            uint64_t n = 0;
+            (void)!read(conn->wake_fd, &n, sizeof(n));
+        }
+
+        if (pfds[0].revents & (POLLOUT | POLLERR | POLLHUP)) {
+            while (wpos < wbuf.size()) {
+                ssize_t rv = write(conn->fd, wbuf.data() + wpos, wbuf.size() - wpos);
+                if (rv < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (rv < 0 && errno == EAGAIN) {
+                    break;
+                }
+                if (rv < 0) {
+                    err = strerror(errno);
+                    break;
+                }
+                wpos += (size_t)rv;
+            }
+        }
+
+        if (err.empty() && (pfds[0].revents & (POLLIN | POLLERR | POLLHUP))) {
+            while (true) {
+                size_t used = rbuf.size();
+                rbuf.resize(used + k_read_size);
+                ssize_t rv = read(conn->fd, rbuf.data() + used, k_read_size);
+                rbuf.resize(used + (rv > 0 ? (size_t)rv : 0));
+                if (rv < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (rv < 0 && errno == EAGAIN) {
+                    break;
+                }
+                if (rv <= 0) {
+                    err = rv == 0 ? "connection closed by the server" : strerror(errno);
+                    break;
+                }
+            }
+            // hand out every complete response
+            while (rbuf.size() - rpos >= 4) {
+                uint32_t len = read_u32(&rbuf[rpos]);
+                if (len > k_max_msg) {
+                    err = "response too long";
+                    break;
+                }
+                if (rbuf.size() - rpos < 4 + (size_t)len) {
+                    break;
+                }
+                on_reply(conn, &rbuf[rpos + 4], len);
+                rpos += 4 + len;
+            }
+            rbuf.erase(rbuf.begin(), rbuf.begin() + rpos);
+            rpos = 0;
+        }
+    }
+
+    fail_all(conn, err);
+    return NULL;
+}
+
+static int connect_unix(const char *path, std::string *err) {
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        if (err) {
+            *err = "socket path too long";
+        }
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (const sockaddr *)&addr, sizeof(addr)) < 0) {
+        if (err) {
+            *err = strerror(errno);
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+static int connect_tcp(const char *host, uint16_t port, std::string *err) {
+    struct addrinfo hints = {};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *res = NULL;
+    std::string service = std::to_string(port);
+    int rv = getaddrinfo(host, service.c_str(), &hints, &res);
+    if (rv != 0) {
+        if (err) {
+            *err = gai_strerror(rv);
+        }
+        return -1;
+    }
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, res->ai_addr, res->ai_addrlen) < 0) {
+        if (err) {
+            *err = strerror(errno);
+        }
+        freeaddrinfo(res);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    freeaddrinfo(res);
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+int kv_dial(const char *host, uint16_t port, std::string *err) {
+    return host[0] == '/' ? connect_unix(host, err) : connect_tcp(host, port, err);
+}
+
+bool kv_connect(KvConn *conn, const char *host, uint16_t port, std::string *err) {
+    int fd = kv_dial(host, port, err);
+    if (fd < 0) {
+        return false;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    conn->fd = fd;
+    conn->wake_fd = eventfd(0, EFD_NONBLOCK);
+    pthread_mutex_init(&conn->mu, NULL);
+    int perr = pthread_create(&conn->thread, NULL, &io_thread, conn);
+    assert(perr == 0);
+    (void)perr;
+    return true;
+}
+
+void kv_close(KvConn *conn) {
+    if (conn->fd < 0) {
+        return;
+    }
+    pthread_mutex_lock(&conn->mu);
+    conn->closing = true;
+    pthread_mutex_unlock(&conn->mu);
+    uint64_t one = 1;
+    (void)!write(conn->wake_fd, &one, sizeof(one));
+    pthread_join(conn->thread, NULL);
+
+    close(conn->fd);
+    close(conn->wake_fd);
+    conn->fd = conn->wake_fd = -1;
+    pthread_mutex_destroy(&conn->mu);
+}
+
+void kv_send(KvConn *conn, const std::vector<std::string_view> &args, KvCallback cb) {
+    conn->inflight++;
+    pthread_mutex_lock(&conn->mu);
+    if (!conn->err.empty()) {
+        KvReply reply;
+        reply.err = conn->err;
+        pthread_mutex_unlock(&conn->mu);
+        conn->inflight--;
+        cb(reply);
+        return;
+    }
+    // only the first request of a batch needs to wake up the I/O thread
+    bool wake = conn->out.empty();
+    kv_encode_req(conn->out, args);
+    conn->waiting.push_back(std::move(cb));
+    pthread_mutex_unlock(&conn->mu);
+
+    if (wake) {
+        uint64_t one = 1;
+        (void)!write(conn->wake_fd, &one, sizeof(one));
+    }
+}
+
+std::future<KvReply> kv_send(KvConn *conn, const std::vector<std::string_view> &args) {
+    auto promise = std::make_shared<std::promise<KvReply>>();
+    std::future<KvReply> future = promise->get_future();
+    kv_send(conn, args, [promise](KvReply &reply) {
+        promise->set_value(std::move(reply));
+    });
+    return future;
+}
+
+KvReply kv_call(KvConn *conn, const std::vector<std::string_view> &args) {
+    return kv_send(conn, args).get();
+}
+
+bool kv_pool_connect(KvPool *pool, const char *host, uint16_t port, size_t n, std::string *err) {
+    for (size_t i = 0; i < n; ++i) {
+        KvConn *conn = new KvConn();
+        if (!kv_connect(conn, host, port, err)) {
+            delete conn;
+            kv_pool_close(pool);
+            return false;
+        }
+        pool->conns.push_back(conn);
+    }
+    return true;
+}
+
+void kv_pool_close(KvPool *pool) {
+    for (KvConn *conn : pool->conns) {
+        kv_close(conn);
+        delete conn;
+    }
+    pool->conns.clear();
+}
+
+KvConn *kv_pool_get(KvPool *pool) {
+    assert(!pool->conns.empty());
+    KvConn *best = pool->conns[0];
+    for (KvConn *conn : pool->conns) {
+        if (conn->inflight < best->inflight) {
+            best = conn;
+        }
+    }
+    return best;
+}
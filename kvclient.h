@@ -0,0 +1,93 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <future>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "common.h"
+
+// a client library for kvserver.
+//
+// each KvConn has an I/O thread. requests from any thread are queued and
+// written together, so concurrent requests are pipelined on the socket,
+// and replies are matched to requests in order. replies are kept as the
+// raw response bytes and read through KvView without copying. messages the
+// server pushes on its own (SER_PUSH, e.g. invalidations for client
+// tracking) go to `on_push` instead.
+
+// one value of a response. views point into the bytes of their KvReply and
+// are valid while it lives.
+struct KvView {
+    const uint8_t *data = NULL;
+    size_t len = 0;     // bytes from `data` to the end of the response
+};
+
+struct KvReply {
+    std::string err;            // a connection error, `data` is empty then
+    std::vector<uint8_t> data;  // the response, without the length prefix
+};
+
+inline KvView kv_root(const KvReply &reply) {
+    return KvView{reply.data.data(), reply.data.size()};
+}
+
+// SER_* from common.h, or -1 if the value is truncated
+int kv_type(KvView v);
+int64_t kv_int(KvView v);
+double kv_dbl(KvView v);
+// SER_STR, or the message of SER_ERR
+std::string_view kv_str(KvView v);
+int32_t kv_err_code(KvView v);
+// SER_KV
+std::string_view kv_key(KvView v);
+std::string_view kv_val(KvView v);
+// SER_ARR or SER_PUSH: the number of elements, the first one, and the value
+// after `v`
+uint32_t kv_arr_len(KvView v);
+KvView kv_arr_first(KvView v);
+KvView kv_next(KvView v);
+
+// runs on the I/O thread of the connection, so it should not block
+typedef std::function<void(KvReply &)> KvCallback;
+
+struct KvConn {
+    int fd = -1;
+    int wake_fd = -1;   // an eventfd that wakes up the I/O thread
+    pthread_t thread;
+    pthread_mutex_t mu;
+    // guarded by `mu`
+    std::string out;    // requests not yet taken by the I/O thread
+    std::deque<KvCallback> waiting;     // one per request, in order
+    bool closing = false;
+    std::string err;    // set once the connection failed
+    std::atomic<size_t> inflight{0};
+    KvCallback on_push;     // set before kv_connect(), pushes are dropped without it
+};
+
+// a `host` starting with '/' is the path of a unix socket, `port` is ignored
+bool kv_connect(KvConn *conn, const char *host, uint16_t port, std::string *err);
+// fails the requests still waiting and stops the I/O thread
+void kv_close(KvConn *conn);
+void kv_send(KvConn *conn, const std::vector<std::string_view> &args, KvCallback cb);
+std::future<KvReply> kv_send(KvConn *conn, const std::vector<std::string_view> &args);
+KvReply kv_call(KvConn *conn, const std::vector<std::string_view> &args);
+
+// for callers that do their own I/O: a blocking socket to the server, -1 on
+// error, and the request format
+int kv_dial(const char *host, uint16_t port, std::string *err);
+void kv_encode_req(std::string &out, const std::vector<std::string_view> &args);
+
+// a fixed set of connections, a request goes to the least busy one
+struct KvPool {
+    std::vector<KvConn *> conns;
+};
+
+bool kv_pool_connect(KvPool *pool, const char *host, uint16_t port, size_t n, std::string *err);
+void kv_pool_close(KvPool *pool);
+KvConn *kv_pool_get(KvPool *pool);
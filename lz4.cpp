@@ -0,0 +1,179 @@
+#include <string.h>
+#include "lz4.h"
+
+
+const int k_hash_log = 12;
+const size_t k_min_match = 4;
+const size_t k_last_literals = 5;   // the block must end with literals
+const size_t k_mf_limit = 12;       // no match may start after n - 12
+const size_t k_max_offset = 65535;
+
+static uint32_t read32(const uint8_t *p) {
+    uint32_t v = 0;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static uint32_t hash4(uint32_t v) {
+    return (v * 2654435761u) >> (32 - k_hash_log);
+}
+
+// write the 255-run length extension
+static uint8_t *put_length(uint8_t *op, size_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+// emit literals [lit, lit + nlit) followed by a match, or no match when mlen == 0
+static uint8_t *put_sequence(
+    uint8_t *op, uint8_t *op_end, const uint8_t *lit, size_t nlit,
+    size_t offset, size_t mlen)
+{
+    // token + length extensions + literals + offset
+    size_t worst = 1 + nlit / 255 + 1 + nlit + 2 + mlen / 255 + 1;
+    if ((size_t)(op_end - op) < worst) {
+        return NULL;
+    }
+    uint8_t *token = op++;
+    *token = (uint8_t)((nlit < 15 ? nlit : 15) << 4);
+    if (nlit >= 15) {
+        op = put_length(op, nlit - 15);
+    }
+    memcpy(op, lit, nlit);
+    op += nlit;
+    if (mlen == 0) {
+        return op;
+    }
+
+    *op++ = (uint8_t)(offset & 0xff);
+    *op++ = (uint8_t)(offset >> 8);
+    size_t ml = mlen - k_min_match;
+    *token |= (uint8_t)(ml < 15 ? ml : 15);
+    if (ml >= 15) {
+        op = put_length(op, ml - 15);
+    }
+    return op;
+}
+
+// greedy matching with a hash table of the last position of each 4-byte
+// sequence; the step grows while no match is found so that incompressible
+// data is skipped quickly.
+size_t lz4_compress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap) {
+    uint8_t *op = dst;
+    uint8_t *op_end = dst + cap;
+    size_t anchor = 0;
+
+    if (n > k_mf_limit) {
+        uint32_t table[1 << k_hash_log] = {};
+        size_t mf_limit = n - k_mf_limit;
+        size_t match_limit = n - k_last_literals;
+        size_t ip = 1;
+        table[hash4(read32(src))] = 0;
+        while (ip < mf_limit) {
+            uint32_t seq = read32(src + ip);
+            uint32_t h = hash4(seq);
+            size_t ref = table[h];
+            table[h] = (uint32_t)ip;
+            if (ip - ref > k_max_offset || read32(src + ref) != seq) {
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+
+            // extend backwards over pending literals, then forwards
+            while (ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1]) {
+                ip--;
+                ref--;
+            }
+            size_t mlen = k_min_match;
+            while (ip + mlen < match_limit && src[ref + mlen] == src[ip + mlen]) {
+                mlen++;
+            }
+
+            op = put_sequence(op, op_end, src + anchor, ip - anchor, ip - ref, mlen);
+            if (!op) {
+                return 0;
+            }
+            ip += mlen;
+            anchor = ip;
+            if (ip < mf_limit) {
+                table[hash4(read32(src + ip - 2))] = (uint32_t)(ip - 2);
+            }
+        }
+    }
+
+    op = put_sequence(op, op_end, src + anchor, n - anchor, 0, 0);
+    return op ? (size_t)(op - dst) : 0;
+}
+
+bool lz4_decompress(const uint8_t *src, size_t n, uint8_t *dst, size_t out_len) {
+    const uint8_t *ip = src;
+    const uint8_t *ip_end = src + n;
+    uint8_t *op = dst;
+    uint8_t *op_end = dst + out_len;
+
+    while (ip < ip_end) {
+        uint8_t token = *ip++;
+
+        // literals
+        size_t nlit = token >> 4;
+        if (nlit == 15) {
+            uint8_t b = 0;
+            do {
+                if (ip >= ip_end) {
+                    return false;
+                }
+                b = *ip++;
+                nlit += b;
+            } while (b == 255);
+        }
+        if ((size_t)(ip_end - ip) < nlit || (size_t)(op_end - op) < nlit) {
+            return false;
+        }
+        memcpy(op, ip, nlit);
+        ip += nlit;
+        op += nlit;
+        if (ip == ip_end) {
+            break;  // the last sequence has no match
+        }
+
+        // match
+        if (ip_end - ip < 2) {
+            return false;
+        }
+        size_t offset = ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - dst)) {
+            return false;
+        }
+        size_t mlen = token & 15;
+        if (mlen == 15) {
+            uint8_t b = 0;
+            do {
+                if (ip >= ip_end) {
+                    return false;
+                }
+                b = *ip++;
+                mlen += b;
+            } while (b == 255);
+        }
+        mlen += k_min_match;
+        if ((size_t)(op_end - op) < mlen) {
+            return false;
+        }
+        const uint8_t *match = op - offset;
+        if (offset >= mlen) {
+            memcpy(op, match, mlen);
+            op += mlen;
+        } else {
+            // overlapping copy, repeats the last `offset` bytes
+            for (size_t i = 0; i < mlen; ++i) {
+                *op++ = match[i];
+            }
+        }
+    }
+    return op == op_end;
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// the LZ4 block format, without the frame format around it
+
+// the worst case size of the compressed output
+inline size_t lz4_bound(size_t n) {
+    return n + n / 255 + 16;
+}
+
+// returns the compressed size, or 0 if the output does not fit in `cap`
+size_t lz4_compress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap);
+// the original size must be known, returns false on corrupted input
+bool lz4_decompress(const uint8_t *src, size_t n, uint8_t *dst, size_t out_len);
@@ -2,29 +2,53 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <stdio.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <netdb.h>
 #include <iostream>
 #include <string>
 #include <vector>
 #include <map>
+#include <deque>
+#include <algorithm>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <signal.h>
 #include <math.h>
 #include <time.h>
+#include <atomic>
+#include <random>
 #include "hashtable.h"
 #include "zset.h"
+#include "hash.h"
+#include "hll.h"
+#include "bloom.h"
+#include "bitops.h"
 #include "common.h"
 #include "list.h"
 #include "heap.h"
+#include "config.h"
+#include "thread_pool.h"
+#include "buffer.h"
+#include "lz4.h"
+#include "backlog.h"
+#include "btree.h"
+#include "sketch.h"
+#include "store.h"
+#include "vlog.h"
+#include "ebr.h"
 
 #define MAX_EVENTS 20
-#define PORT 8085
 
 volatile sig_atomic_t stop = 0;
 
@@ -59,8 +83,11 @@ static void fd_set_nb(int fd) {
     }
 }
 
-const size_t k_max_msg = 4096;
+const size_t k_max_msg = 32 << 20;
 const size_t k_max_args = 1024;
+// a value that grows in place must still fit in one request of the
+// replication snapshot
+const size_t k_max_value = k_max_msg - 1024;
 
 enum {
     STATE_REQ = 0,
@@ -79,89 +106,121 @@ enum {
     ERR_2BIG = 2,    // msg too long
     ERR_TYPE = 3,    // data type
     ERR_ARG = 4,    // ivaliad argument
+    ERR_OOM = 5,    // over maxmemory
+    ERR_READONLY = 6,   // a write sent to a replica
 };
 
 
-static void out_nil(std::string &out){
-    out.push_back(SER_NIL);
+// the out_* helpers serialize straight into the connection's output buffer
+
+static void out_nil(Buffer &out){
+    buf_append_u8(&out, SER_NIL);
 }
 
-static void out_err(std::string &out,  int32_t code, const std::string &msg){
-    out.push_back(SER_ERR);
-    out.append((char *)&code, 4);
+static void out_err(Buffer &out,  int32_t code, const std::string &msg){
+    buf_append_u8(&out, SER_ERR);
+    buf_append(&out, &code, 4);
     uint32_t len = (uint32_t)msg.size();
-    out.append((char *)&len, 4);
-    out.append(msg);
+    buf_append(&out, &len, 4);
+    buf_append(&out, msg.data(), msg.size());
 }
 
-static void out_kv(std::string &out, const std::string &key,const std::string &val){
-    out.push_back(SER_KV);
+// the value is either copied or, when `ref` is given, referenced
+static void out_kv(Buffer &out, const std::string &key, const std::string &val, RcStr *ref = NULL){
+    buf_append_u8(&out, SER_KV);
     uint32_t total_len = key.size() + val.size() + 2 * sizeof(uint32_t);
-    out.append((char *)&total_len, 4);
+    buf_append(&out, &total_len, 4);
      // Add key length and key
     uint32_t key_len = (uint32_t)key.size();
-    out.append((char *)&key_len, sizeof(key_len)); // Append key length
-    out.append(key);                               // Append key data
+    buf_append(&out, &key_len, sizeof(key_len));   // Append key length
+    buf_append(&out, key.data(), key.size());      // Append key data
 
     // Add value length and value
     uint32_t val_len = (uint32_t)val.size();
-    out.append((char *)&val_len, sizeof(val_len)); // Append value length
-    out.append(val);                               // Append value data
+    buf_append(&out, &val_len, sizeof(val_len));   // Append value length
+    if (ref) {
+        buf_append_ref(&out, ref);                 // sent with writev()
+    } else {
+        buf_append(&out, val.data(), val.size());  // Append value data
+    }
 } 
 
-static void out_str(std::string &out, const std::string &val){
-    out.push_back(SER_STR);
-    uint32_t len = (uint32_t)val.size();
-    out.append((char *)&len, 4);
-    out.append(val);
+static void out_str(Buffer &out, const char *s, size_t size) {
+    buf_append_u8(&out, SER_STR);
+    uint32_t len = (uint32_t)size;
+    buf_append(&out, &len, 4);
+    buf_append(&out, s, len);
+}
+
+static void out_str(Buffer &out, const std::string &val){
+    out_str(out, val.data(), val.size());
 } 
 
-static void out_int(std::string &out, int64_t val) {
-    out.push_back(SER_INT);
-    out.append((char *)&val, 8);
+static void out_int(Buffer &out, int64_t val) {
+    buf_append_u8(&out, SER_INT);
+    buf_append(&out, &val, 8);
 }
 
-static void out_arr(std::string &out, uint32_t n) {
-    out.push_back(SER_ARR);
-    out.append((char *)&n, 4);
+static void out_arr(Buffer &out, uint32_t n) {
+    buf_append_u8(&out, SER_ARR);
+    buf_append(&out, &n, 4);
 }
 
-static void out_dbl(std::string &out, double val) {
-    out.push_back(SER_DBL);
-    out.append((char *)&val, 8);
-
+static void out_push(Buffer &out, uint32_t n) {
+    buf_append_u8(&out, SER_PUSH);
+    buf_append(&out, &n, 4);
 }
 
-static void out_str(std::string &out, const char *s, size_t size) {
-    out.push_back(SER_STR);
-    uint32_t len = (uint32_t)size;
-    out.append((char *)&len, 4);
-    out.append(s, len);
+static void out_dbl(Buffer &out, double val) {
+    buf_append_u8(&out, SER_DBL);
+    buf_append(&out, &val, 8);
+
 }
 
-static void *begin_arr(std::string &out) {
-    out.push_back(SER_ARR);
-    out.append("\0\0\0\0", 4);          // filled in end_arr()
-    return (void *)(out.size() - 4);    // the `ctx` arg
+static void *begin_arr(Buffer &out) {
+    buf_append_u8(&out, SER_ARR);
+    buf_append(&out, "\0\0\0\0", 4);    // filled in end_arr()
+    return (void *)(out.tail - 4);      // the `ctx` arg
 }
 
-static void end_arr(std::string &out, void *ctx, uint32_t n) {
+static void end_arr(Buffer &out, void *ctx, uint32_t n) {
     size_t pos = (size_t)ctx;
-    assert(out[pos - 1] == SER_ARR);
-    memcpy(&out[pos], &n, 4);
+    assert(out.data[pos - 1] == SER_ARR);
+    memcpy(&out.data[pos], &n, 4);
 }
 
 enum {
     T_STR = 0,
     T_ZSET = 1,
+    T_HASH = 2,
+    T_HLL = 3,
+    T_BLOOM = 4,
+};
+
+// how a string value is stored
+enum {
+    ENC_RAW = 0,
+    ENC_LZ4 = 1,    // [original length u32][LZ4 block]
+    ENC_INT = 2,    // a canonical decimal int64, kept in `ival`
 };
 
 struct Entry {
 	HNode node;
 	std::string key;
 	std::string value;
-    uint32_t type = 0;
-    ZSet* zset = NULL;
+    RcStr *blob = NULL; // big string values, shared with the output buffers
+    uint16_t type = 0;
+    uint16_t enc = ENC_RAW;
+    uint32_t lru = 0;   // LRU clock, or LFU decay time (16 bits) | log counter (8 bits)
+    uint32_t seq = 0;   // odd while the string value changes, see entry_write_begin()
+    union {
+        ZSet* zset = NULL;
+        Hash *hash;
+        Hll *hll;
+        Bloom *bloom;
+        int64_t ival;
+        uint64_t vloc;  // a string value moved to the value log, see vlog_spill()
+    };
     size_t heap_idx = -1;
 };
 
@@ -171,36 +230,921 @@ static uint64_t get_monotonic_usec(){
     return tv.tv_sec * 1000000 + tv.tv_nsec / 1000;
 } 
 
+static uint64_t get_monotonic_nsec() {
+    timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
+
+// unix time, for what outlives the process
+static int64_t get_realtime_msec() {
+    timespec tv = {0, 0};
+    clock_gettime(CLOCK_REALTIME, &tv);
+    return int64_t(tv.tv_sec) * 1000 + tv.tv_nsec / 1000000;
+}
+
 struct Conn {
     int fd = -1;
     uint32_t state = 0;     // either STATE_REQ or STATE_RES
     // buffer for reading
-    size_t rbuf_size = 0;
-    uint8_t rbuf[4 + k_max_msg];
-    // buffer for writing
-    size_t wbuf_size = 0;
-    size_t wbuf_sent = 0;
-    uint8_t wbuf[4 + k_max_msg];
+    Buffer rbuf;
+    // buffer for writing, responses are serialized into it in place
+    Buffer wbuf;
     uint64_t idle_start = 0;
     DList idle_list;
+    uint32_t events = 0;    // registered with epoll
+    uint32_t flags = 0;
+    // requests left in the event loop iteration `budget_iter`
+    uint32_t budget = 0;
+    uint64_t budget_iter = 0;
+    bool deferred = false;  // ran out of budget with requests left, see process_deferred()
+    size_t out_exempt = 0;  // leading bytes of `wbuf` not held to the output limits
+    uint64_t id = 0;        // unique, unlike the fd
+    // client tracking, see tracking_read()
+    uint32_t tracking = 0;  // TRACK_*
+    std::vector<std::string> prefixes;  // broadcast mode, none means every key
+    std::vector<std::string> inval;     // keys to push, see tracking_flush()
+    bool inval_all = false;
+    bool inval_queued = false;          // in g_data.inval_fds
+    // parked in bzpopmin/bzpopmax, the request stays in `rbuf` until it is
+    // served by block_serve() or times out
+    bool blocked = false;
+    bool block_max = false;
+    std::vector<std::string> block_keys;
+    size_t block_heap_idx = -1;         // in g_data.block_heap, -1 without a timeout
+    // pub/sub subscriptions, and the messages for pubsub_flush() to append
+    std::vector<std::string> channels;
+    std::vector<std::string> patterns;
+    std::vector<RcStr *> messages;
+    bool messages_queued = false;       // in g_data.pubsub_fds
+    // value log reads the parked request waits for, see vlog_prefetch()
+    uint32_t vlog_wait = 0;
+};
+
+// client-side caching: a tracking connection is told when keys change. in
+// the default mode only about the keys it has read, which the server
+// remembers in a table, in broadcast mode about every key under its prefixes.
+enum {
+    TRACK_OFF = 0,
+    TRACK_DEFAULT = 1,
+    TRACK_BCAST = 2,
+};
+
+// a reader of a tracked key, the id tells a reused fd apart
+struct TrackRef {
+    int fd = -1;
+    uint64_t id = 0;
+};
+
+// a key read by default mode connections since it last changed
+struct TrackedKey {
+    HNode node;
+    std::string key;
+    std::vector<TrackRef> readers;
+};
+
+// connections blocked on a key, served in arrival order
+struct BlockedKey {
+    HNode node;
+    std::string key;
+    std::deque<Conn *> waiters;
+};
+
+// the subscribers of a pub/sub channel, or of a pattern
+struct Channel {
+    HNode node;
+    std::string name;
+    std::vector<Conn *> subs;
+};
+
+enum {
+    CONN_REPLICA = 1,   // a replica receiving our command stream
+    CONN_MASTER = 2,    // our link to the primary, exempt from the idle timeout
+};
+
+enum {
+    REPL_CONNECT = 0,   // waiting to (re)connect to the primary
+    REPL_HANDSHAKE = 1, // psync sent
+    REPL_LOADING = 2,   // receiving the snapshot
+    REPL_ONLINE = 3,    // following the command stream
+};
+
+// replication state. the primary sends each write command to its replicas
+// in the request format, and keeps the recent stream in a backlog so that a
+// replica can continue from its offset after a reconnect.
+struct Repl {
+    std::string replid;     // the history the data follows
+    uint64_t offset = 0;    // bytes of the stream produced or applied
+    // as a primary
+    Backlog backlog;        // created when the first replica connects
+    std::vector<Conn *> replicas;
+    uint64_t ping_us = 0;
+    Buffer scratch;         // the command being propagated
+    Buffer pending;         // a client's write, propagated once it succeeds
+    // as a replica
+    bool is_replica = false;
+    std::string master_host;
+    std::string master_port;
+    struct sockaddr_in master_addr = {};
+    Conn *master = NULL;    // the link, NULL while disconnected
+    uint32_t link = REPL_CONNECT;
+    uint64_t retry_us = 0;  // when to reconnect
+    Buffer discard;         // output of the applied commands
+};
+
+// hot key detection: sampled lookups go to a count-min sketch, and the keys
+// with the highest estimates are kept in a top-K heap. both are halved every
+// window, so a count decays with a half-life of one window.
+const uint32_t k_hotkeys_width = 2048;
+const uint32_t k_hotkeys_depth = 4;
+const size_t k_hotkeys_k = 32;
+const uint64_t k_hotkeys_window_us = 10 * 1000000;
+
+const size_t k_slowlog_max_args = 32;
+const size_t k_slowlog_max_arg_len = 128;
+
+// a command that took longer than slowlog-log-slower-than
+struct SlowlogEntry {
+    uint64_t id = 0;
+    uint64_t time = 0;          // unix seconds
+    uint64_t duration_us = 0;
+    int fd = -1;                // of the client
+    std::vector<std::string> args;  // truncated
+};
+
+// sources of event loop stalls
+enum {
+    LAT_COMMAND = 0,    // running requests, including the resize steps they do
+    LAT_EXPIRE = 1,     // TTL expiration in process_timers()
+    LAT_RESIZE = 2,     // keyspace hashtable resizing
+    LAT_ACCEPT = 3,
+    LAT_FLUSH = 4,      // writing responses
+    LAT_LOOP = 5,       // the whole iteration, excluding the wait
+};
+
+const size_t k_lat_events = 6;
+const char *k_lat_names[k_lat_events] = {
+    "command", "expire", "resize", "accept", "flush", "loop",
+};
+const size_t k_lat_history = 160;   // samples kept per source
+
+struct LatencySample {
+    uint64_t time = 0;          // unix seconds
+    uint64_t duration_us = 0;
+};
+
+struct LatencyEvent {
+    uint64_t iter_ns = 0;       // spent in the current loop iteration
+    uint64_t max_us = 0;
+    std::deque<LatencySample> history;
+};
+
+
+const size_t k_type_count = 5;
+const size_t k_hist_bins = 16;  // power-of-two size classes, from <= 64 bytes
+const size_t k_bigkeys = 5;     // biggest keys kept per type
+
+struct TypeStats {
+    uint64_t keys = 0;
+    uint64_t bytes = 0;
+    uint64_t hist[k_hist_bins] = {};
+    std::vector<std::pair<size_t, std::string>> biggest;   // (bytes, key), descending
+};
+
+// an incremental walk over the keyspace for `memory stats`
+struct MemScan {
+    bool running = false;
+    bool has_report = false;
+    uint32_t table = 0;     // 0: ht1, 1: ht2
+    size_t slot = 0;
+    uint64_t started_us = 0;
+    uint64_t finished_us = 0;
+    uint64_t duration_us = 0;   // of the last complete walk
+    TypeStats cur[k_type_count];    // being collected
+    TypeStats report[k_type_count]; // the last complete walk
+};
+
+// a read of the value log by an I/O thread, of a value or of a chunk of
+// the file being compacted
+struct VlogRead {
+    HNode node;             // in Tier::reads, by location
+    uint64_t vloc = 0;
+    std::string key;
+    uint32_t file = 0;
+    uint64_t off = 0;
+    size_t len = 0;
+    std::string data;
+    bool ok = false;
+    std::vector<TrackRef> waiters;  // connections parked on it
+};
+
+// tiered storage: cold string values are moved to the value log
+struct Tier {
+    Vlog log;
+    ThreadPool pool;            // for the reads
+    int efd = -1;               // signaled by the pool as reads finish
+    pthread_mutex_t mu = PTHREAD_MUTEX_INITIALIZER;
+    std::vector<VlogRead *> done;   // finished reads, guarded by `mu`
+    HMap reads;                 // of VlogRead in flight, for sharing them
+    VlogRead *chunk = NULL;     // the compaction read in flight
+    size_t chunk_len = 0;       // for a record bigger than k_vlog_chunk
+    // the clock hand, it visits the db slots like the memory scan
+    uint32_t table = 0;
+    size_t slot = 0;
+    uint32_t pass_start = 0;    // LRU clock at the start of the pass
+    uint32_t prev_pass_start = 0;
+    bool spill_pending = false; // spilled and still over vlog-memory
+    uint64_t values = 0;        // in the log
+    uint64_t value_bytes = 0;
+    uint64_t stat_reads = 0;
+    uint64_t stat_compactions = 0;
+};
+
+// a request that a read thread hands to the event loop, see reader_forward()
+struct Reader;
+struct ReadFwd {
+    Reader *reader = NULL;
+    int fd = -1;            // of the connection, with its id
+    uint64_t id = 0;
+    std::vector<std::string> cmd;
+    Buffer out;             // the response
 };
 
+// read threads, serving `get` on the read port while the event loop writes.
+// the keyspace they look at is kept valid with epoch-based reclamation.
+struct Readers {
+    bool on = false;            // set at startup, before the keyspace fills
+    std::vector<Reader *> threads;
+    Ebr ebr;
+    int efd = -1;               // signaled as `fwd` gets requests
+    pthread_mutex_t mu = PTHREAD_MUTEX_INITIALIZER;
+    std::vector<ReadFwd *> fwd;     // guarded by `mu`
+    std::atomic<bool> stop{false};
+    std::atomic<bool> loading{false};   // keys are left in the keyspace file
+    uint64_t stat_forwarded = 0;
+};
 
 static struct{
     HMap db;
+    int epfd = -1;
     // a map of all client connections, keyed by fd
     std::vector<Conn *> fd2conn;
     DList idle_list;
     std::vector<HeapItem> heap;
+    // bytes owned by the entries in `db`, see entry_mem()
+    size_t used_mem = 0;
+    bool evict_pending = false; // eviction ran out of budget while over the limit
+    uint64_t stat_evicted = 0;
+    uint64_t stat_expired = 0;
+    uint64_t stat_output_closed = 0;    // connections closed by the output limits
+    uint64_t loop_iter = 0;
+    std::vector<int> deferred;  // fds of connections to continue next iteration
+    MemScan memscan;
+    // for freeing large values off the event loop
+    ThreadPool thread_pool;
+    ThreadPool merge_pool;      // for big zunionstore / zinterstore
+    std::atomic<uint64_t> lazyfree_pending{0};
+    std::atomic<uint64_t> lazyfree_done{0};
+    // compressed string values currently in the keyspace
+    uint64_t comp_values = 0;
+    uint64_t comp_raw_bytes = 0;    // before compression
+    uint64_t comp_bytes = 0;        // as stored
+    Repl repl;
+    // ordered keys of `db`, maintained only with --key-index yes
+    BTree index;
+    std::deque<SlowlogEntry> slowlog;   // newest first
+    uint64_t slowlog_next_id = 0;
+    LatencyEvent latency[k_lat_events];
+    uint64_t lat_resize_ns = 0;     // db.resize_ns at the start of the iteration
+    CMSketch hk_sketch;
+    TopK hk_top;
+    uint32_t hk_countdown = 0;  // lookups to skip before the next sample
+    uint64_t hk_rng = 0x9e3779b97f4a7c15ULL;
+    uint64_t hk_start_us = 0;   // of the first sample, 0 if none
+    uint64_t hk_decay_us = 0;   // of the last decay, 0 if none
+    uint64_t next_conn_id = 0;
+    HMap tracking;              // of TrackedKey
+    std::vector<Conn *> bcast;  // connections tracking in broadcast mode
+    std::vector<int> inval_fds; // connections with invalidations to push
+    uint64_t stat_invalidations = 0;
+    HMap blocking;              // of BlockedKey
+    std::vector<std::string> ready_keys;    // blocked on and just added to
+    std::vector<HeapItem> block_heap;       // timeouts of blocked connections
+    HMap channels;              // of Channel
+    std::vector<Channel *> patterns;
+    std::vector<int> pubsub_fds;    // subscribers with messages to append
+    Store store;                // the keyspace file, while keys are left in it
+    Tier tier;
+    Readers readers;
 }g_data; 
 
+static void lat_add(uint32_t event, uint64_t start_ns) {
+    g_data.latency[event].iter_ns += get_monotonic_nsec() - start_ns;
+}
+
+// at the end of an event loop iteration, record the sources of a stall
+static void lat_end_iter(uint64_t start_ns) {
+    LatencyEvent *lat = g_data.latency;
+    lat[LAT_LOOP].iter_ns = get_monotonic_nsec() - start_ns;
+    lat[LAT_RESIZE].iter_ns = g_data.db.resize_ns - g_data.lat_resize_ns;
+    g_data.lat_resize_ns = g_data.db.resize_ns;
+
+    for (size_t i = 0; i < k_lat_events; ++i) {
+        uint64_t us = lat[i].iter_ns / 1000;
+        lat[i].iter_ns = 0;
+        if (!g_conf.latency_monitor_threshold || us < g_conf.latency_monitor_threshold) {
+            continue;
+        }
+        lat[i].history.push_back(LatencySample{(uint64_t)time(NULL), us});
+        if (lat[i].history.size() > k_lat_history) {
+            lat[i].history.pop_front();
+        }
+        lat[i].max_us = std::max(lat[i].max_us, us);
+    }
+}
+
+static int32_t parse_req(const uint8_t *data, uint32_t reqlen, std::vector<std::string> &out);
+
+// commands may move their arguments into the keyspace, so the arguments are
+// parsed again from the request, which is still in the read buffer
+static void slowlog_add(int fd, const uint8_t *req, uint32_t len, uint64_t duration_us) {
+    if (duration_us < g_conf.slowlog_log_slower_than || !g_conf.slowlog_max_len) {
+        return;
+    }
+    std::vector<std::string> cmd;
+    parse_req(req, len, cmd);
+
+    SlowlogEntry ent;
+    ent.id = g_data.slowlog_next_id++;
+    ent.time = (uint64_t)time(NULL);
+    ent.duration_us = duration_us;
+    ent.fd = fd;
+    for (size_t i = 0; i < cmd.size(); ++i) {
+        if (i + 1 == k_slowlog_max_args && cmd.size() > k_slowlog_max_args) {
+            ent.args.push_back("... (" + std::to_string(cmd.size() - i) + " more arguments)");
+            break;
+        }
+        std::string &arg = cmd[i];
+        if (arg.size() > k_slowlog_max_arg_len) {
+            size_t more = arg.size() - k_slowlog_max_arg_len;
+            arg.resize(k_slowlog_max_arg_len);
+            arg += "... (" + std::to_string(more) + " more bytes)";
+        }
+        ent.args.push_back(std::move(arg));
+    }
+    g_data.slowlog.push_front(std::move(ent));
+    while (g_data.slowlog.size() > g_conf.slowlog_max_len) {
+        g_data.slowlog.pop_back();
+    }
+}
+
+
 
 bool entry_eq(HNode* lhs, HNode* rhs){
     struct Entry *le = container_of(lhs, struct Entry,node);
-    struct Entry *re = container_of(lhs, struct Entry,node);
+    struct Entry *re = container_of(rhs, struct Entry,node);
     return le->key == re->key;
 } 
 
+static bool hnode_same(HNode *lhs, HNode *rhs) {
+    return lhs == rhs;
+}
+
+// heap bytes owned by a string, nothing when the short string is inline
+static size_t str_mem(const std::string &s) {
+    const char *p = s.data();
+    if (p >= (const char *)&s && p < (const char *)(&s + 1)) {
+        return 0;
+    }
+    return s.capacity() + 1;
+}
+
+static size_t entry_mem(Entry *ent) {
+    size_t n = sizeof(Entry) + str_mem(ent->key) + str_mem(ent->value);
+    if (ent->blob) {
+        n += sizeof(RcStr) + str_mem(ent->blob->data);
+    }
+    if (ent->type == T_ZSET) {
+        n += zset_mem(ent->zset);
+    } else if (ent->type == T_HASH) {
+        n += hash_mem(ent->hash);
+    } else if (ent->type == T_HLL) {
+        n += hll_mem(ent->hll);
+    } else if (ent->type == T_BLOOM) {
+        n += bloom_mem(ent->bloom);
+    }
+    return n;
+}
+
+static size_t used_memory() {
+    return g_data.used_mem + hm_mem(&g_data.db) + g_data.index.mem;
+}
+
+static bool over_maxmemory() {
+    return g_conf.maxmemory && used_memory() > g_conf.maxmemory;
+}
+
+// LRU clock in seconds, wraps around after 194 days
+const uint32_t k_lru_max = (1 << 24) - 1;
+const uint32_t k_lfu_init_val = 5;
+
+static uint32_t lru_clock() {
+    return (uint32_t)(get_monotonic_usec() / 1000000) & k_lru_max;
+}
+
+static uint32_t lru_idle(Entry *ent) {
+    return (lru_clock() - ent->lru) & k_lru_max;
+}
+
+static bool policy_is_lfu() {
+    return g_conf.maxmemory_policy == EVICT_ALLKEYS_LFU
+        || g_conf.maxmemory_policy == EVICT_VOLATILE_LFU;
+}
+
+static uint32_t lfu_minutes() {
+    return (uint32_t)(get_monotonic_usec() / 60000000) & 0xffff;
+}
+
+// the counter with the decay applied, without updating the entry
+static uint32_t lfu_decayed(Entry *ent) {
+    uint32_t ldt = ent->lru >> 8;
+    uint32_t counter = ent->lru & 0xff;
+    uint32_t elapsed = (lfu_minutes() - ldt) & 0xffff;
+    uint32_t periods = g_conf.lfu_decay_time ? elapsed / g_conf.lfu_decay_time : 0;
+    return periods > counter ? 0 : counter - periods;
+}
+
+// logarithmic increment: the more hits, the less likely to bump it again
+static uint32_t lfu_log_incr(uint32_t counter) {
+    if (counter == 255) {
+        return counter;
+    }
+    double base = counter > k_lfu_init_val ? counter - k_lfu_init_val : 0;
+    double p = 1.0 / (base * g_conf.lfu_log_factor + 1);
+    return (double)rand() / RAND_MAX < p ? counter + 1 : counter;
+}
+
+static void entry_init_lru(Entry *ent) {
+    if (policy_is_lfu()) {
+        ent->lru = (lfu_minutes() << 8) | k_lfu_init_val;
+    } else {
+        ent->lru = lru_clock();
+    }
+}
+
+// record an access for the eviction policy
+static void entry_touch(Entry *ent) {
+    if (policy_is_lfu()) {
+        uint32_t counter = lfu_log_incr(lfu_decayed(ent));
+        ent->lru = (lfu_minutes() << 8) | counter;
+    } else {
+        ent->lru = lru_clock();
+    }
+}
+
+// called for one lookup in hotkeys-sample-rate on average; the gaps are
+// random so that a periodic access pattern can't hide from the sampling
+static void hotkeys_sample(const std::string &key, uint64_t hcode) {
+    uint64_t &x = g_data.hk_rng;    // xorshift64
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    uint64_t rate = g_conf.hotkeys_sample_rate;
+    g_data.hk_countdown = (uint32_t)(x % (2 * rate - 1));
+
+    if (!g_data.hk_sketch.width) {
+        cms_init(&g_data.hk_sketch, k_hotkeys_width, k_hotkeys_depth);
+        g_data.hk_top.k = k_hotkeys_k;
+    }
+    if (!g_data.hk_start_us) {
+        g_data.hk_start_us = get_monotonic_usec();
+    }
+    uint32_t count = cms_add(&g_data.hk_sketch, hcode);
+    topk_add(&g_data.hk_top, key, hcode, count);
+}
+
+static void hotkeys_cron(uint64_t now_us) {
+    uint64_t last_us = g_data.hk_decay_us ? g_data.hk_decay_us : g_data.hk_start_us;
+    if (last_us && now_us >= last_us + k_hotkeys_window_us) {
+        cms_decay(&g_data.hk_sketch);
+        topk_decay(&g_data.hk_top);
+        g_data.hk_decay_us = now_us;
+    }
+}
+
+static Entry *store_fault(const std::string &key);
+
+// look up a key; the key is borrowed and handed back unchanged
+static Entry *db_lookup(std::string &key) {
+    Entry probe;
+    probe.key.swap(key);
+    probe.node.hcode = str_hash((uint8_t *)probe.key.data(), probe.key.size());
+    HNode *node = hm_lookup(&g_data.db, &probe.node, &entry_eq);
+    probe.key.swap(key);
+    if (g_conf.hotkeys_sample_rate && g_data.hk_countdown-- == 0) {
+        hotkeys_sample(key, probe.node.hcode);  // misses count too
+    }
+    if (!node) {
+        return g_data.store.map ? store_fault(key) : NULL;
+    }
+    Entry *ent = container_of(node, Entry, node);
+    entry_touch(ent);
+    return ent;
+}
+
+// the same without counting as an access, for background work
+static Entry *db_find(std::string &key) {
+    Entry probe;
+    probe.key.swap(key);
+    probe.node.hcode = str_hash((uint8_t *)probe.key.data(), probe.key.size());
+    HNode *node = hm_lookup(&g_data.db, &probe.node, &entry_eq);
+    probe.key.swap(key);
+    return node ? container_of(node, Entry, node) : NULL;
+}
+
+// add a new entry that owns its key; type and value are already set
+static void db_insert(Entry *ent) {
+    ent->node.hcode = str_hash((uint8_t *)ent->key.data(), ent->key.size());
+    entry_init_lru(ent);
+    if (g_data.store.map) {
+        store_drop(&g_data.store, ent->key.data(), ent->key.size());    // a stale copy
+    }
+    hm_insert(&g_data.db, &ent->node);
+    if (g_conf.key_index) {
+        bt_insert(&g_data.index, &ent->key);
+    }
+    g_data.used_mem += entry_mem(ent);
+}
+
+static bool tracked_key_eq(HNode *lhs, HNode *rhs) {
+    return container_of(lhs, TrackedKey, node)->key == container_of(rhs, TrackedKey, node)->key;
+}
+
+// the connection of a reader, if it still exists and tracks
+static Conn *track_ref_conn(const TrackRef &ref) {
+    Conn *conn = (size_t)ref.fd < g_data.fd2conn.size() ? g_data.fd2conn[ref.fd] : NULL;
+    return conn && conn->id == ref.id && conn->tracking == TRACK_DEFAULT ? conn : NULL;
+}
+
+// a NULL key stands for every key
+static void tracking_queue(Conn *conn, const std::string *key) {
+    if (key) {
+        conn->inval.push_back(*key);
+    } else {
+        conn->inval_all = true;
+    }
+    if (!conn->inval_queued) {
+        conn->inval_queued = true;
+        g_data.inval_fds.push_back(conn->fd);
+    }
+}
+
+// tell the readers of a key, which is no longer tracked
+static void tracking_drop(TrackedKey *tk) {
+    for (const TrackRef &ref : tk->readers) {
+        if (Conn *conn = track_ref_conn(ref)) {
+            tracking_queue(conn, &tk->key);
+        }
+    }
+    delete tk;
+}
+
+// a default mode connection read a key, which is borrowed as in db_lookup()
+static void tracking_read(Conn *conn, std::string &key) {
+    TrackedKey probe;
+    probe.key.swap(key);
+    probe.node.hcode = str_hash((uint8_t *)probe.key.data(), probe.key.size());
+    HNode *node = hm_lookup(&g_data.tracking, &probe.node, &tracked_key_eq);
+    probe.key.swap(key);
+
+    TrackedKey *tk = NULL;
+    if (node) {
+        tk = container_of(node, TrackedKey, node);
+        // already a reader? also forget the readers that are gone
+        std::vector<TrackRef> &readers = tk->readers;
+        for (size_t i = 0; i < readers.size(); ) {
+            if (readers[i].id == conn->id) {
+                return;
+            }
+            if (!track_ref_conn(readers[i])) {
+                readers[i] = readers.back();
+                readers.pop_back();
+            } else {
+                i++;
+            }
+        }
+    } else {
+        // the table is capped, keys pushed out are invalidated early
+        while (g_conf.tracking_table_max_keys
+            && hm_size(&g_data.tracking) >= g_conf.tracking_table_max_keys)
+        {
+            HNode *victim = hm_random(&g_data.tracking);
+            hm_pop(&g_data.tracking, victim, &hnode_same);
+            tracking_drop(container_of(victim, TrackedKey, node));
+        }
+        tk = new TrackedKey();
+        tk->key = key;
+        tk->node.hcode = probe.node.hcode;
+        hm_insert(&g_data.tracking, &tk->node);
+    }
+    tk->readers.push_back(TrackRef{conn->fd, conn->id});
+}
+
+// called before a key changes or goes away
+static void tracking_modified(std::string &key) {
+    if (hm_size(&g_data.tracking)) {
+        TrackedKey probe;
+        probe.key.swap(key);
+        probe.node.hcode = str_hash((uint8_t *)probe.key.data(), probe.key.size());
+        HNode *node = hm_pop(&g_data.tracking, &probe.node, &tracked_key_eq);
+        probe.key.swap(key);
+        if (node) {
+            tracking_drop(container_of(node, TrackedKey, node));
+        }
+    }
+    for (Conn *conn : g_data.bcast) {
+        bool match = conn->prefixes.empty();
+        for (size_t i = 0; !match && i < conn->prefixes.size(); ++i) {
+            const std::string &p = conn->prefixes[i];
+            match = key.size() >= p.size() && 0 == memcmp(key.data(), p.data(), p.size());
+        }
+        if (match) {
+            tracking_queue(conn, &key);
+        }
+    }
+}
+
+static void tracking_off(Conn *conn) {
+    if (conn->tracking == TRACK_BCAST) {
+        std::vector<Conn *> &v = g_data.bcast;
+        v.erase(std::find(v.begin(), v.end(), conn));
+    }
+    conn->tracking = TRACK_OFF;
+    conn->prefixes.clear();
+}
+
+static bool channel_eq(HNode *lhs, HNode *rhs) {
+    return container_of(lhs, Channel, node)->name == container_of(rhs, Channel, node)->name;
+}
+
+static Channel *channel_get(const std::string &name, bool pattern) {
+    if (pattern) {
+        // patterns are few, and publish has to try all of them anyway
+        for (Channel *ch : g_data.patterns) {
+            if (ch->name == name) {
+                return ch;
+            }
+        }
+        return NULL;
+    }
+    if (!hm_size(&g_data.channels)) {
+        return NULL;
+    }
+    Channel probe;
+    probe.name = name;
+    probe.node.hcode = str_hash((uint8_t *)name.data(), name.size());
+    HNode *node = hm_lookup(&g_data.channels, &probe.node, &channel_eq);
+    return node ? container_of(node, Channel, node) : NULL;
+}
+
+static void pubsub_add(Conn *conn, const std::string &name, bool pattern) {
+    Channel *ch = channel_get(name, pattern);
+    if (!ch) {
+        ch = new Channel();
+        ch->name = name;
+        if (pattern) {
+            g_data.patterns.push_back(ch);
+        } else {
+            ch->node.hcode = str_hash((uint8_t *)name.data(), name.size());
+            hm_insert(&g_data.channels, &ch->node);
+        }
+    }
+    if (std::find(ch->subs.begin(), ch->subs.end(), conn) != ch->subs.end()) {
+        return;     // already subscribed
+    }
+    ch->subs.push_back(conn);
+    (pattern ? conn->patterns : conn->channels).push_back(name);
+}
+
+// drops the connection from the subscribers, and the channel once it has none
+static void channel_leave(Channel *ch, Conn *conn, bool pattern) {
+    std::vector<Conn *> &subs = ch->subs;
+    *std::find(subs.begin(), subs.end(), conn) = subs.back();   // the order doesn't matter
+    subs.pop_back();
+    if (!subs.empty()) {
+        return;
+    }
+    if (pattern) {
+        std::vector<Channel *> &v = g_data.patterns;
+        v.erase(std::find(v.begin(), v.end(), ch));
+    } else {
+        hm_pop(&g_data.channels, &ch->node, &channel_eq);
+    }
+    delete ch;
+}
+
+static void pubsub_remove(Conn *conn, const std::string &name, bool pattern) {
+    std::vector<std::string> &names = pattern ? conn->patterns : conn->channels;
+    auto it = std::find(names.begin(), names.end(), name);
+    if (it != names.end()) {
+        names.erase(it);
+        channel_leave(channel_get(name, pattern), conn, pattern);
+    }
+}
+
+// unsubscribe from every channel, or from every pattern
+static void pubsub_off(Conn *conn, bool pattern) {
+    std::vector<std::string> &names = pattern ? conn->patterns : conn->channels;
+    for (const std::string &name : names) {
+        channel_leave(channel_get(name, pattern), conn, pattern);
+    }
+    names.clear();
+}
+
+// matches one character against the pattern element at `p`, and moves `p`
+// past the element: a character, ?, \x, or a class [abc] [a-z] [^abc]
+static bool glob_one(const std::string &pat, size_t &p, uint8_t c) {
+    uint8_t pc = pat[p++];
+    if (pc == '?') {
+        return true;
+    }
+    if (pc == '\\' && p < pat.size()) {
+        return (uint8_t)pat[p++] == c;
+    }
+    if (pc != '[') {
+        return pc == c;
+    }
+    bool neg = p < pat.size() && pat[p] == '^';
+    p += neg;
+    bool match = false;
+    while (p < pat.size() && pat[p] != ']') {
+        if (pat[p] == '\\' && p + 1 < pat.size()) {
+            p++;
+        }
+        uint8_t lo = pat[p++], hi = lo;
+        if (p + 1 < pat.size() && pat[p] == '-' && pat[p + 1] != ']') {
+            hi = pat[p + 1];
+            p += 2;
+        }
+        if (lo > hi) {
+            std::swap(lo, hi);
+        }
+        match = match || (lo <= c && c <= hi);
+    }
+    p += p < pat.size();    // the ]
+    return match != neg;
+}
+
+// glob-style matching of channel names, a * goes back to the last one only
+static bool glob_match(const std::string &pat, const std::string &str) {
+    size_t p = 0, s = 0;
+    size_t star_p = std::string::npos, star_s = 0;
+    while (s < str.size()) {
+        if (p < pat.size() && pat[p] == '*') {
+            star_p = ++p;
+            star_s = s;
+            continue;
+        }
+        size_t next = p;
+        if (p < pat.size() && glob_one(pat, next, str[s])) {
+            p = next;
+            s++;
+        } else if (star_p != std::string::npos) {
+            p = star_p;     // let the * take one more character
+            s = ++star_s;
+        } else {
+            return false;
+        }
+    }
+    while (p < pat.size() && pat[p] == '*') {
+        p++;
+    }
+    return p == pat.size();
+}
+
+static void str_append_u32(std::string &s, uint32_t val) {
+    s.append((const char *)&val, 4);
+}
+
+// a published message as a complete response: ["message", channel, payload],
+// or ["pmessage", pattern, channel, payload]. it is serialized once and
+// shared by the subscribers. NULL if it exceeds k_max_msg.
+static RcStr *pubsub_message(const std::string *pattern, const std::string &channel,
+                             const std::string &payload)
+{
+    const std::string kind = pattern ? "pmessage" : "message";
+    std::vector<const std::string *> items = {&kind, &channel, &payload};
+    if (pattern) {
+        items.insert(items.begin() + 1, pattern);
+    }
+    size_t len = 5;
+    for (const std::string *item : items) {
+        len += 5 + item->size();
+    }
+    if (len > k_max_msg) {
+        return NULL;
+    }
+    RcStr *msg = rcstr_new();
+    std::string &s = msg->data;
+    s.reserve(4 + len);
+    str_append_u32(s, (uint32_t)len);
+    s.push_back(SER_PUSH);
+    str_append_u32(s, (uint32_t)items.size());
+    for (const std::string *item : items) {
+        s.push_back(SER_STR);
+        str_append_u32(s, (uint32_t)item->size());
+        s.append(*item);
+    }
+    return msg;
+}
+
+static void pubsub_queue(Conn *conn, RcStr *msg) {
+    if (conn->state == STATE_END) {
+        return;
+    }
+    rcstr_ref(msg);
+    conn->messages.push_back(msg);
+    if (!conn->messages_queued) {
+        conn->messages_queued = true;
+        g_data.pubsub_fds.push_back(conn->fd);
+    }
+}
+
+static bool blocked_key_eq(HNode *lhs, HNode *rhs) {
+    return container_of(lhs, BlockedKey, node)->key == container_of(rhs, BlockedKey, node)->key;
+}
+
+static BlockedKey *blocked_key_get(const std::string &key) {
+    if (!hm_size(&g_data.blocking)) {
+        return NULL;
+    }
+    BlockedKey probe;
+    probe.key = key;
+    probe.node.hcode = str_hash((uint8_t *)key.data(), key.size());
+    HNode *node = hm_lookup(&g_data.blocking, &probe.node, &blocked_key_eq);
+    return node ? container_of(node, BlockedKey, node) : NULL;
+}
+
+// `deadline_us` is 0 to wait forever
+static void block_conn(Conn *conn, std::vector<std::string> &&keys, bool max, uint64_t deadline_us) {
+    conn->blocked = true;
+    conn->block_max = max;
+    conn->block_keys = std::move(keys);
+    for (const std::string &key : conn->block_keys) {
+        BlockedKey *bk = blocked_key_get(key);
+        if (!bk) {
+            bk = new BlockedKey();
+            bk->key = key;
+            bk->node.hcode = str_hash((uint8_t *)key.data(), key.size());
+            hm_insert(&g_data.blocking, &bk->node);
+        }
+        if (std::find(bk->waiters.begin(), bk->waiters.end(), conn) == bk->waiters.end()) {
+            bk->waiters.push_back(conn);    // the same key may be given twice
+        }
+    }
+    if (deadline_us) {
+        HeapItem item;
+        item.val = deadline_us;
+        item.ref = &conn->block_heap_idx;
+        g_data.block_heap.push_back(item);
+        heap_update(g_data.block_heap.data(), g_data.block_heap.size() - 1, g_data.block_heap.size());
+    }
+}
+
+static void unblock_conn(Conn *conn) {
+    for (const std::string &key : conn->block_keys) {
+        BlockedKey *bk = blocked_key_get(key);
+        if (!bk) {
+            continue;   // a repeated key, already done
+        }
+        std::deque<Conn *> &w = bk->waiters;
+        w.erase(std::remove(w.begin(), w.end(), conn), w.end());
+        if (w.empty()) {
+            hm_pop(&g_data.blocking, &bk->node, &hnode_same);
+            delete bk;
+        }
+    }
+    size_t pos = conn->block_heap_idx;
+    if (pos != (size_t)-1) {
+        std::vector<HeapItem> &heap = g_data.block_heap;
+        heap[pos] = heap.back();
+        heap.pop_back();
+        if (pos < heap.size()) {
+            heap_update(heap.data(), pos, heap.size());
+        }
+        conn->block_heap_idx = -1;
+    }
+    conn->blocked = false;
+    conn->block_keys.clear();
+}
+
+// members were added to a key, its waiters are served after the command
+static void block_signal(const std::string &key) {
+    if (blocked_key_get(key)) {
+        g_data.ready_keys.push_back(key);
+    }
+}
+
 static void conn_put(std::vector<Conn *> &fd2conn, struct Conn *conn) {
     if (fd2conn.size() <= (size_t)conn->fd) {
         fd2conn.resize(conn->fd + 1);
@@ -208,12 +1152,11 @@ static void conn_put(std::vector<Conn *> &fd2conn, struct Conn *conn) {
     fd2conn[conn->fd] = conn;
 }
 
-static int32_t accept_new_conn(std::vector<Conn *> &fd2conn, int epfd, int fd) {
-    struct sockaddr_in client_addr = {};
-    socklen_t socklen = sizeof(client_addr);
-
+// `tcp` is false for the unix socket listener
+static int32_t accept_new_conn(std::vector<Conn *> &fd2conn, int epfd, int fd, bool tcp) {
     while (true) {
-        int connfd = accept(fd, (struct sockaddr *)&client_addr, &socklen);
+        uint64_t start_ns = get_monotonic_nsec();
+        int connfd = accept(fd, NULL, NULL);
         if (connfd == -1) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) break;
             perror("accept");
@@ -221,18 +1164,16 @@ static int32_t accept_new_conn(std::vector<Conn *> &fd2conn, int epfd, int fd) {
         }
 
         fd_set_nb(connfd);
-
-        Conn *conn = (Conn *)malloc(sizeof(Conn));
-        if (!conn) {
-            close(connfd);
-            continue;
+        if (tcp) {
+            // responses are written whole, don't hold them back for an ACK
+            int val = 1;
+            setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
         }
 
+        Conn *conn = new Conn();
         conn->fd = connfd;
+        conn->id = ++g_data.next_conn_id;
         conn->state = STATE_REQ;
-        conn->rbuf_size = 0;
-        conn->wbuf_size = 0;
-        conn->wbuf_sent = 0;
         conn->idle_start = get_monotonic_usec();
         dlist_insert_before(&g_data.idle_list, &conn->idle_list);
         conn_put(fd2conn, conn);
@@ -240,10 +1181,12 @@ static int32_t accept_new_conn(std::vector<Conn *> &fd2conn, int epfd, int fd) {
         struct epoll_event event = {};
         event.data.fd = connfd;
         event.events = EPOLLIN | EPOLLET;
+        conn->events = event.events;
         if (epoll_ctl(epfd, EPOLL_CTL_ADD, connfd, &event) < 0) {
             perror("epoll_ctl");
             return -1;
         }
+        lat_add(LAT_ACCEPT, start_ns);
     }
 
     return 0;
@@ -294,45 +1237,252 @@ static bool cmd_is(const std::string &word, const char *cmd){
 } 
 
 
-static void do_get(std::vector<std::string> &cmd, std::string &out ){
+const size_t k_str_ref_min = 4096; // values this big are shared with the output, not copied
 
-    Entry key;
+// a string value in the value log rather than in memory
+static bool entry_spilled(Entry *ent) {
+    return ent->type == T_STR && ent->enc != ENC_INT && ent->vloc;
+}
 
-    key.key.swap(cmd[1]);   
-    key.node.hcode = str_hash((uint8_t*)key.key.data(),key.key.size());
+static void vlog_fault(Entry *ent);
 
-    HNode *node = hm_lookup(&g_data.db,&key.node,entry_eq);
+// the value is no longer in the log
+static void vlog_drop(Entry *ent) {
+    Tier &t = g_data.tier;
+    vlog_forget(&t.log, ent->vloc, ent->key.size());
+    t.values--;
+    t.value_bytes -= vloc_len(ent->vloc);
+    ent->vloc = 0;
+}
 
-    if (!node) {
-        return out_nil(out);
+// the stored bytes, which are compressed when `ent->enc` is ENC_LZ4
+static const std::string &entry_str(Entry *ent) {
+    if (entry_spilled(ent)) {
+        vlog_fault(ent);
     }
-    Entry *ent = container_of(node, Entry, node);
-    if (ent->type != T_STR) {
-        return out_err(out, ERR_TYPE, "expect string type");
+    return ent->blob ? ent->blob->data : ent->value;
+}
+
+// the same, writable
+static std::string &entry_str_raw(Entry *ent) {
+    if (entry_spilled(ent)) {
+        vlog_fault(ent);
     }
-    return out_kv(out,ent->key,ent->value);
-} 
+    return ent->blob ? ent->blob->data : ent->value;
+}
+
+static uint32_t lz4_raw_len(const std::string &stored) {
+    uint32_t len = 0;
+    memcpy(&len, stored.data(), 4);
+    return len;
+}
+
+static void comp_stats_update(Entry *ent, int64_t sign) {
+    if (ent->type != T_STR || ent->enc != ENC_LZ4 || entry_spilled(ent)) {
+        return;
+    }
+    const std::string &stored = entry_str(ent);
+    g_data.comp_values += sign;
+    g_data.comp_raw_bytes += sign * (int64_t)lz4_raw_len(stored);
+    g_data.comp_bytes += sign * (int64_t)stored.size();
+}
+
+// replace `val` with its compressed form if that saves at least 1/8
+static bool str_compress(std::string &val) {
+    if (!g_conf.compress_min_size || val.size() < g_conf.compress_min_size
+        || val.size() < k_compress_min_size || val.size() > UINT32_MAX)
+    {
+        return false;
+    }
+    static std::vector<uint8_t> scratch;
+    size_t cap = val.size() - val.size() / 8 - 4;
+    scratch.resize(4 + cap);
+    size_t n = lz4_compress(
+        (const uint8_t *)val.data(), val.size(), scratch.data() + 4, cap);
+    if (n == 0) {
+        return false;
+    }
+    uint32_t raw_len = (uint32_t)val.size();
+    memcpy(scratch.data(), &raw_len, 4);
+    std::string((const char *)scratch.data(), 4 + n).swap(val);
+    return true;
+}
 
-static void do_set(std::vector<std::string> &cmd, std::string &out ){
+static size_t int2str(int64_t val, char *buf) {
+    return (size_t)snprintf(buf, 24, "%lld", (long long)val);
+}
 
-    Entry key;
-    key.key.swap(cmd[1]);   
-    key.node.hcode = str_hash((uint8_t*)key.key.data(),key.key.size());
+// only strings that format back the same are stored as integers
+static bool str2int_canon(const std::string &s, int64_t &out) {
+    if (s.empty() || s.size() > 20 || !(isdigit(s[0]) || s[0] == '-')) {
+        return false;
+    }
+    char *endp = NULL;
+    errno = 0;
+    out = strtoll(s.c_str(), &endp, 10);
+    if (errno || endp != s.c_str() + s.size()) {
+        return false;
+    }
+    char buf[24];
+    return int2str(out, buf) == s.size() && 0 == memcmp(buf, s.data(), s.size());
+}
 
-    HNode *node = hm_lookup(&g_data.db,&key.node,entry_eq);
+// a string value changes: read threads that see `seq` odd or changed
+// while they copy it try again, see reader_get()
+static void entry_write_begin(Entry *ent) {
+    __atomic_store_n(&ent->seq, ent->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
 
-    if (node) {
-        Entry *ent = container_of(node, Entry, node);
+static void entry_write_end(Entry *ent) {
+    __atomic_store_n(&ent->seq, ent->seq + 1, __ATOMIC_RELEASE);
+}
+
+static void rcstr_unref_cb(void *arg) {
+    rcstr_unref((RcStr *)arg);
+}
+
+// a read thread may still be copying from it
+static void blob_release(RcStr *blob) {
+    if (g_data.readers.on) {
+        ebr_retire(&g_data.readers.ebr, &rcstr_unref_cb, blob);
+    } else {
+        rcstr_unref(blob);
+    }
+}
+
+static void entry_clear_str(Entry *ent) {
+    if (entry_spilled(ent)) {
+        vlog_drop(ent);
+    }
+    comp_stats_update(ent, -1);
+    if (ent->blob) {
+        blob_release(ent->blob);
+        ent->blob = NULL;
+    }
+    ent->vloc = 0;  // or the integer
+}
+
+static void entry_set_int(Entry *ent, int64_t val) {
+    entry_write_begin(ent);
+    entry_clear_str(ent);
+    std::string().swap(ent->value);
+    ent->enc = ENC_INT;
+    ent->ival = val;
+    entry_write_end(ent);
+}
+
+// take over the stored bytes, big ones go in a shared blob. with read
+// threads every value does, as they never look at `value`.
+static void entry_put_str(Entry *ent, std::string &val) {
+    if (val.size() >= k_str_ref_min || (g_data.readers.on && !val.empty())) {
+        std::string().swap(ent->value);
+        ent->blob = rcstr_new();
+        ent->blob->data.swap(val);
+    } else {
+        ent->value.swap(val);
+    }
+}
+
+// take over `val` as the string value of the entry
+static void entry_set_str(Entry *ent, std::string &val) {
+    int64_t ival = 0;
+    if (str2int_canon(val, ival)) {
+        return entry_set_int(ent, ival);
+    }
+    uint16_t enc = str_compress(val) ? ENC_LZ4 : ENC_RAW;
+    entry_write_begin(ent);
+    entry_clear_str(ent);
+    ent->enc = enc;
+    entry_put_str(ent, val);
+    comp_stats_update(ent, +1);
+    entry_write_end(ent);
+}
+
+// the length of a string value before compression
+static uint32_t entry_str_len(Entry *ent) {
+    if (ent->enc == ENC_INT) {
+        char buf[24];
+        return (uint32_t)int2str(ent->ival, buf);
+    }
+    if (ent->enc == ENC_RAW && entry_spilled(ent)) {
+        return vloc_len(ent->vloc);
+    }
+    const std::string &stored = entry_str(ent);
+    return ent->enc == ENC_LZ4 ? lz4_raw_len(stored) : (uint32_t)stored.size();
+}
+
+// append the original bytes of a string value. compressed values are
+// decompressed straight into the output, shared ones are referenced.
+static void out_entry_val(Buffer &out, Entry *ent) {
+    const std::string &stored = entry_str(ent);
+    if (ent->enc == ENC_INT) {
+        char buf[24];
+        buf_append(&out, buf, int2str(ent->ival, buf));
+    } else if (ent->enc == ENC_LZ4) {
+        uint32_t val_len = lz4_raw_len(stored);
+        uint8_t *dst = buf_reserve(&out, val_len);
+        bool ok = lz4_decompress(
+            (const uint8_t *)stored.data() + 4, stored.size() - 4, dst, val_len);
+        assert(ok);
+        (void)ok;
+        out.tail += val_len;
+    } else if (ent->blob && stored.size() >= k_str_ref_min) {
+        buf_append_ref(&out, ent->blob);
+    } else {
+        buf_append(&out, stored.data(), stored.size());
+    }
+}
+
+static void out_entry_kv(Buffer &out, Entry *ent, bool raw = false) {
+    if (raw && ent->enc == ENC_LZ4) {
+        const std::string &stored = entry_str(ent);
+        return out_kv(out, ent->key, stored, stored.size() >= k_str_ref_min ? ent->blob : NULL);
+    }
+    uint32_t val_len = entry_str_len(ent);
+    buf_append_u8(&out, SER_KV);
+    uint32_t total_len = ent->key.size() + val_len + 2 * sizeof(uint32_t);
+    buf_append(&out, &total_len, 4);
+    uint32_t key_len = (uint32_t)ent->key.size();
+    buf_append(&out, &key_len, 4);
+    buf_append(&out, ent->key.data(), key_len);
+    buf_append(&out, &val_len, 4);
+    out_entry_val(out, ent);
+}
+
+// get key [raw]: `raw` returns the value as stored, see ENC_LZ4
+static void do_get(std::vector<std::string> &cmd, Buffer &out){
+    bool raw = false;
+    if (cmd.size() == 3) {
+        if (!cmd_is(cmd[2], "raw")) {
+            return out_err(out, ERR_ARG, "expect raw");
+        }
+        raw = true;
+    }
+    Entry *ent = db_lookup(cmd[1]);
+    if (!ent) {
+        return out_nil(out);
+    }
+    if (ent->type != T_STR) {
+        return out_err(out, ERR_TYPE, "expect string type");
+    }
+    return out_entry_kv(out, ent, raw);
+} 
+
+static void do_set(std::vector<std::string> &cmd, Buffer &out){
+    Entry *ent = db_lookup(cmd[1]);
+    if (ent) {
         if (ent->type != T_STR) {
             return out_err(out, ERR_TYPE, "expect string type");
         }
-        ent->value.swap(cmd[2]);
+        g_data.used_mem -= entry_mem(ent);
+        entry_set_str(ent, cmd[2]);
+        g_data.used_mem += entry_mem(ent);
     } else{
-        Entry *ent = new Entry();
-        ent->key = key.key;
-        ent->node.hcode = key.node.hcode;
-        ent->value.swap(cmd[2]);
-        hm_insert(&g_data.db,&ent->node);
+        ent = new Entry();
+        ent->key.swap(cmd[1]);
+        entry_set_str(ent, cmd[2]);
+        db_insert(ent);
     } 
     return out_nil(out);
 } 
@@ -348,42 +1498,156 @@ static bool str2int(const std::string &s, int64_t &out) {
     out = strtoll(s.c_str(), &endp, 10);
     return endp == s.c_str() + s.size();
 }
-// zadd zset score name
-static void do_zadd(std::vector<std::string> &cmd,std::string &out){
 
-    double score = 0;
+// store a new integer value, creating the key if needed
+static void db_set_int(std::string &key, Entry *ent, int64_t val) {
+    if (ent) {
+        g_data.used_mem -= entry_mem(ent);
+        entry_set_int(ent, val);
+        g_data.used_mem += entry_mem(ent);
+    } else {
+        ent = new Entry();
+        ent->key.swap(key);
+        entry_set_int(ent, val);
+        db_insert(ent);
+    }
+}
 
-    if (!str2dbl(cmd[2],score)){
-        out_err(out,ERR_ARG,"expect fp number");
-    } 
-    // look up or create the zset
-    Entry key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+// incr key | incrby key n | decrby key n
+static void do_incr(std::vector<std::string> &cmd, Buffer &out) {
+    int64_t delta = 1;
+    if (cmd.size() == 3 && !str2int_canon(cmd[2], delta)) {
+        return out_err(out, ERR_ARG, "expect int64");
+    }
+    if (cmd_is(cmd[0], "decrby")) {
+        if (delta == INT64_MIN) {
+            return out_err(out, ERR_ARG, "decrement would overflow");
+        }
+        delta = -delta;
+    }
 
-    HNode* hnode = hm_lookup(&g_data.db,&key.node,&entry_eq); 
-    Entry *ent = NULL;
+    Entry *ent = db_lookup(cmd[1]);
+    int64_t val = 0;
+    if (ent) {
+        if (ent->type != T_STR) {
+            return out_err(out, ERR_TYPE, "expect string type");
+        }
+        if (ent->enc != ENC_INT) {
+            return out_err(out, ERR_ARG, "value is not an integer");
+        }
+        val = ent->ival;
+    }
+    if (__builtin_add_overflow(val, delta, &val)) {
+        return out_err(out, ERR_ARG, "increment or decrement would overflow");
+    }
+    db_set_int(cmd[1], ent, val);
+    return out_int(out, val);
+}
+
+// incrbyfloat key incr, the result is stored as text
+static void do_incrbyfloat(std::vector<std::string> &cmd, Buffer &out) {
+    double incr = 0;
+    if (!str2dbl(cmd[2], incr)) {
+        return out_err(out, ERR_ARG, "expect fp number");
+    }
+
+    Entry *ent = db_lookup(cmd[1]);
+    double val = 0;
+    if (ent) {
+        if (ent->type != T_STR) {
+            return out_err(out, ERR_TYPE, "expect string type");
+        }
+        if (ent->enc == ENC_INT) {
+            val = (double)ent->ival;
+        } else if (ent->enc != ENC_RAW || !str2dbl(entry_str(ent), val)) {
+            return out_err(out, ERR_ARG, "value is not a valid float");
+        }
+    }
+    val += incr;
+    if (isnan(val) || isinf(val)) {
+        return out_err(out, ERR_ARG, "increment would produce NaN or Infinity");
+    }
+
+    // the shortest text that reads back as the same double
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.15g", val);
+    if (strtod(buf, NULL) != val) {
+        snprintf(buf, sizeof(buf), "%.17g", val);
+    }
+    std::string text = buf;
+    if (ent) {
+        g_data.used_mem -= entry_mem(ent);
+        entry_set_str(ent, text);
+        g_data.used_mem += entry_mem(ent);
+    } else {
+        ent = new Entry();
+        ent->key.swap(cmd[1]);
+        entry_set_str(ent, text);
+        db_insert(ent);
+    }
+    return out_dbl(out, val);
+}
 
-    if (!hnode){ // if not insert key in hastable
+// look up or create the zset, NULL if the key holds another type
+static Entry *zset_get_or_create(std::string &key) {
+    Entry *ent = db_lookup(key);
+    if (!ent){ // if not insert key in hastable
         ent = new Entry();
-        ent->key.swap(key.key);
-        ent->node.hcode =key.node.hcode;
+        ent->key.swap(key);
         ent->type = T_ZSET; // setting to avl tree
         ent->zset = new ZSet(); // intiate a avl tree 
-        hm_insert(&g_data.db,&ent->node);
-    } else{
-        ent = container_of(hnode, Entry, node);
-        if (ent->type != T_ZSET) {
-            return out_err(out, ERR_TYPE, "expect zset");
-        }
+        db_insert(ent);
+    }
+    return ent->type == T_ZSET ? ent : NULL;
+}
+
+// zadd zset score name
+static void do_zadd(std::vector<std::string> &cmd,Buffer &out){
+
+    double score = 0;
+
+    if (!str2dbl(cmd[2],score)){
+        return out_err(out,ERR_ARG,"expect fp number");
+    } 
+    Entry *ent = zset_get_or_create(cmd[1]);
+    if (!ent) {
+        return out_err(out, ERR_TYPE, "expect zset");
     }
     
     const std::string &name = cmd[3];
+    g_data.used_mem -= entry_mem(ent);
     bool added = zset_add(ent->zset, name.data(), name.size(), score);
+    g_data.used_mem += entry_mem(ent);
+    block_signal(ent->key);
     return out_int(out, (int64_t)added);
 }
 
 
+// zincrby zset increment name, a missing member starts from 0
+static void do_zincrby(std::vector<std::string> &cmd, Buffer &out) {
+    double incr = 0;
+    if (!str2dbl(cmd[2], incr)) {
+        return out_err(out, ERR_ARG, "expect fp number");
+    }
+    Entry *ent = zset_get_or_create(cmd[1]);
+    if (!ent) {
+        return out_err(out, ERR_TYPE, "expect zset");
+    }
+
+    const std::string &name = cmd[3];
+    double score = 0;
+    zset_score(ent->zset, name.data(), name.size(), &score);
+    score += incr;
+    if (isnan(score)) {
+        return out_err(out, ERR_ARG, "resulting score is not a number");
+    }
+    g_data.used_mem -= entry_mem(ent);
+    zset_add(ent->zset, name.data(), name.size(), score);
+    g_data.used_mem += entry_mem(ent);
+    block_signal(ent->key);
+    return out_dbl(out, score);
+}
+
 static void entry_set_ttl(Entry* ent,int64_t ttl_ms){
 
     if (ttl_ms < 0 && ent->heap_idx != (size_t)-1){
@@ -411,275 +1675,3038 @@ static void entry_set_ttl(Entry* ent,int64_t ttl_ms){
 
 } 
 
-static void entry_del(Entry *ent) {
+// free the memory of an entry that is no longer reachable
+static void entry_destroy(Entry *ent) {
     switch (ent->type) {
     case T_ZSET:
         zset_dispose(ent->zset);
         delete ent->zset;
         break;
+    case T_HASH:
+        hash_dispose(ent->hash);
+        delete ent->hash;
+        break;
+    case T_HLL:
+        delete ent->hll;
+        break;
+    case T_BLOOM:
+        bloom_free(ent->bloom);
+        delete ent->bloom;
+        break;
+    }
+    if (ent->blob) {
+        rcstr_unref(ent->blob);
     }
-    entry_set_ttl(ent, -1);
     delete ent;
 }
 
-static void do_del(std::vector<std::string> &cmd, std::string &out) {
-    Entry key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+static void entry_destroy_func(void *arg) {
+    entry_destroy((Entry *)arg);
+    g_data.lazyfree_pending--;
+    g_data.lazyfree_done++;
+}
 
-    HNode *node = hm_pop(&g_data.db, &key.node, &entry_eq);
-    if (node) {
-        entry_del(container_of(node, Entry, node));
+// roughly the number of allocations to free
+static size_t entry_free_cost(Entry *ent) {
+    if (ent->type == T_ZSET && !ent->zset->compact) {
+        return zset_len(ent->zset);
     }
-    return out_int(out, node ? 1 : 0);
+    if (ent->type == T_HASH && !ent->hash->compact) {
+        return hash_len(ent->hash);
+    }
+    return 1;
 }
 
+// large values are handed to the background thread so the event loop is
+// not stalled
+static void entry_free(void *arg) {
+    Entry *ent = (Entry *)arg;
+    if (g_conf.lazyfree_threshold && entry_free_cost(ent) > g_conf.lazyfree_threshold) {
+        g_data.lazyfree_pending++;
+        thread_pool_queue(&g_data.thread_pool, &entry_destroy_func, ent);
+    } else {
+        entry_destroy(ent);
+    }
+}
 
-// pexpire name-1 1000ms-2
-static void do_expire(std::vector<std::string> &cmd, std::string &out){
-    int64_t ttl_ms = 0;
-    if (!str2int(cmd[2], ttl_ms)) {
-        return out_err(out, ERR_ARG, "expect int64");
+// the entry must already be detached from the keyspace. read threads may
+// still be looking at it.
+static void entry_del(Entry *ent) {
+    g_data.used_mem -= entry_mem(ent);
+    comp_stats_update(ent, -1);
+    entry_set_ttl(ent, -1);
+    if (entry_spilled(ent)) {
+        vlog_drop(ent);
     }
 
-    Entry key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t*)key.key.data(),key.key.size());
-    HNode* node = hm_lookup(&g_data.db,&key.node,&entry_eq);
-    if (node){
-        Entry *ent = container_of(node,Entry,node);
-        entry_set_ttl(ent, ttl_ms);
+    if (g_data.readers.on) {
+        ebr_retire(&g_data.readers.ebr, &entry_free, ent);
+    } else {
+        entry_free(ent);
     }
-    return out_int(out, node ? 1: 0); 
-}  
+}
 
-// get the time avialable before expiration
-static void do_ttl(std::vector<std::string> &cmd, std::string &out){
-    Entry key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t*)key.key.data(),key.key.size());
-    HNode* node = hm_lookup(&g_data.db,&key.node,&entry_eq);
-    if (!node) {
-        return out_int(out, -2); //If the key does not exist, send t -2.
+// remove an entry from the keyspace and free it
+static void db_delete(Entry *ent) {
+    HNode *node = hm_pop(&g_data.db, &ent->node, &hnode_same);
+    assert(node == &ent->node);
+    (void)node;
+    if (g_conf.key_index) {
+        bt_delete(&g_data.index, ent->key);
     }
+    entry_del(ent);
+}
 
-    Entry *ent = container_of(node, Entry, node); //If the key exist and ttl does not exist -1.
-    if (ent->heap_idx == (size_t)-1) {
-        return out_int(out, -1);
+static void do_del(std::vector<std::string> &cmd, Buffer &out) {
+    Entry *ent = db_lookup(cmd[1]);
+    if (ent) {
+        db_delete(ent);
     }
-    size_t pos = ent->heap_idx;
-    uint64_t expire_at = g_data.heap[pos].val;
-    uint64_t now_us = get_monotonic_usec();
-    return  out_int(out, expire_at > now_us ? (expire_at - now_us) / 1000 : 0); // delta of time exist in  milliseconds.
-} 
+    return out_int(out, ent ? 1 : 0);
+}
 
+// the original bytes of a string value, expanded into `scratch` when it is
+// compressed or an integer
+static const std::string &entry_str_view(Entry *ent, std::string &scratch) {
+    if (ent->enc == ENC_RAW) {
+        return entry_str(ent);
+    }
+    if (ent->enc == ENC_INT) {
+        char buf[24];
+        scratch.assign(buf, int2str(ent->ival, buf));
+        return scratch;
+    }
+    const std::string &stored = entry_str(ent);
+    scratch.resize(lz4_raw_len(stored));
+    bool ok = lz4_decompress((const uint8_t *)stored.data() + 4, stored.size() - 4,
+                             (uint8_t *)&scratch[0], scratch.size());
+    assert(ok);
+    (void)ok;
+    return scratch;
+}
 
-static bool expect_zset(std::string &out, std::string &s, Entry **ent) {
-    Entry key;
-    key.key.swap(s);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-    HNode *hnode = hm_lookup(&g_data.db, &key.node, &entry_eq);
-    if (!hnode) {
-        out_nil(out);
-        return false;
+// the string value as raw bytes, zero padded to at least `size`, for
+// modifying in place between entry_write_begin() and entry_write_end().
+// it stays raw: a bitmap is neither recompressed nor turned into an integer
+// on every write. a value that an output buffer still references is copied
+// first, and so is one that has to grow while read threads may be copying
+// from it.
+static std::string &entry_str_mut(Entry *ent, size_t size) {
+    if (ent->enc != ENC_RAW) {
+        std::string raw;
+        entry_str_view(ent, raw);
+        entry_clear_str(ent);
+        ent->enc = ENC_RAW;
+        entry_put_str(ent, raw);
+    } else if (ent->blob && (ent->blob->refs.load() > 1
+        || (g_data.readers.on && ent->blob->data.capacity() < size)))
+    {
+        RcStr *copy = rcstr_new();
+        copy->data.reserve(std::max(size, ent->blob->data.size()));
+        copy->data.append(ent->blob->data);
+        blob_release(ent->blob);
+        ent->blob = copy;
+    }
+    std::string &val = entry_str_raw(ent);
+    if (val.size() < size) {
+        val.resize(size, '\0');
     }
+    if (!ent->blob && (val.size() >= k_str_ref_min || g_data.readers.on)) {
+        std::string grown;
+        grown.swap(val);
+        entry_put_str(ent, grown);
+    }
+    return entry_str_raw(ent);
+}
 
-    *ent = container_of(hnode, Entry, node);
-    if ((*ent)->type != T_ZSET) {
-        out_err(out, ERR_TYPE, "expect zset");
+// NULL for a missing key, `*ok` is false if the key holds another type
+static Entry *bitmap_lookup(Buffer &out, std::string &key, bool *ok) {
+    Entry *ent = db_lookup(key);
+    *ok = !ent || ent->type == T_STR;
+    if (!*ok) {
+        out_err(out, ERR_TYPE, "expect string type");
+    }
+    return *ok ? ent : NULL;
+}
+
+static bool str2bit_offset(const std::string &s, uint64_t &out) {
+    int64_t off = 0;
+    if (!str2int(s, off) || off < 0 || (uint64_t)off / 8 >= k_max_value) {
         return false;
     }
+    out = (uint64_t)off;
     return true;
 }
 
-static void do_zrem(std::vector<std::string> &cmd, std::string &out) {
-    Entry *ent = NULL;
-    if (!expect_zset(out, cmd[1], &ent)) {
+// setbit key offset 0|1, replies with the old bit
+static void do_setbit(std::vector<std::string> &cmd, Buffer &out) {
+    uint64_t off = 0;
+    if (!str2bit_offset(cmd[2], off)) {
+        return out_err(out, ERR_ARG, "bit offset is not an integer or out of range");
+    }
+    if (cmd[3] != "0" && cmd[3] != "1") {
+        return out_err(out, ERR_ARG, "bit is not 0 or 1");
+    }
+    bool ok = false;
+    Entry *ent = bitmap_lookup(out, cmd[1], &ok);
+    if (!ok) {
         return;
     }
-
-    const std::string &name = cmd[2];
-    ZNode *znode = zset_pop(ent->zset, name.data(), name.size());
-    if (znode) {
-        znode_del(znode);
+    if (!ent) {
+        ent = new Entry();
+        ent->key.swap(cmd[1]);
+        db_insert(ent);
     }
-    return out_int(out, znode ? 1 : 0);
+    entry_str(ent);     // in memory before the change starts
+    g_data.used_mem -= entry_mem(ent);
+    entry_write_begin(ent);
+    std::string &val = entry_str_mut(ent, off / 8 + 1);
+    uint8_t mask = (uint8_t)(0x80 >> (off % 8));
+    uint8_t &byte = (uint8_t &)val[off / 8];
+    bool old = byte & mask;
+    byte = cmd[3] == "1" ? (byte | mask) : (byte & ~mask);
+    entry_write_end(ent);
+    g_data.used_mem += entry_mem(ent);
+    return out_int(out, old);
 }
 
-static void do_zscore(std::vector<std::string> &cmd, std::string &out) {
-    Entry *ent = NULL;
-    if (!expect_zset(out, cmd[1], &ent)) {
+// getbit key offset, 0 past the end
+static void do_getbit(std::vector<std::string> &cmd, Buffer &out) {
+    uint64_t off = 0;
+    if (!str2bit_offset(cmd[2], off)) {
+        return out_err(out, ERR_ARG, "bit offset is not an integer or out of range");
+    }
+    bool ok = false;
+    Entry *ent = bitmap_lookup(out, cmd[1], &ok);
+    if (!ok) {
         return;
     }
+    std::string scratch;
+    const std::string &val = ent ? entry_str_view(ent, scratch) : scratch;
+    bool bit = off / 8 < val.size() && ((uint8_t)val[off / 8] & (0x80 >> (off % 8)));
+    return out_int(out, bit);
+}
 
-    const std::string &name = cmd[2];
-    ZNode *znode = zset_lookup(ent->zset, name.data(), name.size());
-    return znode ? out_dbl(out, znode->score) : out_nil(out); // send double value in score
+// [start, end] byte indexes, negative ones count from the end, into [*begin, *end)
+static bool str2byte_range(const std::string &s0, const std::string &s1, size_t len,
+                           size_t *begin, size_t *end)
+{
+    int64_t start = 0, stop = 0;
+    if (!str2int(s0, start) || !str2int(s1, stop)) {
+        return false;
+    }
+    int64_t n = (int64_t)len;
+    start = start < 0 ? std::max<int64_t>(0, n + start) : std::min(start, n);
+    stop = stop < 0 ? n + stop : std::min(stop, n - 1);
+    *begin = (size_t)start;
+    *end = stop >= start ? (size_t)stop + 1 : (size_t)start;
+    return true;
 }
 
+// bitcount key [start end], set bits in a byte range
+static void do_bitcount(std::vector<std::string> &cmd, Buffer &out) {
+    bool ok = false;
+    Entry *ent = bitmap_lookup(out, cmd[1], &ok);
+    if (!ok) {
+        return;
+    }
+    std::string scratch;
+    const std::string &val = ent ? entry_str_view(ent, scratch) : scratch;
+    size_t begin = 0, end = val.size();
+    if (cmd.size() == 4 && !str2byte_range(cmd[2], cmd[3], val.size(), &begin, &end)) {
+        return out_err(out, ERR_ARG, "expect int64");
+    }
+    return out_int(out, (int64_t)bit_count((const uint8_t *)val.data() + begin, end - begin));
+}
 
-// zquery zset score name offset limit
-static void do_zquery(std::vector<std::string> &cmd, std::string &out) {
-    // parse args
-    double score = 0;
-    if (!str2dbl(cmd[2], score)) {
-        return out_err(out, ERR_ARG, "expect fp number");
+// bitpos key 0|1 [start [end]], the first such bit in a byte range, or -1.
+// a clear bit is found past the end of the value when no end is given.
+static void do_bitpos(std::vector<std::string> &cmd, Buffer &out) {
+    if (cmd[2] != "0" && cmd[2] != "1") {
+        return out_err(out, ERR_ARG, "bit is not 0 or 1");
     }
-    const std::string &name = cmd[3];
-    int64_t offset = 0;
-    int64_t limit = 0;
-    if (!str2int(cmd[4], offset)) {
-        return out_err(out, ERR_ARG, "expect int");
+    bool bit = cmd[2] == "1";
+    bool ok = false;
+    Entry *ent = bitmap_lookup(out, cmd[1], &ok);
+    if (!ok) {
+        return;
     }
-    if (!str2int(cmd[5], limit)) {
-        return out_err(out, ERR_ARG, "expect int");
+    std::string scratch;
+    const std::string &val = ent ? entry_str_view(ent, scratch) : scratch;
+    if (val.empty()) {
+        return out_int(out, bit ? -1 : 0);
+    }
+    size_t begin = 0, end = val.size();
+    std::string stop = cmd.size() == 5 ? cmd[4] : "-1";
+    if (cmd.size() >= 4 && !str2byte_range(cmd[3], stop, val.size(), &begin, &end)) {
+        return out_err(out, ERR_ARG, "expect int64");
+    }
+    if (begin >= end) {
+        return out_int(out, -1);
     }
+    int64_t pos = bit_pos((const uint8_t *)val.data() + begin, end - begin, bit);
+    if (pos >= 0) {
+        return out_int(out, pos + (int64_t)begin * 8);
+    }
+    if (!bit && cmd.size() < 5) {
+        return out_int(out, (int64_t)end * 8);
+    }
+    return out_int(out, -1);
+}
 
-    // get the zset
-    Entry *ent = NULL;
-    if (!expect_zset(out, cmd[1], &ent)) {
-        if (out[0] == SER_NIL) {
-            out.clear();
-            out_arr(out, 0);
+// bitop and|or|xor|not dest key..., stores the result and replies with its
+// length. shorter inputs count as zero padded, an empty result deletes dest.
+static void do_bitop(std::vector<std::string> &cmd, Buffer &out) {
+    bool is_not = cmd_is(cmd[1], "not");
+    uint32_t op = BITOP_AND;
+    if (cmd_is(cmd[1], "or")) {
+        op = BITOP_OR;
+    } else if (cmd_is(cmd[1], "xor")) {
+        op = BITOP_XOR;
+    } else if (!is_not && !cmd_is(cmd[1], "and")) {
+        return out_err(out, ERR_ARG, "expect and|or|xor|not");
+    }
+    if (is_not && cmd.size() != 4) {
+        return out_err(out, ERR_ARG, "bitop not takes one key");
+    }
+    std::vector<std::string> scratch(cmd.size() - 3);
+    std::vector<const std::string *> srcs;
+    size_t len = 0;
+    for (size_t i = 3; i < cmd.size(); ++i) {
+        bool ok = false;
+        Entry *ent = bitmap_lookup(out, cmd[i], &ok);
+        if (!ok) {
+            return;
         }
-        return;
+        std::string &tmp = scratch[i - 3];
+        srcs.push_back(ent ? &entry_str_view(ent, tmp) : &tmp);
+        len = std::max(len, srcs.back()->size());
     }
 
-    if (limit <= 0) {
-        return out_arr(out, 0);
+    std::string res(len, '\0');
+    memcpy(&res[0], srcs[0]->data(), srcs[0]->size());
+    if (is_not) {
+        bit_not((uint8_t *)&res[0], len);
     }
-    ZNode *znode = zset_query(ent->zset, score, name.data(), name.size());
-    znode = znode_offset(znode, offset);
-
-    // output
-    void *arr = begin_arr(out);
-    uint32_t n = 0;
-    while (znode && (int64_t)n < limit) {
-        out_str(out, znode->name, znode->len);
-        out_dbl(out, znode->score);
-        znode = znode_offset(znode, +1);
-        n += 2;
+    for (size_t i = 1; i < srcs.size(); ++i) {
+        const std::string &src = *srcs[i];
+        bit_op(op, (uint8_t *)&res[0], (const uint8_t *)src.data(), src.size());
+        if (op == BITOP_AND) {
+            memset(&res[src.size()], 0, len - src.size());
+        }
     }
-    end_arr(out, arr, n);
-}
 
-// find all the key's in the hashtables - linked lists
-static void h_scan(HTab *tab, void (*f)(HNode *, void *), void *arg) {
-    if (tab->size == 0) {
-        return;
+    if (Entry *old = db_lookup(cmd[2])) {
+        db_delete(old);
     }
-    for (size_t i = 0; i < tab->mask + 1; ++i) {
-        HNode *node = tab->tab[i];
-        while (node) {
-            f(node, arg);
-            node = node->next;
-        }
+    if (len) {
+        Entry *ent = new Entry();
+        ent->key.swap(cmd[2]);
+        entry_put_str(ent, res);
+        db_insert(ent);
     }
+    return out_int(out, (int64_t)len);
 }
 
-static void cb_scan(HNode *node, void *arg) {
-    std::string &out = *(std::string *)arg;
-    //out_str(out, container_of(node, Entry, node)->key);
-    Entry* ent = container_of(node, Entry, node);
-    out_kv(out,ent->key,ent->value);
+
+// a command in the request format, which is also the replication stream.
+// `len` is the size of the arguments with their length prefixes.
+static void req_begin(Buffer &out, uint32_t nargs, size_t len) {
+    uint32_t total = (uint32_t)(4 + len);
+    buf_append(&out, &total, 4);
+    buf_append(&out, &nargs, 4);
 }
 
-static void do_keys(std::vector<std::string> &cmd, std::string &out) {
-    (void)cmd;
-    out_arr(out, (uint32_t)hm_size(&g_data.db));
-    h_scan(&g_data.db.ht1, &cb_scan, &out);
-    h_scan(&g_data.db.ht2, &cb_scan, &out);
+static void req_arg(Buffer &out, const char *data, size_t n) {
+    uint32_t len = (uint32_t)n;
+    buf_append(&out, &len, 4);
+    buf_append(&out, data, n);
 }
 
-static void do_request(std::vector<std::string> &cmd, std::string &out) {
-    if (cmd.size() == 1 && cmd_is(cmd[0], "keys")) {
-        do_keys(cmd, out);
-    } else if (cmd.size() == 2 && cmd_is(cmd[0], "get")) {
+static void out_req(Buffer &out, const std::vector<std::string> &cmd) {
+    size_t len = 0;
+    for (const std::string &arg : cmd) {
+        len += 4 + arg.size();
+    }
+    req_begin(out, (uint32_t)cmd.size(), len);
+    for (const std::string &arg : cmd) {
+        req_arg(out, arg.data(), arg.size());
+    }
+}
+
+const uint64_t k_repl_ping_ms = 1000;       // keeps the links of idle replicas alive
+const uint64_t k_repl_timeout_ms = 10 * 1000;
+const uint64_t k_repl_retry_ms = 1000;
+
+// output held to the limits, a replica's initial sync is exempt
+static size_t conn_out_size(const Conn *conn) {
+    return buf_size(&conn->wbuf) - conn->out_exempt;
+}
+
+// closes a connection whose reader can't keep up
+static bool conn_check_hard_limit(Conn *conn) {
+    if (!g_conf.output_hard_limit || conn_out_size(conn) <= g_conf.output_hard_limit) {
+        return true;
+    }
+    msg("output over the hard limit, closing");
+    g_data.stat_output_closed++;
+    conn->state = STATE_END;
+    return false;
+}
+
+// whether a connection may run one more request now. past the soft output
+// limit it waits for the output to drain, past its budget it waits for the
+// next event loop iteration.
+static bool conn_take_budget(Conn *conn) {
+    if (g_conf.output_soft_limit && conn_out_size(conn) > g_conf.output_soft_limit) {
+        return false;
+    }
+    if (conn->budget_iter != g_data.loop_iter) {
+        conn->budget_iter = g_data.loop_iter;
+        conn->budget = g_conf.conn_request_budget;
+    }
+    if (!g_conf.conn_request_budget) {
+        return true;
+    }
+    if (conn->budget == 0) {
+        if (!conn->deferred) {
+            conn->deferred = true;
+            g_data.deferred.push_back(conn->fd);
+        }
+        return false;
+    }
+    conn->budget--;
+    return true;
+}
+
+// append a serialized command to the backlog and the replicas' output
+static void repl_send(const uint8_t *data, size_t n) {
+    Repl &r = g_data.repl;
+    backlog_append(&r.backlog, data, n);
+    r.offset += n;
+    for (Conn *conn : r.replicas) {
+        if (conn->state != STATE_END) {
+            buf_append(&conn->wbuf, data, n);   // flushed by repl_cron()
+            conn_check_hard_limit(conn);
+        }
+    }
+}
+
+// send the effect of a write to the replicas right away
+static void repl_feed(const std::vector<std::string> &cmd) {
+    Repl &r = g_data.repl;
+    if (!r.backlog.data) {
+        return;     // no replica has ever connected
+    }
+    Buffer &msg = r.scratch;
+    out_req(msg, cmd);
+    repl_send(&msg.data[msg.head], msg.tail - msg.head);
+    buf_consume(&msg, msg.tail - msg.head);
+}
+
+// a client's write is serialized before it runs, because the command
+// handlers take over their arguments, and sent after it succeeded. the
+// effects it feeds meanwhile go first.
+static void repl_stage(const std::vector<std::string> &cmd) {
+    if (g_data.repl.backlog.data) {
+        out_req(g_data.repl.pending, cmd);
+    }
+}
+
+static void repl_commit(bool ok) {
+    Buffer &msg = g_data.repl.pending;
+    size_t n = msg.tail - msg.head;
+    if (ok && n) {
+        repl_send(&msg.data[msg.head], n);
+    }
+    buf_consume(&msg, n);
+}
+
+// keys removed by expiration or eviction are deleted on the replicas too
+static void repl_feed_del(const std::string &key) {
+    if (g_data.repl.backlog.data) {
+        repl_feed({"del", key});
+    }
+}
+
+// higher means a better candidate for eviction
+static uint64_t evict_score(Entry *ent) {
+    switch (g_conf.maxmemory_policy) {
+    case EVICT_ALLKEYS_LFU:
+    case EVICT_VOLATILE_LFU:
+        return 255 - lfu_decayed(ent);
+    case EVICT_VOLATILE_TTL:
+        return UINT64_MAX - g_data.heap[ent->heap_idx].val;
+    default:
+        return lru_idle(ent);
+    }
+}
+
+// sample some keys and return the best one to evict
+static Entry *evict_pick() {
+    bool volatile_only = g_conf.maxmemory_policy == EVICT_VOLATILE_LRU
+        || g_conf.maxmemory_policy == EVICT_VOLATILE_LFU
+        || g_conf.maxmemory_policy == EVICT_VOLATILE_TTL;
+
+    Entry *best = NULL;
+    uint64_t best_score = 0;
+    for (uint32_t i = 0; i < g_conf.maxmemory_samples; ++i) {
+        Entry *ent = NULL;
+        if (volatile_only) {
+            // keys with a TTL are exactly the ones in the heap
+            if (g_data.heap.empty()) {
+                return NULL;
+            }
+            size_t pos = (size_t)rand() % g_data.heap.size();
+            ent = container_of(g_data.heap[pos].ref, Entry, heap_idx);
+        } else {
+            HNode *node = hm_random(&g_data.db);
+            if (!node) {
+                return NULL;
+            }
+            ent = container_of(node, Entry, node);
+        }
+        uint64_t score = evict_score(ent);
+        if (!best || score > best_score) {
+            best = ent;
+            best_score = score;
+        }
+    }
+    return best;
+}
+
+const size_t k_evict_work = 64;
+
+// evict until under the limit, but at most `k_evict_work` keys per call so
+// that a large overshoot is paid off over several event loop iterations.
+static size_t evict_step() {
+    size_t nevicted = 0;
+    if (g_conf.maxmemory_policy != EVICT_NOEVICTION) {
+        while (nevicted < k_evict_work && over_maxmemory()) {
+            Entry *ent = evict_pick();
+            if (!ent) {
+                break;
+            }
+            tracking_modified(ent->key);
+            repl_feed_del(ent->key);
+            db_delete(ent);
+            nevicted++;
+        }
+    }
+    g_data.stat_evicted += nevicted;
+    g_data.evict_pending = nevicted == k_evict_work && over_maxmemory();
+    return nevicted;
+}
+
+// pexpire name-1 1000ms-2
+static void do_expire(std::vector<std::string> &cmd, Buffer &out){
+    int64_t ttl_ms = 0;
+    if (!str2int(cmd[2], ttl_ms)) {
+        return out_err(out, ERR_ARG, "expect int64");
+    }
+
+    Entry *ent = db_lookup(cmd[1]);
+    if (ent){
+        entry_set_ttl(ent, ttl_ms);
+    }
+    return out_int(out, ent ? 1: 0); 
+}  
+
+// get the time avialable before expiration
+static void do_ttl(std::vector<std::string> &cmd, Buffer &out){
+    Entry *ent = db_lookup(cmd[1]);
+    if (!ent) {
+        return out_int(out, -2); //If the key does not exist, send t -2.
+    }
+
+    //If the key exist and ttl does not exist -1.
+    if (ent->heap_idx == (size_t)-1) {
+        return out_int(out, -1);
+    }
+    size_t pos = ent->heap_idx;
+    uint64_t expire_at = g_data.heap[pos].val;
+    uint64_t now_us = get_monotonic_usec();
+    return  out_int(out, expire_at > now_us ? (expire_at - now_us) / 1000 : 0); // delta of time exist in  milliseconds.
+} 
+
+
+static bool expect_zset(Buffer &out, std::string &s, Entry **ent) {
+    *ent = db_lookup(s);
+    if (!*ent) {
+        out_nil(out);
+        return false;
+    }
+
+    if ((*ent)->type != T_ZSET) {
+        out_err(out, ERR_TYPE, "expect zset");
+        return false;
+    }
+    return true;
+}
+
+static void do_zrem(std::vector<std::string> &cmd, Buffer &out) {
+    Entry *ent = NULL;
+    if (!expect_zset(out, cmd[1], &ent)) {
+        return;
+    }
+
+    const std::string &name = cmd[2];
+    g_data.used_mem -= entry_mem(ent);
+    bool removed = zset_rem(ent->zset, name.data(), name.size());
+    g_data.used_mem += entry_mem(ent);
+    return out_int(out, removed ? 1 : 0);
+}
+
+static void do_zscore(std::vector<std::string> &cmd, Buffer &out) {
+    Entry *ent = NULL;
+    if (!expect_zset(out, cmd[1], &ent)) {
+        return;
+    }
+
+    const std::string &name = cmd[2];
+    double score = 0;
+    bool found = zset_score(ent->zset, name.data(), name.size(), &score);
+    return found ? out_dbl(out, score) : out_nil(out); // send double value in score
+}
+
+
+// zquery zset score name offset limit
+static void do_zquery(std::vector<std::string> &cmd, Buffer &out) {
+    // parse args
+    double score = 0;
+    if (!str2dbl(cmd[2], score)) {
+        return out_err(out, ERR_ARG, "expect fp number");
+    }
+    const std::string &name = cmd[3];
+    int64_t offset = 0;
+    int64_t limit = 0;
+    if (!str2int(cmd[4], offset)) {
+        return out_err(out, ERR_ARG, "expect int");
+    }
+    if (!str2int(cmd[5], limit)) {
+        return out_err(out, ERR_ARG, "expect int");
+    }
+
+    // get the zset, a missing key is an empty result
+    Entry *ent = db_lookup(cmd[1]);
+    if (!ent) {
+        return out_arr(out, 0);
+    }
+    if (ent->type != T_ZSET) {
+        return out_err(out, ERR_TYPE, "expect zset");
+    }
+
+    if (limit <= 0) {
+        return out_arr(out, 0);
+    }
+    ZIter it;
+    zset_seek(ent->zset, score, name.data(), name.size(), &it);
+    ziter_offset(&it, offset);
+
+    // output
+    void *arr = begin_arr(out);
+    uint32_t n = 0;
+    while (ziter_valid(&it) && (int64_t)n < limit) {
+        size_t len = 0;
+        const char *member = ziter_name(&it, &len);
+        out_str(out, member, len);
+        out_dbl(out, ziter_score(&it));
+        ziter_offset(&it, +1);
+        n += 2;
+    }
+    end_arr(out, arr, n);
+}
+
+// remove the lowest or highest member, output as name, score
+static void zset_pop_one(Entry *ent, bool max, Buffer &out) {
+    ZIter it;
+    zset_seek_rank(ent->zset, max ? -1 : 0, &it);
+    assert(ziter_valid(&it));
+    size_t len = 0;
+    const char *p = ziter_name(&it, &len);
+    std::string name(p, len);   // the record moves in the compact encoding
+    out_str(out, name);
+    out_dbl(out, ziter_score(&it));
+    g_data.used_mem -= entry_mem(ent);
+    zset_rem(ent->zset, name.data(), name.size());
+    g_data.used_mem += entry_mem(ent);
+}
+
+// zpopmin|zpopmax zset [count], the reply is laid out as in zquery
+static void do_zpop(std::vector<std::string> &cmd, Buffer &out) {
+    bool max = cmd_is(cmd[0], "zpopmax");
+    int64_t count = 1;
+    if (cmd.size() == 3 && (!str2int(cmd[2], count) || count < 0)) {
+        return out_err(out, ERR_ARG, "expect a count");
+    }
+    Entry *ent = db_lookup(cmd[1]);
+    if (!ent) {
+        return out_arr(out, 0);
+    }
+    if (ent->type != T_ZSET) {
+        return out_err(out, ERR_TYPE, "expect zset");
+    }
+    uint32_t n = (uint32_t)std::min((size_t)count, zset_len(ent->zset));
+    out_arr(out, n * 2);
+    for (uint32_t i = 0; i < n; ++i) {
+        zset_pop_one(ent, max, out);
+    }
+}
+
+enum {
+    AGG_SUM = 0,
+    AGG_MIN = 1,
+    AGG_MAX = 2,
+};
+
+// the inputs of zunionstore / zinterstore, shared read-only by the tasks
+struct ZMerge {
+    std::vector<ZSet *> srcs;   // NULL for a missing key
+    std::vector<double> weights;
+    uint32_t agg = AGG_SUM;
+    bool inter = false;
+};
+
+// a rank range of one input, and the members it contributes
+struct ZMergeTask {
+    const ZMerge *zm = NULL;
+    size_t src = 0;
+    int64_t begin = 0;
+    int64_t end = 0;
+    std::vector<ZMember> out;
+};
+
+static double zagg(uint32_t agg, double acc, double val) {
+    if (agg == AGG_MIN) {
+        return std::min(acc, val);
+    } else if (agg == AGG_MAX) {
+        return std::max(acc, val);
+    }
+    acc += val;
+    return isnan(acc) ? 0 : acc;    // inf + -inf
+}
+
+static double zweighted(const ZMerge &zm, size_t i, double score) {
+    score *= zm.weights[i];
+    return isnan(score) ? 0 : score;    // 0 * inf
+}
+
+// a union member is produced by the first input that has it, and an
+// intersection member by the smallest input. the other inputs are probed,
+// in key order so that sums round the same way wherever a member comes from.
+static void zmerge_task(void *arg) {
+    ZMergeTask &t = *(ZMergeTask *)arg;
+    const ZMerge &zm = *t.zm;
+    ZIter it;
+    zset_seek_rank(zm.srcs[t.src], t.begin, &it);
+    for (int64_t r = t.begin; r < t.end; ++r, ziter_offset(&it, 1)) {
+        ZMember m;
+        m.name = ziter_name(&it, &m.len);
+        double own = ziter_score(&it);
+        bool keep = true, first = true;
+        for (size_t i = 0; keep && i < zm.srcs.size(); ++i) {
+            double score = own;
+            bool found = i == t.src
+                || (zm.srcs[i] && zset_score(zm.srcs[i], m.name, m.len, &score));
+            if (!zm.inter && found && i < t.src) {
+                keep = false;   // produced by an earlier input
+            } else if (zm.inter && !found) {
+                keep = false;
+            } else if (found) {
+                score = zweighted(zm, i, score);
+                m.score = first ? score : zagg(zm.agg, m.score, score);
+                first = false;
+            }
+        }
+        if (keep) {
+            t.out.push_back(m);
+        }
+    }
+    std::sort(t.out.begin(), t.out.end(), &zmember_less);
+}
+
+// zunionstore|zinterstore dest n key... [weights w...] [aggregate sum|min|max]
+static void do_zmerge(std::vector<std::string> &cmd, Buffer &out) {
+    ZMerge zm;
+    zm.inter = cmd_is(cmd[0], "zinterstore");
+    int64_t n = 0;
+    if (!str2int(cmd[2], n) || n < 1 || (size_t)n > cmd.size() - 3) {
+        return out_err(out, ERR_ARG, "expect the number of keys");
+    }
+    for (int64_t i = 0; i < n; ++i) {
+        Entry *ent = db_lookup(cmd[3 + i]);
+        if (ent && ent->type != T_ZSET) {
+            return out_err(out, ERR_TYPE, "expect zset");
+        }
+        zm.srcs.push_back(ent ? ent->zset : NULL);
+    }
+    zm.weights.assign(n, 1);
+    for (size_t i = 3 + n; i < cmd.size(); ) {
+        if (cmd_is(cmd[i], "weights") && i + n < cmd.size()) {
+            for (int64_t j = 0; j < n; ++j) {
+                if (!str2dbl(cmd[i + 1 + j], zm.weights[j])) {
+                    return out_err(out, ERR_ARG, "expect fp number");
+                }
+            }
+            i += 1 + n;
+        } else if (cmd_is(cmd[i], "aggregate") && i + 1 < cmd.size()) {
+            const std::string &agg = cmd[i + 1];
+            if (cmd_is(agg, "sum")) {
+                zm.agg = AGG_SUM;
+            } else if (cmd_is(agg, "min")) {
+                zm.agg = AGG_MIN;
+            } else if (cmd_is(agg, "max")) {
+                zm.agg = AGG_MAX;
+            } else {
+                return out_err(out, ERR_ARG, "expect sum|min|max");
+            }
+            i += 2;
+        } else {
+            return out_err(out, ERR_ARG, "expect weights or aggregate");
+        }
+    }
+
+    // the inputs to iterate: all of them, or the smallest one
+    std::vector<size_t> iter;
+    for (size_t i = 0; i < zm.srcs.size(); ++i) {
+        if (!zm.inter) {
+            if (zm.srcs[i]) {
+                iter.push_back(i);
+            }
+        } else if (iter.empty() || !zm.srcs[i]
+            || (zm.srcs[iter[0]] && zset_len(zm.srcs[i]) < zset_len(zm.srcs[iter[0]])))
+        {
+            iter.assign(1, i);
+        }
+    }
+    if (zm.inter && !zm.srcs[iter[0]]) {
+        iter.clear();   // a missing key empties the intersection
+    }
+    size_t total = 0;
+    for (size_t i : iter) {
+        total += zset_len(zm.srcs[i]);
+    }
+
+    // split big inputs so the merge threads can share them
+    size_t chunk = total;
+    bool parallel = g_conf.zset_merge_threads && total >= g_conf.zset_merge_parallel_min;
+    if (parallel) {
+        chunk = std::max<size_t>(1024, total / (4 * (g_conf.zset_merge_threads + 1)));
+    }
+    std::vector<ZMergeTask> tasks;
+    for (size_t i : iter) {
+        int64_t len = (int64_t)zset_len(zm.srcs[i]);
+        for (int64_t begin = 0; begin < len; begin += (int64_t)chunk) {
+            ZMergeTask t;
+            t.zm = &zm;
+            t.src = i;
+            t.begin = begin;
+            t.end = std::min(len, begin + (int64_t)chunk);
+            tasks.push_back(std::move(t));
+        }
+    }
+    std::vector<void *> args;
+    for (ZMergeTask &t : tasks) {
+        args.push_back(&t);
+    }
+    if (parallel) {
+        thread_pool_run(&g_data.merge_pool, &zmerge_task, args.data(), args.size());
+    } else {
+        for (void *arg : args) {
+            zmerge_task(arg);
+        }
+    }
+
+    // merge the sorted runs pairwise
+    std::vector<ZMember> members;
+    std::vector<size_t> runs = {0};
+    for (ZMergeTask &t : tasks) {
+        members.insert(members.end(), t.out.begin(), t.out.end());
+        runs.push_back(members.size());
+    }
+    while (runs.size() > 2) {
+        std::vector<size_t> merged = {0};
+        for (size_t i = 0; i + 1 < runs.size(); i += 2) {
+            size_t mid = runs[i + 1];
+            size_t end = i + 2 < runs.size() ? runs[i + 2] : mid;
+            std::inplace_merge(members.begin() + runs[i], members.begin() + mid,
+                               members.begin() + end, &zmember_less);
+            merged.push_back(end);
+        }
+        runs.swap(merged);
+    }
+
+    // build the result before replacing dest, which may be an input
+    Entry *ent = new Entry();
+    ent->type = T_ZSET;
+    ent->zset = new ZSet();
+    zset_build(ent->zset, members.data(), members.size());
+    if (Entry *old = db_lookup(cmd[1])) {
+        db_delete(old);
+    }
+    if (members.empty()) {
+        entry_destroy(ent);
+    } else {
+        ent->key.swap(cmd[1]);
+        db_insert(ent);
+        block_signal(ent->key);
+    }
+    return out_int(out, (int64_t)members.size());
+}
+
+// look up or create the hash, NULL if the key holds another type
+static Entry *hash_get_or_create(std::string &key) {
+    Entry *ent = db_lookup(key);
+    if (!ent) {
+        ent = new Entry();
+        ent->key.swap(key);
+        ent->type = T_HASH;
+        ent->hash = new Hash();
+        db_insert(ent);
+    }
+    return ent->type == T_HASH ? ent : NULL;
+}
+
+// a missing key is not an error, `*ent` is NULL then
+static bool expect_hash(Buffer &out, std::string &key, Entry **ent) {
+    *ent = db_lookup(key);
+    if (*ent && (*ent)->type != T_HASH) {
+        out_err(out, ERR_TYPE, "expect hash");
+        return false;
+    }
+    return true;
+}
+
+static void out_hash_field(Buffer &out, Entry *ent, const std::string &field) {
+    const char *val = NULL;
+    size_t len = 0;
+    if (ent && hash_get(ent->hash, field.data(), field.size(), &val, &len)) {
+        out_str(out, val, len);
+    } else {
+        out_nil(out);
+    }
+}
+
+// hset key field value [field value]..., replies with the number of new fields
+static void do_hset(std::vector<std::string> &cmd, Buffer &out) {
+    if (cmd.size() % 2 != 0) {
+        return out_err(out, ERR_ARG, "expect field value pairs");
+    }
+    Entry *ent = hash_get_or_create(cmd[1]);
+    if (!ent) {
+        return out_err(out, ERR_TYPE, "expect hash");
+    }
+    int64_t added = 0;
+    g_data.used_mem -= entry_mem(ent);
+    for (size_t i = 2; i < cmd.size(); i += 2) {
+        const std::string &field = cmd[i], &val = cmd[i + 1];
+        added += hash_set(ent->hash, field.data(), field.size(), val.data(), val.size());
+    }
+    g_data.used_mem += entry_mem(ent);
+    return out_int(out, added);
+}
+
+static void do_hget(std::vector<std::string> &cmd, Buffer &out) {
+    Entry *ent = NULL;
+    if (expect_hash(out, cmd[1], &ent)) {
+        out_hash_field(out, ent, cmd[2]);
+    }
+}
+
+// hmget key field..., nil for each missing field
+static void do_hmget(std::vector<std::string> &cmd, Buffer &out) {
+    Entry *ent = NULL;
+    if (!expect_hash(out, cmd[1], &ent)) {
+        return;
+    }
+    out_arr(out, (uint32_t)(cmd.size() - 2));
+    for (size_t i = 2; i < cmd.size(); ++i) {
+        out_hash_field(out, ent, cmd[i]);
+    }
+}
+
+// hdel key field..., the key goes away with its last field
+static void do_hdel(std::vector<std::string> &cmd, Buffer &out) {
+    Entry *ent = NULL;
+    if (!expect_hash(out, cmd[1], &ent)) {
+        return;
+    }
+    int64_t removed = 0;
+    if (ent) {
+        g_data.used_mem -= entry_mem(ent);
+        for (size_t i = 2; i < cmd.size(); ++i) {
+            removed += hash_del(ent->hash, cmd[i].data(), cmd[i].size());
+        }
+        g_data.used_mem += entry_mem(ent);
+        if (hash_len(ent->hash) == 0) {
+            db_delete(ent);
+        }
+    }
+    return out_int(out, removed);
+}
+
+static void cb_hgetall(const char *field, size_t flen, const char *val, size_t vlen, void *arg) {
+    Buffer &out = *(Buffer *)arg;
+    out_str(out, field, flen);
+    out_str(out, val, vlen);
+}
+
+// hgetall key, replies with [field, value, ...]
+static void do_hgetall(std::vector<std::string> &cmd, Buffer &out) {
+    Entry *ent = NULL;
+    if (!expect_hash(out, cmd[1], &ent)) {
+        return;
+    }
+    if (!ent) {
+        return out_arr(out, 0);
+    }
+    out_arr(out, (uint32_t)(2 * hash_len(ent->hash)));
+    hash_foreach(ent->hash, &cb_hgetall, &out);
+}
+
+// hincrby key field n, a missing field starts from 0
+static void do_hincrby(std::vector<std::string> &cmd, Buffer &out) {
+    int64_t delta = 0;
+    if (!str2int_canon(cmd[3], delta)) {
+        return out_err(out, ERR_ARG, "expect int64");
+    }
+    Entry *ent = NULL;
+    if (!expect_hash(out, cmd[1], &ent)) {
+        return;
+    }
+    const std::string &field = cmd[2];
+    int64_t val = 0;
+    const char *cur = NULL;
+    size_t len = 0;
+    if (ent && hash_get(ent->hash, field.data(), field.size(), &cur, &len)
+        && !str2int_canon(std::string(cur, len), val))
+    {
+        return out_err(out, ERR_ARG, "hash value is not an integer");
+    }
+    if (__builtin_add_overflow(val, delta, &val)) {
+        return out_err(out, ERR_ARG, "increment or decrement would overflow");
+    }
+    if (!ent) {
+        ent = hash_get_or_create(cmd[1]);
+    }
+    std::string text = std::to_string(val);
+    g_data.used_mem -= entry_mem(ent);
+    hash_set(ent->hash, field.data(), field.size(), text.data(), text.size());
+    g_data.used_mem += entry_mem(ent);
+    return out_int(out, val);
+}
+
+// look up or create the HyperLogLog, NULL if the key holds another type
+static Entry *hll_get_or_create(std::string &key, bool *created) {
+    Entry *ent = db_lookup(key);
+    *created = !ent;
+    if (!ent) {
+        ent = new Entry();
+        ent->key.swap(key);
+        ent->type = T_HLL;
+        ent->hll = new Hll();
+        db_insert(ent);
+    }
+    return ent->type == T_HLL ? ent : NULL;
+}
+
+static uint64_t elem_hash(const std::string &elem) {
+    return str_hash64((const uint8_t *)elem.data(), elem.size());
+}
+
+// pfadd key [element]..., 1 if the count may have changed or the key is new
+static void do_pfadd(std::vector<std::string> &cmd, Buffer &out) {
+    bool changed = false;
+    Entry *ent = hll_get_or_create(cmd[1], &changed);
+    if (!ent) {
+        return out_err(out, ERR_TYPE, "expect hll");
+    }
+    g_data.used_mem -= entry_mem(ent);
+    for (size_t i = 2; i < cmd.size(); ++i) {
+        changed |= hll_add(ent->hll, elem_hash(cmd[i]));
+    }
+    g_data.used_mem += entry_mem(ent);
+    return out_int(out, changed);
+}
+
+// pfcount key..., the count of the union for several keys
+static void do_pfcount(std::vector<std::string> &cmd, Buffer &out) {
+    std::vector<Entry *> ents;
+    for (size_t i = 1; i < cmd.size(); ++i) {
+        Entry *ent = db_lookup(cmd[i]);
+        if (ent && ent->type != T_HLL) {
+            return out_err(out, ERR_TYPE, "expect hll");
+        }
+        if (ent) {
+            ents.push_back(ent);
+        }
+    }
+    if (ents.empty()) {
+        return out_int(out, 0);
+    }
+    if (ents.size() == 1) {
+        return out_int(out, (int64_t)hll_count(ents[0]->hll));
+    }
+    std::vector<uint8_t> regs(k_hll_regs, 0);
+    for (Entry *ent : ents) {
+        hll_merge_regs(regs.data(), ent->hll);
+    }
+    return out_int(out, (int64_t)hll_estimate_regs(regs.data()));
+}
+
+// pfmerge dest src..., the union of the sources into dest
+static void do_pfmerge(std::vector<std::string> &cmd, Buffer &out) {
+    std::vector<Entry *> srcs;
+    for (size_t i = 2; i < cmd.size(); ++i) {
+        Entry *ent = db_lookup(cmd[i]);
+        if (ent && ent->type != T_HLL) {
+            return out_err(out, ERR_TYPE, "expect hll");
+        }
+        if (ent) {
+            srcs.push_back(ent);
+        }
+    }
+    bool created = false;
+    Entry *dst = hll_get_or_create(cmd[1], &created);
+    if (!dst) {
+        return out_err(out, ERR_TYPE, "expect hll");
+    }
+    g_data.used_mem -= entry_mem(dst);
+    for (Entry *src : srcs) {
+        if (src != dst) {
+            hll_merge(dst->hll, src->hll);
+        }
+    }
+    g_data.used_mem += entry_mem(dst);
+    return out_nil(out);
+}
+
+const double k_bloom_default_error = 0.01;
+
+static Entry *bloom_create(std::string &key, uint64_t capacity, double error_rate) {
+    Entry *ent = new Entry();
+    ent->key.swap(key);
+    ent->type = T_BLOOM;
+    ent->bloom = new Bloom();
+    bloom_init(ent->bloom, capacity, error_rate);
+    db_insert(ent);
+    return ent;
+}
+
+// a missing key is not an error, `*ent` is NULL then
+static bool expect_bloom(Buffer &out, std::string &key, Entry **ent) {
+    *ent = db_lookup(key);
+    if (*ent && (*ent)->type != T_BLOOM) {
+        out_err(out, ERR_TYPE, "expect bloom");
+        return false;
+    }
+    return true;
+}
+
+// bf.reserve key error_rate capacity
+static void do_bf_reserve(std::vector<std::string> &cmd, Buffer &out) {
+    double error_rate = 0;
+    int64_t capacity = 0;
+    if (!str2dbl(cmd[2], error_rate) || !(error_rate > 0 && error_rate < 1)) {
+        return out_err(out, ERR_ARG, "expect error rate in (0, 1)");
+    }
+    if (!str2int(cmd[3], capacity) || capacity <= 0) {
+        return out_err(out, ERR_ARG, "expect positive capacity");
+    }
+    if (bloom_size((uint64_t)capacity, error_rate) + cmd[1].size() > k_max_value) {
+        return out_err(out, ERR_ARG, "filter too big");
+    }
+    if (db_lookup(cmd[1])) {
+        return out_err(out, ERR_ARG, "key exists");
+    }
+    bloom_create(cmd[1], (uint64_t)capacity, error_rate);
+    return out_nil(out);
+}
+
+// bf.add key item / bf.madd key item..., 1 for each item that was not in.
+// a missing key gets a filter for bf-default-capacity items.
+static void do_bf_add(std::vector<std::string> &cmd, Buffer &out) {
+    Entry *ent = NULL;
+    if (!expect_bloom(out, cmd[1], &ent)) {
+        return;
+    }
+    bool multi = cmd_is(cmd[0], "bf.madd");
+    if (!ent) {
+        // the replicas get the filter as it is sized here, not by their
+        // own bf-default-capacity
+        ent = bloom_create(cmd[1], g_conf.bf_default_capacity, k_bloom_default_error);
+        char error_rate[32];
+        snprintf(error_rate, sizeof(error_rate), "%.17g", k_bloom_default_error);
+        repl_feed({"bf.reserve", ent->key, error_rate,
+                   std::to_string(g_conf.bf_default_capacity)});
+    }
+    if (multi) {
+        out_arr(out, (uint32_t)(cmd.size() - 2));
+    }
+    for (size_t i = 2; i < cmd.size(); ++i) {
+        out_int(out, bloom_add(ent->bloom, elem_hash(cmd[i])));
+    }
+}
+
+// bf.exists key item / bf.mexists key item..., 1 for each item that may be in
+static void do_bf_exists(std::vector<std::string> &cmd, Buffer &out) {
+    Entry *ent = NULL;
+    if (!expect_bloom(out, cmd[1], &ent)) {
+        return;
+    }
+    if (cmd_is(cmd[0], "bf.mexists")) {
+        out_arr(out, (uint32_t)(cmd.size() - 2));
+    }
+    for (size_t i = 2; i < cmd.size(); ++i) {
+        out_int(out, ent && bloom_exists(ent->bloom, elem_hash(cmd[i])));
+    }
+}
+
+// restore key <type: u8><dump>, how the replication snapshot carries the
+// types that have no command to rebuild them. replaces the key.
+static void do_restore(std::vector<std::string> &cmd, Buffer &out) {
+    const std::string &payload = cmd[2];
+    const char *data = payload.data() + 1;
+    size_t len = payload.size() - 1;
+    Entry *ent = new Entry();
+    bool ok = false;
+    if (!payload.empty() && payload[0] == T_HLL) {
+        ent->type = T_HLL;
+        ent->hll = new Hll();
+        ok = hll_load(ent->hll, data, len);
+    } else if (!payload.empty() && payload[0] == T_BLOOM) {
+        ent->type = T_BLOOM;
+        ent->bloom = new Bloom();
+        ok = bloom_load(ent->bloom, data, len);
+    }
+    if (!ok) {
+        entry_destroy(ent);
+        return out_err(out, ERR_ARG, "bad payload");
+    }
+    if (Entry *old = db_lookup(cmd[1])) {
+        db_delete(old);
+    }
+    ent->key.swap(cmd[1]);
+    db_insert(ent);
+    return out_nil(out);
+}
+
+// find all the key's in the hashtables - linked lists
+static void h_scan(HTab *tab, void (*f)(HNode *, void *), void *arg) {
+    if (tab->size == 0) {
+        return;
+    }
+    for (size_t i = 0; i < tab->mask + 1; ++i) {
+        HNode *node = tab->tab[i];
+        while (node) {
+            f(node, arg);
+            node = node->next;
+        }
+    }
+}
+
+// tiered storage, see vlog.h. with vlog-memory set, a clock hand walks the
+// keyspace while the used memory is over it and moves the string values
+// that were not accessed since its last pass to the value log. a request
+// for a spilled value is parked while an I/O thread reads it back, see
+// vlog_prefetch(); paths that don't prefetch read it on the event loop.
+const size_t k_vlog_spill_slots = 1024;     // visited per iteration
+const uint64_t k_vlog_cron_ms = 100;        // while over vlog-memory
+const uint64_t k_vlog_compact_min = 1 << 20;    // smaller files are not compacted
+const size_t k_vlog_chunk = 1 << 20;        // read at once by compaction
+
+static bool vlog_read_eq(HNode *lhs, HNode *rhs) {
+    return container_of(lhs, VlogRead, node)->vloc == container_of(rhs, VlogRead, node)->vloc;
+}
+
+static bool vlog_enabled() {
+    return g_data.tier.efd >= 0;
+}
+
+static bool vlog_over() {
+    return vlog_enabled() && g_conf.vlog_memory && used_memory() > g_conf.vlog_memory;
+}
+
+// the stored bytes of a spilled value, read on the event loop
+static void vlog_read_sync(Entry *ent, std::string &out) {
+    Vlog &vl = g_data.tier.log;
+    if (!vlog_flush(&vl)) {
+        die("value log write");
+    }
+    int fd = vl.files[vloc_file(ent->vloc)].fd;
+    if (!vlog_pread(fd, vloc_off(ent->vloc), vloc_len(ent->vloc), out)) {
+        die("value log read");
+    }
+}
+
+// like entry_str_view(), but a spilled value stays in the log
+static const std::string &entry_str_cold(Entry *ent, std::string &scratch) {
+    if (!entry_spilled(ent)) {
+        return entry_str_view(ent, scratch);
+    }
+    if (ent->enc == ENC_RAW) {
+        vlog_read_sync(ent, scratch);
+        return scratch;
+    }
+    std::string stored;
+    vlog_read_sync(ent, stored);
+    scratch.resize(lz4_raw_len(stored));
+    bool ok = lz4_decompress((const uint8_t *)stored.data() + 4, stored.size() - 4,
+                             (uint8_t *)&scratch[0], scratch.size());
+    assert(ok);
+    (void)ok;
+    return scratch;
+}
+
+// bring a value back into memory
+static void vlog_install(Entry *ent, std::string &stored) {
+    g_data.used_mem -= entry_mem(ent);
+    entry_write_begin(ent);
+    vlog_drop(ent);
+    entry_put_str(ent, stored);
+    comp_stats_update(ent, +1);
+    entry_write_end(ent);
+    g_data.used_mem += entry_mem(ent);
+    entry_touch(ent);
+}
+
+static void vlog_fault(Entry *ent) {
+    std::string stored;
+    vlog_read_sync(ent, stored);
+    vlog_install(ent, stored);
+}
+
+static bool vlog_spill(Entry *ent) {
+    Tier &t = g_data.tier;
+    const std::string &stored = entry_str(ent);
+    uint64_t vloc = vlog_append(
+        &t.log, ent->key.data(), ent->key.size(), stored.data(), stored.size());
+    if (!vloc) {
+        return false;
+    }
+    g_data.used_mem -= entry_mem(ent);
+    entry_write_begin(ent);
+    entry_clear_str(ent);
+    std::string().swap(ent->value);
+    ent->vloc = vloc;
+    entry_write_end(ent);
+    g_data.used_mem += entry_mem(ent);
+    t.values++;
+    t.value_bytes += vloc_len(vloc);
+    return true;
+}
+
+// not accessed since the hand passed it last time, the access time stands
+// in for the reference bit of the CLOCK algorithm
+static bool vlog_cold(Entry *ent, uint32_t since_pass) {
+    uint32_t idle = 0;
+    if (policy_is_lfu()) {
+        idle = ((lfu_minutes() - (ent->lru >> 8)) & 0xffff) * 60;
+    } else {
+        idle = lru_idle(ent);
+    }
+    return idle > since_pass;
+}
+
+static void vlog_spill_step() {
+    Tier &t = g_data.tier;
+    t.spill_pending = false;
+    if (!vlog_over()) {
+        return;
+    }
+    uint32_t since_pass = (lru_clock() - t.prev_pass_start) & k_lru_max;
+    bool spilled = false;
+    for (size_t n = 0; n < k_vlog_spill_slots && vlog_over(); ++n) {
+        HTab *tab = t.table == 0 ? &g_data.db.ht1 : &g_data.db.ht2;
+        if (!tab->tab || t.slot > tab->mask) {
+            t.slot = 0;
+            if (++t.table == 2) {
+                t.table = 0;
+                t.prev_pass_start = t.pass_start;
+                t.pass_start = lru_clock();
+                since_pass = (t.pass_start - t.prev_pass_start) & k_lru_max;
+            }
+            continue;
+        }
+        for (HNode *node = tab->tab[t.slot]; node; node = node->next) {
+            Entry *ent = container_of(node, Entry, node);
+            if (ent->type != T_STR || ent->enc == ENC_INT || ent->vloc) {
+                continue;
+            }
+            size_t size = entry_str(ent).size();
+            if (size >= g_conf.vlog_min_value && size <= k_vlog_max_value
+                && vlog_cold(ent, since_pass) && vlog_spill(ent))
+            {
+                spilled = true;
+            }
+        }
+        t.slot++;
+    }
+    if (!vlog_flush(&t.log)) {
+        die("value log write");
+    }
+    t.spill_pending = spilled && vlog_over();
+}
+
+// on an I/O thread
+static void vlog_read_task(void *arg) {
+    VlogRead *rd = (VlogRead *)arg;
+    Tier &t = g_data.tier;
+    rd->ok = vlog_pread(t.log.files[rd->file].fd, rd->off, rd->len, rd->data);
+    pthread_mutex_lock(&t.mu);
+    t.done.push_back(rd);
+    pthread_mutex_unlock(&t.mu);
+    uint64_t one = 1;
+    ssize_t rv = write(t.efd, &one, sizeof(one));
+    (void)rv;
+}
+
+static void vlog_submit(VlogRead *rd) {
+    g_data.tier.log.files[rd->file].reads++;
+    thread_pool_queue(&g_data.tier.pool, &vlog_read_task, rd);
+}
+
+// a connection waits for a spilled value
+static void vlog_want(Conn *conn, Entry *ent) {
+    Tier &t = g_data.tier;
+    VlogRead probe;
+    probe.vloc = ent->vloc;
+    probe.node.hcode = str_hash((const uint8_t *)&probe.vloc, sizeof(probe.vloc));
+    HNode *node = hm_lookup(&t.reads, &probe.node, &vlog_read_eq);
+    VlogRead *rd = node ? container_of(node, VlogRead, node) : NULL;
+    if (!rd) {
+        rd = new VlogRead();
+        rd->node.hcode = probe.node.hcode;
+        rd->vloc = ent->vloc;
+        rd->key = ent->key;
+        rd->file = vloc_file(ent->vloc);
+        rd->off = vloc_off(ent->vloc);
+        rd->len = vloc_len(ent->vloc);
+        hm_insert(&t.reads, &rd->node);
+        vlog_submit(rd);
+    }
+    rd->waiters.push_back(TrackRef{conn->fd, conn->id});
+    conn->vlog_wait++;
+}
+
+// start reading the spilled values the next request uses. it stays in
+// `rbuf` until they are in memory, true if it has to wait.
+static bool vlog_prefetch(Conn *conn, std::vector<std::string> &cmd) {
+    if (!vlog_enabled() || !g_data.tier.values || cmd.size() < 2) {
+        return false;
+    }
+    size_t first = 1, end = 2;
+    if (cmd_is(cmd[0], "bitop")) {
+        first = 3;
+        end = cmd.size();
+    } else if (!cmd_is(cmd[0], "get") && !cmd_is(cmd[0], "getbit")
+        && !cmd_is(cmd[0], "setbit") && !cmd_is(cmd[0], "bitcount")
+        && !cmd_is(cmd[0], "bitpos") && !cmd_is(cmd[0], "incrbyfloat"))
+    {
+        return false;
+    }
+    for (size_t i = first; i < end; ++i) {
+        Entry *ent = db_find(cmd[i]);
+        if (ent && entry_spilled(ent)) {
+            vlog_want(conn, ent);
+        }
+    }
+    return conn->vlog_wait > 0;
+}
+
+// copy the records of a chunk of the file being compacted that are still
+// in use to the current file
+static void vlog_compact_chunk(VlogRead *rd) {
+    Tier &t = g_data.tier;
+    Vlog &vl = t.log;
+    if (!rd->ok) {
+        die("value log read");
+    }
+    const char *data = rd->data.data();
+    size_t pos = 0;
+    t.chunk_len = 0;
+    while (rd->data.size() - pos >= k_vlog_rec_hdr) {
+        uint32_t lens[2];
+        memcpy(lens, data + pos, sizeof(lens));
+        size_t rec_len = k_vlog_rec_hdr + lens[0] + lens[1];
+        if (rec_len > rd->data.size() - pos) {
+            if (pos == 0) {
+                t.chunk_len = rec_len;  // read it whole next time
+            }
+            break;
+        }
+        std::string key(data + pos + k_vlog_rec_hdr, lens[0]);
+        const char *val = data + pos + k_vlog_rec_hdr + lens[0];
+        uint64_t vloc = vloc_make(rd->file, rd->off + pos + k_vlog_rec_hdr + lens[0], lens[1]);
+        Entry *ent = db_find(key);
+        if (ent && entry_spilled(ent) && ent->vloc == vloc) {
+            uint64_t moved = vlog_append(&vl, key.data(), key.size(), val, lens[1]);
+            if (moved) {
+                entry_write_begin(ent);
+                ent->vloc = moved;
+                entry_write_end(ent);
+            } else {
+                std::string stored(val, lens[1]);   // no room left
+                vlog_install(ent, stored);
+            }
+        }
+        pos += rec_len;
+    }
+    if (pos == 0 && t.chunk_len == 0) {
+        die("value log corrupt");
+    }
+    vl.scan_off += pos;
+    if (!vlog_flush(&vl)) {
+        die("value log write");
+    }
+}
+
+static void vlog_compact_step() {
+    Tier &t = g_data.tier;
+    Vlog &vl = t.log;
+    if (!vl.compacting) {
+        VlogFile &f = vl.files[vl.cur];
+        if (f.size >= k_vlog_compact_min && f.dead * 100 >= f.size * g_conf.vlog_compact_pct) {
+            if (!vlog_compact_begin(&vl)) {
+                msg("value log: can't create a file for compaction");
+                return;
+            }
+            t.stat_compactions++;
+        }
+        return;
+    }
+    if (t.chunk) {
+        return;
+    }
+    VlogRead *rd = new VlogRead();
+    rd->file = vl.cur ^ 1;
+    rd->off = vl.scan_off;
+    uint64_t left = vl.files[rd->file].size - vl.scan_off;
+    if (left == 0) {
+        delete rd;
+        vlog_compact_end(&vl);  // or later, after the reads of the file
+        return;
+    }
+    rd->len = (size_t)std::min<uint64_t>(left, std::max(k_vlog_chunk, t.chunk_len));
+    t.chunk = rd;
+    vlog_submit(rd);
+}
+
+// the pool signaled finished reads
+static void vlog_complete() {
+    Tier &t = g_data.tier;
+    uint64_t n = 0;
+    ssize_t rv = read(t.efd, &n, sizeof(n));
+    (void)rv;
+    std::vector<VlogRead *> done;
+    pthread_mutex_lock(&t.mu);
+    done.swap(t.done);
+    pthread_mutex_unlock(&t.mu);
+
+    for (VlogRead *rd : done) {
+        t.log.files[rd->file].reads--;
+        if (rd == t.chunk) {
+            t.chunk = NULL;
+            vlog_compact_chunk(rd);
+            delete rd;
+            continue;
+        }
+        hm_pop(&t.reads, &rd->node, &hnode_same);
+        t.stat_reads++;
+        // the key may have been changed or deleted meanwhile
+        Entry *ent = db_find(rd->key);
+        if (rd->ok && ent && entry_spilled(ent) && ent->vloc == rd->vloc) {
+            vlog_install(ent, rd->data);
+        }
+        for (const TrackRef &ref : rd->waiters) {
+            Conn *conn = (size_t)ref.fd < g_data.fd2conn.size() ? g_data.fd2conn[ref.fd] : NULL;
+            if (!conn || conn->id != ref.id || --conn->vlog_wait > 0) {
+                continue;
+            }
+            if (!conn->deferred) {
+                conn->deferred = true;
+                g_data.deferred.push_back(conn->fd);
+            }
+        }
+        delete rd;
+    }
+}
+
+static void vlog_cron() {
+    if (vlog_enabled()) {
+        vlog_spill_step();
+        vlog_compact_step();
+    }
+}
+
+// the keyspace file, see store.h. after a restart a key moves from the
+// mapped file into the keyspace the first time it is looked up, and the rest
+// follow a batch per event loop iteration, so requests are served as soon as
+// the file is mapped.
+const size_t k_store_load_batch = 1000;
+
+struct StoreSave {
+    StoreWriter w;
+    std::string val;
+};
+
+static void cb_save_field(const char *field, size_t flen, const char *val, size_t vlen, void *arg) {
+    std::string &out = *(std::string *)arg;
+    uint32_t lens[2] = {(uint32_t)flen, (uint32_t)vlen};
+    out.append((const char *)lens, 8);
+    out.append(field, flen);
+    out.append(val, vlen);
+}
+
+// zsets are [n: u32]([score: f64][len: u32][name])... in order, hashes are
+// [n: u32]([flen: u32][vlen: u32][field][value])...
+static void cb_save(HNode *node, void *arg) {
+    StoreSave &ss = *(StoreSave *)arg;
+    Entry *ent = container_of(node, Entry, node);
+    StoreRec rec;
+    rec.key = ent->key.data();
+    rec.klen = (uint32_t)ent->key.size();
+    rec.type = (uint8_t)ent->type;
+    std::string &val = ss.val;
+    val.clear();
+    if (ent->type == T_STR) {
+        rec.enc = (uint8_t)ent->enc;
+        if (ent->enc == ENC_INT) {
+            val.assign((const char *)&ent->ival, 8);
+        } else if (entry_spilled(ent)) {
+            vlog_read_sync(ent, val);   // it stays in the log
+        }
+    } else if (ent->type == T_ZSET) {
+        uint32_t n = (uint32_t)zset_len(ent->zset);
+        val.append((const char *)&n, 4);
+        ZIter it;
+        for (zset_seek_rank(ent->zset, 0, &it); ziter_valid(&it); ziter_offset(&it, 1)) {
+            size_t len = 0;
+            const char *name = ziter_name(&it, &len);
+            double score = ziter_score(&it);
+            uint32_t len32 = (uint32_t)len;
+            val.append((const char *)&score, 8);
+            val.append((const char *)&len32, 4);
+            val.append(name, len);
+        }
+    } else if (ent->type == T_HASH) {
+        uint32_t n = (uint32_t)hash_len(ent->hash);
+        val.append((const char *)&n, 4);
+        hash_foreach(ent->hash, &cb_save_field, &val);
+    } else if (ent->type == T_HLL) {
+        val = hll_dump(ent->hll);
+    } else if (ent->type == T_BLOOM) {
+        val = bloom_dump(ent->bloom);
+    }
+    if (ent->type == T_STR && ent->enc != ENC_INT && !entry_spilled(ent)) {
+        const std::string &stored = entry_str(ent);
+        rec.val = stored.data();
+        rec.vlen = (uint32_t)stored.size();
+    } else if (val.size() > UINT32_MAX) {
+        ss.w.ok = false;
+        return;
+    } else {
+        rec.val = val.data();
+        rec.vlen = (uint32_t)val.size();
+    }
+    if (ent->heap_idx != (size_t)-1) {
+        uint64_t now_us = get_monotonic_usec();
+        uint64_t expire_us = g_data.heap[ent->heap_idx].val;
+        rec.expire_ms = get_realtime_msec()
+            + (int64_t)(expire_us > now_us ? (expire_us - now_us) / 1000 : 0);
+    }
+    store_write(&ss.w, rec);
+}
+
+// write the keyspace to the file, including the keys still in the old one
+static bool db_save() {
+    uint64_t start_us = get_monotonic_usec();
+    StoreSave ss;
+    if (!store_write_begin(&ss.w, g_conf.dbfilename.c_str())) {
+        return false;
+    }
+    h_scan(&g_data.db.ht1, &cb_save, &ss);
+    h_scan(&g_data.db.ht2, &cb_save, &ss);
+    int64_t now_ms = get_realtime_msec();
+    StoreRec rec;
+    for (size_t pos = 0; store_iter(&g_data.store, &pos, &rec); ++pos) {
+        if (rec.expire_ms < 0 || rec.expire_ms > now_ms) {
+            store_write(&ss.w, rec);
+        }
+    }
+    size_t keys = ss.w.slots.size();
+    if (!store_write_end(&ss.w)) {
+        return false;
+    }
+    fprintf(stderr, "store: saved %zu keys in %llu ms\n",
+        keys, (unsigned long long)(get_monotonic_usec() - start_us) / 1000);
+    return true;
+}
+
+// false on a bad record value
+static bool rec_read(const char *&p, const char *end, void *dst, size_t n) {
+    if ((size_t)(end - p) < n) {
+        return false;
+    }
+    memcpy(dst, p, n);
+    p += n;
+    return true;
+}
+
+static bool zset_load_rec(ZSet *zset, const StoreRec &rec) {
+    const char *p = rec.val, *end = rec.val + rec.vlen;
+    uint32_t n = 0;
+    if (!rec_read(p, end, &n, 4) || n == 0 || n > rec.vlen / 12) {
+        return false;
+    }
+    // the names stay in the map until the set is built
+    std::vector<ZMember> members(n);
+    for (uint32_t i = 0; i < n; ++i) {
+        ZMember &m = members[i];
+        uint32_t len = 0;
+        if (!rec_read(p, end, &m.score, 8) || !rec_read(p, end, &len, 4)
+            || (size_t)(end - p) < len)
+        {
+            return false;
+        }
+        m.name = p;
+        m.len = len;
+        p += len;
+        if (i && !zmember_less(members[i - 1], m)) {
+            return false;
+        }
+    }
+    if (p != end) {
+        return false;
+    }
+    zset_build(zset, members.data(), n);
+    return true;
+}
+
+static bool hash_load_rec(Hash *hash, const StoreRec &rec) {
+    const char *p = rec.val, *end = rec.val + rec.vlen;
+    uint32_t n = 0;
+    if (!rec_read(p, end, &n, 4)) {
+        return false;
+    }
+    for (uint32_t i = 0; i < n; ++i) {
+        uint32_t lens[2] = {0, 0};
+        if (!rec_read(p, end, lens, 8) || (size_t)(end - p) < (size_t)lens[0] + lens[1]) {
+            return false;
+        }
+        hash_set(hash, p, lens[0], p + lens[0], lens[1]);
+        p += lens[0] + lens[1];
+    }
+    return p == end && n > 0;
+}
+
+// a new entry with the value of a record, NULL if it is not valid
+static Entry *entry_load(const StoreRec &rec) {
+    Entry *ent = new Entry();
+    ent->type = rec.type;
+    bool ok = false;
+    if (rec.type == T_STR) {
+        if (rec.enc == ENC_INT && rec.vlen == 8) {
+            memcpy(&ent->ival, rec.val, 8);
+            ent->enc = ENC_INT;
+            ok = true;
+        } else if (rec.enc == ENC_RAW || (rec.enc == ENC_LZ4 && rec.vlen > 4)) {
+            std::string val(rec.val, rec.vlen);
+            ent->enc = rec.enc;
+            entry_put_str(ent, val);
+            comp_stats_update(ent, +1);
+            ok = true;
+        }
+    } else if (rec.type == T_ZSET) {
+        ent->zset = new ZSet();
+        ok = zset_load_rec(ent->zset, rec);
+    } else if (rec.type == T_HASH) {
+        ent->hash = new Hash();
+        ok = hash_load_rec(ent->hash, rec);
+    } else if (rec.type == T_HLL) {
+        ent->hll = new Hll();
+        ok = hll_load(ent->hll, rec.val, rec.vlen);
+    } else if (rec.type == T_BLOOM) {
+        ent->bloom = new Bloom();
+        ok = bloom_load(ent->bloom, rec.val, rec.vlen);
+    } else {
+        ent->type = T_STR;
+    }
+    if (!ok) {
+        entry_destroy(ent);
+        return NULL;
+    }
+    return ent;
+}
+
+// move a record into the keyspace, NULL if it has expired or is not valid
+static Entry *store_load_rec(const StoreRec &rec, int64_t now_ms) {
+    if (rec.expire_ms >= 0 && rec.expire_ms <= now_ms) {
+        g_data.stat_expired++;
+        return NULL;
+    }
+    Entry *ent = entry_load(rec);
+    if (!ent) {
+        g_data.store.corrupt++;
+        return NULL;
+    }
+    ent->key.assign(rec.key, rec.klen);
+    db_insert(ent);
+    if (rec.expire_ms >= 0) {
+        entry_set_ttl(ent, rec.expire_ms - now_ms);
+    }
+    return ent;
+}
+
+static Entry *store_fault(const std::string &key) {
+    StoreRec rec;
+    if (!store_take(&g_data.store, key.data(), key.size(), &rec)) {
+        return NULL;
+    }
+    return store_load_rec(rec, get_realtime_msec());
+}
+
+static void store_done() {
+    Store &st = g_data.store;
+    fprintf(stderr, "store: all %llu keys loaded, %llu bad records\n",
+        (unsigned long long)st.keys, (unsigned long long)st.corrupt);
+    store_close(&st);
+    g_data.readers.loading.store(false);
+}
+
+static void store_load_step() {
+    Store &st = g_data.store;
+    if (!st.map) {
+        return;
+    }
+    int64_t now_ms = get_realtime_msec();
+    StoreRec rec;
+    for (size_t i = 0; i < k_store_load_batch && store_take_next(&st, &rec); ++i) {
+        store_load_rec(rec, now_ms);
+    }
+    if (st.pending == 0) {
+        store_done();
+    }
+}
+
+// for the commands that need every key
+static void store_load_all() {
+    Store &st = g_data.store;
+    if (!st.map) {
+        return;
+    }
+    int64_t now_ms = get_realtime_msec();
+    StoreRec rec;
+    while (store_take_next(&st, &rec)) {
+        store_load_rec(rec, now_ms);
+    }
+    store_done();
+}
+
+static void do_save(std::vector<std::string> &cmd, Buffer &out) {
+    (void)cmd;
+    if (g_conf.dbfilename.empty()) {
+        return out_err(out, ERR_ARG, "no dbfilename, start with --dbfilename <path>");
+    }
+    if (!db_save()) {
+        return out_err(out, ERR_UNKNOWN, "save failed");
+    }
+    return out_nil(out);
+}
+
+static void cb_scan(HNode *node, void *arg) {
+    Buffer &out = *(Buffer *)arg;
+    //out_str(out, container_of(node, Entry, node)->key);
+    Entry* ent = container_of(node, Entry, node);
+    out_entry_kv(out, ent);
+}
+
+static void do_keys(std::vector<std::string> &cmd, Buffer &out) {
+    (void)cmd;
+    store_load_all();
+    out_arr(out, (uint32_t)hm_size(&g_data.db));
+    h_scan(&g_data.db.ht1, &cb_scan, &out);
+    h_scan(&g_data.db.ht2, &cb_scan, &out);
+}
+
+static bool expect_index(Buffer &out) {
+    if (!g_conf.key_index) {
+        out_err(out, ERR_ARG, "the key index is off, start with --key-index yes");
+        return false;
+    }
+    store_load_all();   // the index only has the loaded keys
+    return true;
+}
+
+// scanprefix prefix: the keys starting with `prefix`, in order
+static void do_scanprefix(std::vector<std::string> &cmd, Buffer &out) {
+    if (!expect_index(out)) {
+        return;
+    }
+    const std::string &prefix = cmd[1];
+    void *arr = begin_arr(out);
+    uint32_t n = 0;
+    for (BIter it = bt_seek(&g_data.index, prefix); bt_valid(&it); bt_next(&it)) {
+        const std::string *key = bt_key(&it);
+        if (0 != key->compare(0, prefix.size(), prefix)) {
+            break;
+        }
+        out_str(out, *key);
+        n++;
+    }
+    end_arr(out, arr, n);
+}
+
+// keyrange start end limit: up to `limit` keys in [start, end] in order,
+// an empty `end` means no upper bound
+static void do_keyrange(std::vector<std::string> &cmd, Buffer &out) {
+    int64_t limit = 0;
+    if (!str2int(cmd[3], limit) || limit < 0) {
+        return out_err(out, ERR_ARG, "expect int");
+    }
+    if (!expect_index(out)) {
+        return;
+    }
+    const std::string &end = cmd[2];
+    void *arr = begin_arr(out);
+    int64_t n = 0;
+    for (BIter it = bt_seek(&g_data.index, cmd[1]); bt_valid(&it) && n < limit; bt_next(&it)) {
+        const std::string *key = bt_key(&it);
+        if (!end.empty() && *key > end) {
+            break;
+        }
+        out_str(out, *key);
+        n++;
+    }
+    end_arr(out, arr, (uint32_t)n);
+}
+
+static uint64_t readers_requests();
+
+static void do_info(std::vector<std::string> &cmd, Buffer &out) {
+    (void)cmd;
+    const Repl &r = g_data.repl;
+    char ratio[32];
+    snprintf(ratio, sizeof(ratio), "%.2f", g_data.comp_bytes
+        ? (double)g_data.comp_raw_bytes / g_data.comp_bytes : 1.0);
+    std::vector<std::pair<std::string, std::string>> stats = {
+        {"keys", std::to_string(hm_size(&g_data.db))},
+        {"store_pending_keys", std::to_string(g_data.store.pending)},
+        {"store_bad_records", std::to_string(g_data.store.corrupt)},
+        {"vlog_values", std::to_string(g_data.tier.values)},
+        {"vlog_value_bytes", std::to_string(g_data.tier.value_bytes)},
+        {"vlog_file_bytes", std::to_string(g_data.tier.log.files[0].size + g_data.tier.log.files[1].size)},
+        {"vlog_dead_bytes", std::to_string(g_data.tier.log.files[0].dead + g_data.tier.log.files[1].dead)},
+        {"vlog_reads", std::to_string(g_data.tier.stat_reads)},
+        {"vlog_compactions", std::to_string(g_data.tier.stat_compactions)},
+        {"read_threads", std::to_string(g_data.readers.threads.size())},
+        {"read_requests", std::to_string(readers_requests())},
+        {"read_forwarded", std::to_string(g_data.readers.stat_forwarded)},
+        {"ebr_epoch", std::to_string(g_data.readers.ebr.epoch.load())},
+        {"ebr_pending", std::to_string(g_data.readers.ebr.pending)},
+        {"ebr_freed", std::to_string(g_data.readers.ebr.freed)},
+        {"used_memory", std::to_string(used_memory())},
+        {"maxmemory", std::to_string(g_conf.maxmemory)},
+        {"evicted_keys", std::to_string(g_data.stat_evicted)},
+        {"expired_keys", std::to_string(g_data.stat_expired)},
+        {"lazyfree_pending_objects", std::to_string(g_data.lazyfree_pending.load())},
+        {"lazyfreed_objects", std::to_string(g_data.lazyfree_done.load())},
+        {"output_limit_closed", std::to_string(g_data.stat_output_closed)},
+        {"tracking_keys", std::to_string(hm_size(&g_data.tracking))},
+        {"blocked_keys", std::to_string(hm_size(&g_data.blocking))},
+        {"pubsub_channels", std::to_string(hm_size(&g_data.channels))},
+        {"pubsub_patterns", std::to_string(g_data.patterns.size())},
+        {"tracking_invalidations", std::to_string(g_data.stat_invalidations)},
+        {"compressed_values", std::to_string(g_data.comp_values)},
+        {"compressed_raw_bytes", std::to_string(g_data.comp_raw_bytes)},
+        {"compressed_bytes", std::to_string(g_data.comp_bytes)},
+        {"compression_ratio", ratio},
+        {"bitops_kernel", bit_kernel()},
+        {"role", r.is_replica ? "replica" : "primary"},
+        {"repl_id", r.replid},
+        {"repl_offset", std::to_string(r.offset)},
+        {"connected_replicas", std::to_string(r.replicas.size())},
+    };
+    if (r.is_replica) {
+        static const char *k_link_names[] = {"connect", "handshake", "loading", "up"};
+        stats.push_back({"master_host", r.master_host});
+        stats.push_back({"master_port", r.master_port});
+        stats.push_back({"master_link_status", k_link_names[r.link]});
+    }
+    out_arr(out, (uint32_t)stats.size());
+    for (auto &kv : stats) {
+        out_kv(out, kv.first, kv.second);
+    }
+}
+
+// config get name | config set name value
+static void do_config(std::vector<std::string> &cmd, Buffer &out) {
+    if (cmd.size() == 3 && cmd_is(cmd[1], "get")) {
+        std::string val;
+        if (!config_get(cmd[2], val)) {
+            return out_nil(out);
+        }
+        return out_str(out, val);
+    } else if (cmd.size() == 4 && cmd_is(cmd[1], "set")) {
+        if (!config_set(cmd[2], cmd[3])) {
+            return out_err(out, ERR_ARG, "bad config");
+        }
+        return out_nil(out);
+    }
+    return out_err(out, ERR_ARG, "expect config get|set");
+}
+
+// commands that may grow the dataset, refused when over maxmemory
+static bool cmd_denyoom(const std::string &name) {
+    return cmd_is(name, "set") || cmd_is(name, "zadd") || cmd_is(name, "zincrby")
+        || cmd_is(name, "incr") || cmd_is(name, "incrby") || cmd_is(name, "decrby")
+        || cmd_is(name, "incrbyfloat") || cmd_is(name, "hset") || cmd_is(name, "hincrby")
+        || cmd_is(name, "pfadd") || cmd_is(name, "pfmerge") || cmd_is(name, "bf.reserve")
+        || cmd_is(name, "bf.add") || cmd_is(name, "bf.madd") || cmd_is(name, "setbit")
+        || cmd_is(name, "bitop") || cmd_is(name, "zunionstore") || cmd_is(name, "zinterstore");
+}
+
+static const char *k_type_names[k_type_count] = {"string", "zset", "hash", "hll", "bloom"};
+
+static size_t hist_bin(size_t bytes) {
+    size_t bin = 0;
+    while (bin + 1 < k_hist_bins && bytes > ((size_t)64 << bin)) {
+        bin++;
+    }
+    return bin;
+}
+
+static void memscan_add(Entry *ent) {
+    TypeStats &ts = g_data.memscan.cur[ent->type];
+    size_t bytes = entry_mem(ent);
+    ts.keys++;
+    ts.bytes += bytes;
+    ts.hist[hist_bin(bytes)]++;
+
+    auto &big = ts.biggest;
+    if (big.size() < k_bigkeys || bytes > big.back().first) {
+        if (big.size() == k_bigkeys) {
+            big.pop_back();
+        }
+        size_t pos = big.size();
+        while (pos > 0 && big[pos - 1].first < bytes) {
+            pos--;
+        }
+        big.insert(big.begin() + pos, std::make_pair(bytes, ent->key));
+    }
+}
+
+const size_t k_memscan_work = 1000;
+
+// walk a bounded number of keys per event loop iteration. slots are
+// re-checked against the current tables on each step, since a resize may
+// start or finish in between; keys moved by the resize during the walk can
+// be missed or counted twice, which is fine for a size distribution.
+static void memscan_step() {
+    MemScan &ms = g_data.memscan;
+    size_t nwork = 0;
+    while (ms.running && nwork < k_memscan_work) {
+        HTab *tab = ms.table == 0 ? &g_data.db.ht1 : &g_data.db.ht2;
+        if (!tab->tab || ms.slot > tab->mask) {
+            ms.table++;
+            ms.slot = 0;
+            if (ms.table == 2) {
+                ms.running = false;
+                ms.has_report = true;
+                ms.finished_us = get_monotonic_usec();
+                ms.duration_us = ms.finished_us - ms.started_us;
+                for (size_t i = 0; i < k_type_count; ++i) {
+                    ms.report[i] = ms.cur[i];
+                }
+            }
+            continue;
+        }
+        for (HNode *node = tab->tab[ms.slot]; node; node = node->next) {
+            memscan_add(container_of(node, Entry, node));
+            nwork++;
+        }
+        ms.slot++;
+        nwork++;    // count empty slots too
+    }
+}
+
+static void memscan_start() {
+    MemScan &ms = g_data.memscan;
+    if (ms.running) {
+        return;
+    }
+    ms.running = true;
+    ms.table = 0;
+    ms.slot = 0;
+    ms.started_us = get_monotonic_usec();
+    for (size_t i = 0; i < k_type_count; ++i) {
+        ms.cur[i] = TypeStats{};
+    }
+}
+
+// memory usage key
+static void do_memory_usage(std::vector<std::string> &cmd, Buffer &out) {
+    Entry *ent = db_lookup(cmd[2]);
+    if (!ent) {
+        return out_nil(out);
+    }
+    return out_int(out, (int64_t)entry_mem(ent));
+}
+
+// memory stats: report the last complete keyspace walk and start a new one.
+static void do_memory_stats(std::vector<std::string> &cmd, Buffer &out) {
+    (void)cmd;
+    MemScan &ms = g_data.memscan;
+    memscan_start();
+
+    void *arr = begin_arr(out);
+    uint32_t n = 0;
+    auto add = [&](const std::string &key, uint64_t val) {
+        out_kv(out, key, std::to_string(val));
+        n++;
+    };
+    add("used_memory", used_memory());
+    add("keyspace.buckets", hm_mem(&g_data.db));
+    add("keyspace.entries", g_data.used_mem);
+    add("scan.complete", ms.has_report ? 1 : 0);
+    if (ms.has_report) {
+        add("scan.age_ms", (get_monotonic_usec() - ms.finished_us) / 1000);
+        add("scan.duration_us", ms.duration_us);
+        for (size_t t = 0; t < k_type_count; ++t) {
+            const TypeStats &ts = ms.report[t];
+            std::string prefix = k_type_names[t];
+            add(prefix + ".keys", ts.keys);
+            add(prefix + ".bytes", ts.bytes);
+            for (size_t b = 0; b < k_hist_bins; ++b) {
+                if (ts.hist[b]) {
+                    std::string label = b + 1 < k_hist_bins ? "<=" : ">";
+                    size_t bound = (size_t)64 << (b + 1 < k_hist_bins ? b : b - 1);
+                    add(prefix + ".size" + label + std::to_string(bound), ts.hist[b]);
+                }
+            }
+            for (auto &big : ts.biggest) {
+                out_kv(out, prefix + ".big:" + big.second, std::to_string(big.first));
+                n++;
+            }
+        }
+    }
+    end_arr(out, arr, n);
+}
+
+// slowlog get [n] | slowlog len | slowlog reset
+static void do_slowlog(std::vector<std::string> &cmd, Buffer &out) {
+    std::deque<SlowlogEntry> &log = g_data.slowlog;
+    if (cmd.size() == 2 && cmd_is(cmd[1], "len")) {
+        return out_int(out, (int64_t)log.size());
+    } else if (cmd.size() == 2 && cmd_is(cmd[1], "reset")) {
+        log.clear();
+        return out_nil(out);
+    } else if ((cmd.size() == 2 || cmd.size() == 3) && cmd_is(cmd[1], "get")) {
+        int64_t n = 10;
+        if (cmd.size() == 3 && (!str2int(cmd[2], n) || n < 0)) {
+            return out_err(out, ERR_ARG, "expect a count");
+        }
+        size_t count = std::min(log.size(), (size_t)n);
+        out_arr(out, (uint32_t)count);
+        for (size_t i = 0; i < count; ++i) {
+            const SlowlogEntry &ent = log[i];
+            out_arr(out, 5);
+            out_int(out, (int64_t)ent.id);
+            out_int(out, (int64_t)ent.time);
+            out_int(out, (int64_t)ent.duration_us);
+            out_int(out, ent.fd);
+            out_arr(out, (uint32_t)ent.args.size());
+            for (const std::string &arg : ent.args) {
+                out_str(out, arg);
+            }
+        }
+        return;
+    }
+    out_err(out, ERR_ARG, "expect slowlog get|len|reset");
+}
+
+static int lat_lookup(const std::string &name) {
+    for (size_t i = 0; i < k_lat_events; ++i) {
+        if (cmd_is(name, k_lat_names[i])) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+// latency latest | latency history <source> | latency reset
+static void do_latency(std::vector<std::string> &cmd, Buffer &out) {
+    LatencyEvent *lat = g_data.latency;
+    if (cmd.size() == 2 && cmd_is(cmd[1], "latest")) {
+        // [source, time, duration_us, max_us] of the sources with samples
+        void *arr = begin_arr(out);
+        uint32_t n = 0;
+        for (size_t i = 0; i < k_lat_events; ++i) {
+            if (lat[i].history.empty()) {
+                continue;
+            }
+            const LatencySample &last = lat[i].history.back();
+            out_arr(out, 4);
+            out_str(out, k_lat_names[i]);
+            out_int(out, (int64_t)last.time);
+            out_int(out, (int64_t)last.duration_us);
+            out_int(out, (int64_t)lat[i].max_us);
+            n++;
+        }
+        return end_arr(out, arr, n);
+    } else if (cmd.size() == 3 && cmd_is(cmd[1], "history")) {
+        int event = lat_lookup(cmd[2]);
+        if (event < 0) {
+            return out_err(out, ERR_ARG, "unknown latency source");
+        }
+        out_arr(out, (uint32_t)lat[event].history.size());
+        for (const LatencySample &s : lat[event].history) {
+            out_arr(out, 2);
+            out_int(out, (int64_t)s.time);
+            out_int(out, (int64_t)s.duration_us);
+        }
+        return;
+    } else if (cmd.size() == 2 && cmd_is(cmd[1], "reset")) {
+        for (size_t i = 0; i < k_lat_events; ++i) {
+            lat[i].history.clear();
+            lat[i].max_us = 0;
+        }
+        return out_nil(out);
+    }
+    out_err(out, ERR_ARG, "expect latency latest|history|reset");
+}
+
+// hotkeys [count] | hotkeys reset
+// [key, estimated lookups per second, sampled count] of the hottest keys
+static void do_hotkeys(std::vector<std::string> &cmd, Buffer &out) {
+    if (cmd.size() == 2 && cmd_is(cmd[1], "reset")) {
+        cms_clear(&g_data.hk_sketch);
+        g_data.hk_top.heap.clear();
+        g_data.hk_start_us = g_data.hk_decay_us = 0;
+        return out_nil(out);
+    }
+    int64_t n = (int64_t)k_hotkeys_k;
+    if (cmd.size() == 2 && (!str2int(cmd[1], n) || n < 0)) {
+        return out_err(out, ERR_ARG, "expect hotkeys [count]|reset");
+    }
+
+    // a steady rate r leaves a count of r * (window + t) at t after a decay,
+    // before the first decay the count covers the time since the first sample
+    uint64_t now_us = get_monotonic_usec();
+    double secs = 0;
+    if (g_data.hk_decay_us) {
+        secs = (double)(k_hotkeys_window_us + now_us - g_data.hk_decay_us) / 1e6;
+    } else if (g_data.hk_start_us) {
+        secs = (double)(now_us - g_data.hk_start_us) / 1e6;
+    }
+    secs = std::max(secs, 1e-3);
+
+    std::vector<TopKItem> items = topk_list(&g_data.hk_top);
+    size_t count = std::min(items.size(), (size_t)n);
+    out_arr(out, (uint32_t)count);
+    for (size_t i = 0; i < count; ++i) {
+        out_arr(out, 3);
+        out_str(out, items[i].key);
+        out_dbl(out, (double)items[i].count * g_conf.hotkeys_sample_rate / secs);
+        out_int(out, items[i].count);
+    }
+}
+
+static void do_memory(std::vector<std::string> &cmd, Buffer &out) {
+    if (cmd.size() == 3 && cmd_is(cmd[1], "usage")) {
+        do_memory_usage(cmd, out);
+    } else if (cmd.size() == 2 && cmd_is(cmd[1], "stats")) {
+        do_memory_stats(cmd, out);
+    } else {
+        out_err(out, ERR_ARG, "expect memory usage|stats");
+    }
+}
+
+// object encoding <key>
+static void do_object(std::vector<std::string> &cmd, Buffer &out) {
+    if (!cmd_is(cmd[1], "encoding")) {
+        return out_err(out, ERR_ARG, "expect object encoding");
+    }
+    Entry *ent = db_lookup(cmd[2]);
+    if (!ent) {
+        return out_nil(out);
+    }
+    if (ent->type == T_ZSET) {
+        return out_str(out, ent->zset->compact ? "compact" : "tree");
+    }
+    if (ent->type == T_HASH) {
+        return out_str(out, ent->hash->compact ? "compact" : "hashtable");
+    }
+    if (ent->type == T_HLL) {
+        return out_str(out, ent->hll->dense ? "dense" : "sparse");
+    }
+    if (ent->type == T_BLOOM) {
+        return out_str(out, "blocked");
+    }
+    static const char *k_enc_names[] = {"raw", "lz4", "int"};
+    return out_str(out, k_enc_names[ent->enc]);
+}
+
+// the key a write command modifies, `bitop <op> <dest>` names it second
+static std::string &cmd_write_key(std::vector<std::string> &cmd) {
+    return cmd_is(cmd[0], "bitop") && cmd.size() >= 3 ? cmd[2] : cmd[1];
+}
+
+// commands that modify the keyspace, sent to replicas and refused on them
+static bool cmd_is_write(const std::string &name) {
+    return cmd_is(name, "set") || cmd_is(name, "del") || cmd_is(name, "unlink")
+        || cmd_is(name, "pexpire") || cmd_is(name, "zadd") || cmd_is(name, "zrem")
+        || cmd_is(name, "zincrby") || cmd_is(name, "incr") || cmd_is(name, "incrby")
+        || cmd_is(name, "decrby") || cmd_is(name, "incrbyfloat")
+        || cmd_is(name, "zpopmin") || cmd_is(name, "zpopmax") || cmd_is(name, "hset")
+        || cmd_is(name, "hdel") || cmd_is(name, "hincrby") || cmd_is(name, "pfadd")
+        || cmd_is(name, "pfmerge") || cmd_is(name, "bf.reserve") || cmd_is(name, "bf.add")
+        || cmd_is(name, "bf.madd") || cmd_is(name, "restore") || cmd_is(name, "setbit")
+        || cmd_is(name, "bitop") || cmd_is(name, "zunionstore") || cmd_is(name, "zinterstore");
+}
+
+static std::string repl_new_id() {
+    static const char k_hex[] = "0123456789abcdef";
+    std::random_device rd;
+    std::string id(40, '0');
+    for (char &c : id) {
+        c = k_hex[rd() % 16];
+    }
+    return id;
+}
+
+// stop following the primary, the data so far starts a new history.
+// links are only marked here and closed by repl_cron(), since this may run
+// in the middle of processing one of them.
+static void repl_set_primary() {
+    Repl &r = g_data.repl;
+    if (!r.is_replica) {
+        return;
+    }
+    r.is_replica = false;
+    if (r.master) {
+        r.master->state = STATE_END;
+    }
+    r.replid = repl_new_id();
+    msg("replication: now a primary");
+}
+
+static bool repl_set_master(const std::string &host, const std::string &port) {
+    struct addrinfo hints = {};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *res = NULL;
+    if (0 != getaddrinfo(host.c_str(), port.c_str(), &hints, &res)) {
+        return false;
+    }
+    Repl &r = g_data.repl;
+    memcpy(&r.master_addr, res->ai_addr, sizeof(r.master_addr));
+    freeaddrinfo(res);
+
+    // our own replicas resync with the new history when they reconnect
+    for (Conn *conn : r.replicas) {
+        conn->state = STATE_END;
+    }
+    backlog_free(&r.backlog);
+    if (r.master) {
+        r.master->state = STATE_END;
+    }
+    r.is_replica = true;
+    r.master_host = host;
+    r.master_port = port;
+    r.link = REPL_CONNECT;
+    r.retry_us = 0;
+    return true;
+}
+
+// replicaof <host> <port> | replicaof no one
+static void do_replicaof(std::vector<std::string> &cmd, Buffer &out) {
+    if (cmd_is(cmd[1], "no") && cmd_is(cmd[2], "one")) {
+        repl_set_primary();
+    } else if (!repl_set_master(cmd[1], cmd[2])) {
+        return out_err(out, ERR_ARG, "bad address");
+    }
+    return out_nil(out);
+}
+
+// publish channel message, replies with the number of subscribers it went to.
+// not replicated, subscribers of a replica only get what is published there.
+static void do_publish(std::vector<std::string> &cmd, Buffer &out) {
+    int64_t n = 0;
+    if (Channel *ch = channel_get(cmd[1], false)) {
+        RcStr *msg = pubsub_message(NULL, cmd[1], cmd[2]);  // fits, like the request
+        for (Conn *sub : ch->subs) {
+            pubsub_queue(sub, msg);
+        }
+        n += ch->subs.size();
+        rcstr_unref(msg);
+    }
+    for (Channel *pat : g_data.patterns) {
+        if (!glob_match(pat->name, cmd[1])) {
+            continue;
+        }
+        RcStr *msg = pubsub_message(&pat->name, cmd[1], cmd[2]);
+        if (!msg) {
+            continue;
+        }
+        for (Conn *sub : pat->subs) {
+            pubsub_queue(sub, msg);
+        }
+        n += pat->subs.size();
+        rcstr_unref(msg);
+    }
+    out_int(out, n);
+}
+
+// pubsub numsub [channel...] | pubsub numpat
+static void do_pubsub(std::vector<std::string> &cmd, Buffer &out) {
+    if (cmd.size() == 2 && cmd_is(cmd[1], "numpat")) {
+        return out_int(out, (int64_t)g_data.patterns.size());
+    }
+    if (!cmd_is(cmd[1], "numsub")) {
+        return out_err(out, ERR_ARG, "expect pubsub numsub|numpat");
+    }
+    out_arr(out, (uint32_t)(cmd.size() - 2));
+    for (size_t i = 2; i < cmd.size(); ++i) {
+        Channel *ch = channel_get(cmd[i], false);
+        out_int(out, ch ? (int64_t)ch->subs.size() : 0);
+    }
+}
+
+static void do_request(std::vector<std::string> &cmd, Buffer &out) {
+    if (cmd.size() == 1 && cmd_is(cmd[0], "keys")) {
+        do_keys(cmd, out);
+    } else if (cmd.size() == 1 && cmd_is(cmd[0], "save")) {
+        do_save(cmd, out);
+    } else if ((cmd.size() == 2 || cmd.size() == 3) && cmd_is(cmd[0], "get")) {
         do_get(cmd, out);
     } else if (cmd.size() == 3 && cmd_is(cmd[0], "set")) {
         do_set(cmd, out);
-    } else if (cmd.size() == 2 && cmd_is(cmd[0], "del")) {
+    } else if (cmd.size() == 2 && (cmd_is(cmd[0], "del") || cmd_is(cmd[0], "unlink"))) {
         do_del(cmd, out);
     } else if (cmd.size() == 3 && cmd_is(cmd[0], "pexpire")) {
         do_expire(cmd, out);
     } else if (cmd.size() == 2 && cmd_is(cmd[0], "pttl")) {
         do_ttl(cmd, out);
+    } else if (cmd.size() == 2 && cmd_is(cmd[0], "incr")) {
+        do_incr(cmd, out);
+    } else if (cmd.size() == 3 && (cmd_is(cmd[0], "incrby") || cmd_is(cmd[0], "decrby"))) {
+        do_incr(cmd, out);
+    } else if (cmd.size() == 3 && cmd_is(cmd[0], "incrbyfloat")) {
+        do_incrbyfloat(cmd, out);
+    } else if (cmd.size() == 4 && cmd_is(cmd[0], "setbit")) {
+        do_setbit(cmd, out);
+    } else if (cmd.size() == 3 && cmd_is(cmd[0], "getbit")) {
+        do_getbit(cmd, out);
+    } else if ((cmd.size() == 2 || cmd.size() == 4) && cmd_is(cmd[0], "bitcount")) {
+        do_bitcount(cmd, out);
+    } else if (cmd.size() >= 3 && cmd.size() <= 5 && cmd_is(cmd[0], "bitpos")) {
+        do_bitpos(cmd, out);
+    } else if (cmd.size() >= 4 && cmd_is(cmd[0], "bitop")) {
+        do_bitop(cmd, out);
     } else if (cmd.size() == 4 && cmd_is(cmd[0], "zadd")) {
         do_zadd(cmd, out);
+    } else if (cmd.size() == 4 && cmd_is(cmd[0], "zincrby")) {
+        do_zincrby(cmd, out);
     } else if (cmd.size() == 3 && cmd_is(cmd[0], "zrem")) {
         do_zrem(cmd, out);
+    } else if ((cmd.size() == 2 || cmd.size() == 3)
+        && (cmd_is(cmd[0], "zpopmin") || cmd_is(cmd[0], "zpopmax")))
+    {
+        do_zpop(cmd, out);
+    } else if (cmd.size() >= 4 && (cmd_is(cmd[0], "zunionstore") || cmd_is(cmd[0], "zinterstore"))) {
+        do_zmerge(cmd, out);
+    } else if (cmd.size() >= 4 && cmd_is(cmd[0], "hset")) {
+        do_hset(cmd, out);
+    } else if (cmd.size() == 3 && cmd_is(cmd[0], "hget")) {
+        do_hget(cmd, out);
+    } else if (cmd.size() >= 3 && cmd_is(cmd[0], "hmget")) {
+        do_hmget(cmd, out);
+    } else if (cmd.size() >= 3 && cmd_is(cmd[0], "hdel")) {
+        do_hdel(cmd, out);
+    } else if (cmd.size() == 2 && cmd_is(cmd[0], "hgetall")) {
+        do_hgetall(cmd, out);
+    } else if (cmd.size() == 4 && cmd_is(cmd[0], "hincrby")) {
+        do_hincrby(cmd, out);
+    } else if (cmd.size() >= 2 && cmd_is(cmd[0], "pfadd")) {
+        do_pfadd(cmd, out);
+    } else if (cmd.size() >= 2 && cmd_is(cmd[0], "pfcount")) {
+        do_pfcount(cmd, out);
+    } else if (cmd.size() >= 2 && cmd_is(cmd[0], "pfmerge")) {
+        do_pfmerge(cmd, out);
+    } else if (cmd.size() == 4 && cmd_is(cmd[0], "bf.reserve")) {
+        do_bf_reserve(cmd, out);
+    } else if ((cmd.size() == 3 && cmd_is(cmd[0], "bf.add"))
+        || (cmd.size() >= 3 && cmd_is(cmd[0], "bf.madd")))
+    {
+        do_bf_add(cmd, out);
+    } else if ((cmd.size() == 3 && cmd_is(cmd[0], "bf.exists"))
+        || (cmd.size() >= 3 && cmd_is(cmd[0], "bf.mexists")))
+    {
+        do_bf_exists(cmd, out);
+    } else if (cmd.size() == 3 && cmd_is(cmd[0], "restore")) {
+        do_restore(cmd, out);
     } else if (cmd.size() == 3 && cmd_is(cmd[0], "zscore")) {
         do_zscore(cmd, out);
     } else if (cmd.size() == 6 && cmd_is(cmd[0], "zquery")) {
         do_zquery(cmd, out);
+    } else if (cmd.size() == 2 && cmd_is(cmd[0], "scanprefix")) {
+        do_scanprefix(cmd, out);
+    } else if (cmd.size() == 4 && cmd_is(cmd[0], "keyrange")) {
+        do_keyrange(cmd, out);
+    } else if (cmd.size() == 1 && cmd_is(cmd[0], "info")) {
+        do_info(cmd, out);
+    } else if (cmd.size() >= 3 && cmd_is(cmd[0], "config")) {
+        do_config(cmd, out);
+    } else if (cmd.size() >= 2 && cmd_is(cmd[0], "slowlog")) {
+        do_slowlog(cmd, out);
+    } else if (cmd.size() >= 2 && cmd_is(cmd[0], "latency")) {
+        do_latency(cmd, out);
+    } else if (cmd.size() <= 2 && cmd_is(cmd[0], "hotkeys")) {
+        do_hotkeys(cmd, out);
+    } else if (cmd.size() == 3 && cmd_is(cmd[0], "publish")) {
+        do_publish(cmd, out);
+    } else if (cmd.size() >= 2 && cmd_is(cmd[0], "pubsub")) {
+        do_pubsub(cmd, out);
+    } else if (cmd.size() >= 2 && cmd_is(cmd[0], "memory")) {
+        do_memory(cmd, out);
+    } else if (cmd.size() == 3 && cmd_is(cmd[0], "object")) {
+        do_object(cmd, out);
+    } else if (cmd.size() == 3 && cmd_is(cmd[0], "replicaof")) {
+        do_replicaof(cmd, out);
     } else {
         // cmd is not recognized
         out_err(out, ERR_UNKNOWN, "Unknown cmd");
     }
 }
 
-static bool try_one_request(Conn *conn) {
-   
-    if (conn->rbuf_size < 4) {
+// reads whose key a default mode tracking connection is told about
+static bool cmd_is_tracked_read(const std::string &name) {
+    return cmd_is(name, "get") || cmd_is(name, "pttl") || cmd_is(name, "zscore")
+        || cmd_is(name, "zquery") || cmd_is(name, "hget") || cmd_is(name, "hmget")
+        || cmd_is(name, "hgetall") || cmd_is(name, "pfcount") || cmd_is(name, "bf.exists")
+        || cmd_is(name, "bf.mexists") || cmd_is(name, "getbit") || cmd_is(name, "bitcount")
+        || cmd_is(name, "bitpos");
+}
+
+// past the last key a tracked read looks at. a multi-key read must list
+// every key here, or writes to the others send no invalidation.
+static size_t cmd_tracked_keys_end(const std::vector<std::string> &cmd) {
+    return cmd_is(cmd[0], "pfcount") ? cmd.size() : 2;
+}
+
+// client tracking on [bcast] [prefix <p>]... | client tracking off
+static void do_client(Conn *conn, std::vector<std::string> &cmd, Buffer &out) {
+    if (!cmd_is(cmd[1], "tracking") || cmd.size() < 3) {
+        return out_err(out, ERR_ARG, "expect client tracking on|off");
+    }
+    if (cmd.size() == 3 && cmd_is(cmd[2], "off")) {
+        tracking_off(conn);
+        return out_nil(out);
+    }
+    if (!cmd_is(cmd[2], "on")) {
+        return out_err(out, ERR_ARG, "expect client tracking on|off");
+    }
+    bool bcast = false;
+    std::vector<std::string> prefixes;
+    for (size_t i = 3; i < cmd.size(); ++i) {
+        if (cmd_is(cmd[i], "bcast")) {
+            bcast = true;
+        } else if (cmd_is(cmd[i], "prefix") && i + 1 < cmd.size()) {
+            prefixes.push_back(std::move(cmd[++i]));
+        } else {
+            return out_err(out, ERR_ARG, "bad tracking option");
+        }
+    }
+    if (!prefixes.empty() && !bcast) {
+        return out_err(out, ERR_ARG, "prefix needs bcast");
+    }
+    tracking_off(conn);
+    conn->tracking = bcast ? TRACK_BCAST : TRACK_DEFAULT;
+    conn->prefixes.swap(prefixes);
+    if (bcast) {
+        g_data.bcast.push_back(conn);
+    }
+    return out_nil(out);
+}
+
+// subscribe|psubscribe name [name...], replies with the number of channels
+// and patterns the connection is now subscribed to
+static void do_subscribe(Conn *conn, std::vector<std::string> &cmd, Buffer &out) {
+    bool pattern = cmd_is(cmd[0], "psubscribe");
+    for (size_t i = 1; i < cmd.size(); ++i) {
+        pubsub_add(conn, cmd[i], pattern);
+    }
+    out_int(out, (int64_t)(conn->channels.size() + conn->patterns.size()));
+}
+
+// unsubscribe|punsubscribe [name...], from all of them without a name
+static void do_unsubscribe(Conn *conn, std::vector<std::string> &cmd, Buffer &out) {
+    bool pattern = cmd_is(cmd[0], "punsubscribe");
+    if (cmd.size() == 1) {
+        pubsub_off(conn, pattern);
+    }
+    for (size_t i = 1; i < cmd.size(); ++i) {
+        pubsub_remove(conn, cmd[i], pattern);
+    }
+    out_int(out, (int64_t)(conn->channels.size() + conn->patterns.size()));
+}
+
+// bzpopmin|bzpopmax key [key...] timeout
+// pops from the first non-empty zset, or parks the connection until a member
+// is added to one of the keys or `timeout` seconds pass (0 waits forever).
+// replicated as the zpopmin|zpopmax that actually ran.
+static void do_bzpop(Conn *conn, std::vector<std::string> &cmd, Buffer &out) {
+    bool max = cmd_is(cmd[0], "bzpopmax");
+    double timeout = 0;
+    if (!str2dbl(cmd.back(), timeout) || !(timeout >= 0)) {
+        return out_err(out, ERR_ARG, "expect a timeout in seconds");
+    }
+    if (g_data.repl.is_replica) {
+        return out_err(out, ERR_READONLY, "can't write against a read only replica");
+    }
+    for (size_t i = 1; i + 1 < cmd.size(); ++i) {
+        Entry *ent = db_lookup(cmd[i]);
+        if (ent && ent->type != T_ZSET) {
+            return out_err(out, ERR_TYPE, "expect zset");
+        }
+        if (ent && zset_len(ent->zset)) {
+            tracking_modified(cmd[i]);
+            repl_feed({max ? "zpopmax" : "zpopmin", cmd[i]});
+            out_arr(out, 3);
+            out_str(out, cmd[i]);
+            return zset_pop_one(ent, max, out);
+        }
+    }
+    uint64_t deadline_us = 0;
+    if (timeout > 0) {
+        deadline_us = get_monotonic_usec() + (uint64_t)std::max(timeout * 1e6, 1.0);
+    }
+    std::vector<std::string> keys(std::make_move_iterator(cmd.begin() + 1),
+                                  std::make_move_iterator(cmd.end() - 1));
+    block_conn(conn, std::move(keys), max, deadline_us);
+}
+
+// a command from a client, as opposed to one replicated from the primary
+static void process_request(Conn *conn, std::vector<std::string> &cmd, Buffer &out) {
+    if (cmd.size() >= 2 && cmd_is(cmd[0], "client")) {
+        return do_client(conn, cmd, out);
+    }
+    if (cmd.size() >= 3 && (cmd_is(cmd[0], "bzpopmin") || cmd_is(cmd[0], "bzpopmax"))) {
+        return do_bzpop(conn, cmd, out);
+    }
+    if (cmd.size() >= 2 && (cmd_is(cmd[0], "subscribe") || cmd_is(cmd[0], "psubscribe"))) {
+        return do_subscribe(conn, cmd, out);
+    }
+    if (!cmd.empty() && (cmd_is(cmd[0], "unsubscribe") || cmd_is(cmd[0], "punsubscribe"))) {
+        return do_unsubscribe(conn, cmd, out);
+    }
+    bool write = !cmd.empty() && cmd_is_write(cmd[0]);
+    if (write && g_data.repl.is_replica) {
+        return out_err(out, ERR_READONLY, "can't write against a read only replica");
+    }
+    if (!cmd.empty() && cmd_denyoom(cmd[0]) && over_maxmemory()) {
+        if (evict_step() == 0) {
+            return out_err(out, ERR_OOM, "command not allowed when used memory > 'maxmemory'");
+        }
+    }
+    if (write && cmd.size() >= 2) {
+        tracking_modified(cmd_write_key(cmd));
+    }
+    size_t res_pos = out.tail;
+    if (write) {
+        repl_stage(cmd);
+    }
+    do_request(cmd, out);
+    if (write) {
+        repl_commit(out.tail > res_pos && out.data[res_pos] != SER_ERR);
+    }
+    if (conn->tracking == TRACK_DEFAULT && !write && cmd.size() >= 2
+        && cmd_is_tracked_read(cmd[0]))
+    {
+        for (size_t i = 1; i < cmd_tracked_keys_end(cmd); ++i) {
+            tracking_read(conn, cmd[i]);
+        }
+    }
+}
+
+// reserve the length prefix of a response
+static size_t response_begin(Buffer &out) {
+    size_t header = out.tail;
+    uint32_t zero = 0;
+    buf_append(&out, &zero, 4);
+    return header;
+}
+
+// fill in the length prefix, or replace a response that is too big
+static void response_end(Buffer &out, size_t header, size_t ref_bytes_before) {
+    size_t msg_size = out.tail - header - 4 + out.ref_bytes - ref_bytes_before;
+    if (msg_size > k_max_msg) {
+        buf_truncate(&out, header + 4);
+        out_err(out, ERR_2BIG, "response is too big");
+        msg_size = out.tail - header - 4;
+    }
+    uint32_t len = (uint32_t)msg_size;
+    memcpy(&out.data[header], &len, 4);
+}
+
+// the parked request was answered: drop it, and let the connection go on
+// with what it sent after it, see process_deferred()
+static void block_finish(Conn *conn) {
+    uint32_t len = 0;
+    memcpy(&len, &conn->rbuf.data[conn->rbuf.head], 4);
+    buf_consume(&conn->rbuf, 4 + len);
+    unblock_conn(conn);
+    conn_check_hard_limit(conn);
+    if (!conn->deferred) {
+        conn->deferred = true;
+        g_data.deferred.push_back(conn->fd);
+    }
+}
+
+// after a command added to keys that connections are blocked on, pop for
+// the waiters in arrival order while there are members
+static void block_serve() {
+    std::vector<std::string> keys;
+    keys.swap(g_data.ready_keys);
+    for (std::string &key : keys) {
+        while (BlockedKey *bk = blocked_key_get(key)) {
+            Entry *ent = db_lookup(key);
+            if (!ent || ent->type != T_ZSET || !zset_len(ent->zset)) {
+                break;
+            }
+            Conn *conn = bk->waiters.front();
+            bool max = conn->block_max;
+            tracking_modified(key);
+            repl_feed({max ? "zpopmax" : "zpopmin", key});
+
+            Buffer &out = conn->wbuf;
+            size_t ref_bytes = out.ref_bytes;
+            size_t header = response_begin(out);
+            out_arr(out, 3);
+            out_str(out, key);
+            zset_pop_one(ent, max, out);
+            response_end(out, header, ref_bytes);
+            block_finish(conn);
+        }
+    }
+}
+
+// blocked connections past their timeout get a nil reply
+static void block_timeouts(uint64_t now_us) {
+    while (!g_data.block_heap.empty() && g_data.block_heap[0].val <= now_us) {
+        Conn *conn = container_of(g_data.block_heap[0].ref, Conn, block_heap_idx);
+        Buffer &out = conn->wbuf;
+        size_t ref_bytes = out.ref_bytes;
+        size_t header = response_begin(out);
+        out_nil(out);
+        response_end(out, header, ref_bytes);
+        block_finish(conn);
+    }
+}
+
+static void cb_collect(HNode *node, void *arg) {
+    ((std::vector<Entry *> *)arg)->push_back(container_of(node, Entry, node));
+}
+
+// drop every key, before loading a snapshot from the primary
+static void cb_collect_tracked(HNode *node, void *arg) {
+    ((std::vector<TrackedKey *> *)arg)->push_back(container_of(node, TrackedKey, node));
+}
+
+// every key changed at once, tracking starts over
+static void tracking_invalidate_all() {
+    std::vector<TrackedKey *> tks;
+    h_scan(&g_data.tracking.ht1, &cb_collect_tracked, &tks);
+    h_scan(&g_data.tracking.ht2, &cb_collect_tracked, &tks);
+    hm_destroy(&g_data.tracking);
+    for (TrackedKey *tk : tks) {
+        delete tk;
+    }
+    for (Conn *conn : g_data.fd2conn) {
+        if (conn && conn->tracking != TRACK_OFF) {
+            tracking_queue(conn, NULL);
+        }
+    }
+}
+
+static void db_flush() {
+    tracking_invalidate_all();
+    std::vector<Entry *> ents;
+    h_scan(&g_data.db.ht1, &cb_collect, &ents);
+    h_scan(&g_data.db.ht2, &cb_collect, &ents);
+    hm_destroy(&g_data.db);
+    bt_clear(&g_data.index);
+    for (Entry *ent : ents) {
+        entry_del(ent);
+    }
+    store_close(&g_data.store);
+    g_data.readers.loading.store(false);
+    g_data.memscan.running = false;
+}
+
+struct SnapshotHash {
+    Buffer *out;
+    const std::string *key;
+};
+
+static void cb_snapshot_field(const char *field, size_t flen, const char *val, size_t vlen, void *arg) {
+    SnapshotHash &sh = *(SnapshotHash *)arg;
+    const std::string &key = *sh.key;
+    req_begin(*sh.out, 4, 4 + 4 + 4 + key.size() + 4 + flen + 4 + vlen);
+    req_arg(*sh.out, "hset", 4);
+    req_arg(*sh.out, key.data(), key.size());
+    req_arg(*sh.out, field, flen);
+    req_arg(*sh.out, val, vlen);
+}
+
+// the commands that recreate an entry
+static void cb_snapshot(HNode *node, void *arg) {
+    Buffer &out = *(Buffer *)arg;
+    Entry *ent = container_of(node, Entry, node);
+    const std::string &key = ent->key;
+    if (entry_spilled(ent)) {
+        std::string scratch;
+        const std::string &val = entry_str_cold(ent, scratch);
+        req_begin(out, 3, 4 + 3 + 4 + key.size() + 4 + val.size());
+        req_arg(out, "set", 3);
+        req_arg(out, key.data(), key.size());
+        req_arg(out, val.data(), val.size());
+    } else if (ent->type == T_STR) {
+        uint32_t val_len = entry_str_len(ent);
+        req_begin(out, 3, 4 + 3 + 4 + key.size() + 4 + val_len);
+        req_arg(out, "set", 3);
+        req_arg(out, key.data(), key.size());
+        buf_append(&out, &val_len, 4);
+        out_entry_val(out, ent);
+    } else if (ent->type == T_ZSET) {
+        ZIter it;
+        for (zset_seek_rank(ent->zset, 0, &it); ziter_valid(&it); ziter_offset(&it, 1)) {
+            size_t len = 0;
+            const char *name = ziter_name(&it, &len);
+            char score[32];
+            int n = snprintf(score, sizeof(score), "%.17g", ziter_score(&it));
+            req_begin(out, 4, 4 + 4 + 4 + key.size() + 4 + n + 4 + len);
+            req_arg(out, "zadd", 4);
+            req_arg(out, key.data(), key.size());
+            req_arg(out, score, n);
+            req_arg(out, name, len);
+        }
+    } else if (ent->type == T_HASH) {
+        SnapshotHash sh = {&out, &key};
+        hash_foreach(ent->hash, &cb_snapshot_field, &sh);
+    } else if (ent->type == T_HLL || ent->type == T_BLOOM) {
+        std::string payload(1, (char)ent->type);
+        payload += ent->type == T_HLL ? hll_dump(ent->hll) : bloom_dump(ent->bloom);
+        out_req(out, {"restore", key, payload});
+    }
+    if (ent->heap_idx != (size_t)-1) {
+        uint64_t now_us = get_monotonic_usec();
+        uint64_t expire_us = g_data.heap[ent->heap_idx].val;
+        uint64_t ms = expire_us > now_us ? (expire_us - now_us) / 1000 : 0;
+        out_req(out, {"pexpire", key, std::to_string(ms ? ms : 1)});
+    }
+}
+
+// psync <replid> <offset>: a replica asks for the stream from `offset`, and
+// gets a snapshot first when that part of the stream is no longer held.
+// from then on the connection only carries the stream.
+static void repl_psync(Conn *conn, std::vector<std::string> &cmd) {
+    Repl &r = g_data.repl;
+    Buffer &out = conn->wbuf;
+    int64_t offset = 0;
+    if (r.is_replica || !str2int(cmd[2], offset) || offset < 0) {
+        size_t ref_bytes = out.ref_bytes;
+        size_t header = response_begin(out);
+        out_err(out, ERR_ARG, "can't sync from this server");
+        response_end(out, header, ref_bytes);
+        return;
+    }
+
+    if (!r.backlog.data) {
+        backlog_init(&r.backlog, g_conf.repl_backlog_size, r.offset);
+    }
+    if (cmd[1] == r.replid && backlog_has(&r.backlog, (uint64_t)offset)) {
+        msg("replication: partial sync");
+        out_req(out, {"continue", r.replid});
+        backlog_copy(&r.backlog, (uint64_t)offset, &out);
+    } else {
+        msg("replication: full sync");
+        out_req(out, {"fullresync", r.replid, std::to_string(r.offset)});
+        store_load_all();
+        h_scan(&g_data.db.ht1, &cb_snapshot, &out);
+        h_scan(&g_data.db.ht2, &cb_snapshot, &out);
+        out_req(out, {"snapshotend"});
+    }
+    conn->out_exempt = buf_size(&out);
+    conn->flags |= CONN_REPLICA;
+    dlist_detach(&conn->idle_list);
+    dlist_init(&conn->idle_list);
+    r.replicas.push_back(conn);
+}
+
+// a message from the primary: the answer to psync, then the snapshot,
+// then the command stream
+static void repl_apply(Conn *conn, std::vector<std::string> &cmd, size_t nbytes) {
+    Repl &r = g_data.repl;
+    if (r.link == REPL_HANDSHAKE) {
+        int64_t offset = 0;
+        if (cmd.size() == 3 && cmd_is(cmd[0], "fullresync") && str2int(cmd[2], offset)) {
+            db_flush();
+            r.replid = cmd[1];
+            r.offset = (uint64_t)offset;
+            r.link = REPL_LOADING;
+        } else if (cmd.size() == 2 && cmd_is(cmd[0], "continue") && cmd[1] == r.replid) {
+            r.link = REPL_ONLINE;
+        } else {
+            msg("replication: bad psync reply");
+            conn->state = STATE_END;
+        }
+        return;
+    }
+    if (r.link == REPL_LOADING) {
+        if (cmd.size() == 1 && cmd_is(cmd[0], "snapshotend")) {
+            msg("replication: snapshot loaded");
+            r.link = REPL_ONLINE;
+            return;
+        }
+    } else {
+        r.offset += nbytes;     // the snapshot is not part of the stream
+    }
+    if (cmd.size() == 1 && cmd_is(cmd[0], "ping")) {
+        return;
+    }
+    if (cmd.size() >= 2 && cmd_is_write(cmd[0])) {
+        tracking_modified(cmd_write_key(cmd));
+    }
+    do_request(cmd, r.discard);
+    buf_consume(&r.discard, buf_size(&r.discard));
+}
+
+static void repl_connect() {
+    Repl &r = g_data.repl;
+    r.retry_us = get_monotonic_usec() + k_repl_retry_ms * 1000;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        msg("socket() error");
+        return;
+    }
+    fd_set_nb(fd);
+    int rv = connect(fd, (const sockaddr *)&r.master_addr, sizeof(r.master_addr));
+    if (rv < 0 && errno != EINPROGRESS) {
+        msg("replication: connect() error");
+        close(fd);
+        return;
+    }
+
+    // psync is sent once the connection is writable
+    Conn *conn = new Conn();
+    conn->fd = fd;
+    conn->state = STATE_RES;
+    conn->flags = CONN_MASTER;
+    conn->idle_start = get_monotonic_usec();
+    dlist_init(&conn->idle_list);
+    conn_put(g_data.fd2conn, conn);
+    out_req(conn->wbuf, {"psync", r.replid, std::to_string(r.offset)});
+
+    struct epoll_event event = {};
+    event.data.fd = fd;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    conn->events = event.events;
+    if (epoll_ctl(g_data.epfd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        msg("epoll_ctl() error");
+    }
+    r.master = conn;
+    r.link = REPL_HANDSHAKE;
+}
+
+// `clock_ns` is when the previous request of the batch ended, it is
+// advanced so that timing a request takes a single clock read
+static bool try_one_request(Conn *conn, uint64_t &clock_ns) {
+    if (conn->blocked || conn->vlog_wait) {
+        return false;   // nothing runs after the parked request
+    }
+    size_t avail = buf_size(&conn->rbuf);
+    if (avail < 4) {
         // not enough data in the buffer
         return false;
     }
+    const uint8_t *data = &conn->rbuf.data[conn->rbuf.head];
     uint32_t len = 0;
-    memcpy(&len, &conn->rbuf[0], 4);
+    memcpy(&len, &data[0], 4);
     if (len > k_max_msg) {
         msg("too long");
         conn->state = STATE_END;
         return false;
     }
 
-    if (4 + len > conn->rbuf_size) { 
+    if (4 + len > avail) { 
         // checking if the data exist in the buffer 
         // not enough data in buffer . will retry in the next iteration
         return false;
     }
+    if (!conn_take_budget(conn)) {
+        return false;
+    }
 
     std::vector<std::string> cmd;  
     
-    if (0 != parse_req(&conn->rbuf[4],len,cmd)){
+    if (0 != parse_req(&data[4],len,cmd)){
         msg("bad req");
         conn->state = STATE_END;
         return false; // fixed here!
     } 
-    std::string out;
-    do_request(cmd, out);
 
-    // pack the response into the buffer
-    if (4 + out.size() > k_max_msg) {
-        out.clear();
-        out_err(out, ERR_2BIG, "response is too big");
+    if (conn->flags & CONN_MASTER) {
+        repl_apply(conn, cmd, 4 + len);
+    } else if (cmd.size() == 3 && cmd_is(cmd[0], "psync")) {
+        repl_psync(conn, cmd);
+    } else if (vlog_prefetch(conn, cmd)) {
+        return false;   // vlog_complete() brings it back
+    } else {
+        // the response goes straight into the output buffer
+        Buffer &out = conn->wbuf;
+        size_t ref_bytes = out.ref_bytes;
+        size_t header = response_begin(out);
+        process_request(conn, cmd, out);
+        if (conn->blocked) {
+            buf_truncate(&out, header);     // the reply comes when it is served
+            return false;
+        }
+        response_end(out, header, ref_bytes);
+        conn_check_hard_limit(conn);
     }
-    
-    uint32_t wlen = (uint32_t)out.size();
-    memcpy(&conn->wbuf[0], &wlen, 4);
-    memcpy(&conn->wbuf[4], out.data(), out.size());
-    conn->wbuf_size = 4 + wlen;
-
-  
-    size_t remain = conn->rbuf_size - 4 - len;
-    if (remain) {
-        memmove(conn->rbuf, &conn->rbuf[4 + len], remain);
+    uint64_t end_ns = get_monotonic_nsec();
+    uint64_t duration_ns = end_ns - clock_ns;
+    clock_ns = end_ns;
+    g_data.latency[LAT_COMMAND].iter_ns += duration_ns;
+    slowlog_add(conn->fd, &data[4], len, duration_ns / 1000);
+
+    buf_consume(&conn->rbuf, 4 + len);
+    if (!g_data.ready_keys.empty()) {
+        block_serve();
     }
-    conn->rbuf_size = remain;
-
-    // change state
-    conn->state = STATE_RES;
-    state_res(conn);
-    return (conn->state == STATE_REQ);
+    return conn->state != STATE_END;
 }
 
-// fill the the entire read buffer
-static bool try_fill_buffer(Conn *conn) {
-    
-    assert(conn->rbuf_size < sizeof(conn->rbuf));
+const size_t k_read_size = 16 * 1024;
+
+// read what is available and process every complete request
+static bool try_fill_buffer(Conn *conn) {
+    // a partial big request makes the buffer grow to fit it
+    size_t want = k_read_size;
+    if (buf_size(&conn->rbuf) >= 4) {
+        uint32_t len = 0;
+        memcpy(&len, &conn->rbuf.data[conn->rbuf.head], 4);
+        if (len <= k_max_msg && 4 + len > buf_size(&conn->rbuf) + want) {
+            want = 4 + len - buf_size(&conn->rbuf);
+        }
+    }
+
     ssize_t rv = 0;
     do {
-        size_t cap = sizeof(conn->rbuf) - conn->rbuf_size; // intially 4100 - 0 = 4100
-        rv = read(conn->fd, &conn->rbuf[conn->rbuf_size], cap);
+        uint8_t *dst = buf_reserve(&conn->rbuf, want);
+        rv = read(conn->fd, dst, want);
     } while (rv < 0 && errno == EINTR);
     if (rv < 0 && errno == EAGAIN) {
         return false;
@@ -690,7 +4717,7 @@ static bool try_fill_buffer(Conn *conn) {
         return false;
     }
     if (rv == 0) {
-        if (conn->rbuf_size > 0) {
+        if (buf_size(&conn->rbuf) > 0) {
             msg("unexpected EOF");
         } else {
             msg("EOF");
@@ -698,35 +4725,55 @@ static bool try_fill_buffer(Conn *conn) {
         conn->state = STATE_END;
         return false;
     }
+    conn->rbuf.tail += (size_t)rv;
 
-    conn->rbuf_size += (size_t)rv;
-    assert(conn->rbuf_size <= sizeof(conn->rbuf)); // the message read should be less than rbuf size
-
-    while (try_one_request(conn)) {}
+    // pipelined requests are answered with a single write
+    uint64_t clock_ns = get_monotonic_nsec();
+    while (try_one_request(conn, clock_ns)) {}
+    if (conn->state == STATE_REQ && buf_size(&conn->wbuf) > 0) {
+        conn->state = STATE_RES;
+        state_res(conn);
+    }
     return (conn->state == STATE_REQ);
 }
 
 static void state_req(Conn *conn) {
-    while (try_fill_buffer(conn)) {}
+    // answer what was left in the buffer while the output was blocked
+    uint64_t clock_ns = get_monotonic_nsec();
+    while (try_one_request(conn, clock_ns)) {}
+    if (conn->state == STATE_REQ && buf_size(&conn->wbuf) > 0) {
+        conn->state = STATE_RES;
+        state_res(conn);
+    }
+    // a deferred connection reads no more until its turn comes again. a
+    // blocked one reads a little, to notice when the client goes away.
+    while (conn->state == STATE_REQ && !conn->deferred
+        && (!(conn->blocked || conn->vlog_wait) || buf_size(&conn->rbuf) < k_read_size)
+        && try_fill_buffer(conn)) {}
 }
 
+const int k_max_iov = 64;
 
 static bool try_flush_buffer(Conn *conn) {
-    while (conn->wbuf_sent < conn->wbuf_size) {
-        ssize_t rv = write(conn->fd, &conn->wbuf[conn->wbuf_sent], conn->wbuf_size - conn->wbuf_sent);
+    uint64_t start_ns = get_monotonic_nsec();
+    while (buf_size(&conn->wbuf) > 0) {
+        struct iovec iov[k_max_iov];
+        int niov = buf_iov(&conn->wbuf, iov, k_max_iov);
+        ssize_t rv = writev(conn->fd, iov, niov);
         if (rv == -1) {
             if (errno == EINTR) continue;
-            if (errno == EAGAIN) return true;
+            lat_add(LAT_FLUSH, start_ns);
+            if (errno == EAGAIN) return false;  // wait for EPOLLOUT
             msg("write() error");
             conn->state = STATE_END;
             return false;
         }
-        conn->wbuf_sent += (size_t)rv;
+        buf_consume(&conn->wbuf, (size_t)rv);
+        conn->out_exempt -= std::min(conn->out_exempt, (size_t)rv);
     }
+    lat_add(LAT_FLUSH, start_ns);
 
     conn->state = STATE_REQ;
-    conn->wbuf_sent = 0;
-    conn->wbuf_size = 0;
     return false;
 }
 
@@ -735,55 +4782,754 @@ static void state_res(Conn *conn) {
     while (try_flush_buffer(conn)) {}
 }
 
+// only wait for EPOLLOUT while the output is blocked, otherwise every ACK
+// would wake up the edge-triggered loop. no requests are read meanwhile, so
+// EPOLLIN is dropped until the output drains.
+static void conn_update_events(Conn *conn) {
+    uint32_t events = EPOLLIN | EPOLLET;
+    if (conn->state == STATE_RES) {
+        events = EPOLLOUT | EPOLLET;
+    }
+    if (conn->state == STATE_END || events == conn->events) {
+        return;
+    }
+    struct epoll_event event = {};
+    event.data.fd = conn->fd;
+    event.events = events;
+    if (epoll_ctl(g_data.epfd, EPOLL_CTL_MOD, conn->fd, &event) < 0) {
+        msg("epoll_ctl() error");
+        conn->state = STATE_END;
+        return;
+    }
+    conn->events = events;
+}
+
 static void connection_io(Conn *conn) {
     conn->idle_start = get_monotonic_usec();
-    dlist_detach(&conn->idle_list);
-    dlist_insert_before(&g_data.idle_list, &conn->idle_list);
+    if (!conn->flags) {
+        // replication links are not in the idle list
+        dlist_detach(&conn->idle_list);
+        dlist_insert_before(&g_data.idle_list, &conn->idle_list);
+    }
 
     if (conn->state == STATE_REQ) {
         state_req(conn);
     } else if (conn->state == STATE_RES) {
         state_res(conn);
+        if (conn->state == STATE_REQ) {
+            state_req(conn);    // the output drained, resume reading
+        }
     } else {
         assert(0);
     }
+    conn_update_events(conn);
+}
+
+// a connection to the read port, owned by one read thread
+struct RConn {
+    int fd = -1;
+    uint64_t id = 0;
+    Buffer rbuf;
+    Buffer wbuf;
+    uint32_t events = 0;    // registered with epoll
+    bool waiting = false;   // on a request forwarded to the event loop
+};
+
+struct Reader {
+    pthread_t thread;
+    int epfd = -1;
+    int lfd = -1;           // its own listener on the read port
+    int efd = -1;           // signaled as `replies` gets responses
+    EbrSlot *slot = NULL;
+    std::vector<RConn *> conns;     // by fd
+    uint64_t next_id = 0;
+    pthread_mutex_t mu = PTHREAD_MUTEX_INITIALIZER;
+    std::vector<ReadFwd *> replies; // guarded by `mu`
+    std::atomic<uint64_t> requests{0};
+};
+
+static void efd_signal(int efd) {
+    uint64_t one = 1;
+    ssize_t rv = write(efd, &one, sizeof(one));
+    (void)rv;
+}
+
+static void efd_drain(int efd) {
+    uint64_t n = 0;
+    ssize_t rv = read(efd, &n, sizeof(n));
+    (void)rv;
+}
+
+// an LRU access from a read thread. LFU counters are only kept by the
+// event loop, a racing update would lose increments anyway.
+static void entry_touch_shared(Entry *ent) {
+    if (!policy_is_lfu()) {
+        __atomic_store_n(&ent->lru, lru_clock(), __ATOMIC_RELAXED);
+    }
+}
+
+// get on a read thread. the entry stays allocated while the thread is in
+// its epoch, but the string value may change under it: the copy is only
+// kept if the entry's seqlock did not move, see entry_write_begin().
+// false if the event loop has to answer instead.
+static bool reader_get(std::vector<std::string> &cmd, Buffer &out) {
+    bool raw = false;
+    if (cmd.size() == 3) {
+        if (!cmd_is(cmd[2], "raw")) {
+            out_err(out, ERR_ARG, "expect raw");
+            return true;
+        }
+        raw = true;
+    }
+    Entry probe;
+    probe.key.swap(cmd[1]);
+    probe.node.hcode = str_hash((uint8_t *)probe.key.data(), probe.key.size());
+    HNode *node = hm_lookup_shared(&g_data.db, &probe.node, &entry_eq);
+    probe.key.swap(cmd[1]);
+    if (!node) {
+        // the key may still be in the keyspace file
+        if (g_data.readers.loading.load(std::memory_order_acquire)) {
+            return false;
+        }
+        out_nil(out);
+        return true;
+    }
+    Entry *ent = container_of(node, Entry, node);
+    if (ent->type != T_STR) {   // set once, before the entry is published
+        out_err(out, ERR_TYPE, "expect string type");
+        return true;
+    }
+
+    size_t start = out.tail;
+    uint32_t spins = 0;
+    while (true) {
+        uint32_t seq = __atomic_load_n(&ent->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            spin_wait(spins);
+            continue;
+        }
+        uint16_t enc = __atomic_load_n(&ent->enc, __ATOMIC_RELAXED);
+        RcStr *blob = __atomic_load_n(&ent->blob, __ATOMIC_RELAXED);
+        uint64_t ival = __atomic_load_n(&ent->vloc, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&ent->seq, __ATOMIC_RELAXED) != seq) {
+            spin_wait(spins);
+            continue;
+        }
+        if (enc != ENC_INT && ival) {
+            return false;   // in the value log
+        }
+
+        // the blob is not freed before the epoch ends, and its bytes are
+        // only changed in place within their capacity, see entry_str_mut()
+        char num[24];
+        const char *data = num;
+        size_t size = 0;
+        if (enc == ENC_INT) {
+            size = int2str((int64_t)ival, num);
+        } else if (blob) {
+            data = blob->data.data();
+            size = blob->data.size();
+        }
+        bool lz4 = enc == ENC_LZ4 && !raw;
+        uint32_t val_len = (uint32_t)size;
+        if (lz4) {
+            if (size < 4) {
+                spin_wait(spins);
+                continue;
+            }
+            memcpy(&val_len, data, 4);
+        }
+        buf_append_u8(&out, SER_KV);
+        uint32_t key_len = (uint32_t)cmd[1].size();
+        uint32_t total_len = key_len + val_len + 2 * sizeof(uint32_t);
+        buf_append(&out, &total_len, 4);
+        buf_append(&out, &key_len, 4);
+        buf_append(&out, cmd[1].data(), key_len);
+        buf_append(&out, &val_len, 4);
+        bool ok = true;
+        if (lz4) {
+            // a compressed value is replaced, never changed in place
+            uint8_t *dst = buf_reserve(&out, val_len);
+            ok = lz4_decompress((const uint8_t *)data + 4, size - 4, dst, val_len);
+            out.tail += val_len;
+        } else {
+            buf_append(&out, data, size);
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (!ok || __atomic_load_n(&ent->seq, __ATOMIC_RELAXED) != seq) {
+            buf_truncate(&out, start);
+            spin_wait(spins);
+            continue;
+        }
+        entry_touch_shared(ent);
+        return true;
+    }
+}
+
+// hand a request to the event loop, the connection reads nothing more
+// until the response comes back, see readers_serve()
+static void reader_forward(Reader *r, RConn *c, std::vector<std::string> &cmd) {
+    ReadFwd *f = new ReadFwd();
+    f->reader = r;
+    f->fd = c->fd;
+    f->id = c->id;
+    f->cmd.swap(cmd);
+    c->waiting = true;
+    Readers &rs = g_data.readers;
+    pthread_mutex_lock(&rs.mu);
+    rs.fwd.push_back(f);
+    pthread_mutex_unlock(&rs.mu);
+    efd_signal(rs.efd);
+}
+
+// answer the complete requests in `rbuf`, false on a protocol error
+static bool rconn_run(Reader *r, RConn *c) {
+    while (!c->waiting) {
+        size_t avail = buf_size(&c->rbuf);
+        if (avail < 4) {
+            return true;
+        }
+        const uint8_t *data = &c->rbuf.data[c->rbuf.head];
+        uint32_t len = 0;
+        memcpy(&len, data, 4);
+        if (len > k_max_msg) {
+            return false;
+        }
+        if (4 + len > avail) {
+            return true;
+        }
+        std::vector<std::string> cmd;
+        if (0 != parse_req(&data[4], len, cmd)) {
+            return false;
+        }
+        buf_consume(&c->rbuf, 4 + len);
+        r->requests.fetch_add(1, std::memory_order_relaxed);
+
+        bool get = (cmd.size() == 2 || cmd.size() == 3) && cmd_is(cmd[0], "get");
+        if (!get && !cmd.empty() && cmd_is_tracked_read(cmd[0])) {
+            reader_forward(r, c, cmd);
+            return true;
+        }
+        size_t ref_bytes = c->wbuf.ref_bytes;
+        size_t header = response_begin(c->wbuf);
+        bool done = true;
+        if (get) {
+            ebr_enter(&g_data.readers.ebr, r->slot);
+            done = reader_get(cmd, c->wbuf);
+            ebr_exit(r->slot);
+        } else {
+            out_err(c->wbuf, ERR_READONLY, "not served on the read port");
+        }
+        if (!done) {
+            buf_truncate(&c->wbuf, header);
+            reader_forward(r, c, cmd);
+            return true;
+        }
+        response_end(c->wbuf, header, ref_bytes);
+    }
+    return true;
+}
+
+// write what it can, false on an error
+static bool rconn_flush(RConn *c) {
+    while (buf_size(&c->wbuf) > 0) {
+        struct iovec iov[k_max_iov];
+        int niov = buf_iov(&c->wbuf, iov, k_max_iov);
+        ssize_t rv = writev(c->fd, iov, niov);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv < 0) {
+            return errno == EAGAIN;
+        }
+        buf_consume(&c->wbuf, (size_t)rv);
+    }
+    return true;
+}
+
+static void rconn_close(Reader *r, RConn *c) {
+    epoll_ctl(r->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    r->conns[c->fd] = NULL;
+    close(c->fd);
+    buf_free(&c->rbuf);
+    buf_free(&c->wbuf);
+    delete c;
+}
+
+// run requests, write responses and read more, until the socket has
+// nothing to give, the output is blocked or a request is forwarded.
+// the same edge-triggered scheme as connection_io().
+static void rconn_io(Reader *r, RConn *c) {
+    while (true) {
+        if (!rconn_run(r, c) || !rconn_flush(c)) {
+            return rconn_close(r, c);
+        }
+        if (c->waiting || buf_size(&c->wbuf) > 0) {
+            break;
+        }
+        ssize_t rv = 0;
+        do {
+            rv = read(c->fd, buf_reserve(&c->rbuf, k_read_size), k_read_size);
+        } while (rv < 0 && errno == EINTR);
+        if (rv < 0 && errno == EAGAIN) {
+            break;
+        }
+        if (rv <= 0) {
+            return rconn_close(r, c);
+        }
+        c->rbuf.tail += (size_t)rv;
+    }
+    uint32_t events = buf_size(&c->wbuf) > 0 ? EPOLLOUT | EPOLLET : EPOLLIN | EPOLLET;
+    if (events != c->events) {
+        struct epoll_event event = {};
+        event.data.fd = c->fd;
+        event.events = events;
+        if (epoll_ctl(r->epfd, EPOLL_CTL_MOD, c->fd, &event) < 0) {
+            return rconn_close(r, c);
+        }
+        c->events = events;
+    }
+}
+
+static void reader_accept(Reader *r) {
+    while (true) {
+        int connfd = accept(r->lfd, NULL, NULL);
+        if (connfd < 0) {
+            return;
+        }
+        fd_set_nb(connfd);
+        int val = 1;
+        setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+        RConn *c = new RConn();
+        c->fd = connfd;
+        c->id = ++r->next_id;
+        c->events = EPOLLIN | EPOLLET;
+        if (r->conns.size() <= (size_t)connfd) {
+            r->conns.resize(connfd + 1);
+        }
+        r->conns[connfd] = c;
+        struct epoll_event event = {};
+        event.data.fd = connfd;
+        event.events = c->events;
+        if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, connfd, &event) < 0) {
+            rconn_close(r, c);
+        }
+    }
+}
+
+// responses from the event loop, for connections that may have closed
+static void reader_replies(Reader *r) {
+    efd_drain(r->efd);
+    std::vector<ReadFwd *> replies;
+    pthread_mutex_lock(&r->mu);
+    replies.swap(r->replies);
+    pthread_mutex_unlock(&r->mu);
+    for (ReadFwd *f : replies) {
+        RConn *c = (size_t)f->fd < r->conns.size() ? r->conns[f->fd] : NULL;
+        if (c && c->id == f->id) {
+            buf_move(&c->wbuf, &f->out);
+            c->waiting = false;
+            rconn_io(r, c);
+        }
+        buf_free(&f->out);
+        delete f;
+    }
+}
+
+static void *reader_main(void *arg) {
+    Reader *r = (Reader *)arg;
+    struct epoll_event events[MAX_EVENTS];
+    while (!g_data.readers.stop.load()) {
+        int nfds = epoll_wait(r->epfd, events, MAX_EVENTS, -1);
+        if (nfds < 0 && errno != EINTR) {
+            die("epoll_wait()");
+        }
+        for (int i = 0; i < nfds; ++i) {
+            int fd = events[i].data.fd;
+            if (fd == r->lfd) {
+                reader_accept(r);
+            } else if (fd == r->efd) {
+                reader_replies(r);
+            } else if ((size_t)fd < r->conns.size() && r->conns[fd]) {
+                rconn_io(r, r->conns[fd]);
+            }
+        }
+    }
+    for (RConn *c : r->conns) {
+        if (c) {
+            rconn_close(r, c);
+        }
+    }
+    return NULL;
+}
+
+static uint64_t readers_requests() {
+    uint64_t n = 0;
+    for (Reader *r : g_data.readers.threads) {
+        n += r->requests.load(std::memory_order_relaxed);
+    }
+    return n;
+}
+
+// run the requests read threads forwarded, and send the responses back
+static void readers_serve() {
+    Readers &rs = g_data.readers;
+    efd_drain(rs.efd);
+    std::vector<ReadFwd *> fwd;
+    pthread_mutex_lock(&rs.mu);
+    fwd.swap(rs.fwd);
+    pthread_mutex_unlock(&rs.mu);
+    for (ReadFwd *f : fwd) {
+        uint64_t start_ns = get_monotonic_nsec();
+        size_t header = response_begin(f->out);
+        do_request(f->cmd, f->out);
+        response_end(f->out, header, 0);
+        g_data.latency[LAT_COMMAND].iter_ns += get_monotonic_nsec() - start_ns;
+        rs.stat_forwarded++;
+        Reader *r = f->reader;
+        pthread_mutex_lock(&r->mu);
+        r->replies.push_back(f);
+        pthread_mutex_unlock(&r->mu);
+        efd_signal(r->efd);
+    }
+}
+
+// a listener per thread on the same port, the kernel spreads the
+// connections over them
+static int reader_listen(uint32_t port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        die("socket()");
+    }
+    int val = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val));
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)port);
+    addr.sin_addr.s_addr = ntohl(0);
+    if (bind(fd, (const sockaddr *)&addr, sizeof(addr)) || listen(fd, SOMAXCONN)) {
+        die("read port");
+    }
+    fd_set_nb(fd);
+    return fd;
+}
+
+static void db_retire_tab(void *tab) {
+    ebr_retire(&g_data.readers.ebr, &free, tab);
+}
+
+static void readers_start() {
+    Readers &rs = g_data.readers;
+    rs.efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (rs.efd < 0) {
+        die("eventfd()");
+    }
+    struct epoll_event event = {};
+    event.data.fd = rs.efd;
+    event.events = EPOLLIN;
+    if (epoll_ctl(g_data.epfd, EPOLL_CTL_ADD, rs.efd, &event) < 0) {
+        die("epoll_ctl() error");
+    }
+    // the keyspace is resized under the readers, the old bucket arrays
+    // wait for them
+    g_data.db.retire = &db_retire_tab;
+    uint32_t port = g_conf.read_port ? g_conf.read_port : g_conf.port + 1;
+    for (uint32_t i = 0; i < g_conf.read_threads; ++i) {
+        Reader *r = new Reader();
+        r->slot = ebr_register(&rs.ebr);
+        r->lfd = reader_listen(port);
+        r->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        r->epfd = epoll_create1(0);
+        if (r->efd < 0 || r->epfd < 0) {
+            die("read thread");
+        }
+        event.data.fd = r->lfd;
+        epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->lfd, &event);
+        event.data.fd = r->efd;
+        epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->efd, &event);
+        if (pthread_create(&r->thread, NULL, &reader_main, r)) {
+            die("pthread_create()");
+        }
+        rs.threads.push_back(r);
+    }
+    fprintf(stderr, "read threads: %u on port %u\n", g_conf.read_threads, port);
+}
+
+static void readers_stop() {
+    Readers &rs = g_data.readers;
+    rs.stop.store(true);
+    for (Reader *r : rs.threads) {
+        efd_signal(r->efd);
+    }
+    for (Reader *r : rs.threads) {
+        pthread_join(r->thread, NULL);
+        for (ReadFwd *f : r->replies) {
+            buf_free(&f->out);
+            delete f;
+        }
+        close(r->lfd);
+        close(r->efd);
+        close(r->epfd);
+        delete r;
+    }
+    rs.threads.clear();
+    for (ReadFwd *f : rs.fwd) {
+        delete f;
+    }
+    rs.fwd.clear();
+    ebr_drain(&rs.ebr);
 }
 
 const uint64_t k_idle_timeout_ms = 60 * 1000;
+const uint32_t k_repl_cron_ms = 100;
+const uint32_t k_ebr_poll_ms = 10;
 
 static uint32_t next_timer_ms() {
-    if (dlist_empty(&g_data.idle_list)) {
+    if (g_data.evict_pending || g_data.memscan.running || !g_data.deferred.empty()
+        || g_data.store.map || g_data.tier.spill_pending
+        || (g_data.tier.log.compacting && !g_data.tier.chunk))
+    {
+        return 0;   // background work to continue
+    }
+    const Repl &r = g_data.repl;
+    uint32_t max_ms = k_idle_timeout_ms;
+    if (r.is_replica || !r.replicas.empty()) {
+        max_ms = k_repl_cron_ms;    // for repl_cron()
+    }
+    if (vlog_over()) {
+        max_ms = std::min(max_ms, (uint32_t)k_vlog_cron_ms);   // for vlog_cron()
+    }
+    if (g_data.readers.ebr.pending) {
+        max_ms = std::min(max_ms, k_ebr_poll_ms);   // memory waiting for the readers
+    }
+    bool ttl_timers = !g_data.heap.empty() && !r.is_replica;
+    bool block_timers = !g_data.block_heap.empty();
+    if (dlist_empty(&g_data.idle_list) && !ttl_timers && !block_timers) {
         //printf("No timers. Default timeout: 10000ms\n");
-        return k_idle_timeout_ms;   // no timer, the value doesn't matter
+        return max_ms;   // no timer, the value doesn't matter
     }
 
     uint64_t now_us = get_monotonic_usec();
-    Conn *next = container_of(g_data.idle_list.next, Conn, idle_list);
-    uint64_t next_us = next->idle_start + k_idle_timeout_ms * 1000;
+    uint64_t next_us = (uint64_t)-1;
+    if (!dlist_empty(&g_data.idle_list)) {
+        Conn *next = container_of(g_data.idle_list.next, Conn, idle_list);
+        next_us = next->idle_start + k_idle_timeout_ms * 1000;
+    }
+    if (ttl_timers && g_data.heap[0].val < next_us) {
+        next_us = g_data.heap[0].val;   // the nearest TTL
+    }
+    if (block_timers && g_data.block_heap[0].val < next_us) {
+        next_us = g_data.block_heap[0].val;
+    }
     if (next_us <= now_us) {
 
         return 0;
     }
 
-    uint32_t timeout = (uint32_t)((next_us - now_us) / 1000);
-    return timeout;
+    uint64_t timeout = (next_us - now_us) / 1000;
+    return timeout < max_ms ? (uint32_t)timeout : max_ms;
 }
 
 
 static void conn_done(Conn *conn) {
- 
+    Repl &r = g_data.repl;
+    if (conn->flags & CONN_REPLICA) {
+        for (size_t i = 0; i < r.replicas.size(); ++i) {
+            if (r.replicas[i] == conn) {
+                r.replicas[i] = r.replicas.back();
+                r.replicas.pop_back();
+                break;
+            }
+        }
+        msg("replication: replica disconnected");
+    }
+    tracking_off(conn);
+    if (conn->blocked) {
+        unblock_conn(conn);
+    }
+    pubsub_off(conn, false);
+    pubsub_off(conn, true);
+    for (RcStr *m : conn->messages) {
+        rcstr_unref(m);
+    }
+    if (conn == r.master) {
+        r.master = NULL;
+        if (r.link == REPL_LOADING) {
+            r.replid = repl_new_id();   // the snapshot is incomplete, sync it again
+        }
+        r.link = REPL_CONNECT;
+        r.retry_us = get_monotonic_usec() + k_repl_retry_ms * 1000;
+        if (r.is_replica) {
+            msg("replication: lost the primary");
+        }
+    }
+
     g_data.fd2conn[conn->fd] = NULL;
     (void)close(conn->fd);
     dlist_detach(&conn->idle_list);
-    free(conn);
+    buf_free(&conn->rbuf);
+    buf_free(&conn->wbuf);
+    delete conn;
     
 }
 
-static bool hnode_same(HNode *lhs, HNode *rhs) {
-    return lhs == rhs;
+// connections that used up their budget continue where they stopped
+static void process_deferred() {
+    std::vector<int> fds;
+    fds.swap(g_data.deferred);
+    for (int fd : fds) {
+        Conn *conn = g_data.fd2conn[fd];
+        if (!conn || !conn->deferred) {
+            continue;   // closed, the fd may have been reused
+        }
+        conn->deferred = false;
+        if (conn->state == STATE_REQ) {
+            state_req(conn);
+            conn_update_events(conn);
+        }
+        if (conn->state == STATE_END) {
+            conn_done(conn);
+        }
+    }
+}
+
+// reconnect to the primary, ping the replicas and send them the stream
+static void repl_cron() {
+    Repl &r = g_data.repl;
+    uint64_t now_us = get_monotonic_usec();
+    if (r.master && (r.master->state == STATE_END
+        || now_us - r.master->idle_start > k_repl_timeout_ms * 1000))
+    {
+        conn_done(r.master);
+    }
+    if (r.is_replica && !r.master && now_us >= r.retry_us) {
+        repl_connect();
+    }
+
+    if (!r.replicas.empty() && now_us - r.ping_us >= k_repl_ping_ms * 1000) {
+        r.ping_us = now_us;
+        repl_feed({"ping"});
+    }
+    for (size_t i = 0; i < r.replicas.size();) {
+        Conn *conn = r.replicas[i];
+        if (conn->state == STATE_REQ && buf_size(&conn->wbuf) > 0) {
+            conn->state = STATE_RES;
+            state_res(conn);
+            conn_update_events(conn);
+        }
+        if (conn->state == STATE_END) {
+            conn_done(conn);    // removes it from `replicas`
+        } else {
+            i++;
+        }
+    }
 }
+
+// push the queued invalidations, one message per connection per event loop
+// iteration: ["invalidate", [keys]], or ["invalidate", nil] for every key
+static void tracking_flush() {
+    std::vector<int> fds;
+    fds.swap(g_data.inval_fds);
+    for (int fd : fds) {
+        Conn *conn = g_data.fd2conn[fd];
+        if (!conn || !conn->inval_queued) {
+            continue;   // closed, or the fd was reused and already handled
+        }
+        conn->inval_queued = false;
+        std::vector<std::string> &keys = conn->inval;
+        std::sort(keys.begin(), keys.end());    // broadcast mode sees repeats
+        keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+        size_t i = 0;
+        do {
+            Buffer &out = conn->wbuf;
+            size_t ref_bytes = out.ref_bytes;
+            size_t header = response_begin(out);
+            out_push(out, 2);
+            out_str(out, "invalidate");
+            if (conn->inval_all) {
+                out_nil(out);
+                i = keys.size();
+            } else {
+                // split to stay within k_max_msg
+                void *arr = begin_arr(out);
+                size_t size = 0, n = 0;
+                for (; i < keys.size(); ++i, ++n) {
+                    size += 5 + keys[i].size();
+                    if (n && size > k_max_msg - 64) {
+                        break;
+                    }
+                    out_str(out, keys[i]);
+                }
+                end_arr(out, arr, (uint32_t)n);
+                g_data.stat_invalidations += n;
+            }
+            response_end(out, header, ref_bytes);
+        } while (i < keys.size());
+        keys.clear();
+        conn->inval_all = false;
+
+        if (conn_check_hard_limit(conn) && conn->state == STATE_REQ) {
+            conn->state = STATE_RES;
+            state_res(conn);
+        }
+        if (conn->state == STATE_END) {
+            conn_done(conn);
+        } else {
+            conn_update_events(conn);
+        }
+    }
+}
+
+// append the published messages to the output of their subscribers, shared
+// like big values are. a subscriber too far behind is closed rather than
+// slowing down the publishers or holding on to messages, see
+// pubsub-output-limit.
+static void pubsub_flush() {
+    std::vector<int> fds;
+    fds.swap(g_data.pubsub_fds);
+    for (int fd : fds) {
+        Conn *conn = g_data.fd2conn[fd];
+        if (!conn || !conn->messages_queued) {
+            continue;   // closed, or the fd was reused and already handled
+        }
+        conn->messages_queued = false;
+        size_t limit = g_conf.pubsub_output_limit;
+        for (RcStr *m : conn->messages) {
+            if (conn->state != STATE_END && limit
+                && conn_out_size(conn) + m->data.size() > limit)
+            {
+                msg("subscriber over pubsub-output-limit, closing");
+                g_data.stat_output_closed++;
+                conn->state = STATE_END;
+            }
+            if (conn->state != STATE_END && m->data.size() >= k_str_ref_min) {
+                buf_append_ref(&conn->wbuf, m);
+            } else if (conn->state != STATE_END) {
+                // small ones are cheaper to copy, the copies go out in one iovec
+                buf_append(&conn->wbuf, m->data.data(), m->data.size());
+            }
+            rcstr_unref(m);
+        }
+        conn->messages.clear();
+
+        if (conn_check_hard_limit(conn) && conn->state == STATE_REQ) {
+            conn->state = STATE_RES;
+            state_res(conn);
+        }
+        if (conn->state == STATE_END) {
+            conn_done(conn);
+        } else {
+            conn_update_events(conn);
+        }
+    }
+}
+
 static void process_timers() {
     uint64_t now_us = get_monotonic_usec();
+    hotkeys_cron(now_us);
+    block_timeouts(now_us);
     while (!dlist_empty(&g_data.idle_list)) {
         Conn *next = container_of(g_data.idle_list.next, Conn, idle_list);
         uint64_t next_us = next->idle_start + k_idle_timeout_ms * 1000;
@@ -791,48 +5537,254 @@ static void process_timers() {
             // not ready, the extra 1000us is for the ms resolution of poll()
             break;
         }
+        if (next->blocked) {
+            // waiting in a blocking command is not idling
+            next->idle_start = now_us;
+            dlist_detach(&next->idle_list);
+            dlist_insert_before(&g_data.idle_list, &next->idle_list);
+            continue;
+        }
         conn_done(next);
     }
 
+    if (g_data.repl.is_replica) {
+        return;     // keys expire and get evicted on the primary, which sends DELs
+    }
+
     const size_t k_max_works = 2000;
     size_t nworks = 0;
+    uint64_t start_ns = get_monotonic_nsec();
     while (!g_data.heap.empty() && g_data.heap[0].val < now_us) {
         Entry *ent = container_of(g_data.heap[0].ref, Entry, heap_idx);
-        std::cout<< ent->key << std::endl;
-        HNode *node = hm_pop(&g_data.db, &ent->node, &entry_eq);
-
-        assert(node == &ent->node);
-        entry_del(ent);
+        tracking_modified(ent->key);
+        repl_feed_del(ent->key);
+        db_delete(ent);
+        g_data.stat_expired++;
         if (nworks++ >= k_max_works) {
             // don't stall the server if too many keys are expiring at once
             break;
         }
     }
+    lat_add(LAT_EXPIRE, start_ns);
+
+    if (over_maxmemory()) {
+        evict_step();
+    }
+}
+
+
+static int unix_listen(const char *path, uint32_t perm) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        die("socket()");
+    }
+    unlink(path);   // a stale file from a previous run
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    if (bind(fd, (const sockaddr *)&addr, sizeof(addr))) {
+        die("bind()");
+    }
+    if (perm && chmod(path, perm)) {
+        die("chmod()");
+    }
+    if (listen(fd, SOMAXCONN)) {
+        die("listen()");
+    }
+    fd_set_nb(fd);
+    return fd;
 }
 
+// a command line option, either a startup only one or a config setting
+static bool set_option(const std::string &name, const std::string &val) {
+    if (name == "port") {
+        char *endp = NULL;
+        unsigned long port = strtoul(val.c_str(), &endp, 10);
+        g_conf.port = (uint32_t)port;
+        return !val.empty() && *endp == '\0' && port > 0 && port <= 65535;
+    } else if (name == "unixsocket") {
+        g_conf.unixsocket = val;
+        return !val.empty() && val.size() < sizeof(((sockaddr_un *)0)->sun_path);
+    } else if (name == "unixsocketperm") {
+        char *endp = NULL;
+        unsigned long perm = strtoul(val.c_str(), &endp, 8);
+        g_conf.unixsocket_perm = (uint32_t)perm;
+        return !val.empty() && *endp == '\0' && perm <= 0777;
+    } else if (name == "dbfilename") {
+        g_conf.dbfilename = val;
+        return !val.empty();
+    } else if (name == "key-index") {
+        g_conf.key_index = val == "yes";
+        return val == "yes" || val == "no";
+    } else if (name == "zset-merge-threads") {
+        char *endp = NULL;
+        unsigned long n = strtoul(val.c_str(), &endp, 10);
+        g_conf.zset_merge_threads = (uint32_t)n;
+        return !val.empty() && *endp == '\0' && n <= 64;
+    } else if (name == "vlog-file") {
+        g_conf.vlog_file = val;
+        return !val.empty();
+    } else if (name == "vlog-io-threads") {
+        char *endp = NULL;
+        unsigned long n = strtoul(val.c_str(), &endp, 10);
+        g_conf.vlog_io_threads = (uint32_t)n;
+        return !val.empty() && *endp == '\0' && n > 0 && n <= 64;
+    } else if (name == "read-threads") {
+        char *endp = NULL;
+        unsigned long n = strtoul(val.c_str(), &endp, 10);
+        g_conf.read_threads = (uint32_t)n;
+        return !val.empty() && *endp == '\0' && n <= k_ebr_max_readers;
+    } else if (name == "read-port") {
+        char *endp = NULL;
+        unsigned long port = strtoul(val.c_str(), &endp, 10);
+        g_conf.read_port = (uint32_t)port;
+        return !val.empty() && *endp == '\0' && port <= 65535;
+    } else if (name == "replicaof") {
+        size_t colon = val.rfind(':');
+        return colon != std::string::npos
+            && repl_set_master(val.substr(0, colon), val.substr(colon + 1));
+    }
+    return config_set(name, val);
+}
 
 int main(int argc, char *argv[]) {
 
 
   
     if (argc > 1 && strcmp(argv[1], "help") == 0) {
-        printf("Usage: ./kvserver [help]\n\n");
+        printf("Usage: ./kvserver [help] [--<config> <value> ...]\n\n");
         printf("Available commands:\n");
         printf("  set <key> <value>       - Set a string value\n");
-        printf("  get <key>               - Get a string value\n");
+        printf("  get <key> [raw]         - Get a string value, raw skips decompression\n");
         printf("  del <key>               - Delete a key\n");
+        printf("  unlink <key>            - Same as del\n");
         printf("  pexpire <key> <ms>      - Set a key to expire in ms\n");
         printf("  pttl <key>              - Get TTL of a key\n");
+        printf("  incr|incrby|decrby <key> [n] - Add to an integer value\n");
+        printf("  incrbyfloat <key> <x>   - Add to a numeric value\n");
+        printf("  setbit <key> <offset> 0|1 - Set a bit, returns the old one\n");
+        printf("  getbit <key> <offset>   - Read a bit\n");
+        printf("  bitcount <key> [<start> <end>] - Set bits, in a byte range\n");
+        printf("  bitpos <key> 0|1 [<start> [<end>]] - Position of the first such bit\n");
+        printf("  bitop and|or|xor|not <dest> <key>... - Store a bitwise combination\n");
         printf("  zadd <zset> <score> <member> - Add member to sorted set\n");
+        printf("  zincrby <zset> <incr> <member> - Add to the score of a member\n");
         printf("  zrem <zset> <member>    - Remove member from sorted set\n");
         printf("  zscore <zset> <member>  - Get score of member\n");
         printf("  zquery <zset> <score> <member> <offset> <limit> - Range query\n");
+        printf("  zpopmin|zpopmax <zset> [count] - Remove and return the lowest/highest members\n");
+        printf("  zunionstore|zinterstore <dest> <n> <zset>... [weights|aggregate] - Store a union/intersection\n");
+        printf("  bzpopmin|bzpopmax <zset>... <timeout> - Pop, or wait for a member (timeout 0 = forever)\n");
+        printf("  hset <hash> <field> <value> [<field> <value>]... - Set fields, returns how many are new\n");
+        printf("  hget <hash> <field>     - Get the value of a field\n");
+        printf("  hmget <hash> <field>... - Get the values of several fields\n");
+        printf("  hdel <hash> <field>...  - Remove fields\n");
+        printf("  hgetall <hash>          - All fields and values\n");
+        printf("  hincrby <hash> <field> <n> - Add to an integer field\n");
+        printf("  pfadd <key> [<element>]... - Add to a HyperLogLog\n");
+        printf("  pfcount <key>...        - Estimated distinct elements (of the union)\n");
+        printf("  pfmerge <dest> <src>... - Store the union of HyperLogLogs\n");
+        printf("  bf.reserve <key> <error_rate> <capacity> - Create a Bloom filter\n");
+        printf("  bf.add|bf.madd <key> <item>... - Add to a Bloom filter\n");
+        printf("  bf.exists|bf.mexists <key> <item>... - 1 for each item that may be in\n");
         printf("  keys                    - List all keys\n");
+        printf("  save                    - Write the keyspace file now\n");
+        printf("  scanprefix <prefix>     - Keys with a prefix, in order (needs --key-index)\n");
+        printf("  keyrange <start> <end> <limit> - Keys in [start, end], in order\n");
+        printf("  info                    - Server statistics\n");
+        printf("  config get|set <name> [value] - Read or change a setting\n");
+        printf("  memory usage <key>      - Bytes used by a key\n");
+        printf("  memory stats            - Keyspace size distribution by type\n");
+        printf("  object encoding <key>   - Storage encoding of a key\n");
+        printf("  slowlog get [n]|len|reset - Commands slower than the threshold\n");
+        printf("  latency latest|history <source>|reset - Event loop stalls by source\n");
+        printf("  hotkeys [n]|reset       - Most looked up keys and their rates\n");
+        printf("  client tracking on [bcast] [prefix <p>]...|off - Push invalidations of read keys\n");
+        printf("  subscribe|psubscribe <channel|pattern>... - Receive published messages as pushes\n");
+        printf("  unsubscribe|punsubscribe [channel|pattern]... - Stop, from all without arguments\n");
+        printf("  publish <channel> <message> - Send to the subscribers, returns how many\n");
+        printf("  pubsub numsub [channel]...|numpat - Subscriber counts\n");
+        printf("  replicaof <host> <port> - Replicate a primary, `replicaof no one` stops\n");
+        printf("\nOptions:\n");
+        printf("  --port <port>           - TCP port to listen on (default 8085)\n");
+        printf("  --unixsocket <path>     - Also listen on a unix socket\n");
+        printf("  --unixsocketperm <mode> - Octal permissions of the unix socket file\n");
+        printf("  --replicaof <host:port> - Start as a replica of a primary\n");
+        printf("  --key-index yes|no      - Keep an ordered index of keys (default no)\n");
+        printf("  --dbfilename <path>     - Keyspace file, mapped at startup and written on exit\n");
+        printf("  --repl-backlog-size <bytes> - Stream kept for replicas that reconnect\n");
+        printf("  --maxmemory <bytes>     - Memory limit, accepts kb/mb/gb (0 = none)\n");
+        printf("  --maxmemory-policy <p>  - noeviction, allkeys-lru, allkeys-lfu,\n");
+        printf("                            volatile-lru, volatile-lfu, volatile-ttl\n");
+        printf("  --maxmemory-samples <n> - Keys sampled per eviction\n");
+        printf("  --lfu-log-factor <n>    - LFU counter logarithm factor\n");
+        printf("  --lfu-decay-time <min>  - LFU counter decay period\n");
+        printf("  --lazyfree-threshold <n> - Free bigger values on a background thread\n");
+        printf("  --zset-merge-threads <n> - Worker threads for big zunionstore/zinterstore\n");
+        printf("  --vlog-file <path>      - Value log for cold strings, <path>.0 and <path>.1\n");
+        printf("  --vlog-memory <bytes>   - Move cold string values to the log above this (0 = never)\n");
+        printf("  --vlog-min-value <bytes> - Smaller values stay in memory\n");
+        printf("  --vlog-io-threads <n>   - Threads reading the value log\n");
+        printf("  --vlog-compact-pct <n>  - Compact a log file this much dead\n");
+        printf("  --read-threads <n>      - Threads serving reads on the read port (default 0)\n");
+        printf("  --read-port <port>      - Port of the read threads (default port + 1)\n");
+        printf("  --conn-request-budget <n> - Requests per connection per loop iteration\n");
+        printf("  --slowlog-log-slower-than <us> - Log commands slower than this\n");
+        printf("  --slowlog-max-len <n>   - Entries kept in the slowlog\n");
+        printf("  --latency-monitor-threshold <us> - Record loop stalls over this (0 = off)\n");
+        printf("  --hotkeys-sample-rate <n> - Sample 1 in n lookups for hotkeys (0 = off)\n");
+        printf("  --tracking-table-max-keys <n> - Keys remembered for client tracking (0 = no limit)\n");
+        printf("  --pubsub-output-limit <bytes> - Queued output that closes a subscriber\n");
+        printf("  --output-soft-limit <bytes> - Queued output that pauses a connection\n");
+        printf("  --output-hard-limit <bytes> - Queued output that closes a connection\n");
         printf("\nStart the server by simply running: ./kvserver\n");
         return 0;
     }
 
+    g_data.repl.replid = repl_new_id();
+    for (int i = 1; i < argc; i += 2) {
+        if (strncmp(argv[i], "--", 2) != 0 || i + 1 >= argc
+            || !set_option(argv[i] + 2, argv[i + 1]))
+        {
+            fprintf(stderr, "bad option: %s\n", argv[i]);
+            return 1;
+        }
+    }
+    // before the keyspace fills: values are stored for the read threads
+    g_data.readers.on = g_conf.read_threads > 0;
+
+    // a file that is there but can't be used stops the start, so that the
+    // shutdown save does not replace it
+    if (!g_conf.dbfilename.empty() && access(g_conf.dbfilename.c_str(), F_OK) == 0) {
+        uint64_t start_us = get_monotonic_usec();
+        std::string err;
+        if (!store_open(&g_data.store, g_conf.dbfilename.c_str(), err)) {
+            fprintf(stderr, "store: %s: %s\n", g_conf.dbfilename.c_str(), err.c_str());
+            return 1;
+        }
+        fprintf(stderr, "store: mapped %llu keys in %llu ms\n",
+            (unsigned long long)g_data.store.keys,
+            (unsigned long long)(get_monotonic_usec() - start_us) / 1000);
+        g_data.readers.loading.store(true);
+    }
+
     dlist_init(&g_data.idle_list);
+    thread_pool_init(&g_data.thread_pool, 1);
+    if (g_conf.zset_merge_threads) {
+        thread_pool_init(&g_data.merge_pool, g_conf.zset_merge_threads);
+    }
+    if (!g_conf.vlog_file.empty()) {
+        Tier &t = g_data.tier;
+        if (!vlog_open(&t.log, g_conf.vlog_file)) {
+            fprintf(stderr, "value log: %s: %s\n", g_conf.vlog_file.c_str(), strerror(errno));
+            return 1;
+        }
+        thread_pool_init(&t.pool, g_conf.vlog_io_threads);
+        t.efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (t.efd < 0) {
+            die("eventfd()");
+        }
+    }
     
     int fd = socket(AF_INET, SOCK_STREAM, 0); // create a server socket 
     if (fd < 0) {
@@ -845,7 +5797,7 @@ int main(int argc, char *argv[]) {
     // bind
     struct sockaddr_in addr = {};
     addr.sin_family = AF_INET;
-    addr.sin_port = htons(PORT);
+    addr.sin_port = htons((uint16_t)g_conf.port);
     addr.sin_addr.s_addr = ntohl(0);    // wildcard address 0.0.0.0
     int rv = bind(fd, (const sockaddr *)&addr, sizeof(addr));
     if (rv) {
@@ -865,6 +5817,7 @@ int main(int argc, char *argv[]) {
     if (epfd < 0) {
         die("epoll_create1()");
     }
+    g_data.epfd = epfd;
 
     // Register the listening socket
     struct epoll_event event = {};
@@ -876,29 +5829,61 @@ int main(int argc, char *argv[]) {
         die("epoll_ctl() error");
     }
 
+    // the optional unix socket, served by the same loop and Conn state machine
+    int ufd = -1;
+    if (!g_conf.unixsocket.empty()) {
+        ufd = unix_listen(g_conf.unixsocket.c_str(), g_conf.unixsocket_perm);
+        event.data.fd = ufd;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, ufd, &event) < 0) {
+            die("epoll_ctl() error");
+        }
+    }
+    if (vlog_enabled()) {
+        event.data.fd = g_data.tier.efd;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, g_data.tier.efd, &event) < 0) {
+            die("epoll_ctl() error");
+        }
+    }
+    if (g_data.readers.on) {
+        readers_start();
+    }
+
     // the event loop
     struct epoll_event events[MAX_EVENTS];
     printf("%s\n","the server is listening");
     signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
 
     while (!stop) {
-        int timeout_ms = (int)next_timer_ms(); // Ingnoring timeouts
+        int timeout_ms = (int)next_timer_ms();
       
-        int nfds = epoll_wait(epfd, events, MAX_EVENTS,-1); // blocking operation 
+        int nfds = epoll_wait(epfd, events, MAX_EVENTS, timeout_ms); // blocking operation 
      
         if (nfds < 0) {
             if (errno == EINTR) continue; // Interrupted by signal, retry
             die("epoll_wait()");
         }
+        uint64_t iter_ns = get_monotonic_nsec();
+        g_data.loop_iter++;
+        process_deferred();
 
         for (int i = 0; i < nfds; ++i) {
-            if (events[i].data.fd == fd) {    // if fd is server fd
+            if (events[i].data.fd == fd || events[i].data.fd == ufd) {
                 // The listening fd is ready, try to accept new connections
-                accept_new_conn(g_data.fd2conn, epfd, fd);
+                accept_new_conn(g_data.fd2conn, epfd, events[i].data.fd, events[i].data.fd == fd);
+            } else if (events[i].data.fd == g_data.tier.efd) {
+                vlog_complete();
+            } else if (events[i].data.fd == g_data.readers.efd) {
+                readers_serve();
             } else {
                 // A client connection is ready
                 Conn *conn = g_data.fd2conn[events[i].data.fd];
-                connection_io(conn);
+                if (!conn) {
+                    continue;   // closed earlier in this iteration
+                }
+                if (conn->state != STATE_END) {
+                    connection_io(conn);
+                }
                 if (conn->state == STATE_END) {
                     // Client closed the connection or an error occurred
                     conn_done(conn);
@@ -907,10 +5892,31 @@ int main(int argc, char *argv[]) {
         }
         
         // handle timers
-        // process_timers();
+        process_timers();
+        tracking_flush();
+        pubsub_flush();
+        repl_cron();
+        memscan_step();
+        store_load_step();
+        vlog_cron();
+        ebr_poll(&g_data.readers.ebr);
+        lat_end_iter(iter_ns);
     }
     close(epfd);
     close(fd);
+    if (ufd >= 0) {
+        close(ufd);
+        unlink(g_conf.unixsocket.c_str());
+    }
+    if (g_data.readers.on) {
+        readers_stop();
+    }
+    if (!g_conf.dbfilename.empty() && !db_save()) {
+        msg("store: save failed");
+    }
+    if (vlog_enabled()) {
+        vlog_close(&g_data.tier.log);
+    }
    
     return 0;
 }
@@ -0,0 +1,139 @@
+#include <assert.h>
+#include <algorithm>
+#include "sketch.h"
+
+
+void cms_init(CMSketch *cms, uint32_t width, uint32_t depth) {
+    assert(width > 1 && ((width - 1) & width) == 0);
+    assert(depth > 0 && depth <= k_cms_max_depth);
+    cms->width = width;
+    cms->bits = 0;
+    while ((1u << cms->bits) < width) {
+        cms->bits++;
+    }
+    cms->depth = depth;
+    cms->counts.assign((size_t)width * depth, 0);
+}
+
+// str_hash() has 32 bits, spread them over 64 before splitting
+static uint64_t mix64(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+// each row takes its own bits of the mixed hash, so that two keys share a
+// counter in every row only by chance in every row. (h1 + i * h2 would make
+// the rows collide together whenever h1 and h2 both do.)
+static void cms_slots(const CMSketch *cms, uint64_t hcode, uint32_t *slots) {
+    uint64_t h = mix64(hcode);
+    uint32_t used = 0;
+    for (uint32_t i = 0; i < cms->depth; ++i) {
+        if (used + cms->bits > 64) {
+            h = mix64(h + i);
+            used = 0;
+        }
+        slots[i] = i * cms->width + (uint32_t)((h >> used) & (cms->width - 1));
+        used += cms->bits;
+    }
+}
+
+uint32_t cms_add(CMSketch *cms, uint64_t hcode) {
+    uint32_t slots[k_cms_max_depth];
+    cms_slots(cms, hcode, slots);
+    uint32_t est = UINT32_MAX;
+    for (uint32_t i = 0; i < cms->depth; ++i) {
+        est = std::min(est, cms->counts[slots[i]]);
+    }
+    if (est == UINT32_MAX) {
+        return est;
+    }
+    // conservative update: only the counters at the minimum go up
+    for (uint32_t i = 0; i < cms->depth; ++i) {
+        uint32_t &c = cms->counts[slots[i]];
+        if (c == est) {
+            c++;
+        }
+    }
+    return est + 1;
+}
+
+void cms_decay(CMSketch *cms) {
+    for (uint32_t &c : cms->counts) {
+        c >>= 1;
+    }
+}
+
+void cms_clear(CMSketch *cms) {
+    std::fill(cms->counts.begin(), cms->counts.end(), 0);
+}
+
+static void topk_swap(TopK *tk, size_t a, size_t b) {
+    std::swap(tk->heap[a], tk->heap[b]);
+}
+
+static void topk_up(TopK *tk, size_t pos) {
+    while (pos > 0) {
+        size_t parent = (pos - 1) / 2;
+        if (tk->heap[parent].count <= tk->heap[pos].count) {
+            break;
+        }
+        topk_swap(tk, parent, pos);
+        pos = parent;
+    }
+}
+
+static void topk_down(TopK *tk, size_t pos) {
+    size_t len = tk->heap.size();
+    while (true) {
+        size_t l = pos * 2 + 1, r = pos * 2 + 2, min = pos;
+        if (l < len && tk->heap[l].count < tk->heap[min].count) {
+            min = l;
+        }
+        if (r < len && tk->heap[r].count < tk->heap[min].count) {
+            min = r;
+        }
+        if (min == pos) {
+            break;
+        }
+        topk_swap(tk, pos, min);
+        pos = min;
+    }
+}
+
+void topk_add(TopK *tk, const std::string &key, uint64_t hcode, uint32_t count) {
+    // k is small, a linear search beats keeping an index
+    for (size_t i = 0; i < tk->heap.size(); ++i) {
+        TopKItem &item = tk->heap[i];
+        if (item.hcode == hcode && item.key == key) {
+            item.count = count;     // only grows, see cms_add()
+            topk_down(tk, i);
+            return;
+        }
+    }
+    if (tk->heap.size() < tk->k) {
+        tk->heap.push_back(TopKItem{key, hcode, count});
+        topk_up(tk, tk->heap.size() - 1);
+    } else if (tk->k && count > tk->heap[0].count) {
+        tk->heap[0] = TopKItem{key, hcode, count};
+        topk_down(tk, 0);
+    }
+}
+
+void topk_decay(TopK *tk) {
+    // halving keeps the heap order
+    for (TopKItem &item : tk->heap) {
+        item.count >>= 1;
+    }
+}
+
+std::vector<TopKItem> topk_list(const TopK *tk) {
+    std::vector<TopKItem> items = tk->heap;
+    std::sort(items.begin(), items.end(), [](const TopKItem &a, const TopKItem &b) {
+        return a.count > b.count;
+    });
+    return items;
+}
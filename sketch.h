@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// a count-min sketch: `depth` rows of `width` counters, a key is counted in
+// one counter per row and its estimate is the smallest of them. estimates
+// never undercount, and conservative update keeps the overcount low.
+const uint32_t k_cms_max_depth = 16;
+
+struct CMSketch {
+    uint32_t width = 0;     // a power of 2
+    uint32_t bits = 0;      // log2(width)
+    uint32_t depth = 0;
+    std::vector<uint32_t> counts;
+};
+
+void cms_init(CMSketch *cms, uint32_t width, uint32_t depth);
+// counts a key by its hash and returns the new estimate
+uint32_t cms_add(CMSketch *cms, uint64_t hcode);
+// halves every counter, so that old hits fade out
+void cms_decay(CMSketch *cms);
+void cms_clear(CMSketch *cms);
+
+struct TopKItem {
+    std::string key;
+    uint64_t hcode = 0;
+    uint32_t count = 0;
+};
+
+// the `k` keys with the highest estimates, as a min-heap on the count
+struct TopK {
+    size_t k = 0;
+    std::vector<TopKItem> heap;
+};
+
+void topk_add(TopK *tk, const std::string &key, uint64_t hcode, uint32_t count);
+void topk_decay(TopK *tk);
+// the items, highest count first
+std::vector<TopKItem> topk_list(const TopK *tk);
@@ -0,0 +1,321 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "store.h"
+#include "common.h"
+
+
+const char k_store_magic[8] = {'K', 'V', 'S', 'T', 'O', 'R', 'E', 0};
+const uint32_t k_store_version = 1;
+const size_t k_store_flush = 1 << 20;
+
+struct StoreHdr {
+    char magic[8];
+    uint32_t version;
+    uint32_t clean;
+    uint64_t keys;
+    uint64_t slots_off;
+    uint64_t nslots;
+    uint64_t file_size;
+    uint64_t check;     // of the slots
+    uint64_t pad;
+};
+
+struct StoreRecHdr {
+    uint64_t check;     // of the rest of the record
+    uint32_t klen;
+    uint32_t vlen;
+    uint8_t type;
+    uint8_t enc;
+    uint8_t pad[6];
+    int64_t expire_ms;
+};
+
+static_assert(sizeof(StoreHdr) == 64, "header layout");
+static_assert(sizeof(StoreRecHdr) == 32, "record layout");
+
+static uint64_t key_hash(const char *key, size_t klen) {
+    return str_hash64((const uint8_t *)key, klen);
+}
+
+static bool write_all(int fd, const char *data, size_t n) {
+    while (n > 0) {
+        ssize_t rv = write(fd, data, n);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv <= 0) {
+            return false;
+        }
+        data += rv;
+        n -= (size_t)rv;
+    }
+    return true;
+}
+
+static void writer_flush(StoreWriter *w) {
+    if (w->ok && !write_all(w->fd, w->buf.data(), w->buf.size())) {
+        w->ok = false;
+    }
+    w->buf.clear();
+}
+
+bool store_write_begin(StoreWriter *w, const char *path) {
+    w->path = path;
+    w->tmp = w->path + ".tmp";
+    w->fd = open(w->tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (w->fd < 0) {
+        return false;
+    }
+    // the header goes in last
+    w->buf.assign(sizeof(StoreHdr), '\0');
+    w->off = sizeof(StoreHdr);
+    w->slots.clear();
+    w->ok = true;
+    return true;
+}
+
+void store_write(StoreWriter *w, const StoreRec &rec) {
+    StoreRecHdr hdr = {};
+    hdr.klen = rec.klen;
+    hdr.vlen = rec.vlen;
+    hdr.type = rec.type;
+    hdr.enc = rec.enc;
+    hdr.expire_ms = rec.expire_ms;
+    size_t start = w->buf.size();
+    w->buf.append((const char *)&hdr, sizeof(hdr));
+    w->buf.append(rec.key, rec.klen);
+    w->buf.append(rec.val, rec.vlen);
+    uint64_t check = str_hash64(
+        (const uint8_t *)&w->buf[start + 8], w->buf.size() - start - 8);
+    memcpy(&w->buf[start], &check, 8);
+    w->buf.append((8 - w->buf.size() % 8) % 8, '\0');
+
+    w->slots.emplace_back(key_hash(rec.key, rec.klen), w->off);
+    w->off += w->buf.size() - start;
+    if (w->buf.size() >= k_store_flush) {
+        writer_flush(w);
+    }
+}
+
+bool store_write_end(StoreWriter *w) {
+    // a table at most half full
+    uint64_t nslots = 16;
+    while (nslots < 2 * w->slots.size()) {
+        nslots *= 2;
+    }
+    std::vector<uint64_t> table(2 * nslots, 0);
+    for (const auto &s : w->slots) {
+        uint64_t i = s.first & (nslots - 1);
+        while (table[2 * i + 1]) {
+            i = (i + 1) & (nslots - 1);
+        }
+        table[2 * i] = s.first;
+        table[2 * i + 1] = s.second;
+    }
+    writer_flush(w);
+
+    StoreHdr hdr = {};
+    memcpy(hdr.magic, k_store_magic, 8);
+    hdr.version = k_store_version;
+    hdr.keys = w->slots.size();
+    hdr.slots_off = w->off;
+    hdr.nslots = nslots;
+    hdr.file_size = w->off + nslots * 16;
+    hdr.check = str_hash64((const uint8_t *)table.data(), nslots * 16);
+    if (w->ok) {
+        w->ok = write_all(w->fd, (const char *)table.data(), nslots * 16)
+            && 0 == fsync(w->fd);
+    }
+    // the clean flag only after everything before it is on disk
+    hdr.clean = 1;
+    if (w->ok) {
+        w->ok = sizeof(hdr) == pwrite(w->fd, &hdr, sizeof(hdr), 0) && 0 == fsync(w->fd);
+    }
+    close(w->fd);
+    w->fd = -1;
+    std::vector<std::pair<uint64_t, uint64_t>>().swap(w->slots);
+    if (!w->ok || rename(w->tmp.c_str(), w->path.c_str())) {
+        unlink(w->tmp.c_str());
+        return false;
+    }
+    // make the rename durable
+    size_t slash = w->path.rfind('/');
+    std::string dir = slash == std::string::npos ? "." : w->path.substr(0, slash + 1);
+    int dfd = open(dir.c_str(), O_RDONLY | O_CLOEXEC);
+    if (dfd >= 0) {
+        fsync(dfd);
+        close(dfd);
+    }
+    return true;
+}
+
+bool store_open(Store *st, const char *path, std::string &err) {
+    store_close(st);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat sb = {};
+    if (fd < 0 || fstat(fd, &sb)) {
+        err = strerror(errno);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+    size_t size = (size_t)sb.st_size;
+    void *map = size ? mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    if (map == MAP_FAILED) {
+        err = size ? strerror(errno) : "empty file";
+        close(fd);
+        return false;
+    }
+    st->fd = fd;
+    st->map = (const uint8_t *)map;
+    st->size = size;
+
+    StoreHdr hdr = {};
+    if (size >= sizeof(hdr)) {
+        memcpy(&hdr, map, sizeof(hdr));
+    }
+    if (size < sizeof(hdr) || memcmp(hdr.magic, k_store_magic, 8)) {
+        err = "not a store file";
+    } else if (hdr.version != k_store_version) {
+        err = "unknown version";
+    } else if (!hdr.clean) {
+        err = "incomplete file";
+    } else if (hdr.file_size != size || hdr.slots_off < sizeof(hdr) || hdr.slots_off % 8
+        || hdr.nslots == 0 || (hdr.nslots & (hdr.nslots - 1))
+        || hdr.nslots > (size - hdr.slots_off) / 16
+        || hdr.slots_off + hdr.nslots * 16 != size || hdr.keys > hdr.nslots / 2)
+    {
+        err = "bad layout";
+    } else if (hdr.check != str_hash64(st->map + hdr.slots_off, hdr.nslots * 16)) {
+        err = "bad checksum";
+    } else {
+        st->slots = (const uint64_t *)(st->map + hdr.slots_off);
+        st->mask = hdr.nslots - 1;
+        st->keys = st->pending = hdr.keys;
+        st->taken.assign((hdr.nslots + 63) / 64, 0);
+        // records are visited in slot order, not file order
+        madvise((void *)st->map, hdr.slots_off, MADV_RANDOM);
+        return true;
+    }
+    store_close(st);
+    return false;
+}
+
+void store_close(Store *st) {
+    if (st->map) {
+        munmap((void *)st->map, st->size);
+    }
+    if (st->fd >= 0) {
+        close(st->fd);
+    }
+    st->fd = -1;
+    st->map = NULL;
+    st->size = 0;
+    st->slots = NULL;
+    st->mask = st->keys = st->pending = 0;
+    std::vector<uint64_t>().swap(st->taken);
+    st->scan_pos = 0;
+}
+
+static bool slot_taken(const Store *st, size_t i) {
+    return st->taken[i / 64] >> (i % 64) & 1;
+}
+
+static void slot_take(Store *st, size_t i) {
+    st->taken[i / 64] |= 1ULL << (i % 64);
+    st->pending--;
+}
+
+// the record of a slot, false if it is out of bounds
+static bool slot_rec(const Store *st, size_t i, StoreRec *rec, StoreRecHdr *hdr) {
+    uint64_t off = st->slots[2 * i + 1];
+    uint64_t end = (const uint8_t *)st->slots - st->map;
+    if (off < sizeof(StoreHdr) || off > end - sizeof(StoreRecHdr)) {
+        return false;
+    }
+    memcpy(hdr, st->map + off, sizeof(*hdr));
+    if ((uint64_t)hdr->klen + hdr->vlen > end - off - sizeof(*hdr)) {
+        return false;
+    }
+    rec->key = (const char *)st->map + off + sizeof(*hdr);
+    rec->klen = hdr->klen;
+    rec->val = rec->key + hdr->klen;
+    rec->vlen = hdr->vlen;
+    rec->type = hdr->type;
+    rec->enc = hdr->enc;
+    rec->expire_ms = hdr->expire_ms;
+    return true;
+}
+
+static bool rec_valid(const Store *st, size_t i, const StoreRec &rec, const StoreRecHdr &hdr) {
+    const uint8_t *start = st->map + st->slots[2 * i + 1] + 8;
+    return hdr.check == str_hash64(start, sizeof(hdr) - 8 + rec.klen + rec.vlen);
+}
+
+// the slot of a key, or -1
+static int64_t slot_find(Store *st, const char *key, size_t klen, StoreRec *rec) {
+    if (!st->map) {
+        return -1;
+    }
+    uint64_t h = key_hash(key, klen);
+    for (uint64_t i = h & st->mask; st->slots[2 * i + 1]; i = (i + 1) & st->mask) {
+        StoreRecHdr hdr;
+        if (st->slots[2 * i] != h || slot_taken(st, i) || !slot_rec(st, i, rec, &hdr)) {
+            continue;
+        }
+        if (rec->klen == klen && 0 == memcmp(rec->key, key, klen)) {
+            if (!rec_valid(st, i, *rec, hdr)) {
+                slot_take(st, i);
+                st->corrupt++;
+                return -1;
+            }
+            return (int64_t)i;
+        }
+    }
+    return -1;
+}
+
+bool store_take(Store *st, const char *key, size_t klen, StoreRec *rec) {
+    int64_t i = slot_find(st, key, klen, rec);
+    if (i < 0) {
+        return false;
+    }
+    slot_take(st, (size_t)i);
+    return true;
+}
+
+void store_drop(Store *st, const char *key, size_t klen) {
+    StoreRec rec;
+    store_take(st, key, klen, &rec);
+}
+
+bool store_iter(Store *st, size_t *pos, StoreRec *rec) {
+    for (; st->map && *pos <= st->mask; ++*pos) {
+        size_t i = *pos;
+        if (!st->slots[2 * i + 1] || slot_taken(st, i)) {
+            continue;
+        }
+        StoreRecHdr hdr;
+        if (!slot_rec(st, i, rec, &hdr) || !rec_valid(st, i, *rec, hdr)) {
+            slot_take(st, i);
+            st->corrupt++;
+            continue;
+        }
+        return true;
+    }
+    return false;
+}
+
+bool store_take_next(Store *st, StoreRec *rec) {
+    if (!store_iter(st, &st->scan_pos, rec)) {
+        return false;
+    }
+    slot_take(st, st->scan_pos++);
+    return true;
+}
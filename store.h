@@ -0,0 +1,67 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// the keyspace on disk, laid out to be used in place through mmap():
+//
+//   [header][record]...[slot]...
+//
+// records are [check: u64][klen: u32][vlen: u32][type: u8][enc: u8][pad: 6]
+// [expire_ms: i64][key][value], padded to 8 bytes, and the slots are an
+// open addressing table of (hash, file offset) pairs over them. nothing in
+// the file is a pointer, so opening it is a map and a check of the slots.
+// the header is written last with the clean flag, a file whose write did
+// not finish is refused.
+struct StoreRec {
+    const char *key = NULL;
+    uint32_t klen = 0;
+    const char *val = NULL;
+    uint32_t vlen = 0;
+    uint8_t type = 0;
+    uint8_t enc = 0;
+    int64_t expire_ms = -1;     // unix time, -1 for none
+};
+
+struct StoreWriter {
+    int fd = -1;
+    std::string path;
+    std::string tmp;
+    std::string buf;    // records not written yet
+    uint64_t off = 0;   // file offset of the end of `buf`
+    std::vector<std::pair<uint64_t, uint64_t>> slots;  // (hash, offset)
+    bool ok = false;
+};
+
+// a mapped file. records move out of it as the keys are loaded.
+struct Store {
+    int fd = -1;
+    const uint8_t *map = NULL;
+    size_t size = 0;
+    const uint64_t *slots = NULL;   // nslots (hash, offset) pairs
+    uint64_t mask = 0;
+    uint64_t keys = 0;
+    uint64_t pending = 0;   // records not taken yet
+    uint64_t corrupt = 0;   // records dropped by the checksum
+    std::vector<uint64_t> taken;    // a bit per slot
+    size_t scan_pos = 0;    // for store_take_next()
+};
+
+bool store_write_begin(StoreWriter *w, const char *path);
+void store_write(StoreWriter *w, const StoreRec &rec);
+// write the slots and the header, then replace the file
+bool store_write_end(StoreWriter *w);
+
+// map and validate a file, `err` says why not
+bool store_open(Store *st, const char *path, std::string &err);
+void store_close(Store *st);
+// find a record and take it out of the store; `rec` points into the map
+bool store_take(Store *st, const char *key, size_t klen, StoreRec *rec);
+// take any record, false when none are left
+bool store_take_next(Store *st, StoreRec *rec);
+// forget a record, for a key that was created again
+void store_drop(Store *st, const char *key, size_t klen);
+// the records not taken yet, from `*pos` on, without taking them
+bool store_iter(Store *st, size_t *pos, StoreRec *rec);
@@ -0,0 +1,103 @@
+#include <assert.h>
+#include <atomic>
+#include <algorithm>
+#include "thread_pool.h"
+
+
+static void *worker(void *arg) {
+    ThreadPool *tp = (ThreadPool *)arg;
+    while (true) {
+        pthread_mutex_lock(&tp->mu);
+        // wait for the condition: a non-empty queue
+        while (tp->queue.empty()) {
+            pthread_cond_wait(&tp->not_empty, &tp->mu);
+        }
+
+        // got the job
+        Work w = tp->queue.front();
+        tp->queue.pop_front();
+        pthread_mutex_unlock(&tp->mu);
+
+        // do the work
+        w.f(w.arg);
+    }
+    return NULL;
+}
+
+void thread_pool_init(ThreadPool *tp, size_t num_threads) {
+    assert(num_threads > 0);
+
+    int err = pthread_mutex_init(&tp->mu, NULL);
+    assert(err == 0);
+    err = pthread_cond_init(&tp->not_empty, NULL);
+    assert(err == 0);
+
+    tp->threads.resize(num_threads);
+    for (size_t i = 0; i < num_threads; ++i) {
+        err = pthread_create(&tp->threads[i], NULL, &worker, tp);
+        assert(err == 0);
+    }
+    (void)err;
+}
+
+void thread_pool_queue(ThreadPool *tp, void (*f)(void *), void *arg) {
+    Work w;
+    w.f = f;
+    w.arg = arg;
+
+    pthread_mutex_lock(&tp->mu);
+    tp->queue.push_back(w);
+    pthread_cond_signal(&tp->not_empty);
+    pthread_mutex_unlock(&tp->mu);
+}
+
+// the calls of one thread_pool_run(), taken in order by whoever is free
+struct Batch {
+    void (*f)(void *) = NULL;
+    void **args = NULL;
+    size_t n = 0;
+    std::atomic<size_t> next{0};
+    pthread_mutex_t mu;
+    pthread_cond_t done;
+    size_t helpers = 0;     // queued helpers that have not finished
+};
+
+static void batch_work(Batch *b) {
+    for (size_t i; (i = b->next.fetch_add(1)) < b->n; ) {
+        b->f(b->args[i]);
+    }
+}
+
+static void batch_help(void *arg) {
+    Batch *b = (Batch *)arg;
+    batch_work(b);
+    // the batch lives on the caller's stack, this is the last access
+    pthread_mutex_lock(&b->mu);
+    if (--b->helpers == 0) {
+        pthread_cond_signal(&b->done);
+    }
+    pthread_mutex_unlock(&b->mu);
+}
+
+void thread_pool_run(ThreadPool *tp, void (*f)(void *), void **args, size_t n) {
+    Batch b;
+    b.f = f;
+    b.args = args;
+    b.n = n;
+    pthread_mutex_init(&b.mu, NULL);
+    pthread_cond_init(&b.done, NULL);
+    // a helper can finish before the rest are queued, so count them apart
+    size_t helpers = n > 1 ? std::min(n - 1, tp->threads.size()) : 0;
+    b.helpers = helpers;
+    for (size_t i = 0; i < helpers; ++i) {
+        thread_pool_queue(tp, &batch_help, &b);
+    }
+    batch_work(&b);
+    pthread_mutex_lock(&b.mu);
+    while (b.helpers > 0) {
+        pthread_cond_wait(&b.done, &b.mu);
+    }
+    pthread_mutex_unlock(&b.mu);
+    pthread_mutex_destroy(&b.mu);
+    pthread_cond_destroy(&b.done);
+}
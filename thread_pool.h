@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stddef.h>
+#include <pthread.h>
+#include <vector>
+#include <deque>
+
+struct Work {
+    void (*f)(void *) = NULL;
+    void *arg = NULL;
+};
+
+struct ThreadPool {
+    std::vector<pthread_t> threads;
+    std::deque<Work> queue;
+    pthread_mutex_t mu;
+    pthread_cond_t not_empty;
+};
+
+void thread_pool_init(ThreadPool *tp, size_t num_threads);
+void thread_pool_queue(ThreadPool *tp, void (*f)(void *), void *arg);
+// calls f(args[i]) for every i, on the pool threads and the calling thread,
+// and returns when all calls are done
+void thread_pool_run(ThreadPool *tp, void (*f)(void *), void **args, size_t n);
@@ -0,0 +1,119 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include "vlog.h"
+
+
+static std::string file_path(const Vlog *vl, uint32_t file) {
+    return vl->path + "." + std::to_string(file);
+}
+
+static bool file_create(Vlog *vl, uint32_t file) {
+    VlogFile &f = vl->files[file];
+    f.fd = open(file_path(vl, file).c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    f.size = f.dead = 0;
+    f.reads = 0;
+    return f.fd >= 0;
+}
+
+static void file_drop(Vlog *vl, uint32_t file) {
+    VlogFile &f = vl->files[file];
+    if (f.fd >= 0) {
+        close(f.fd);
+    }
+    unlink(file_path(vl, file).c_str());
+    f = VlogFile();
+}
+
+bool vlog_open(Vlog *vl, const std::string &path) {
+    vl->path = path;
+    file_drop(vl, 1);
+    vl->cur = 0;
+    return file_create(vl, 0);
+}
+
+void vlog_close(Vlog *vl) {
+    file_drop(vl, 0);
+    file_drop(vl, 1);
+    vl->wbuf.clear();
+    vl->compacting = false;
+}
+
+uint64_t vlog_append(Vlog *vl, const char *key, size_t klen, const char *val, size_t vlen) {
+    VlogFile &f = vl->files[vl->cur];
+    uint64_t off = f.size + k_vlog_rec_hdr + klen;
+    if (vlen == 0 || vlen > k_vlog_max_value || off + vlen > k_vlog_max_size) {
+        return 0;
+    }
+    uint32_t lens[2] = {(uint32_t)klen, (uint32_t)vlen};
+    vl->wbuf.append((const char *)lens, k_vlog_rec_hdr);
+    vl->wbuf.append(key, klen);
+    vl->wbuf.append(val, vlen);
+    f.size = off + vlen;
+    return vloc_make(vl->cur, off, (uint32_t)vlen);
+}
+
+bool vlog_flush(Vlog *vl) {
+    VlogFile &f = vl->files[vl->cur];
+    const char *data = vl->wbuf.data();
+    size_t n = vl->wbuf.size();
+    uint64_t off = f.size - n;
+    while (n > 0) {
+        ssize_t rv = pwrite(f.fd, data, n, (off_t)off);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv <= 0) {
+            return false;
+        }
+        data += rv;
+        off += (uint64_t)rv;
+        n -= (size_t)rv;
+    }
+    vl->wbuf.clear();
+    return true;
+}
+
+bool vlog_pread(int fd, uint64_t off, size_t len, std::string &out) {
+    out.resize(len);
+    size_t done = 0;
+    while (done < len) {
+        ssize_t rv = pread(fd, &out[done], len - done, (off_t)(off + done));
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv <= 0) {
+            return false;
+        }
+        done += (size_t)rv;
+    }
+    return true;
+}
+
+void vlog_forget(Vlog *vl, uint64_t vloc, size_t klen) {
+    vl->files[vloc_file(vloc)].dead += k_vlog_rec_hdr + klen + vloc_len(vloc);
+}
+
+bool vlog_compact_begin(Vlog *vl) {
+    assert(!vl->compacting && vl->wbuf.empty());
+    uint32_t next = vl->cur ^ 1;
+    if (!file_create(vl, next)) {
+        return false;
+    }
+    vl->cur = next;
+    vl->compacting = true;
+    vl->scan_off = 0;
+    return true;
+}
+
+bool vlog_compact_end(Vlog *vl) {
+    uint32_t old = vl->cur ^ 1;
+    if (vl->files[old].reads) {
+        return false;
+    }
+    file_drop(vl, old);
+    vl->compacting = false;
+    return true;
+}
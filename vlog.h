@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+// an append-only log of cold string values, for keeping datasets bigger
+// than memory. records are [klen: u32][vlen: u32][key][value]; the key is
+// there so that compaction can tell whether a record is still in use.
+// there are two files, <path>.0 and <path>.1: values are appended to one
+// while the other is being compacted into it.
+//
+// a value is found by a location: [file: 1 bit][offset of the value: 39]
+// [length: 24], so values up to 16 MB in files up to 512 GB.
+const uint32_t k_vlog_max_value = (1 << 24) - 1;
+const uint64_t k_vlog_max_size = 1ULL << 39;
+const size_t k_vlog_rec_hdr = 8;
+
+inline uint64_t vloc_make(uint32_t file, uint64_t off, uint32_t len) {
+    return (uint64_t)file << 63 | off << 24 | len;
+}
+inline uint32_t vloc_file(uint64_t vloc) {
+    return (uint32_t)(vloc >> 63);
+}
+inline uint64_t vloc_off(uint64_t vloc) {
+    return (vloc >> 24) & (k_vlog_max_size - 1);
+}
+inline uint32_t vloc_len(uint64_t vloc) {
+    return (uint32_t)(vloc & k_vlog_max_value);
+}
+
+struct VlogFile {
+    int fd = -1;
+    uint64_t size = 0;      // including what is still in the write buffer
+    uint64_t dead = 0;      // bytes of records no longer in use
+    uint32_t reads = 0;     // in flight, the file stays open until they end
+};
+
+struct Vlog {
+    std::string path;
+    VlogFile files[2];
+    uint32_t cur = 0;       // the file appended to
+    std::string wbuf;       // appended to `cur`, not written yet
+    bool compacting = false;    // the other file is being copied into `cur`
+    uint64_t scan_off = 0;      // how far compaction got
+};
+
+// start with empty files, the values don't outlive the process
+bool vlog_open(Vlog *vl, const std::string &path);
+// remove the files
+void vlog_close(Vlog *vl);
+// returns the location, 0 if the file is full
+uint64_t vlog_append(Vlog *vl, const char *key, size_t klen, const char *val, size_t vlen);
+// write out what was appended; reads must not start before
+bool vlog_flush(Vlog *vl);
+// safe to call from any thread
+bool vlog_pread(int fd, uint64_t off, size_t len, std::string &out);
+// a record is no longer in use
+void vlog_forget(Vlog *vl, uint64_t vloc, size_t klen);
+// switch appending to the other file, and start copying the live records
+// of the current one into it
+bool vlog_compact_begin(Vlog *vl);
+// drop the compacted file, once no reads of it are in flight
+bool vlog_compact_end(Vlog *vl);
@@ -3,7 +3,9 @@
 #include <stdlib.h>
 #include "zset.h"
 #include "common.h"
+#include "config.h"
 #include <iostream>
+#include <vector>
 
 
 
@@ -35,8 +37,168 @@ static bool hcmp(HNode *node, HNode *key) {
     return 0 == memcmp(znode->name, hkey->name, znode->len);
 }
 
-// lookup by name
-ZNode *zset_lookup(ZSet *zset, const char *name, size_t len) {
+// the compact encoding. records are [score: f64][len: u32][name] in
+// (score, name) order, and are followed by an array of u32 record offsets
+// so that records can be binary searched.
+const size_t k_lp_rec_hdr = 8 + 4;
+
+static uint32_t *lp_offsets(ZSet *zset) {
+    return (uint32_t *)(zset->lp + zset->lp_bytes - 4 * zset->lp_len);
+}
+
+static uint8_t *lp_rec(ZSet *zset, uint32_t idx) {
+    uint32_t off = 0;
+    memcpy(&off, &lp_offsets(zset)[idx], 4);
+    return zset->lp + off;
+}
+
+static double lp_score(const uint8_t *rec) {
+    double score = 0;
+    memcpy(&score, rec, 8);
+    return score;
+}
+
+static const char *lp_name(const uint8_t *rec, size_t *len) {
+    uint32_t n = 0;
+    memcpy(&n, rec + 8, 4);
+    *len = n;
+    return (const char *)rec + k_lp_rec_hdr;
+}
+
+// record (score, name) < (score, name)
+static bool lp_less(const uint8_t *rec, double score, const char *name, size_t len) {
+    double rscore = lp_score(rec);
+    if (rscore != score) {
+        return rscore < score;
+    }
+    size_t rlen = 0;
+    const char *rname = lp_name(rec, &rlen);
+    int rv = memcmp(rname, name, rlen < len ? rlen : len);
+    return rv != 0 ? rv < 0 : rlen < len;
+}
+
+// the index of the first record >= (score, name)
+static uint32_t lp_lower_bound(ZSet *zset, double score, const char *name, size_t len) {
+    uint32_t lo = 0;
+    uint32_t hi = zset->lp_len;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (lp_less(lp_rec(zset, mid), score, name, len)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// linear scan by name, the set is small
+static int64_t lp_find(ZSet *zset, const char *name, size_t len) {
+    uint8_t *rec = zset->lp;
+    for (uint32_t i = 0; i < zset->lp_len; ++i) {
+        size_t rlen = 0;
+        const char *rname = lp_name(rec, &rlen);
+        if (rlen == len && 0 == memcmp(rname, name, len)) {
+            return i;
+        }
+        rec += k_lp_rec_hdr + rlen;
+    }
+    return -1;
+}
+
+static void lp_insert(ZSet *zset, const char *name, size_t len, double score) {
+    uint32_t idx = lp_lower_bound(zset, score, name, len);
+    uint32_t n = zset->lp_len;
+    uint32_t rsize = (uint32_t)(k_lp_rec_hdr + len);
+    uint32_t data = zset->lp_bytes - 4 * n;     // bytes of records
+    uint32_t pos = idx < n ? (uint32_t)(lp_rec(zset, idx) - zset->lp) : data;
+
+    zset->lp = (uint8_t *)realloc(zset->lp, zset->lp_bytes + rsize + 4);
+    assert(zset->lp);
+    // move the offsets to their new place, leaving a gap at `idx`
+    uint8_t *old_off = zset->lp + data;
+    uint8_t *new_off = zset->lp + data + rsize;
+    memmove(new_off + 4 * (idx + 1), old_off + 4 * idx, 4 * (n - idx));
+    memmove(new_off, old_off, 4 * idx);
+    // make room for the record
+    memmove(zset->lp + pos + rsize, zset->lp + pos, data - pos);
+    uint8_t *rec = zset->lp + pos;
+    uint32_t len32 = (uint32_t)len;
+    memcpy(rec, &score, 8);
+    memcpy(rec + 8, &len32, 4);
+    memcpy(rec + k_lp_rec_hdr, name, len);
+
+    zset->lp_len = n + 1;
+    zset->lp_bytes += rsize + 4;
+    uint32_t *offs = lp_offsets(zset);
+    for (uint32_t i = idx + 1; i <= n; ++i) {
+        uint32_t off = 0;
+        memcpy(&off, &offs[i], 4);
+        off += rsize;
+        memcpy(&offs[i], &off, 4);
+    }
+    memcpy(&offs[idx], &pos, 4);
+}
+
+static void lp_delete(ZSet *zset, uint32_t idx) {
+    uint32_t n = zset->lp_len;
+    uint8_t *rec = lp_rec(zset, idx);
+    size_t len = 0;
+    lp_name(rec, &len);
+    uint32_t rsize = (uint32_t)(k_lp_rec_hdr + len);
+    uint32_t pos = (uint32_t)(rec - zset->lp);
+    uint32_t data = zset->lp_bytes - 4 * n;
+
+    // adjust the offsets of the following records, then close both gaps
+    uint32_t *offs = lp_offsets(zset);
+    for (uint32_t i = idx + 1; i < n; ++i) {
+        uint32_t off = 0;
+        memcpy(&off, &offs[i], 4);
+        off -= rsize;
+        memcpy(&offs[i], &off, 4);
+    }
+    uint8_t *old_off = zset->lp + data;
+    memmove(zset->lp + pos, zset->lp + pos + rsize, data - pos - rsize);
+    uint8_t *new_off = zset->lp + data - rsize;
+    memmove(new_off, old_off, 4 * idx);
+    memmove(new_off + 4 * idx, old_off + 4 * (idx + 1), 4 * (n - idx - 1));
+
+    zset->lp_len = n - 1;
+    zset->lp_bytes -= rsize + 4;
+    if (zset->lp_len == 0) {
+        free(zset->lp);
+        zset->lp = NULL;
+        zset->lp_bytes = 0;
+    }
+}
+
+static void tree_add(ZSet *zset, const char *name, size_t len, double score) {
+    ZNode *node = znode_new(name, len, score);
+    zset->node_bytes += sizeof(ZNode) + len;
+    hm_insert(&zset->hmap, &node->hnode);
+    zset->tree = avl_insert(zset->tree, node);
+}
+
+// move the records into the tree and the hashtable
+static void zset_convert(ZSet *zset) {
+    assert(zset->compact);
+    uint8_t *rec = zset->lp;
+    for (uint32_t i = 0; i < zset->lp_len; ++i) {
+        size_t len = 0;
+        const char *name = lp_name(rec, &len);
+        tree_add(zset, name, len, lp_score(rec));
+        rec += k_lp_rec_hdr + len;
+    }
+    free(zset->lp);
+    zset->lp = NULL;
+    zset->lp_len = 0;
+    zset->lp_bytes = 0;
+    zset->compact = false;
+}
+
+// lookup by name. only writers help the hashtable resizing, so readers
+// leave the set untouched.
+static ZNode *zset_lookup(ZSet *zset, const char *name, size_t len, bool writer) {
     if (!zset->tree) {
         return NULL;
     }
@@ -45,13 +207,33 @@ ZNode *zset_lookup(ZSet *zset, const char *name, size_t len) {
     key.node.hcode = str_hash((uint8_t *)name, len);
     key.name = name;
     key.len = len;
-    HNode *found = hm_lookup(&zset->hmap, &key.node, &hcmp);
+    HNode *found = writer ? hm_lookup(&zset->hmap, &key.node, &hcmp)
+        : hm_lookup_ro(&zset->hmap, &key.node, &hcmp);
     return found ? container_of(found, ZNode, hnode) : NULL;
 }
 
 // add a new (score, name) tuple, or update the score of the existing tuple
 bool zset_add(ZSet *zset, const char *name, size_t len, double score) {
-    ZNode *node = zset_lookup(zset, name, len);
+    if (zset->compact) {
+        int64_t idx = lp_find(zset, name, len);
+        if (idx >= 0) {
+            if (lp_score(lp_rec(zset, (uint32_t)idx)) == score) {
+                return false;
+            }
+            lp_delete(zset, (uint32_t)idx);
+            lp_insert(zset, name, len, score);
+            return false;
+        }
+        if (zset->lp_len < g_conf.zset_max_compact_entries
+            && len <= g_conf.zset_max_compact_value)
+        {
+            lp_insert(zset, name, len, score);
+            return true;
+        }
+        zset_convert(zset);
+    }
+
+    ZNode *node = zset_lookup(zset, name, len, true);
     if (node) {
         zset->tree = avl_delete(zset->tree, node);
         node->score = score;
@@ -59,24 +241,102 @@ bool zset_add(ZSet *zset, const char *name, size_t len, double score) {
         zset->tree = avl_insert(zset->tree, node);
         return false; // Node was updated, not newly added
     } else {
-        node = znode_new(name, len, score);
-        hm_insert(&zset->hmap, &node->hnode);
-        zset->tree = avl_insert(zset->tree, node);
+        tree_add(zset, name, len, score);
         return true;
     }
 }
 
-ZNode *zset_query(ZSet *zset, double score, const char *name, size_t len) {
+bool zmember_less(const ZMember &a, const ZMember &b) {
+    if (a.score != b.score) {
+        return a.score < b.score;
+    }
+    int rv = memcmp(a.name, b.name, a.len < b.len ? a.len : b.len);
+    return rv != 0 ? rv < 0 : a.len < b.len;
+}
+
+// a balanced subtree of nodes[begin, end), returns its root
+static AVLNode *tree_build(ZNode **nodes, size_t begin, size_t end, AVLNode *parent) {
+    if (begin >= end) {
+        return NULL;
+    }
+    size_t mid = begin + (end - begin) / 2;
+    AVLNode *node = &nodes[mid]->tree;
+    node->parent = parent;
+    node->left = tree_build(nodes, begin, mid, node);
+    node->right = tree_build(nodes, mid + 1, end, node);
+    uint32_t lh = node->left ? node->left->height : 0;
+    uint32_t rh = node->right ? node->right->height : 0;
+    node->height = 1 + (lh > rh ? lh : rh);
+    node->count = (uint32_t)(end - begin);
+    return node;
+}
+
+void zset_build(ZSet *zset, const ZMember *members, size_t n) {
+    assert(zset_len(zset) == 0 && !zset->lp);
+    bool fits = n <= g_conf.zset_max_compact_entries;
+    size_t data = 0;
+    for (size_t i = 0; fits && i < n; ++i) {
+        fits = members[i].len <= g_conf.zset_max_compact_value;
+        data += k_lp_rec_hdr + members[i].len;
+    }
+    if (fits) {
+        if (n == 0) {
+            return;
+        }
+        // the records, then their offsets
+        zset->lp = (uint8_t *)malloc(data + 4 * n);
+        assert(zset->lp);
+        zset->lp_len = (uint32_t)n;
+        zset->lp_bytes = (uint32_t)(data + 4 * n);
+        uint32_t pos = 0;
+        for (size_t i = 0; i < n; ++i) {
+            uint8_t *rec = zset->lp + pos;
+            uint32_t len32 = (uint32_t)members[i].len;
+            memcpy(rec, &members[i].score, 8);
+            memcpy(rec + 8, &len32, 4);
+            memcpy(rec + k_lp_rec_hdr, members[i].name, members[i].len);
+            memcpy(zset->lp + data + 4 * i, &pos, 4);
+            pos += (uint32_t)k_lp_rec_hdr + len32;
+        }
+        return;
+    }
+
+    zset->compact = false;
+    hm_reserve(&zset->hmap, n);
+    std::vector<ZNode *> nodes(n);
+    for (size_t i = 0; i < n; ++i) {
+        nodes[i] = znode_new(members[i].name, members[i].len, members[i].score);
+        zset->node_bytes += sizeof(ZNode) + members[i].len;
+        hm_insert(&zset->hmap, &nodes[i]->hnode);
+    }
+    zset->tree = tree_build(nodes.data(), 0, n, NULL);
+}
+
+bool zset_score(ZSet *zset, const char *name, size_t len, double *score) {
+    if (zset->compact) {
+        int64_t idx = lp_find(zset, name, len);
+        if (idx < 0) {
+            return false;
+        }
+        *score = lp_score(lp_rec(zset, (uint32_t)idx));
+        return true;
+    }
+    ZNode *node = zset_lookup(zset, name, len, false);
+    if (!node) {
+        return false;
+    }
+    *score = node->score;
+    return true;
+}
+
+// find the first (score, name) tuple that is >= the argument.
+static ZNode *zset_query(ZSet *zset, double score, const char *name, size_t len) {
     AVLNode* found = nullptr; // To store the candidate node
 
     AVLNode* root = zset->tree;
     while (root){
         ZNode* rootData = container_of(root, ZNode, tree);
-
-        // Compare the current node with the target (score, name)
-        if (rootData->score < score ||
-            (rootData->score == score && rootData->len < len) ||
-            (rootData->score == score && rootData->len == len && strcmp(rootData->name, name) < 0)) {
+        if (zless(rootData, score, name, len)) {
             // Current node is less than the target, go to the right subtree
             root = root->right;
         } else {
@@ -90,12 +350,12 @@ ZNode *zset_query(ZSet *zset, double score, const char *name, size_t len) {
 }
 
 // offset into the succeeding or preceding node.
-ZNode *znode_offset(ZNode *node, int64_t offset) {
+static ZNode *znode_offset(ZNode *node, int64_t offset) {
     AVLNode *tnode = node ? avl_offset(&node->tree, offset) : NULL;
     return tnode ? container_of(tnode, ZNode, tree) : NULL;
 }
 
-ZNode *zset_pop(ZSet *zset, const char *name, size_t len) {
+static ZNode *zset_pop(ZSet *zset, const char *name, size_t len) {
     if (!zset->tree) {
         return NULL;
     }
@@ -111,27 +371,129 @@ ZNode *zset_pop(ZSet *zset, const char *name, size_t len) {
 
     ZNode *node = container_of(found, ZNode, hnode);
     zset->tree = avl_delete(zset->tree,node);
+    zset->node_bytes -= sizeof(ZNode) + node->len;
     return node;
 }
 
-void tree_dispose(AVLNode* root) {
-    if (!root) {
+bool zset_rem(ZSet *zset, const char *name, size_t len) {
+    if (zset->compact) {
+        int64_t idx = lp_find(zset, name, len);
+        if (idx < 0) {
+            return false;
+        }
+        lp_delete(zset, (uint32_t)idx);
+        return true;
+    }
+    ZNode *node = zset_pop(zset, name, len);
+    if (node) {
+        free(node);
+    }
+    return node != NULL;
+}
+
+// position at the first member >= (score, name)
+void zset_seek(ZSet *zset, double score, const char *name, size_t len, ZIter *it) {
+    it->zset = zset;
+    it->node = NULL;
+    it->idx = -1;
+    if (zset->compact) {
+        it->idx = lp_lower_bound(zset, score, name, len);
+    } else {
+        it->node = zset_query(zset, score, name, len);
+    }
+}
+
+// position by rank, negative ranks count from the end
+void zset_seek_rank(ZSet *zset, int64_t rank, ZIter *it) {
+    it->zset = zset;
+    it->node = NULL;
+    it->idx = -1;
+    int64_t n = (int64_t)zset_len(zset);
+    if (rank < 0) {
+        rank += n;
+    }
+    if (rank < 0 || rank >= n) {
         return;
     }
+    if (zset->compact) {
+        it->idx = rank;
+        return;
+    }
+    // start from the root, whose rank is the size of the left subtree
+    ZNode *root = container_of(zset->tree, ZNode, tree);
+    int64_t root_rank = zset->tree->left ? zset->tree->left->count : 0;
+    it->node = znode_offset(root, rank - root_rank);
+}
 
-    tree_dispose(root->left);  // Delete left subtree
-    tree_dispose(root->right); // Delete right subtree
+bool ziter_valid(const ZIter *it) {
+    if (!it->zset) {
+        return false;
+    }
+    if (it->zset->compact) {
+        return it->idx >= 0 && it->idx < (int64_t)it->zset->lp_len;
+    }
+    return it->node != NULL;
+}
 
-    ZNode* nodeData = container_of(root, ZNode, tree);
-    free(nodeData); // Free the ZNode memory
+void ziter_offset(ZIter *it, int64_t offset) {
+    if (it->zset->compact) {
+        it->idx += offset;
+    } else {
+        it->node = znode_offset(it->node, offset);
+    }
+}
+
+double ziter_score(const ZIter *it) {
+    if (it->zset->compact) {
+        return lp_score(lp_rec(it->zset, (uint32_t)it->idx));
+    }
+    return it->node->score;
+}
+
+const char *ziter_name(const ZIter *it, size_t *len) {
+    if (it->zset->compact) {
+        return lp_name(lp_rec(it->zset, (uint32_t)it->idx), len);
+    }
+    *len = it->node->len;
+    return it->node->name;
+}
+
+// free the whole tree without recursion: rotate left children up until
+// the root has none, then free the root and continue with its right child.
+static void tree_dispose(AVLNode* root) {
+    while (root) {
+        AVLNode* left = root->left;
+        if (left) {
+            root->left = left->right;
+            left->right = root;
+            root = left;
+            continue;
+        }
+        AVLNode* right = root->right;
+        free(container_of(root, ZNode, tree)); // Free the ZNode memory
+        root = right;
+    }
 }
 
 void zset_dispose(ZSet *zset) {
     tree_dispose(zset->tree);
     hm_destroy(&zset->hmap);
+    free(zset->lp);
+    zset->tree = NULL;
+    zset->node_bytes = 0;
+    zset->lp = NULL;
+    zset->lp_len = 0;
+    zset->lp_bytes = 0;
 }
 
-void znode_del(ZNode *node) {
-    free(node);
+size_t zset_len(ZSet *zset) {
+    if (zset->compact) {
+        return zset->lp_len;
+    }
+    return zset->tree ? zset->tree->count : 0;
 }
 
+// bytes owned by the zset, including the hashtable buckets
+size_t zset_mem(ZSet *zset) {
+    return sizeof(ZSet) + hm_mem(&zset->hmap) + zset->node_bytes + zset->lp_bytes;
+}
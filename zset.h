@@ -3,15 +3,49 @@
 #include "avl.h"
 #include "hashtable.h"
 
+// small sets are stored as one sorted array of packed (score, len, name)
+// records followed by the record offsets; big sets use the AVL tree for
+// ordering and the hashtable for lookup by name.
 struct ZSet {
     AVLNode *tree = NULL;
     HMap hmap;
+    size_t node_bytes = 0;  // sum of the ZNode allocations
+    bool compact = true;
+    uint8_t *lp = NULL;     // the compact array
+    uint32_t lp_len = 0;    // number of records
+    uint32_t lp_bytes = 0;  // size of the compact array
+};
+
+// a position in (score, name) order, invalidated by any update
+struct ZIter {
+    ZSet *zset = NULL;
+    ZNode *node = NULL;     // the tree encoding
+    int64_t idx = -1;       // the compact encoding
+};
+
+// an input of zset_build(), the name is copied
+struct ZMember {
+    const char *name = NULL;
+    size_t len = 0;
+    double score = 0;
 };
 
 bool zset_add(ZSet *zset, const char *name, size_t len, double score);
-ZNode *zset_lookup(ZSet *zset, const char *name, size_t len);
-ZNode *zset_pop(ZSet *zset, const char *name, size_t len);
-ZNode *zset_query(ZSet *zset, double score, const char *name, size_t len);
+// fill an empty set with distinct members given in (score, name) order. the
+// tree is built balanced in one pass instead of n searches and rebalances.
+void zset_build(ZSet *zset, const ZMember *members, size_t n);
+// (score, name) order
+bool zmember_less(const ZMember &a, const ZMember &b);
+// zset_score(), zset_len() and the iterators do not modify the set, so
+// several threads may use them at once while nothing writes to it
+bool zset_score(ZSet *zset, const char *name, size_t len, double *score);
+bool zset_rem(ZSet *zset, const char *name, size_t len);
+void zset_seek(ZSet *zset, double score, const char *name, size_t len, ZIter *it);
+void zset_seek_rank(ZSet *zset, int64_t rank, ZIter *it);
+bool ziter_valid(const ZIter *it);
+void ziter_offset(ZIter *it, int64_t offset);
+double ziter_score(const ZIter *it);
+const char *ziter_name(const ZIter *it, size_t *len);
 void zset_dispose(ZSet *zset);
-ZNode *znode_offset(ZNode *node, int64_t offset);
-void znode_del(ZNode *node);
\ No newline at end of file
+size_t zset_mem(ZSet *zset);
+size_t zset_len(ZSet *zset);